@@ -0,0 +1,113 @@
+/* Hedgie runs hardware abstraction
+
+The sketch reaches the hardware only through these functions:  clocks, pins, the wheel sensor (ADC, comparator and Timer1),
+sleep and the watchdog, EEPROM, the I2C bus (RTC, temperature sensor, LCD), the SPI bus (night log flash), and the W5100 (DHCP,
+one TCP connection for uploads, UDP for DNS and NTP).  The device drivers (DS1307, MCP9808, LCD, W25Qxx, DNS, NTP, HTTP) stay in
+the sketch, on top of the bus functions.
+
+The Arduino implementation is the hardware section of hedgie_runs_v8_5.cpp.  Building with HOST_BUILD leaves it out, and the host
+build (host/) links hal_host.cpp instead:  a virtual clock, a trace fed wheel sensor, in-memory EEPROM, DS1307, MCP9808, LCD and
+flash models, and a loopback network with stand-in DNS, NTP and HTTP servers.
+
+The interrupt handlers at the end are in the sketch, and are called by the HAL from its interrupts.
+*/
+
+#ifndef HEDGIE_HAL_H
+#define HEDGIE_HAL_H
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+typedef enum
+{
+  HAL_UDP_DNS,
+  HAL_UDP_NTP,
+  NUM_HAL_UDP
+} HAL_UDP_t;
+
+typedef enum
+{
+  HAL_TCP_CLOSED,
+  HAL_TCP_CONNECTING,      // handshake under way
+  HAL_TCP_ESTABLISHED,
+  HAL_TCP_CLOSING          // either side has sent its FIN
+} HAL_TCP_STATE_t;
+
+// clocks.  halMicros() can be called from the wheel interrupts
+uint32_t halMicros(void);
+uint32_t halMillis(void);
+void halDelay(uint32_t delayInMs);
+void halDelayMicros(uint16_t delayInUs);
+
+// LEDs and buttons
+void halInitPins(void);
+boolean halReadButton(uint8_t pin);
+void halSetLed(uint8_t pin, boolean isOn);
+
+// watchdog (an interrupt every 8 seconds), idle sleep, and free RAM
+void halStartWatchdog(void);
+void halReset(void);
+void halIdle(void);
+uint16_t halFreeRam(void);
+uint16_t halMinFreeRam(void);
+
+// wheel sensor.  Call with interrupts off
+void halStartAdcSampling(void);
+void halStartComparatorCapture(void);
+void halSetComparatorEdge(boolean isMirrorNext);
+void halArmComparatorWake(void);
+void halDisarmComparatorWake(void);
+void halEnableButtonWake(void);
+
+// EEPROM
+uint8_t halEepromRead(int addr);
+void halEepromWrite(int addr, uint8_t value);
+boolean halEepromIsReady(void);               // no write in progress:  a read or write now won't wait for one
+
+// I2C.  halI2cWrite() returns the Wire.endTransmission() status, 0 when the write went through
+void halI2cBegin(void);
+uint8_t halI2cWrite(uint8_t address, const uint8_t *data, uint8_t length);
+boolean halI2cRead(uint8_t address, uint8_t reg, uint8_t *data, uint8_t length);
+void halI2cRecoverBus(void);
+
+// SPI flash
+void halFlashBegin(void);
+void halFlashSelect(void);
+void halFlashDeselect(void);
+uint8_t halSpiTransfer(uint8_t value);
+
+// Ethernet.  halNetBegin() does DHCP, and blocks until it has an address or gives up
+boolean halNetBegin(uint8_t *mac);
+IPAddress halDnsServerIp(void);
+
+// UDP, one socket per user.  A packet is read with halUdpRead() after halUdpParsePacket() returns its size
+boolean halUdpBegin(HAL_UDP_t udp, uint16_t localPort);
+void halUdpStop(HAL_UDP_t udp);
+boolean halUdpBeginPacket(HAL_UDP_t udp, IPAddress address, uint16_t port);
+void halUdpWrite(HAL_UDP_t udp, const uint8_t *data, uint16_t length);
+boolean halUdpEndPacket(HAL_UDP_t udp);
+int halUdpParsePacket(HAL_UDP_t udp);
+int halUdpRead(HAL_UDP_t udp);
+int halUdpRead(HAL_UDP_t udp, uint8_t *data, uint16_t length);
+
+// TCP, one connection (the uploads).  None of these wait on the network.  Bytes given to halTcpBuffer() go out on halTcpSend(),
+// and halTcpIsSent() is true once the peer has acked them
+boolean halTcpConnect(IPAddress& address, uint16_t port);
+HAL_TCP_STATE_t halTcpState(void);
+boolean halTcpConnected(void);
+uint16_t halTcpTxFree(void);
+void halTcpBuffer(const uint8_t *data, uint16_t length);
+void halTcpSend(void);
+boolean halTcpIsSent(void);
+int halTcpRead(void);
+void halTcpDisconnect(void);
+void halTcpClose(void);
+
+// in the sketch, called from the HAL's interrupts
+void wheelSampleInterrupt(int sample);
+void wheelEdgeInterrupt(uint32_t edgeTimeInUs, boolean isMirrorEdge);
+void wheelWakeInterrupt(void);
+void buttonWakeInterrupt(void);
+void watchdogInterrupt(void);
+
+#endif
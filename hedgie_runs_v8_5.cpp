@@ -1,4 +1,4 @@
-/* Hedgie runs version 8.5
+/* Hedgie runs version 8.6
 - counts wheel turns
 - finds duration of shortest wheel revolution, for each 5 minute interval
 - calculates total distance, in km
@@ -27,27 +27,132 @@ v8.4
 v8.5
 - discard any RTC reads where HOURS are bogus.  This is a software fix to a problem that cropped up when I2C temperature sensor was added in v8.4.  
 Occasionally, the RTC read came back with HH:MM = 153:165.  Suspect I2C signal degradation due to long connect wire to I2C sensor, with non-optimal pull-up resistor.
+v8.6
+- wheel sensor is sampled in the background by the ADC interrupt (conversions triggered by Timer0 overflow, every 1.024ms).  Each rotation is
+queued with its micros() timestamp, and loop() drains the queue.  Slow network and LCD calls no longer drop wheel turns.
+- revolution statistics for each 5 minute interval:  shortest, longest and mean revolution, peak speed and a speed histogram.
+Sent to SparkFun with the interval distance.  Fastest revolution and speed histogram of the night are kept in the night stats.
+- cloud uploads (Adafruit IO, SparkFun, ThingTweet) run in the background:  a state machine advances connect, send, response and close
+a small step on each loop() pass, with a timeout on each step.  Adafruit IO is now posted directly, without the Adafruit IO library.
+Each request is written once, straight into the W5100 transmit buffer, and sent with one SEND (a buffer full at a time, if it is
+ever longer than the buffer).  Everything in it comes from a snapshot taken when it was queued or started, so it can't change.
+- worst case loop() time and other health counters are pushed every 5 mins to the Adafruit IO diagnostics feed
+- 5 minute interval stats are stored in an EEPROM queue until SparkFun and Adafruit IO have both accepted them.  The backlog is
+replayed in batches:  pipelined requests on one connection to SparkFun, one batch request to Adafruit IO.  Oldest records are
+dropped when the queue is full.
+- night stats are saved to an EEPROM journal:  each save goes to the next of 6 slots, with a sequence number and CRC, and only the
+bytes that differ from the slot's old contents are written.  The newest valid record is recovered after a reset.
+- every counted rotation also flips one bit in an EEPROM rotation counter.  After a reset during the night, the rotations since
+the last night stats save are recovered from it, instead of losing up to 5 minutes of running.
+- LCD screens no longer block:  pages are drawn into a 16x2 frame buffer, and only the characters that changed are sent to the LCD,
+a few per loop() pass.  The button page sequence (distance, temperature, time, last reset) is timed with millis().
+- every hardware access goes through the hal* functions declared in hedgie_hal.h:  clocks, LEDs and buttons, the ADC, comparator
+and Timer1, sleep and the watchdog, EEPROM, the I2C and SPI buses, and the W5100 (DHCP, the upload connection, UDP for DNS and NTP).
+The LCD, DS1307, MCP9808, flash, DNS, NTP and HTTP code stays in the sketch, on top of them.  The Arduino side is the hardware section
+of the sketch.  The host build (make -C host) compiles the sketch for Linux against host/hal_host.cpp:  a virtual clock, a trace
+fed wheel sensor, in-memory EEPROM, RTC, temperature sensor, LCD and flash, and a loopback network with stand-in DNS, NTP and HTTP
+servers.  make -C host test runs the host tests and benchmarks.
+- detection benchmark build (#define DETECTION_BENCHMARK):  instead of running the monitor, synthesized wheel sensor traces are replayed
+through the wheel state machine for a range of wheel speeds, noise levels and sample periods.  Missed and double counted rotations,
+and the highest speed counted without errors, are printed on the serial port at 9600 baud.  On the host, bench_detector does the
+same with traces read from files (host/traces), through the ADC sampling interrupt.
+- adaptive wheel detector:  the white and mirror sensor levels are tracked with running averages, and the mirror is detected with
+separate rising and falling thresholds set between them.  The white debounce is scaled to the last revolution period instead of a
+fixed 40 samples.  The fixed 300 threshold detector is still selectable (wheelDetector), and the benchmark runs both.
+- software clock:  the time is served from millis(), instead of an I2C read of the DS1307 on every loop() pass and rotation.
+It is resynced from the RTC once a minute, using 3 reads that are range checked and majority voted, so a bad read (like the
+153:165 seen in v8.5) never becomes the time.  Drift of the Arduino clock against the RTC is measured and reported.
+- I2C layer:  the RTC, temperature sensor and LCD are driven through one set of I2C functions (instead of RTClib, the Adafruit MCP9808
+library and LiquidCrystal_I2C), with bounded retries, recovery of a stuck bus (SCL clocked until the slave releases SDA) and a set bus
+clock.  An LCD write is only retried when nothing reached the LCD, after a part sent write the LCD is started over.  Every RTC
+field is range checked.  Per device transaction, retry, failure and worst latency counters go out with the diagnostics.
+- daytime power mode:  from 7am to 10pm, when nothing is uploading or showing on the LCD, and the wheel has been still for a minute,
+the Arduino idles in sleep mode between loop() passes.  Wheel sampling is stopped, and the analog comparator (A0 against the 1.1V
+bandgap) wakes it on a mirror edge, which is counted as a rotation.  The buttons wake it through pin change interrupts.  The SPI
+clock is stopped while asleep (the W5100 itself has no power down).  Sleeps last at most 1 second, so the watchdog count is restored
+on every loop() pass as before.  Awake duty cycle, wheel wakes and worst wake latency are reported with the diagnostics.
+- comparator wheel sensor build (#define WHEEL_SENSOR_COMPARATOR):  instead of ADC sampling, the analog comparator watches A0
+against the 1.1V bandgap, and Timer1 input capture timestamps its edges to 0.5us.  The CPU only runs on the two edges of each mirror
+pass.  ADC sampling stays the default.  Both edges are watched on A0 (no hysteresis), and white has to last 40ms, as with the ADC.
+Optional hardware change, for hysteresis:  feed A1 from the sensor through a 15k/82k divider (15k in series, 82k to ground, so the
+mirror threshold is ~1.29V), and set COMPARATOR_MIRROR_CHANNEL to 1.  The mirror edge is then watched on A1, the white one on A0.
+- loop() runs a small cooperative scheduler.  Tasks are periodic (every so many ms) or aligned to the wall clock (10pm reset, 7am
+tweet, 5 minute pushes), listed highest priority first.  The rotation counting task runs before every other task, so it never waits
+longer than one task run.  Each task's worst run time, runs over budget, and missed deadlines go out with the diagnostics.
+- fast boot:  setup() starts wheel sampling right after the pins are set up, and restores the night stats, then returns.  The LCD
+start up and greeting, and the Ethernet bring up and DHCP, are done later by the UI and network tasks.  Uploads and NTP wait for the
+network.  Boot to sampling, boot to counting, and boot to network times are reported with the diagnostics.
+- DNS cache:  Adafruit IO, SparkFun, ThingSpeak and pool.ntp.org are looked up through one small cache, kept for the TTL in the
+DNS answer (1 minute to 1 day).  Failed lookups are cached for a minute, and the last good address is used meanwhile.  A failed
+connect drops the cached address.  Hits, misses, failures and stale answers are reported with the diagnostics.  A lookup doesn't
+block:  the query is sent, and the upload and NTP state machines pick up the answer on a later pass.
+- Adafruit IO feed updates queued together (the 5 minute distance, temperature, uptime and diagnostics) are pipelined on one
+HTTP/1.1 keep-alive connection, instead of a connection each.  If the server drops the connection part way, the updates without a
+response are sent again on a new one.  Connection setup time saved, and the time to finish each 5 minute push, are reported.
+- the 7am tweet is streamed straight into the request, instead of being built in a 200 byte buffer with sprintf.  A first pass
+through the same writer counts the bytes for Content-Length.  The month and day names and the fixed text are read from flash.
+- less RAM:  request and diagnostics text, the SparkFun and ThingTweet keys (no longer String objects) and the sprintf formats are
+kept in flash.  The free RAM between the heap and the stack is painted at reset, and the least of it left unpainted (the deepest
+the stack has reached) is sent with the diagnostics, along with the free RAM at the time.
+- NTP no longer blocks, and runs by itself every morning at 7:10 (the protoshield button still starts it).  4 requests are sent
+2 seconds apart, and each reply is checked (server mode, synchronized, answer to our request) and turned into the server time at
+its arrival, using the round trip from all four timestamps.  The RTC is only set when at least 2 samples agree within 100ms with
+the fastest one, and it is set on the second boundary.  The last offset and round trip, lost replies, rejected samples and failed
+syncs are reported with the diagnostics.
+- the RTC and the software clock keep UTC, and local time is worked out from it on every second, from the DST start and end of the
+current year (computed once a year from the rule in timezoneRules[]).  DST changes take effect on time, without an NTP sync.  US
+Pacific is the default (localTimezone), and US Eastern, central Europe, UK, eastern Australia and Japan are in the table.  The
+telemetry queue keeps UTC, and Adafruit IO gets the local offset in created_at.  The clock is synced by NTP once the network is up.
+- night rotation log:  with a SPI NOR flash (W25Qxx) on pin 5, every counted rotation is logged, one 64KB block per night.  A rotation
+is the change in revolution period from the one before, in ms, zigzag varint coded (1 byte when the pace is steady, 2 otherwise).
+After a pause of over 5 seconds, or a reset, the time since the start of the night is written instead.  The log is buffered in
+RAM and written a page at a time by its task.  After a reset at night, the log is decoded to its end and continued.  Rotations,
+bytes, the compression against 4 byte timestamps and the worst encode time are reported.  Build with #define NIGHT_LOG_EXPORT to
+print the newest night over the serial port.  Without the flash chip the log is off.
+- running bouts:  the night's rotations are split into bouts at pauses of over 30 seconds.  A bout has its start, duration,
+distance and peak speed, and the 3 longest of the night are kept.  The tweet has the number of bouts and the longest one, and the
+diagnostics feed has the bouts so far and the worst analyzer time per rotation.  Bouts are not kept over a reset.
+- night history:  at 7am the night is added to an EEPROM ring of 34 nightly summaries (date, distance, start, end, bouts and peak
+speed in 8 bytes).  7 and 30 day totals are updated as each night is added and the oldest drop out, and are kept in EEPROM with a
+CRC.  The newest night counted in the totals is kept with them, and if a reset came between the night's summary and the totals,
+or part way through saving the totals, they are rebuilt from the ring at boot.  The ring is only cleared when its format marker is
+missing.  The button pages now show the newest night and the 7 and 30 day averages, and each press on the history page goes back a night.
 
 EEPROM map
 ==========
-800: night stats
+800: night stats journal (6 slots x 33 bytes)
 100: debug log
 200: reset log
+224: telemetry queue (12 slots x 20 bytes)
+464: rotation counter (64 bytes)
+528: night history ring (34 slots x 8 bytes)
+998: night history 7 and 30 day totals (16 bytes), newest night counted in them (2 bytes), CRC
+1017: night history format marker
 
 */
 
 #include <stdio.h>
+// #define NIGHT_LOG_EXPORT        // print the newest night rotation log on the serial port, see exportNightLog()
+// #define DETECTION_BENCHMARK     // build the detection benchmark instead of the monitor, see runDetectionBenchmark()
+// #define WHEEL_SENSOR_COMPARATOR // detect the mirror with the analog comparator and Timer1 input capture, instead of ADC sampling
+
+// HOST_BUILD:  set by the host build (host/Makefile), which leaves out the hardware section and links host/hal_host.cpp
+
+#include <RTClib.h>    // DateTime only, the DS1307 is read through the I2C layer
+#include <IPAddress.h>
+#include "hedgie_hal.h"
+#ifndef HOST_BUILD
 #include <Wire.h>  
 #include <EEPROM.h>
-#include <LiquidCrystal_I2C.h>
-#include <RTClib.h>
 #include <SPI.h>
 #include <Ethernet.h>
 #include <EthernetUdp.h>
-#include <Dns.h>
+#include <utility/w5100.h>
+#include <utility/socket.h>
 #include <avr/wdt.h>
-#include "Adafruit_IO_Client.h"
-#include "Adafruit_MCP9808.h"   // temperature sensor
+#include <avr/sleep.h>
+#include <avr/power.h>
+#endif
 
 typedef enum
 {
@@ -62,17 +167,223 @@ typedef enum
   WAITING_FOR_WHITE
 } WHEEL_STATE_t;
 
+typedef enum
+{
+  NIGHT_LOG_OFF,           // no flash chip
+  NIGHT_LOG_IDLE,          // daytime
+  NIGHT_LOG_ERASING,       // the night's block, at 10pm
+  NIGHT_LOG_RECORDING,
+  NIGHT_LOG_CLOSING        // 7am, writing what's left in the buffer
+} NIGHT_LOG_STATE_t;
+
+// at the start of each night's block
+typedef struct
+{
+  uint16_t magic;
+  uint16_t sequence;
+  uint32_t startTime;      // UTC
+} NightLogHeader_t;
+
+typedef enum
+{
+  NTP_IDLE,
+  NTP_RESOLVE,             // DNS lookup of the NTP server
+  NTP_SEND,                // next request, when the sample interval is up
+  NTP_WAIT_REPLY,
+  NTP_APPLY                // set the clocks at the next second boundary
+} NTP_STATE_t;
+
+// DST rule:  DST starts on the startWeek'th startDayOfWeek of startMonth at startHour local standard time, and ends on the endWeek'th
+// endDayOfWeek of endMonth at endHour local daylight time.  Week 5 is the last one of the month
+typedef struct
+{
+  int16_t standardOffsetInMins;   // local standard time - UTC
+  uint8_t dstOffsetInMins;        // 0 when there's no DST
+  uint8_t startMonth;
+  uint8_t startWeek;
+  uint8_t startDayOfWeek;         // 0 = Sunday
+  uint8_t startHour;
+  uint8_t endMonth;
+  uint8_t endWeek;
+  uint8_t endDayOfWeek;
+  uint8_t endHour;
+} TimezoneRule_t;
+
+typedef enum
+{
+  TIMEZONE_US_PACIFIC,
+  TIMEZONE_US_EASTERN,
+  TIMEZONE_EU_CENTRAL,
+  TIMEZONE_UK,
+  TIMEZONE_AUSTRALIA_EASTERN,
+  TIMEZONE_JAPAN,
+  NUM_TIMEZONES             // <-- keep this last
+} TIMEZONE_t;
+
+// one NTP reply:  the server time when it arrived (server transmit time + half the round trip)
+typedef struct
+{
+  uint32_t unixTime;
+  uint16_t fractionInMs;
+  uint16_t roundTripInMs;
+  uint32_t arrivalMillis;
+} NtpSample_t;
+
+typedef enum
+{
+  ETHERNET_POWER_UP,       // give the shield a second after reset
+  ETHERNET_DHCP,
+  ETHERNET_SETTLE,         // and another second after DHCP
+  ETHERNET_UP,
+  ETHERNET_RETRY_WAIT      // DHCP failed, try again later
+} ETHERNET_STATE_t;
+
+typedef enum
+{
+  TASK_PERIODIC,           // every interval ms
+  TASK_WALL_CLOCK          // when the minute of the day % interval == offset
+} TASK_TIMING_t;
+
+// listed highest priority first
+typedef enum
+{
+  TASK_COUNT_ROTATIONS,    // the hot path, runs before every other task
+  TASK_SOFTWARE_CLOCK,
+  TASK_NIGHT_RESET,
+  TASK_INTERVAL_STATS,
+  TASK_TWEET,
+  TASK_HEALTH_PUSH,
+  TASK_UPLOAD,
+  TASK_UI,
+  TASK_NIGHT_LOG,
+  TASK_EEPROM_WRITES,
+  TASK_NTP_DAILY,
+  TASK_NTP,
+  TASK_NETWORK,
+  NUM_TASKS                // <-- keep this last
+} TASK_ID_t;
+
+typedef struct
+{
+  void (*run)(void);
+  char name[4];            // for the diagnostics feed
+  TASK_TIMING_t timing;
+  uint16_t interval;       // ms for TASK_PERIODIC (0 for every pass), minutes for TASK_WALL_CLOCK
+  uint16_t offset;         // TASK_WALL_CLOCK only, minutes
+  uint16_t deadlineInMs;   // longest wait after becoming due.  For an every pass task, the longest gap between runs
+  uint16_t budgetInUs;     // longest run
+} TaskConfig_t;
+
+typedef struct
+{
+  uint16_t maxRunTimeInUs;
+  uint8_t overrunCount;          // runs longer than the budget
+  uint8_t missedDeadlineCount;
+} TaskStats_t;
+
+typedef enum
+{
+  I2C_DEVICE_RTC,            // DS1307
+  I2C_DEVICE_TEMPERATURE,    // MCP9808
+  I2C_DEVICE_LCD,            // PCF8574 LCD backpack
+  NUM_I2C_DEVICES            // <-- keep this last
+} I2C_DEVICE_t;
+
+typedef struct
+{
+  uint16_t transactionCount;
+  uint16_t retryCount;
+  uint16_t failureCount;       // transactions that still failed after all the retries
+  uint16_t rangeErrorCount;    // reads that came back with values out of range
+  uint16_t maxLatencyInUs;     // including retries
+} I2cDeviceStats_t;
+
+typedef enum
+{
+  FIXED_THRESHOLD_DETECTOR,      // MIRROR_THRESHOLD and WHITE_SAMPLES_TO_DEBOUNCE
+  ADAPTIVE_THRESHOLD_DETECTOR
+} WHEEL_DETECTOR_t;
+
+// adaptive detector state, only used by the ADC interrupt
+typedef struct
+{
+  int16_t whiteLevel;            // running average of white samples, ADC counts x 16
+  int16_t mirrorLevel;           // running average of mirror samples, ADC counts x 16
+  int16_t risingThreshold;       // white -> mirror, ADC counts
+  int16_t fallingThreshold;      // mirror -> white, ADC counts
+  uint16_t samplesSinceMirror;   // revolution period, in samples
+  uint16_t mirrorSampleCount;    // samples in a row above the rising threshold
+  uint8_t debounceSamples;       // consecutive white samples needed before the next mirror
+} AdaptiveDetector_t;
+
 typedef enum
 {
   SHORT_TIME_FORMAT,
   LONG_TIME_FORMAT,
 } TIME_FORMAT_t;
 
+typedef enum
+{
+  UI_PAGE_NONE,              // display off
+  UI_PAGE_DISTANCE,
+  UI_PAGE_HISTORY,           // one night from the history ring, a press goes back a night
+  UI_PAGE_AVERAGES,          // 7 and 30 day
+  UI_PAGE_TEMPERATURE,
+  UI_PAGE_TIME,
+  UI_PAGE_LAST_RESET,
+  NUM_UI_PAGES               // <-- keep this last
+} UI_PAGE_t;
+
+#define NUM_SPEED_BUCKETS (4)
+#define NUM_TOP_BOUTS (3)
+
+// a run without a pause longer than BOUT_GAP_IN_US
+typedef struct
+{
+  uint32_t startTime;              // UTC
+  uint16_t durationInSecs;
+  uint16_t numRotations;
+  uint32_t fastestRevolutionInUs;  // 0 for a single rotation
+} Bout_t;
+
+// updated once per wheel revolution, so keep it cheap:  no divisions, a few compares
+typedef struct
+{
+  uint32_t minPeriodInUs;
+  uint32_t maxPeriodInUs;
+  uint32_t sumPeriodInUs;    // can't overflow:  the periods of one 5 minute interval add up to ~300 seconds
+  uint16_t numRevolutions;
+  uint16_t speedHistogram[NUM_SPEED_BUCKETS];
+} IntervalRevolutionStats_t;
+
+// one night in the EEPROM history ring
+typedef struct
+{
+  uint16_t dayNumber;          // date of the morning, days since 1 Jan 2000.  HISTORY_EMPTY_DAY for an empty slot
+  uint16_t distanceInM;
+  uint8_t startTime;           // first rotation, 3 minute steps after 10pm local time
+  uint8_t endTime;             // last rotation
+  uint8_t boutCount;
+  uint8_t fastestInCmPerSec;
+} NightSummary_t;
+
+// running totals of the nights in the last 7 or 30 days, to the newest night
 typedef struct
 {
-  unsigned long totalDistanceInCm;
+  uint32_t distanceInM;
+  uint16_t boutCount;
+  uint8_t nightCount;
+  uint8_t oldestSlot;          // ring slot of the oldest night in the window
+} HistoryWindow_t;
+
+typedef struct
+{
+  uint32_t totalDistanceInCm;
   DateTime dateTimeOfFirstRotationInDateTime;
   DateTime dateTimeOfLastRotationInDateTime;
+  uint32_t fastestRevolutionInUs;
+  uint16_t speedHistogram[NUM_SPEED_BUCKETS];
+  uint16_t rotationCounterAtSave;    // EEPROM rotation counter value when these stats were saved
   
 } HedgieNightStats_t;
 
@@ -103,81 +414,694 @@ enum
   ETHERNET_NTP_12, //22
   NUMBER_OF_DEBUG_MESSAGES             // <-- keep this last
   
-} DEBUG_MESSAGES;
+};
+
+typedef enum
+{
+  UPLOAD_IDLE,
+  UPLOAD_RESOLVE,
+  UPLOAD_CONNECT,
+  UPLOAD_SEND,
+  UPLOAD_READ_RESPONSE,
+  UPLOAD_CLOSE
+} UPLOAD_STATE_t;
+
+typedef enum
+{
+  UPLOAD_ADAFRUIT_IO_FEED,
+  UPLOAD_ADAFRUIT_IO_DIAGNOSTICS,
+  UPLOAD_ADAFRUIT_IO_BACKLOG,
+  UPLOAD_SPARKFUN_BACKLOG,
+  UPLOAD_THINGTWEET
+} UPLOAD_KIND_t;
+
+typedef enum
+{
+  SERVER_ADAFRUIT_IO,
+  SERVER_SPARKFUN,
+  SERVER_THINGSPEAK,
+  NUM_UPLOAD_SERVERS             // <-- keep this last
+} UPLOAD_SERVER_t;
+
+typedef struct
+{
+  const char *name;        // hostname, the cache key
+  uint32_t address;        // last good address, 0 if none yet
+  uint32_t expiresMillis;  // answer (or failure) is used until then
+  boolean isFailed;        // last lookup failed
+} DnsCacheEntry_t;
+
+typedef enum
+{
+  DNS_PENDING,             // waiting for the DNS server, ask again on a later pass
+  DNS_OK,
+  DNS_FAILED
+} DNS_RESULT_t;
+
+typedef struct
+{
+  UPLOAD_KIND_t kind;
+  const char *feedKey;   // Adafruit IO feed
+  int32_t value;         // Adafruit IO feed value, sent as value / 10^decimals.  Tweet:  the local time it was queued
+  uint8_t decimals;
+} UploadJob_t;
+
+// one 5 minute interval, as stored in the EEPROM telemetry queue
+typedef struct
+{
+  uint32_t unixTime;                           // time of the 5 minute push, UTC
+  uint16_t numRotations;                       // interval distance, in wheel rotations
+  uint16_t totalDistanceInM;                   // night distance so far
+  uint16_t minRevolutionInMs;
+  uint16_t maxRevolutionInMs;
+  uint16_t meanRevolutionInMs;
+  uint8_t speedHistogram[NUM_SPEED_BUCKETS];   // saturates at 255
+} TelemetryRecord_t;
+
+// An EEPROM record written in the background, a byte a pass as the EEPROM becomes ready, so a save doesn't hold loop() up for
+// 3.3ms a byte.  The commit byte makes the record valid:  it's written with invalidValue first and its own value last, so a reset
+// part way through leaves a record that reads as not there.  Bytes that are already right aren't written
+typedef struct
+{
+  const uint8_t *image;        // the record's bytes, from addr.  Left alone until the write is done.  NULL for all zeros
+  int addr;
+  uint8_t length;
+  uint8_t commitIndex;
+  uint8_t invalidValue;
+  uint8_t position;            // next step:  0 invalidates, 1 to length write the bytes, length+1 commits
+  boolean isPending;
+  uint8_t bytesWritten;
+} EepromRecordWrite_t;
+
+// health counters, pushed to the Adafruit IO diagnostics feed every 5 mins
+typedef struct
+{
+  uint32_t maxLoopTimeInUs;
+  uint16_t rotationBufferOverflowCount;
+  uint16_t uploadFailureCount;
+  uint16_t uploadDropCount;
+  uint16_t uploadReusedCount;              // requests sent on an already open connection, since the last push
+  uint16_t uploadReconnectCount;           // connections dropped part way through a pipeline
+  uint32_t uploadConnectTimeSavedInMs;
+  uint16_t pushLatencyInMs;                // last 5 minute push, until the upload queue was empty
+  uint8_t telemetryQueueDepth;
+  uint16_t telemetryDropCount;
+  uint16_t nightStatsSaveCount;            // since 10pm
+  uint16_t nightStatsBytesWritten;         // since 10pm.  The old scheme wrote every byte:  saves x sizeof(HedgieNightStats_t)
+  uint32_t nightStatsMaxSaveTimeInUs;
+  uint32_t nightLogRotations;              // since 10pm
+  uint32_t nightLogBytes;
+  uint16_t nightLogMaxEncodeTimeInUs;
+  uint16_t nightLogDropCount;              // rotations not logged, buffer or block full
+  uint16_t boutCount;                      // since 10pm
+  Bout_t topBouts[NUM_TOP_BOUTS];          // longest first, numRotations 0 when not used
+  uint16_t currentBoutInSecs;              // when the diagnostics were taken
+  uint16_t boutMaxTimeInUs;                // bout analyzer, worst time for one rotation, since 10pm
+  uint16_t rotationsRecoveredAtReset;
+  uint16_t lcdUpdateCount;                 // screen updates (page changes) since the last push
+  uint32_t lcdI2cBytesSaved;               // compared to clearing and rewriting the whole screen on each update
+  uint32_t lcdTimeSavedInUs;
+  TaskStats_t taskStats[NUM_TASKS];               // since the last push
+  I2cDeviceStats_t i2cStats[NUM_I2C_DEVICES];    // since the last push
+  uint16_t i2cBusRecoveryCount;
+  uint16_t clockSyncFailureCount;          // resyncs where no two RTC reads agreed
+  int16_t clockDriftPpm;                   // Arduino clock against the RTC, positive when the Arduino is slow
+  uint16_t dnsHitCount;                    // since the last push
+  uint16_t dnsMissCount;                   // lookups sent to the DNS server
+  uint16_t dnsFailureCount;
+  uint16_t dnsStaleCount;                  // last good address used after a failed lookup
+  uint32_t bootToSamplingInUs;             // since reset (after the bootloader)
+  uint16_t bootToCountingInMs;             // first scheduler pass
+  uint16_t bootToNetworkInMs;
+  uint32_t sleepTimeInMs;                  // daytime sleep, since the last push
+  uint16_t awakePermille;                  // share of the last push interval spent awake
+  uint16_t wheelWakeCount;                 // daytime sleeps ended by the wheel
+  uint16_t maxWakeLatencyInUs;             // wheel edge to the first ADC sample after it
+  int16_t wheelWhiteLevel;                 // adaptive detector state, ADC counts
+  int16_t wheelMirrorLevel;
+  uint8_t wheelDebounceSamples;
+  int32_t ntpOffsetInMs;                   // last NTP sync, against the software clock.  Positive when the clock was slow
+  uint16_t ntpRoundTripInMs;               // of the sample used
+  uint16_t ntpSyncCount;                   // since reset
+  uint16_t ntpFailureCount;                // syncs without enough agreeing samples
+  uint16_t ntpLostCount;                   // requests without a valid reply
+  uint16_t ntpRejectedCount;               // replies that disagreed with the rest
+  uint16_t minFreeRam;                     // bytes the stack never reached, since reset
+  int16_t freeRam;                         // when the diagnostics were taken
+} Diagnostics_t;
+
+// the key=value pairs of the diagnostics feed, in the order they're written
+typedef enum
+{
+  DIAGNOSTICS_LOOP_TIME,
+  DIAGNOSTICS_ROTATION_OVERFLOWS,
+  DIAGNOSTICS_UPLOAD_FAILURES,
+  DIAGNOSTICS_UPLOAD_DROPS,
+  DIAGNOSTICS_UPLOAD_REUSED,
+  DIAGNOSTICS_UPLOAD_RECONNECTS,
+  DIAGNOSTICS_UPLOAD_TIME_SAVED,
+  DIAGNOSTICS_PUSH_LATENCY,
+  DIAGNOSTICS_TELEMETRY_DEPTH,
+  DIAGNOSTICS_TELEMETRY_DROPS,
+  DIAGNOSTICS_NIGHT_STATS_SAVES,
+  DIAGNOSTICS_NIGHT_STATS_BYTES,
+  DIAGNOSTICS_NIGHT_STATS_SAVE_TIME,
+  DIAGNOSTICS_ROTATIONS_RECOVERED,
+  DIAGNOSTICS_LCD_UPDATES,
+  DIAGNOSTICS_LCD_BYTES_SAVED,
+  DIAGNOSTICS_LCD_TIME_SAVED,
+  DIAGNOSTICS_I2C_STATS,                                              // one for each I2C device
+  DIAGNOSTICS_I2C_RECOVERIES = DIAGNOSTICS_I2C_STATS + NUM_I2C_DEVICES,
+  DIAGNOSTICS_TASK_STATS,                                             // one for each task
+  DIAGNOSTICS_BOOT_TO_SAMPLING = DIAGNOSTICS_TASK_STATS + NUM_TASKS,
+  DIAGNOSTICS_BOOT_TO_COUNTING,
+  DIAGNOSTICS_BOOT_TO_NETWORK,
+  DIAGNOSTICS_CLOCK_SYNC_FAILURES,
+  DIAGNOSTICS_CLOCK_DRIFT,
+  DIAGNOSTICS_DNS_HITS,
+  DIAGNOSTICS_DNS_MISSES,
+  DIAGNOSTICS_DNS_FAILURES,
+  DIAGNOSTICS_DNS_STALE,
+  DIAGNOSTICS_AWAKE,
+  DIAGNOSTICS_WHEEL_WAKES,
+  DIAGNOSTICS_WAKE_LATENCY,
+  DIAGNOSTICS_WHITE_LEVEL,
+  DIAGNOSTICS_MIRROR_LEVEL,
+  DIAGNOSTICS_DEBOUNCE,
+  DIAGNOSTICS_NIGHT_LOG_ROTATIONS,
+  DIAGNOSTICS_NIGHT_LOG_BYTES,
+  DIAGNOSTICS_NIGHT_LOG_RATIO,
+  DIAGNOSTICS_NIGHT_LOG_ENCODE_TIME,
+  DIAGNOSTICS_NIGHT_LOG_DROPS,
+  DIAGNOSTICS_BOUTS,
+  DIAGNOSTICS_CURRENT_BOUT,
+  DIAGNOSTICS_BOUT_TIME,
+  DIAGNOSTICS_TOP_BOUTS,                                              // one for each of the top bouts
+  DIAGNOSTICS_NTP_OFFSET = DIAGNOSTICS_TOP_BOUTS + NUM_TOP_BOUTS,
+  DIAGNOSTICS_NTP_ROUND_TRIP,
+  DIAGNOSTICS_NTP_SYNCS,
+  DIAGNOSTICS_NTP_FAILURES,
+  DIAGNOSTICS_NTP_LOST,
+  DIAGNOSTICS_NTP_REJECTED,
+  DIAGNOSTICS_MIN_FREE_RAM,
+  DIAGNOSTICS_FREE_RAM,
+  NUM_DIAGNOSTICS_FIELDS                                              // <-- keep this last
+} DIAGNOSTICS_FIELD_t;
 
 #define CAPTOUCH_BUTTON (6)
 #define PROTOSHIELD_BUTTON (7)
 #define WHEEL_ROTATION_LED (8)
 #define GREEN_LED (9)
 #define WHEEL_CIRCUMFERENCE_IN_CM (85)
+#define TIME_STRING_SIZE (11)           // getTimeAsString():  "12:45 PM", sized for any uint8_t hour and minute ("255:255 PM")
 #define DELAY_BETWEEN_SAMPLES (2)
+#define MIRROR_THRESHOLD (300)
+#define WHITE_SAMPLES_TO_DEBOUNCE (40)  // ~40ms of consecutive white samples, at the 1.024ms ADC sample rate
+#define ADAPTIVE_LEVEL_SHIFT (4)           // adaptive detector levels are kept in ADC counts x 16
+#define ADAPTIVE_WHITE_AVERAGE_SHIFT (6)   // white level follows the sensor over ~64 samples
+#define ADAPTIVE_MIRROR_AVERAGE_SHIFT (2)  // a mirror pass at speed is only a few samples long
+#define ADAPTIVE_MIN_SPAN (100)            // ADC counts between the white and mirror levels, at least
+#define ADAPTIVE_MIN_DEBOUNCE_SAMPLES (3)
+#define ADAPTIVE_MAX_MIRROR_SAMPLES (2000) // ~2 secs above the rising threshold is no mirror pass:  the levels are started over
+#define ROTATION_BUFFER_SIZE (16)       // must be a power of 2
+#define REVOLUTION_PERIOD_MAX_IN_US (5000000UL)  // a longer gap between rotations means hedgie stopped, it's not a revolution
+#define SPEED_TO_PERIOD_IN_US(cmPerSec) ((WHEEL_CIRCUMFERENCE_IN_CM * 1000000UL) / (cmPerSec))
+#define BOUT_GAP_IN_US (30000000UL)      // a longer pause ends the bout
+#define BOUT_MIN_ROTATIONS (5)           // fewer is a nudge, not a bout
 #define STARTUP_COUNT_THRESHOLD (10)
 #define NUM_INTERVALS_TO_RESET 2
 #define WLAN_SSID       "... your WiFi SSID..."
 #define WLAN_PASS       "... your WiFi password..."
 #define AIO_KEY  "==AIO Key =="
+#define AIO_FEED_DISTANCE "hhd"
+#define AIO_FEED_TEMPERATURE "hht"
+#define AIO_FEED_UPTIME "hhu"
+#define AIO_FEED_DIAGNOSTICS "hhx"
+#define STACK_PAINT (0xC5)                  // free RAM is filled with this at reset
+#define UPLOAD_QUEUE_SIZE (8)
+#define UPLOAD_CHUNK_SIZE (32)              // request bytes copied to the W5100 per loop() pass, in one SPI burst
+#define UPLOAD_READ_BYTES_PER_PASS (8)      // response bytes read per loop() pass
+#define UPLOAD_CONNECT_TIMEOUT_MS (5000)
+#define UPLOAD_SEND_TIMEOUT_MS (5000)
+#define UPLOAD_RESPONSE_TIMEOUT_MS (5000)
+#define UPLOAD_CLOSE_TIMEOUT_MS (1000)
+#define UPLOAD_PIPELINE_MAX (4)             // Adafruit IO feed updates written on one connection
+#define UPLOAD_NO_FIELD (0xFF)
+#define DIAGNOSTICS_BODY_SLACK (16)         // room for the diagnostics to grow while they're sent, padded with spaces if they don't
+#define TELEMETRY_QUEUE_SLOTS (12)
+#define TELEMETRY_SLOT_SIZE (sizeof(TelemetryRecord_t) + 2)   // state byte, record, CRC
+#define TELEMETRY_BATCH_SIZE (4)          // records replayed per request
+#define TELEMETRY_SLOT_VALID (0xA0)       // upper nibble of the slot state byte, lower bits are the destinations still to send to
+#define TELEMETRY_TO_SPARKFUN (0x01)
+#define TELEMETRY_TO_ADAFRUIT_IO (0x02)
+#define NIGHT_STATS_JOURNAL_SLOTS (6)
+#define NIGHT_STATS_SLOT_SIZE (sizeof(HedgieNightStats_t) + 3)   // sequence number, stats, CRC
+#define HISTORY_SLOTS (34)
+#define HISTORY_EMPTY_DAY (0xFFFF)
+#define HISTORY_TIME_STEP_IN_MINS (3)
+#define NUM_HISTORY_WINDOWS (2)
+#define HISTORY_CRC_SEED (0x5A)      // so erased (0x00 or 0xFF) totals don't pass the CRC
+#define HISTORY_FORMAT_MARKER (0xA1)  // the ring has been formatted.  Change it to format again when NightSummary_t changes
+#define DAYS_FROM_1970_TO_2000 (10957)
+#define ROTATION_COUNTER_BYTES (64)
+#define ROTATION_COUNTER_BITS (ROTATION_COUNTER_BYTES * 8)
+#define ROTATION_COUNTER_MODULUS (ROTATION_COUNTER_BITS * 2)    // bits are cleared on one pass, and set again on the next
+#define ROTATION_COUNTER_SAVE_MARGIN (128)  // the night stats are saved early this far (x2) before the counter could wrap
+#define LCD_COLS (16)
+#define LCD_ROWS (2)
+#define LCD_CELLS_PER_PASS (4)             // characters sent to the LCD per loop() pass
+#define LCD_I2C_BYTES_PER_COMMAND (5)      // a character or command is one transaction:  address, then EN high and low for 2 nibbles
+#define LCD_CLEAR_TIME_IN_US (2000)        // the LCD takes this long to clear
+#define I2C_BUS_CLOCK_HZ (100000UL)        // the DS1307 is a 100kHz part, and the bus is a long wire
+#define I2C_TIMEOUT_US (5000)              // a transfer stuck longer than this resets the TWI hardware
+#define I2C_MAX_ATTEMPTS (3)
+#define I2C_ADDRESS_NACK (2)               // Wire.endTransmission():  the address wasn't acked, no data byte was sent
+#define RTC_I2C_ADDRESS (0x68)
+#define TEMPERATURE_I2C_ADDRESS (0x18)
+#define LCD_I2C_ADDRESS (0x27)
+#define MCP9808_REG_AMBIENT_TEMP (0x05)
+#define LCD_RS (0x01)                      // PCF8574 pins:  RS, RW, EN, backlight, then D4-D7 on the upper nibble
+#define LCD_EN (0x04)
+#define LCD_BACKLIGHT (0x08)
+#define COMPARATOR_WHITE_DEBOUNCE_IN_US (WHITE_SAMPLES_TO_DEBOUNCE * 1024UL)    // white shorter than this is a glitch, as with the ADC
+#define COMPARATOR_MIRROR_CHANNEL (0)     // comparator - input for the mirror edge:  A0, the sensor.  1 for A1, with the optional divider
+#define COMPARATOR_WHITE_CHANNEL (0)      // and for the white edge:  A0, the sensor
+#define ETHERNET_POWER_UP_MS (1000)
+#define ETHERNET_SETTLE_MS (1000)
+#define ETHERNET_DHCP_TIMEOUT_MS (4000)           // Ethernet.begin() blocks for up to this long
+#define ETHERNET_DHCP_RESPONSE_TIMEOUT_MS (2000)
+#define ETHERNET_DHCP_RETRY_MS (60000UL)          // the first retry, doubled after each failure
+#define ETHERNET_DHCP_MAX_RETRY_MS (960000UL)     // 16 mins:  a network that stays down costs a 4s stall every 16 mins
+#define LCD_POWER_UP_MS (50)
+#define LCD_BEGIN_STEP_MS (5)                     // LCD reset and clear times, rounded up
+#define NIGHT_LOG_CS (5)                          // flash chip select.  The Ethernet shield uses 10 (W5100) and 4 (SD card)
+#define SD_CARD_CS (4)
+#define NIGHT_LOG_BLOCK_SIZE (0x10000UL)          // one night per 64KB erase block
+#define NIGHT_LOG_MAX_BLOCKS (64)
+#define NIGHT_LOG_MAGIC (0x4C4E)
+#define NIGHT_LOG_BUFFER_SIZE (32)
+#define NIGHT_LOG_MAX_RECORD (6)                  // bytes, an escape with the time since the start of the night
+#define NIGHT_LOG_FLUSH_BYTES (16)
+#define NIGHT_LOG_FLUSH_MS (10000)                // a partial buffer is written after this long
+#define NIGHT_LOG_RESUME_WINDOW (10UL*3600)       // a reset within this long of the start of the night continues its log
+#define FLASH_PAGE_SIZE (256)
+#define FLASH_READ (0x03)
+#define FLASH_PAGE_PROGRAM (0x02)
+#define FLASH_WRITE_ENABLE (0x06)
+#define FLASH_READ_STATUS (0x05)
+#define FLASH_BLOCK_ERASE (0xD8)
+#define FLASH_JEDEC_ID (0x9F)
+#define NTP_PORT (123)
+#define NTP_SAMPLES (4)
+#define NTP_SAMPLE_INTERVAL_MS (2000)
+#define NTP_REPLY_TIMEOUT_MS (1500)
+#define NTP_MAX_ROUND_TRIP_MS (1000)
+#define NTP_MAX_SPREAD_MS (100)                   // samples further than this from the fastest one are outliers
+#define NTP_MIN_AGREEING_SAMPLES (2)
+#define NTP_DAILY_MINUTE (7*60+10)                // after the 7am tweet
+#define SEVENTY_YEARS (2208988800UL)              // NTP time starts in 1900, Unix time in 1970
+#define DNS_CACHE_SIZE (4)
+#define DNS_PORT (53)
+#define DNS_LOCAL_PORT (1053)
+#define DNS_TIMEOUT_MS (1500)                     // a lookup without an answer by then has failed
+#define DNS_MIN_TTL_MS (60000UL)                  // also how long a failed lookup is cached
+#define DNS_MAX_TTL_MS (86400000UL)
+#define DAYTIME_SLEEP_MAX_MS (1000)                // longest sleep, loop() runs at least this often
+#define DAYTIME_AWAKE_AFTER_ACTIVITY_MS (60000UL)  // keep sampling the wheel this long after a rotation
+#define CLOCK_SYNC_INTERVAL_MS (60000UL)
+#define CLOCK_SYNC_READS (3)
+#define CLOCK_DRIFT_RESTART_MS (86400000UL)   // the drift measurement restarts once a day, well before millis() wraps
+
+#ifdef DETECTION_BENCHMARK
+#define BENCH_ROTATIONS_PER_TRACE (20)
+#define BENCH_MIRROR_WIDTH_IN_CM (4)        // width of the mirror strip on the wheel
+#define BENCH_WHITE_LEVEL (150)             // ADC counts seen on the white part of the wheel
+#define BENCH_MIRROR_LEVEL (600)            // ADC counts seen on the mirror
+#define BENCH_NUM_SPEEDS (12)
+#define BENCH_NUM_NOISE_LEVELS (3)
+#define BENCH_NUM_SAMPLE_PERIODS (3)
+#define BENCH_NUM_OFFSETS (2)
+
+typedef struct
+{
+  uint16_t missedRotations;
+  uint16_t doubleCountedRotations;
+} BenchResult_t;
+#endif
 
-WHEEL_STATE_t detectMirror(DateTime& dateNow);
-WHEEL_STATE_t detectWhite(void);
+void setupWheelSampling(void);
+boolean isReadyToSleep(DateTime& dateNow);
+void armWakeOnActivity(void);
+void disarmWakeOnActivity(void);
+void sleepUntilActivity(void);
+void processWheelSample(int sample);
+WHEEL_STATE_t detectMirror(int sample);
+WHEEL_STATE_t detectWhite(int sample);
+WHEEL_STATE_t detectMirrorEdge(uint32_t edgeTimeInUs);
+WHEEL_STATE_t detectWhiteEdge(uint32_t edgeTimeInUs);
+void countRotation(DateTime& dateNow, uint32_t rotationTimeInUs);
+void initRevolutionStats(IntervalRevolutionStats_t *stats);
+void updateRevolutionStats(IntervalRevolutionStats_t *stats, uint32_t periodInUs);
+void addRevolutionStatsToNightStats(IntervalRevolutionStats_t *stats);
+uint32_t getMeanRevolutionInUs(IntervalRevolutionStats_t *stats);
+uint16_t convertRevolutionToCmPerSec(uint32_t periodInUs);
+void initBouts(void);
+void updateBouts(uint32_t periodInUs, boolean isSameBout);
+void endBout(void);
+void endIdleBout(void);
+void writeBout(Bout_t *bout, Print& out);
+boolean rotationBufferPush(uint32_t rotationTimeInUs);
+boolean rotationBufferPop(uint32_t *rotationTimeInUs);
 void initCountLog(void);
 void initNightStats(void);
 void saveNightStatsToEEPROM(void);
 void loadNightStatsFromEEPROM(void);
-boolean isMirror(int reference);
+void initNightStatsJournal(void);
+uint8_t findNewestNightStatsSlot(uint16_t *sequenceNumber);
+boolean eepromWriteIfChanged(int addr, uint8_t value);
+void startEepromRecordWrite(EepromRecordWrite_t *write, int addr, const uint8_t *image, uint8_t length, uint8_t commitIndex,
+                            uint8_t invalidValue);
+boolean serviceEepromRecordWrite(EepromRecordWrite_t *write);
+void finishEepromRecordWrite(EepromRecordWrite_t *write);
+boolean isEepromWritePending(void);
+void initRotationCounter(void);
+void incrementRotationCounter(void);
+void serviceRotationCounter(void);
+uint16_t getRotationCounter(void);
+void recoverRotationsSinceLastSave(DateTime& dateNow);
+void initNightHistory(void);
+void rebuildHistoryWindows(void);
+uint8_t getHistoryWindowsCrc(void);
+void addNightToHistory(void);
+uint16_t historyNewestDay(void);
+uint8_t packHistoryTime(DateTime& dateTime);
+DateTime unpackHistoryTime(uint8_t packedTime);
+void readNightSummary(uint8_t slot, NightSummary_t *summary);
+void writeNightSummary(uint8_t slot, NightSummary_t *summary);
+void saveHistoryWindows(void);
+void displayNightHistory(void);
+void displayHistoryAverages(void);
+void initNightLog(boolean isNight);
+void startNightLog(void);
+void closeNightLog(void);
+void appendNightLog(uint32_t rotationTimeInUs);
+void putNightLogVarint(uint32_t value);
+void serviceNightLog(void);
+uint32_t decodeNightLog(uint8_t block, Print *out, uint32_t *endAddress);
+void exportNightLog(Print& out);
+void readNightLogHeader(uint8_t block, NightLogHeader_t *header);
+void flashCommand(uint8_t command, uint32_t address);
+boolean isFlashBusy(void);
+void flashRead(uint32_t address, uint8_t *data, uint16_t length);
+void flashProgram(uint32_t address, const uint8_t *data, uint16_t length);
+void flashEraseBlock(uint32_t address);
+boolean isMirror(int sample);
+boolean isWhite(int sample);
+void initAdaptiveDetector(void);
+void updateAdaptiveDetector(int sample);
 void initDebugMsgLog(void);
 void logDebugMsg(uint8_t debugIndex, uint8_t debugMsg);
 void initResetLog(void);
 void saveTimeOfLastResetToEEPROM(DateTime timeOfLastReset);
 DateTime readTimeOfLastResetFromEEPROM(void);
 void displayTimeOfLastReset(void);
+void displayNightStats(void);
+void displayTemperature(void);
+void showUiPages(UI_PAGE_t firstPage, boolean isSinglePage);
+void serviceUi(void);
+void renderUiPage(UI_PAGE_t page);
+void flushLcd(void);
 boolean isButtonPress(void);
 boolean isProtoshieldButtonPress(void);
-boolean isNewHour(DateTime&);
-boolean isNewMinute(DateTime&);
+void runScheduler(void);
+boolean isTaskDue(uint8_t task, TaskConfig_t *config, uint32_t nowMillis);
+void runTask(uint8_t task, TaskConfig_t *config);
+void restartTaskDeadlines(void);
+void taskCountRotations(void);
+void taskSoftwareClock(void);
+void taskNightReset(void);
+void taskIntervalStats(void);
+void taskTweet(void);
+void taskHealthPush(void);
+void taskUpload(void);
+void taskUi(void);
+void taskNightLog(void);
+void taskEepromWrites(void);
+void taskNtpDaily(void);
+void taskNtp(void);
+void taskNetwork(void);
+void writeTaskStats(Print& out);
+void writeTaskStat(uint8_t task, Print& out);
 void delaySecsWithWatchdog(uint16_t numSecDelay);
 void handleButtonPress(DateTime& dateNow);
 void convertCmsToKm(uint32_t cms, uint32_t *km, uint32_t *kmFraction);
 uint32_t convertCmsToM(uint32_t cms);
 void getTimeAsString(DateTime& dateTime, char *timeBuf_p, TIME_FORMAT_t format);
-void constructTwitterMsg(char *twitterMsg);
+void writeTwitterMsg(DateTime& timeNow, Print& out);
 void tweetNightStats(void);
-void updateTwitterStatus(char *twitterMsg);
-void sendDataToSparkFun(DateTime& dateNow, uint32_t distanceRunIntervalInCm);
-void setupEthernet();
-void updateRtcUsingNTP(void);
-unsigned long getNTP();
-void sendNTPpacket(IPAddress& address, byte *packetBuffer);
-int dstOffset (DateTime time);
+void updateTwitterStatus(UploadJob_t *job, Print& out);
+void sendDataToSparkFun(uint32_t distanceRunIntervalInCm, IntervalRevolutionStats_t *intervalStats);
+void writeSparkFunRequest(TelemetryRecord_t *record, boolean isLastRequest, Print& out);
+void writeSparkFunBacklogRequest(Print& out);
+void writeAdafruitIOBacklogRequest(Print& out);
+void writeAdafruitIOBacklogBody(Print& out);
+void initTelemetryQueue(void);
+void saveTelemetryRecord(TelemetryRecord_t *record);
+boolean readTelemetryRecord(uint8_t slot, TelemetryRecord_t *record);
+uint8_t readTelemetrySlotState(uint8_t slot);
+void selectTelemetryBatch(uint8_t destination);
+boolean acknowledgeTelemetryBatch(uint8_t destination, uint8_t okResponseMask);
+boolean acknowledgeUploadBatch(UploadJob_t *job);
+void queueTelemetryBacklog(void);
+uint8_t crc8(const uint8_t *data, uint8_t length, uint8_t crc = 0);
+void sendFeedToAdafruitIO(const char *feedKey, int32_t value, uint8_t decimals);
+void sendDiagnosticsToAdafruitIO(void);
+void startDiagnosticsPeriod(void);
+void writeAdafruitIORequest(UploadJob_t *job, boolean isLastRequest, Print& out);
+uint8_t getUploadPipelineLength(void);
+void finishUploadPipeline(void);
+void writeAdafruitIOValue(UploadJob_t *job, Print& out);
+void writeDiagnostics(Print& out);
+void writeDiagnosticsField(uint8_t field, Print& out);
+boolean queueUpload(UPLOAD_KIND_t kind, const char *feedKey, int32_t value, uint8_t decimals);
+void serviceUpload(void);
+void writeUploadRequest(UploadJob_t *job, Print& out);
+DNS_RESULT_t resolveUploadServer(UPLOAD_SERVER_t server, IPAddress& address);
+DNS_RESULT_t resolveHost(const char *name, IPAddress& address);
+void invalidateHost(const char *name);
+DnsCacheEntry_t *findDnsCacheEntry(const char *name);
+boolean sendDnsQuery(const char *name);
+DNS_RESULT_t pollDnsQuery(void);
+DNS_RESULT_t readDnsReply(uint32_t *address, uint32_t *ttlInSecs);
+uint16_t readDnsWord(void);
+boolean skipDnsName(void);
+void parseUploadResponse(char c);
+UPLOAD_SERVER_t getUploadServer(UPLOAD_KIND_t kind);
+void finishUpload(boolean isSuccess);
+void startNtpSync(void);
+void serviceNtp(void);
+boolean readNtpReply(NtpSample_t *sample, uint32_t arrivalMillis);
+void finishNtpSync(void);
+void applyNtpTime(void);
+uint32_t readNtpWord32(const byte *p);
+uint16_t ntpFractionToMs(uint32_t fraction);
+void sendNTPpacket(IPAddress& address, byte *packetBuffer, uint32_t token);
+int32_t getUtcOffsetInSecs(uint32_t utcTime);
+void loadTimezoneYear(uint32_t utcTime);
+uint32_t getDstTransition(uint16_t year, uint8_t month, uint8_t week, uint8_t dayOfWeek, uint8_t hour, int32_t offsetInSecs);
+uint32_t softwareClockUtc(void);
 void displayTime(DateTime& dateNow);
 boolean isValidHour(DateTime& dateNow);
-int freeRam();
+void initSoftwareClock(void);
+DateTime softwareClockNow(void);
+void serviceSoftwareClock(void);
+boolean syncSoftwareClockFromRtc(void);
+void setSoftwareClock(uint32_t unixTime);
+boolean isValidRtcTime(DateTime& dateTime);
+void initI2c(void);
+boolean i2cWrite(I2C_DEVICE_t device, const uint8_t *data, uint8_t length);
+boolean i2cReadRegisters(I2C_DEVICE_t device, uint8_t reg, uint8_t *data, uint8_t length);
+void recordI2cTransaction(I2C_DEVICE_t device, uint8_t attempts, boolean isSuccess, uint32_t startTimeInUs);
+void recoverI2cBus(void);
+boolean readRtcTime(DateTime *dateTime);
+boolean writeRtcTime(uint32_t unixTime);
+boolean isValidBcd(uint8_t value, uint8_t maxValue);
+uint8_t bcdToBin(uint8_t value);
+uint8_t binToBcd(uint8_t value);
+boolean readTemperature(float *temperatureInC);
+boolean serviceLcdBegin(void);
+void lcdClear(void);
+void lcdSetCursor(uint8_t col, uint8_t row);
+void lcdWrite(uint8_t c);
+void lcdSetBacklight(boolean isOn);
+void lcdSend(uint8_t value, uint8_t mode);
+void lcdSendNibble(uint8_t nibble);
+void writeI2cStats(const __FlashStringHelper *name, I2cDeviceStats_t *stats, Print& out);
+#ifdef DETECTION_BENCHMARK
+void runDetectionBenchmark(void);
+void runDetectionBenchmarkTrace(uint16_t speedInRpm, uint16_t noiseLevel, uint16_t offset, uint16_t samplePeriodInUs, BenchResult_t *result);
+#endif
 
 HedgieNightStats_t nightStats;
 DateTime resetLog;
 uint32_t distanceRunIntervalInCm=0;
+IntervalRevolutionStats_t intervalRevolutionStats;
+uint32_t lastRotationTimeInUs = 0;
+boolean isLastRotationTimeValid = false;
+Bout_t currentBout;
+boolean isBoutRunning = false;
+uint32_t boutStartMillis;
+uint32_t boutLastMillis;
+
+// speed histogram bucket limits.  Bucket 0 is slower than the first limit, the last bucket is faster than the last limit
+const uint32_t speedBucketPeriodInUs[NUM_SPEED_BUCKETS-1] = 
+{
+  SPEED_TO_PERIOD_IN_US(25),   // 25 cm/s
+  SPEED_TO_PERIOD_IN_US(50),   // 50 cm/s
+  SPEED_TO_PERIOD_IN_US(100)   // 1 m/s
+};
+
+#ifdef DETECTION_BENCHMARK
+const uint16_t benchSpeedInRpm[BENCH_NUM_SPEEDS] = { 30, 60, 100, 150, 200, 300, 400, 600, 800, 1000, 1200, 1500 };
+const uint16_t benchNoiseLevel[BENCH_NUM_NOISE_LEVELS] = { 0, 100, 200 };    // peak uniform noise, ADC counts
+const uint16_t benchSamplePeriodInUs[BENCH_NUM_SAMPLE_PERIODS] = { 1024, 2048, 4096 };
+const uint16_t benchOffset[BENCH_NUM_OFFSETS] = { 0, 200 };    // ambient light or sensor alignment drift, ADC counts
+uint32_t benchTimeInUs;    // virtual clock, stands in for micros() while traces are replayed
+#endif
+
 const int EEPROMaddrForDebugLog=100;
 const int EEPROMaddrForResetLog=200;
 const int EEPROMaddrForNightStats=800;
-int whiteSampleCount = 0;
+const int EEPROMaddrForTelemetryQueue=224;
+const int EEPROMaddrForRotationCounter=464;
+const int EEPROMaddrForNightHistory=528;
+const int EEPROMaddrForHistoryWindows=998;
+const int EEPROMaddrForHistoryFormat=1017;
+uint32_t debugMsgLogged = 0;    // a bit for each message written to the debug log since it was cleared.  32 messages at most
+EepromRecordWrite_t debugLogClearWrite;
+volatile int whiteSampleCount = 0;
+WHEEL_DETECTOR_t wheelDetector = ADAPTIVE_THRESHOLD_DETECTOR;
+AdaptiveDetector_t adaptiveDetector;
 uint16_t startupTestingCount=0;
 uint8_t wdtCount = NUM_INTERVALS_TO_RESET; // number of intervals before unit will force a reset (total time is intervals x 8 seconds)
 uint32_t uptimeInMinutes = 0;
 
 STATISTICS_CAPTURE_STATE_t statisticsCaptureState = STARTUP_TESTING_DISCARD_HEDGIE_STATISTICS;
-WHEEL_STATE_t wheelState = DETERMINE_MIRROR_LOCATION;
-byte prevHour;
-byte prevMinute;
-RTC_DS1307 rtc;
+volatile WHEEL_STATE_t wheelState = DETERMINE_MIRROR_LOCATION;
+
+// single-producer (ADC interrupt) / single-consumer (loop) queue of rotation timestamps.
+// head is only written by the interrupt, tail is only written by loop(), so no locking is needed
+volatile uint32_t rotationBuffer[ROTATION_BUFFER_SIZE];
+volatile uint8_t rotationBufferHead = 0;
+volatile uint8_t rotationBufferTail = 0;
+volatile uint16_t rotationBufferOverflowCount = 0;
+
+Diagnostics_t diagnostics;
+boolean isDiagnosticsQueued = false;
+uint16_t diagnosticsBodyLength = 0;  // fixed when the request is started, 0 until then
+uint32_t loopStartTimeInUs;
+
+// task table, highest priority first.  Wall clock tasks run once, in the first pass of their minute.  The budgets are the worst
+// runs seen in the simulator over a night, with some room.  EEPROM writes (3.3ms each) are left to taskEepromWrites(), except the
+// night history's at 7am.  int can still wait out a write in progress, when it reads the telemetry queue
+const TaskConfig_t taskConfig[NUM_TASKS] PROGMEM =
+{
+  //  run                  name   timing           interval  offset   deadline  budget
+  { taskCountRotations,  "rot", TASK_PERIODIC,          0,      0,        20,   1000 },
+  { taskSoftwareClock,   "clk", TASK_PERIODIC,       1000,      0,      1000,   4000 },
+  { taskNightReset,      "10p", TASK_WALL_CLOCK,     1440, 22*60,      1000,  30000U },
+  { taskIntervalStats,   "int", TASK_WALL_CLOCK,        5,      0,      1000,   5000 },
+  { taskTweet,           "7am", TASK_WALL_CLOCK,     1440,  7*60,      1000,  65000U },
+  { taskHealthPush,      "hlt", TASK_WALL_CLOCK,        5,      0,      1000,   1000 },
+  { taskUpload,          "upl", TASK_PERIODIC,          0,      0,       100,   1000 },
+  { taskUi,              "ui",  TASK_PERIODIC,         10,      0,        50,   4000 },
+  { taskNightLog,        "nlg", TASK_PERIODIC,         20,      0,       100,   3000 },
+  { taskEepromWrites,    "eep", TASK_PERIODIC,          0,      0,       100,   1000 },
+  { taskNtpDaily,        "ntd", TASK_WALL_CLOCK,     1440, NTP_DAILY_MINUTE, 1000, 1000 },
+  { taskNtp,             "ntp", TASK_PERIODIC,         20,      0,       100,   2000 },
+  { taskNetwork,         "net", TASK_PERIODIC,        100,      0,      1000,   1000 }    // DHCP left out, see taskNetwork()
+};
+
+// when each task is next due (TASK_PERIODIC), or became due (TASK_WALL_CLOCK).  For an every pass task, when it last ran
+uint32_t taskDueMillis[NUM_TASKS];
+boolean isTaskPending[NUM_TASKS];    // TASK_WALL_CLOCK only
+uint16_t schedulerMinuteOfDay = 0xFFFF;
+boolean isSchedulerStarted = false;
+boolean isDhcpInTaskRun = false;     // the task running blocked in halNetBegin()
+DateTime schedulerNow;               // the time for this pass, read once by the scheduler
+
+const uint8_t i2cDeviceAddress[NUM_I2C_DEVICES] = { RTC_I2C_ADDRESS, TEMPERATURE_I2C_ADDRESS, LCD_I2C_ADDRESS };
+uint8_t lcdBacklight = LCD_BACKLIGHT;    // backlight bit, sent with every LCD write
+
+// Screens are drawn here, with the same calls as the LCD (clear, setCursor, print), and flushLcd() sends the changed characters
+class LcdFrameBuffer : public Print
+{
+  public:
+    char cells[LCD_ROWS][LCD_COLS];
+    uint8_t col;
+    uint8_t row;
+    
+    void clear()
+    {
+      memset(cells, ' ', sizeof(cells));
+      col = 0;
+      row = 0;
+    }
+    
+    void setCursor(uint8_t newCol, uint8_t newRow)
+    {
+      col = newCol;
+      row = newRow;
+    }
+    
+    virtual size_t write(uint8_t c)
+    {
+      if ((row < LCD_ROWS) && (col < LCD_COLS))
+      {
+        cells[row][col] = c;
+      }
+      
+      col++;
+      return 1;
+    }
+};
 
-// set the LCD address to 0x27 for a 20 chars 4 line display
-// Set the pins on the I2C chip used for LCD connections:
-//                    addr, en,rw,rs,d4,d5,d6,d7,bl,blpol
-LiquidCrystal_I2C lcd(0x27, 2, 1, 0, 4, 5, 6, 7, 3, POSITIVE);  // Set the LCD I2C address
+LcdFrameBuffer lcdFrame;
+char lcdShadow[LCD_ROWS][LCD_COLS];   // what the LCD is showing
+uint8_t lcdCursorCol = LCD_COLS;       // LCD cursor position, LCD_COLS when unknown
+uint8_t lcdCursorRow = 0;
+boolean isLcdUpdateInProgress = false;
+uint16_t lcdUpdateCommands;            // characters and cursor moves sent for the current screen update
+uint32_t lcdUpdateTimeInUs;
 
-const char* monthStr[]={"January","February","March","April","May","June","July","August","September","October","November","December"};
-const char* dayOfWeekStr[]={"Sunday","Monday","Tuesday","Wednesday","Thursday","Friday","Saturday"};
+// button page sequence
+UI_PAGE_t uiPage = UI_PAGE_NONE;
+boolean isUiSinglePage;
+uint32_t uiPageStartMillis;
+const uint16_t uiPageDurationInMs[NUM_UI_PAGES] = { 0, 4000, 4000, 4000, 4000, 2000, 2000 };
 
-Adafruit_MCP9808 tempsensor = Adafruit_MCP9808();
+// month and day names for the tweet, in flash
+const char january[] PROGMEM = "January";
+const char february[] PROGMEM = "February";
+const char march[] PROGMEM = "March";
+const char april[] PROGMEM = "April";
+const char may[] PROGMEM = "May";
+const char june[] PROGMEM = "June";
+const char july[] PROGMEM = "July";
+const char august[] PROGMEM = "August";
+const char september[] PROGMEM = "September";
+const char october[] PROGMEM = "October";
+const char november[] PROGMEM = "November";
+const char december[] PROGMEM = "December";
+const char sunday[] PROGMEM = "Sunday";
+const char monday[] PROGMEM = "Monday";
+const char tuesday[] PROGMEM = "Tuesday";
+const char wednesday[] PROGMEM = "Wednesday";
+const char thursday[] PROGMEM = "Thursday";
+const char friday[] PROGMEM = "Friday";
+const char saturday[] PROGMEM = "Saturday";
+const char* const monthStr[] PROGMEM = {january, february, march, april, may, june, july, august, september, october, november, december};
+const char* const dayOfWeekStr[] PROGMEM = {sunday, monday, tuesday, wednesday, thursday, friday, saturday};
 
 // Enter a MAC address for your controller below.
 // Newer Ethernet shields have a MAC address printed on a sticker on the shield
@@ -189,62 +1113,311 @@ byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
 // Set the static IP address to use if the DHCP fails to assign
 IPAddress ip(192,168,0,177);
 
-// Initialize the Ethernet client library
-// with the IP address and port of the server 
-// that you want to connect to (port 80 is default for HTTP):
-EthernetClient client;
-
-// Create an Adafruit IO Client instance.  Notice that this needs to take a
-// WiFiClient object as the first parameter, and as the second parameter a
-// default Adafruit IO key to use when accessing feeds (however each feed can
-// override this default key value if required, see further below).
-Adafruit_IO_Client aio = Adafruit_IO_Client(client, AIO_KEY);
-
-// Finally create instances of Adafruit_IO_Feed objects, one per feed.  Do this
-// by calling the getFeed function on the Adafruit_IO_Feed object and passing
-// it at least the name of the feed, and optionally a specific AIO key to use
-// when accessing the feed (the default is to use the key set on the
-// Adafruit_IO_Client class).
-Adafruit_IO_Feed hedgieDistance = aio.getFeed("hhd");
-Adafruit_IO_Feed hedgieTemperature = aio.getFeed("hht");
-Adafruit_IO_Feed hedgieUptime = aio.getFeed("hhu");
+// Adafruit IO connection information
+char aioServer[] = "io.adafruit.com";
 
 // ThingSpeak connection information
 #define WEBSITE      "api.thingspeak.com"
-char thingtweetAPIKey[] = "=======";  // ThingSpeak settings
+const char thingtweetAPIKey[] PROGMEM = "=======";  // ThingSpeak settings
 char thingspeeakServer[] = WEBSITE;    // name address for Google (using DNS)
 
 // Sparkfun Data connection information
 char sparkfunServer[] = "data.sparkfun.com";    // name address for data.sparkFun (using DNS)
-const String publicKey = "============";
-const String privateKey = "==============";
+const char publicKey[] PROGMEM = "============";
+const char privateKey[] PROGMEM = "==============";
+
+// Background uploads.  Jobs are queued by loop() and sent one at a time by serviceUpload(), without waiting on the network.
+//
+// Each pass generates the request from the start, and copies the bytes of this pass's chunk to the transmit buffer.  Fields are
+// the parts printed from values that change while the request is sent (the diagnostics).  A pass picks up at the field the last
+// one stopped in, at the position it had then:  the fields before it are in the socket already, and would print to a different
+// length now.  A field is only copied whole, unless it's longer than the chunk
+class UploadRequestWriter : public Print
+{
+  public:
+    uint16_t position;          // request bytes generated so far
+    uint16_t windowStart;       // request bytes already in the socket
+    uint16_t windowEnd;         // end of this pass's chunk
+    uint8_t length;
+    uint8_t buffer[UPLOAD_CHUNK_SIZE];
+    uint8_t resumeField;        // the field the last pass stopped in, UPLOAD_NO_FIELD for none
+    uint16_t resumePosition;
+    uint8_t nextResumeField;    // the same, for the next pass
+    uint16_t nextResumePosition;
+    boolean isSkipping;         // generating the fields before resumeField, for nothing
+    boolean isTruncated;        // something past the chunk wasn't taken
+    
+    void startRequest(void)
+    {
+      resumeField = UPLOAD_NO_FIELD;
+    }
+    
+    void startPass(uint16_t start, uint16_t end)
+    {
+      position = 0;
+      windowStart = start;
+      windowEnd = end;
+      length = 0;
+      nextResumeField = UPLOAD_NO_FIELD;
+      isSkipping = (resumeField != UPLOAD_NO_FIELD);
+      isTruncated = false;
+    }
+    
+    // copies the chunk to the transmit buffer
+    void endPass(void)
+    {
+      if (length > 0)
+      {
+        halTcpBuffer(buffer, length);
+      }
+      
+      resumeField = nextResumeField;
+      resumePosition = nextResumePosition;
+    }
+    
+    void beginField(uint8_t field)
+    {
+      if (isSkipping)
+      {
+        if (field != resumeField)
+        {
+          return;
+        }
+        
+        position = resumePosition;
+        isSkipping = false;
+      }
+      else if (isTruncated && (nextResumeField != UPLOAD_NO_FIELD) && (nextResumePosition > windowStart) &&
+               (nextResumePosition < windowEnd))
+      {
+        // the last field didn't fit:  the chunk ends before it, and the next pass writes it whole
+        length -= windowEnd - nextResumePosition;
+        windowEnd = nextResumePosition;
+        position = windowEnd;
+      }
+      
+      if ((isTruncated == false) && (position <= windowEnd))
+      {
+        nextResumeField = field;
+        nextResumePosition = position;
+      }
+    }
+    
+    // Past the chunk, nothing is taken, so each print stops at its first byte, and the request ended before windowEnd when
+    // position < windowEnd
+    virtual size_t write(uint8_t c)
+    {
+      if (isSkipping)
+      {
+        position++;
+        return 1;
+      }
+      
+      if (position >= windowEnd)
+      {
+        isTruncated = true;
+        return 0;
+      }
+      
+      if (position >= windowStart)
+      {
+        buffer[length++] = c;
+      }
+      
+      position++;
+      return 1;
+    }
+};
+
+// counts the bytes that would be printed, for Content-Length
+class CountingPrint : public Print
+{
+  public:
+    uint16_t count;
+    
+    CountingPrint() : count(0) {}
+    
+    virtual size_t write(uint8_t)
+    {
+      count++;
+      return 1;
+    }
+};
+
+char *uploadServerName[NUM_UPLOAD_SERVERS] = { aioServer, sparkfunServer, thingspeeakServer };
+char ntpServerName[] = "pool.ntp.org";
+DnsCacheEntry_t dnsCache[DNS_CACHE_SIZE];
+uint16_t dnsQueryId = 0;
+const char *dnsQueryName = NULL;      // hostname of the lookup waiting for its answer
+uint32_t dnsQueryStartMillis = 0;
+UploadJob_t uploadQueue[UPLOAD_QUEUE_SIZE];
+uint8_t uploadQueueHead = 0;
+uint8_t uploadQueueTail = 0;
+UPLOAD_STATE_t uploadState = UPLOAD_IDLE;
+uint32_t uploadStepStartMillis;
+UploadRequestWriter uploadWriter;
+uint16_t uploadBytesBuffered;     // request bytes copied to the socket's transmit buffer so far
+uint16_t uploadBytesSent;         // of those, the ones SEND was issued for
+uint16_t uploadRequestLength;     // 0xFFFF until the end of the request has been generated
+boolean isUploadSending = false;  // SEND issued, waiting for SEND_OK
+uint8_t uploadLineIndex;          // position in the current response line
+boolean isUploadStatusLine;
+uint16_t uploadStatusCode;
+uint8_t uploadResponseCount;      // more than one response when requests are pipelined
+uint8_t uploadOkResponseMask;     // bit n set when response n was 2xx
+uint8_t uploadPipelineLength;     // queued jobs written on the current connection
+uint16_t uploadConnectTimeInMs;
+uint32_t pushStartMillis = 0;     // 0 when no push is in progress
+
+// EEPROM telemetry queue.  Slots are written in ring order, so from the write slot onwards they are oldest first
+uint8_t telemetryWriteSlot = 0;
+uint8_t telemetryBatchSlots[TELEMETRY_BATCH_SIZE];   // slots in the request being sent
+uint8_t telemetryBatchSize = 0;
+uint8_t telemetryAckCount = 0;                       // slots in the batch acknowledged so far
+boolean isSparkfunBacklogQueued = false;
+boolean isAdafruitIOBacklogQueued = false;
+boolean isBacklogReplayDue = false;                  // queueTelemetryBacklog() once the EEPROM writes are done
+uint8_t telemetrySlotImage[TELEMETRY_SLOT_SIZE];     // the newest record, as it's written to its slot
+EepromRecordWrite_t telemetryWrite;
+
+// night stats journal
+uint8_t nightStatsJournalSlot = 0;          // slot of the newest record
+uint16_t nightStatsJournalSequence = 0;     // sequence number of the newest record
+uint8_t nightStatsSlotImage[NIGHT_STATS_SLOT_SIZE];
+EepromRecordWrite_t nightStatsWrite;
+
+// night history ring
+uint8_t historyNewestSlot = HISTORY_SLOTS;     // HISTORY_SLOTS when the ring is empty
+HistoryWindow_t historyWindows[NUM_HISTORY_WINDOWS];
+uint16_t historyCountedDay = HISTORY_EMPTY_DAY;  // newest night in historyWindows, saved with them
+const uint8_t historyWindowDays[NUM_HISTORY_WINDOWS] = { 7, 30 };
+uint8_t historyBrowseAge = 0;                  // nights back from the newest, on the history page
+boolean wasButtonPressed = false;
+
+// night rotation log, on the SPI flash
+NIGHT_LOG_STATE_t nightLogState = NIGHT_LOG_OFF;
+uint8_t nightLogBlockCount = 0;
+uint8_t nightLogBlock = 0;                  // block of the newest night
+uint16_t nightLogSequence = 0;
+uint32_t nightLogStartTime;                 // UTC
+uint32_t nightLogWriteAddress;              // next free byte in flash
+uint8_t nightLogBuffer[NIGHT_LOG_BUFFER_SIZE];
+uint8_t nightLogBufferLength = 0;
+uint32_t nightLogFlushMillis;
+uint32_t nightLogLastRotationInUs;
+uint16_t nightLogLastPeriodInMs;
+uint16_t nightLogResidualInUs;              // sub-ms part of the periods, carried so the times don't drift
+boolean isNightLogTimeValid = false;        // false:  the next rotation is logged with its full time
+
+ETHERNET_STATE_t ethernetState = ETHERNET_POWER_UP;
+uint32_t ethernetStateMillis = 0;     // when the current state started
+uint32_t ethernetRetryMs = ETHERNET_DHCP_RETRY_MS;
+boolean isLcdReady = false;
+uint8_t lcdBeginStep = 0;             // serviceLcdBegin() step to run next
+uint32_t lcdBeginStepMillis = 0;
+boolean isLcdResyncNeeded = false;    // an LCD write failed part way, the LCD may be out of step in 4 bit mode
+
+// daytime power mode
+volatile boolean isWakeOnActivityArmed = false;    // wheel sampling is stopped, the comparator watches the wheel
+volatile boolean isButtonWake = false;
+volatile boolean isWakeLatencyPending = false;
+volatile uint32_t wheelWakeTimeInUs;
+uint32_t lastWheelActivityMillis = 0;
+
+// comparator wheel sensor
+uint32_t whiteEdgeTimeInUs = 0;
+uint32_t lastDiagnosticsMillis = 0;
+
+uint16_t rotationCounterValue = 0;          // 0 .. ROTATION_COUNTER_MODULUS-1, mirrors the EEPROM rotation counter
+uint8_t rotationCounterPending = 0;         // rotations counted, not written to the EEPROM counter yet
+boolean isNightStatsSaveDue = false;        // the rotation counter is close to wrapping since the last save
 
 // NTP 
 unsigned int localPort = 8888; //Local port to listen for UDP Packets
 // IPAddress timeServer(132, 163, 4, 101); //NTP Server IP 
 IPAddress timeServer; // pool.ntp.org NTP server
 const int NTP_PACKET_SIZE= 48;  //NTP Time stamp is in the firth 48 bytes of the message
-EthernetUDP Udp;  //UDP Instance to let us send and recieve packets
-unsigned long epoch; //Unix Epoch time (NTP or RTC depending on state)
-const int TZ_OFFSET = (8*3600);  //PST UTC-8
+NTP_STATE_t ntpState = NTP_IDLE;
+NtpSample_t ntpSamples[NTP_SAMPLES];
+uint8_t ntpSampleCount;
+uint8_t ntpRequestCount;
+uint32_t ntpRequestMillis;           // when the last request was sent
+uint32_t ntpRequestToken;            // sent as our transmit timestamp, the server returns it as the originate timestamp
+uint32_t ntpApplyMillis;
+uint32_t ntpApplyTime;               // UTC at ntpApplyMillis
 
-void setup()
+// time zones
+const TimezoneRule_t timezoneRules[NUM_TIMEZONES] PROGMEM =
 {
-  DateTime dateNow;
-  
-  // Watchdog timer setup.  
-  noInterrupts();
-  MCUSR  &= ~_BV(WDRF);
-  WDTCSR  =  _BV(WDCE) | _BV(WDE);              // WDT change enable
-  WDTCSR  =  _BV(WDIE) | _BV(WDP3) | _BV(WDP0); // Interrupt enable, 8 sec.
-  interrupts();  
+  //  UTC offset  DST   start:  month week day hour   end:  month week day hour
+  {   -8*60,      60,            3,    2,   0,   2,         11,   1,   0,   2 },    // US Pacific
+  {   -5*60,      60,            3,    2,   0,   2,         11,   1,   0,   2 },    // US Eastern
+  {    1*60,      60,            3,    5,   0,   2,         10,   5,   0,   3 },    // central Europe
+  {       0,      60,            3,    5,   0,   1,         10,   5,   0,   2 },    // UK
+  {   10*60,      60,           10,    1,   0,   2,          4,   1,   0,   3 },    // eastern Australia (DST over the new year)
+  {    9*60,       0,            0,    0,   0,   0,          0,   0,   0,   0 }     // Japan, no DST
+};
 
-  Wire.begin();
-  rtc.begin();
-  tempsensor.begin();
-  
-  // Serial.begin(9600); 
-  
+TIMEZONE_t localTimezone = TIMEZONE_US_PACIFIC;
+
+// the current year's DST transitions, as UTC.  Reloaded when the time leaves the year
+uint32_t timezoneYearStart = 0;
+uint32_t timezoneYearEnd = 0;
+uint32_t dstStart = 0;
+uint32_t dstEnd = 0;
+int32_t standardOffsetInSecs = 0;
+int32_t daylightOffsetInSecs = 0;
+
+// software clock.  softwareClockTime (UTC) was the time at softwareClockMillis
+uint32_t softwareClockTime = 0;
+uint32_t softwareClockMillis = 0;
+DateTime softwareClockDateTime;         // softwareClockTime, converted to local time
+uint32_t softwareClockSyncMillis = 0;
+uint32_t clockDriftReferenceTime = 0;   // RTC time and millis() at the start of the drift measurement
+uint32_t clockDriftReferenceMillis = 0;
+boolean isClockDriftReferenceValid = false;
+
+// ================================================================================================================================
+// Hardware section:  the Arduino side of hedgie_hal.h.  Everything that touches a register, a pin, Wire, SPI, EEPROM or the W5100 is
+// here, and nowhere else.  The host build (HOST_BUILD) leaves it out, and links host/hal_host.cpp instead.
+// ================================================================================================================================
+
+#ifndef HOST_BUILD
+
+volatile uint32_t timer1OverflowInUs = 0;    // Timer1 is extended to 32 bits of microseconds by its overflow interrupt
+EthernetUDP halUdp[NUM_HAL_UDP];
+uint16_t uploadLocalPort = 49152;
+SOCKET uploadSocket = MAX_SOCK_NUM;
+EthernetClient uploadClient;
+
+void paintStack(void) __attribute__ ((naked)) __attribute__ ((used)) __attribute__ ((section (".init1")));    // used:  nothing calls it, LTO would drop it
+
+uint32_t halMicros(void)
+{
+#ifdef DETECTION_BENCHMARK
+  return benchTimeInUs;
+#else
+  return micros();
+#endif
+}
+
+uint32_t halMillis(void)
+{
+  return millis();
+}
+
+void halDelay(uint32_t delayInMs)
+{
+  delay(delayInMs);
+}
+
+void halDelayMicros(uint16_t delayInUs)
+{
+  delayMicroseconds(delayInUs);
+}
+
+void halInitPins(void)
+{
   // initialize digital pins as outputs
   pinMode(WHEEL_ROTATION_LED, OUTPUT);     
   pinMode(GREEN_LED, OUTPUT);    
@@ -252,349 +1425,5237 @@ void setup()
   // initialize captouch digital pin as an input, using internal pullup resistor.
   pinMode(CAPTOUCH_BUTTON, INPUT_PULLUP);
   pinMode(PROTOSHIELD_BUTTON, INPUT_PULLUP);
+}
 
-  lcd.begin(16,2);   // initialize the lcd for 16 chars 2 lines, turn on backlight
-  lcd.clear();
-  lcd.backlight();
-  
-  //rtc.adjust(DateTime(__DATE__, __TIME__));
-  
-  dateNow = rtc.now();
-  displayTime(dateNow);
-  
-  wheelState = DETERMINE_MIRROR_LOCATION;
-  distanceRunIntervalInCm = 0;
-  
-  if (dateNow.hour() >= 7 && dateNow.hour() < 22) 
-  {
-    // normal startup during hedgie sleeping hours (daytime)
-    startupTestingCount = 0; 
-    statisticsCaptureState = STARTUP_TESTING_DISCARD_HEDGIE_STATISTICS;
-    initNightStats();      
-  }
-  else
-  {
-    // unexpected reset during hedgie office hours (nighttime)
-    // recover the nightStats from EEPROM - this allows continuation of nightStats used for tweeting
-    startupTestingCount = STARTUP_COUNT_THRESHOLD; 
-    statisticsCaptureState = CAPTURE_HEDGIE_STATISTICS;
-    loadNightStatsFromEEPROM(); 
-    saveTimeOfLastResetToEEPROM(dateNow);  
-   }
-  
-  prevHour = dateNow.hour();
-  prevMinute = dateNow.minute();
-  
-  digitalWrite(WHEEL_ROTATION_LED, HIGH);
-  setupEthernet();
-  digitalWrite(WHEEL_ROTATION_LED, LOW);
-  
-  // Initialize the Adafruit IO client class 
-  aio.begin();
-  
-  uptimeInMinutes = 0;
-} 
+boolean halReadButton(uint8_t pin)
+{
+  return digitalRead(pin);
+}
 
+void halSetLed(uint8_t pin, boolean isOn)
+{
+  digitalWrite(pin, isOn ? HIGH : LOW);
+}
 
-void loop()
+// an interrupt every 8 seconds, not a reset.  watchdogInterrupt() counts them
+void halStartWatchdog(void)
 {
-  DateTime dateNow;
-  boolean newHour;
-  boolean newMinute;
+  noInterrupts();
+  MCUSR  &= ~_BV(WDRF);
+  WDTCSR  =  _BV(WDCE) | _BV(WDE);              // WDT change enable
+  WDTCSR  =  _BV(WDIE) | _BV(WDP3) | _BV(WDP0); // Interrupt enable, 8 sec.
+  interrupts();  
+}
 
-  dateNow = rtc.now();
-  
-  if (isValidHour(dateNow) == true)
-  {
-    newHour = isNewHour(dateNow);
-    newMinute = isNewMinute(dateNow);
-  }
+void halReset(void)
+{
+  wdt_enable(WDTO_15MS); // turn on the WatchDog and allow it to fire
+  while(1);
+}
+
+ISR(WDT_vect) 
+{ // Watchdog interrupt @ 8 sec. interval
+  watchdogInterrupt();
+}
+
+// Idle sleep until the next interrupt, with the SPI clock stopped.  Timer0 keeps running for millis(), so it is at most 1.024ms
+void halIdle(void)
+{
+  power_spi_disable();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+  power_spi_enable();
+}
+
+uint16_t halFreeRam(void) 
+{
+  extern int __heap_start, *__brkval; 
+  int v; 
+  return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval); 
+}
+
+// fill the RAM between the heap and the top of the stack, before the stack pointer is set up (.init1), so nothing is on the stack yet
+void paintStack(void)
+{
+  extern int __heap_start;
+  extern uint8_t __stack;
+  uint8_t *p;
+  
+  for (p = (uint8_t *)&__heap_start; p <= &__stack; p++)
+  {
+    *p = STACK_PAINT;
+  }
+}
+
+// the paint left above the heap is RAM the stack has never used
+uint16_t halMinFreeRam(void)
+{
+  extern int __heap_start, *__brkval; 
+  extern uint8_t __stack;
+  const uint8_t *p;
+  uint16_t count = 0;
+  
+  p = (__brkval == 0) ? (const uint8_t *)&__heap_start : (const uint8_t *)__brkval;
+  
+  while ((p <= &__stack) && (*p == STACK_PAINT))
+  {
+    p++;
+    count++;
+  }
+  
+  return count;
+}
+
+// ADC sampling of the wheel sensor on A0, a conversion on every Timer0 overflow (1.024ms)
+void halStartAdcSampling(void)
+{
+  ADMUX = _BV(REFS0);                                          // AVcc reference, channel 0
+  ADCSRB = _BV(ADTS2);                                         // auto trigger source:  Timer/Counter0 overflow
+  ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) |    // enable, auto trigger, interrupt, clear any stale flag
+           _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);               // prescaler 128 -> 125kHz ADC clock
+}
+
+ISR(ADC_vect)
+{
+  wheelSampleInterrupt(ADC);
+}
+
+// Comparator wheel sensor:  the comparator output goes low when the mirror pulls the sensor above the bandgap, and Timer1 captures
+// each edge.  The pin 6 (AIN0) + input is the captouch button, so the threshold is the 1.1V bandgap.  The multiplexer picks the
+// - input for each edge:  A0 for both by default.  With the optional divider on A1, A1 (divided down, so a higher sensor level)
+// while waiting for the mirror, for hysteresis.  Starts with the mirror edge
+void halStartComparatorCapture(void)
+{
+  ADCSRA = 0;                        // ADC off, the comparator borrows its multiplexer
+  ADMUX = COMPARATOR_MIRROR_CHANNEL;
+  ADCSRB = _BV(ACME);
+  ACSR = _BV(ACBG) | _BV(ACIC);      // bandgap on the + input, output to Timer1 input capture
+  
+  TCCR1A = 0;
+  TCCR1B = _BV(ICNC1) | _BV(CS11);   // noise canceler, capture on the falling edge (mirror), prescaler 8 -> 0.5us ticks
+  TCNT1 = 0;
+  TIFR1 = _BV(ICF1) | _BV(TOV1);
+  TIMSK1 = _BV(ICIE1) | _BV(TOIE1);
+}
+
+// the sensor is past both thresholds when this is called, so switching the channel doesn't change the output
+void halSetComparatorEdge(boolean isMirrorNext)
+{
+  if (isMirrorNext)
+  {
+    ADMUX = COMPARATOR_MIRROR_CHANNEL;
+    TCCR1B &= ~_BV(ICES1);           // the falling edge
+  }
+  else
+  {
+    ADMUX = COMPARATOR_WHITE_CHANNEL;
+    TCCR1B |= _BV(ICES1);            // the rising edge
+  }
+  
+  TIFR1 = _BV(ICF1);                 // changing the edge can set the capture flag
+}
+
+ISR(TIMER1_OVF_vect)
+{
+  timer1OverflowInUs += 32768;       // 65536 ticks of 0.5us
+}
+
+ISR(TIMER1_CAPT_vect)
+{
+  uint16_t captureTicks = ICR1;
+  uint32_t overflowInUs = timer1OverflowInUs;
+  
+  if ((TIFR1 & _BV(TOV1)) && (captureTicks < 0x8000))
+  {
+    // the timer overflowed just before the capture, and the overflow interrupt hasn't run yet
+    overflowInUs += 32768;
+  }
+  
+  // the edge being captured tells which one this is
+  wheelEdgeInterrupt(overflowInUs + (captureTicks >> 1), (TCCR1B & _BV(ICES1)) == 0);
+}
+
+// Stop the ADC sampling, and let the analog comparator watch the wheel instead.  The comparator borrows the ADC multiplexer
+// (still on channel 0) for its - input, with the 1.1V bandgap on the + input, which sits between the white and mirror levels.
+// A mirror pulls the comparator output low.
+void halArmComparatorWake(void)
+{
+  ADCSRA = 0;
+  ADCSRB = _BV(ACME);
+  ACSR = _BV(ACBG) | _BV(ACIS1);     // falling output edge.  Interrupt stays off while the edge select changes
+  ACSR |= _BV(ACI);                  // clear any stale flag
+  ACSR |= _BV(ACIE);
+}
+
+void halDisarmComparatorWake(void)
+{
+  ACSR &= ~_BV(ACIE);
+}
+
+ISR(ANALOG_COMP_vect)
+{
+  ACSR &= ~_BV(ACIE);
+  wheelWakeInterrupt();
+}
+
+// buttons wake the Arduino from the daytime sleep
+void halEnableButtonWake(void)
+{
+  PCMSK2 |= _BV(PCINT22) | _BV(PCINT23);    // pins 6 and 7
+  PCIFR = _BV(PCIF2);
+  PCICR |= _BV(PCIE2);
+}
+
+ISR(PCINT2_vect)
+{
+  buttonWakeInterrupt();
+}
+
+uint8_t halEepromRead(int addr)
+{
+  return EEPROM.read(addr);
+}
+
+void halEepromWrite(int addr, uint8_t value)
+{
+  EEPROM.write(addr, value);
+}
+
+boolean halEepromIsReady(void)
+{
+  return eeprom_is_ready();
+}
+
+void halI2cBegin(void)
+{
+  Wire.begin();
+  Wire.setClock(I2C_BUS_CLOCK_HZ);
+#if defined(WIRE_HAS_TIMEOUT)
+  Wire.setWireTimeout(I2C_TIMEOUT_US, true);
+#endif
+}
+
+uint8_t halI2cWrite(uint8_t address, const uint8_t *data, uint8_t length)
+{
+  Wire.beginTransmission(address);
+  Wire.write(data, length);
+  return Wire.endTransmission();
+}
+
+boolean halI2cRead(uint8_t address, uint8_t reg, uint8_t *data, uint8_t length)
+{
+  uint8_t i;
+  
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  
+  if ((Wire.endTransmission() != 0) || (Wire.requestFrom(address, length) != length))
+  {
+    return false;
+  }
+  
+  for (i=0; i<length; i++)
+  {
+    data[i] = Wire.read();
+  }
+  
+  return true;
+}
+
+// A slave that was cut off mid byte can hold SDA low forever.  Clock SCL until it lets go, then send a STOP and restart the TWI
+// hardware.  The pins are driven open drain:  low as an output, high by switching back to an input with the pullup.
+void halI2cRecoverBus(void)
+{
+  uint8_t i;
+  
+  TWCR = 0;    // release the pins from the TWI hardware
+  pinMode(SDA, INPUT_PULLUP);
+  pinMode(SCL, INPUT_PULLUP);
+  
+  for (i=0; (i<9) && (digitalRead(SDA) == LOW); i++)
+  {
+    pinMode(SCL, OUTPUT);
+    digitalWrite(SCL, LOW);
+    delayMicroseconds(5);
+    pinMode(SCL, INPUT_PULLUP);
+    delayMicroseconds(5);
+  }
+  
+  // STOP:  SDA goes high while SCL is high
+  pinMode(SDA, OUTPUT);
+  digitalWrite(SDA, LOW);
+  delayMicroseconds(5);
+  pinMode(SDA, INPUT_PULLUP);
+  delayMicroseconds(5);
+  
+  halI2cBegin();
+}
+
+// the W25Qxx shares the SPI bus with the W5100
+void halFlashBegin(void)
+{
+  pinMode(SD_CARD_CS, OUTPUT);     // keep the shield's SD card off the bus
+  digitalWrite(SD_CARD_CS, HIGH);
+  pinMode(NIGHT_LOG_CS, OUTPUT);
+  digitalWrite(NIGHT_LOG_CS, HIGH);
+  SPI.begin();
+}
+
+void halFlashSelect(void)
+{
+  SPI.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0));
+  digitalWrite(NIGHT_LOG_CS, LOW);
+}
+
+void halFlashDeselect(void)
+{
+  digitalWrite(NIGHT_LOG_CS, HIGH);
+  SPI.endTransaction();
+}
+
+uint8_t halSpiTransfer(uint8_t value)
+{
+  return SPI.transfer(value);
+}
+
+boolean halNetBegin(uint8_t *mac)
+{
+  return Ethernet.begin(mac, ETHERNET_DHCP_TIMEOUT_MS, ETHERNET_DHCP_RESPONSE_TIMEOUT_MS) != 0;
+}
+
+IPAddress halDnsServerIp(void)
+{
+  return Ethernet.dnsServerIP();
+}
+
+boolean halUdpBegin(HAL_UDP_t udp, uint16_t localPort)
+{
+  return halUdp[udp].begin(localPort) != 0;
+}
+
+void halUdpStop(HAL_UDP_t udp)
+{
+  halUdp[udp].stop();
+}
+
+boolean halUdpBeginPacket(HAL_UDP_t udp, IPAddress address, uint16_t port)
+{
+  return halUdp[udp].beginPacket(address, port) != 0;
+}
+
+void halUdpWrite(HAL_UDP_t udp, const uint8_t *data, uint16_t length)
+{
+  halUdp[udp].write(data, length);
+}
+
+boolean halUdpEndPacket(HAL_UDP_t udp)
+{
+  return halUdp[udp].endPacket() != 0;
+}
+
+int halUdpParsePacket(HAL_UDP_t udp)
+{
+  return halUdp[udp].parsePacket();
+}
+
+int halUdpRead(HAL_UDP_t udp)
+{
+  return halUdp[udp].read();
+}
+
+int halUdpRead(HAL_UDP_t udp, uint8_t *data, uint16_t length)
+{
+  return halUdp[udp].read(data, length);
+}
+
+// The upload socket is driven directly (not with EthernetClient::connect/stop) because those calls block until the connection is
+// up or down.  Opens a socket and starts the TCP handshake
+boolean halTcpConnect(IPAddress& address, uint16_t port)
+{
+  uint8_t serverIp[4];
+  uint8_t socketStatus;
+  uint8_t i;
+  
+  uploadSocket = MAX_SOCK_NUM;
+  
+  for (i=0; i<MAX_SOCK_NUM; i++)
+  {
+    socketStatus = W5100.readSnSR(i);
+    
+    if ((socketStatus == SnSR::CLOSED) || (socketStatus == SnSR::FIN_WAIT) || (socketStatus == SnSR::CLOSE_WAIT))
+    {
+      uploadSocket = i;
+      break;
+    }
+  }
+  
+  if (uploadSocket == MAX_SOCK_NUM)
+  {
+    // no free socket
+    return false;
+  }
+  
+  for (i=0; i<4; i++)
+  {
+    serverIp[i] = address[i];
+  }
+  
+  uploadLocalPort++;
+  if (uploadLocalPort == 0)
+  {
+    uploadLocalPort = 49152;
+  }
+  
+  socket(uploadSocket, SnMR::TCP, uploadLocalPort, 0);
+  ::connect(uploadSocket, serverIp, port);
+  uploadClient = EthernetClient(uploadSocket);
+  return true;
+}
+
+HAL_TCP_STATE_t halTcpState(void)
+{
+  if (uploadSocket == MAX_SOCK_NUM)
+  {
+    return HAL_TCP_CLOSED;
+  }
+  
+  switch (W5100.readSnSR(uploadSocket))
+  {
+    case SnSR::CLOSED:
+      return HAL_TCP_CLOSED;
+      
+    case SnSR::INIT:
+    case SnSR::SYNSENT:
+    case SnSR::SYNRECV:
+      return HAL_TCP_CONNECTING;
+      
+    case SnSR::ESTABLISHED:
+      return HAL_TCP_ESTABLISHED;
+      
+    default:
+      return HAL_TCP_CLOSING;
+  }
+}
+
+// up, or closed by the server with part of its response still to be read
+boolean halTcpConnected(void)
+{
+  return (uploadSocket != MAX_SOCK_NUM) && uploadClient.connected();
+}
+
+uint16_t halTcpTxFree(void)
+{
+  return W5100.getTXFreeSize(uploadSocket);
+}
+
+void halTcpBuffer(const uint8_t *data, uint16_t length)
+{
+  W5100.send_data_processing(uploadSocket, data, length);
+}
+
+void halTcpSend(void)
+{
+  W5100.execCmdSn(uploadSocket, Sock_SEND);
+}
+
+// the flag is cleared as it is read, so call it only while a send is outstanding
+boolean halTcpIsSent(void)
+{
+  if (W5100.readSnIR(uploadSocket) & SnIR::SEND_OK)
+  {
+    W5100.writeSnIR(uploadSocket, SnIR::SEND_OK);
+    return true;
+  }
+  
+  return false;
+}
+
+int halTcpRead(void)
+{
+  return uploadClient.read();
+}
+
+void halTcpDisconnect(void)
+{
+  disconnect(uploadSocket);
+}
+
+void halTcpClose(void)
+{
+  if (uploadSocket != MAX_SOCK_NUM)
+  {
+    close(uploadSocket);
+  }
+  
+  uploadClient = EthernetClient();
+  uploadSocket = MAX_SOCK_NUM;
+}
+
+#endif
+
+void setup()
+{
+  DateTime dateNow;
+  
+#ifdef DETECTION_BENCHMARK
+  Serial.begin(9600);
+  runDetectionBenchmark();
+  while (1);    // benchmark build doesn't run the monitor
+#endif
+  
+  // Watchdog timer setup.  
+  halStartWatchdog();
+
+  initI2c();
+  initSoftwareClock();
+  
+  // Serial.begin(9600); 
+  
+  // LEDs and buttons
+  halInitPins();
+  
+  // start counting as soon as possible.  Rotations wait in the rotation buffer until loop() starts
+  setupWheelSampling();
+
+  initNightStatsJournal();
+  initRotationCounter();
+  initNightHistory();
+  
+  memset(lcdShadow, ' ', sizeof(lcdShadow));
+  lcdFrame.clear();
+  
+  //writeRtcTime(DateTime(__DATE__, __TIME__).unixtime());
+  
+  dateNow = softwareClockNow();
+  
+  distanceRunIntervalInCm = 0;
+  initRevolutionStats(&intervalRevolutionStats);
+  
+  if (dateNow.hour() >= 7 && dateNow.hour() < 22) 
+  {
+    // normal startup during hedgie sleeping hours (daytime)
+    startupTestingCount = 0; 
+    statisticsCaptureState = STARTUP_TESTING_DISCARD_HEDGIE_STATISTICS;
+    initNightStats();      
+  }
+  else
+  {
+    // unexpected reset during hedgie office hours (nighttime)
+    // recover the nightStats from EEPROM - this allows continuation of nightStats used for tweeting
+    startupTestingCount = STARTUP_COUNT_THRESHOLD; 
+    statisticsCaptureState = CAPTURE_HEDGIE_STATISTICS;
+    loadNightStatsFromEEPROM(); 
+    recoverRotationsSinceLastSave(dateNow);
+    saveTimeOfLastResetToEEPROM(dateNow);  
+   }
+  
+  initNightLog((dateNow.hour() >= 22) || (dateNow.hour() < 7));
+  
+#ifdef NIGHT_LOG_EXPORT
+  Serial.begin(115200);
+  exportNightLog(Serial);
+  while (1);    // export build doesn't run the monitor
+#endif
+  
+  initTelemetryQueue();
+  
+  // the LCD and Ethernet start up in their tasks
+  ethernetStateMillis = halMillis();
+  uptimeInMinutes = 0;
+  
+  // wall clock tasks first run at the next minute, like the old new hour / new minute checks
+  schedulerMinuteOfDay = (dateNow.hour() * 60) + dateNow.minute();
+  restartTaskDeadlines();
+} 
+
+
+void loop()
+{
+  uint32_t loopTimeInUs;
+
+  loopStartTimeInUs = halMicros();
+  runScheduler();
+    
+  loopTimeInUs = halMicros() - loopStartTimeInUs;
+  if (loopTimeInUs > diagnostics.maxLoopTimeInUs)
+  {
+    diagnostics.maxLoopTimeInUs = loopTimeInUs;
+  }
+  
+  // pace the loop.  Wheel samples are taken by the ADC interrupt, not here.  During a quiet day, sleep instead
+  if (isReadyToSleep(schedulerNow))
+  {
+    sleepUntilActivity();
+    restartTaskDeadlines();    // the sleep ends as soon as there's work, so the time asleep doesn't count against the tasks
+  }
+  else
+  {
+    disarmWakeOnActivity();
+    halDelay(DELAY_BETWEEN_SAMPLES);
+  }
+  
+  wdtCount = NUM_INTERVALS_TO_RESET;  // restore watchdog count
+} 
+
+// One pass over the task table, highest priority first.  The rotation counting task runs again before each other task that
+// is due, so it waits at most one task run.
+void runScheduler(void)
+{
+  TaskConfig_t rotationConfig;
+  TaskConfig_t config;
+  uint16_t minuteOfDay;
+  uint32_t nowMillis;
+  uint8_t task;
+  
+  schedulerNow = softwareClockNow();
+  nowMillis = halMillis();
+  
+  if (isSchedulerStarted == false)
+  {
+    diagnostics.bootToCountingInMs = nowMillis;
+    isSchedulerStarted = true;
+  }
+  
+  // the first pass in a new minute makes the wall clock tasks for that minute due
+  if (isValidHour(schedulerNow) == true)
+  {
+    minuteOfDay = (schedulerNow.hour() * 60) + schedulerNow.minute();
+    
+    if (minuteOfDay != schedulerMinuteOfDay)
+    {
+      schedulerMinuteOfDay = minuteOfDay;
+      
+      for (task=0; task<NUM_TASKS; task++)
+      {
+        memcpy_P(&config, &taskConfig[task], sizeof(TaskConfig_t));
+        
+        if ((config.timing == TASK_WALL_CLOCK) && ((minuteOfDay % config.interval) == config.offset))
+        {
+          isTaskPending[task] = true;
+          taskDueMillis[task] = nowMillis;
+        }
+      }
+    }
+  }
+  
+  memcpy_P(&rotationConfig, &taskConfig[TASK_COUNT_ROTATIONS], sizeof(TaskConfig_t));
+  runTask(TASK_COUNT_ROTATIONS, &rotationConfig);
+  
+  for (task=TASK_COUNT_ROTATIONS+1; task<NUM_TASKS; task++)
+  {
+    memcpy_P(&config, &taskConfig[task], sizeof(TaskConfig_t));
+    
+    if (isTaskDue(task, &config, halMillis()))
+    {
+      runTask(task, &config);
+      runTask(TASK_COUNT_ROTATIONS, &rotationConfig);
+    }
+  }
+}
+
+boolean isTaskDue(uint8_t task, TaskConfig_t *config, uint32_t nowMillis)
+{
+  if (config->timing == TASK_WALL_CLOCK)
+  {
+    return isTaskPending[task];
+  }
+  
+  return ((config->interval == 0) || ((int32_t)(nowMillis - taskDueMillis[task]) >= 0));
+}
+
+void runTask(uint8_t task, TaskConfig_t *config)
+{
+  TaskStats_t *stats = &diagnostics.taskStats[task];
+  uint32_t startMillis = halMillis();
+  uint32_t startTimeInUs = halMicros();
+  uint32_t runTimeInUs;
+  
+  if ((startMillis - taskDueMillis[task] > config->deadlineInMs) && (stats->missedDeadlineCount < 0xFF))
+  {
+    stats->missedDeadlineCount++;
+  }
+  
+  config->run();
+  
+  runTimeInUs = halMicros() - startTimeInUs;
+  
+  if (isDhcpInTaskRun)
+  {
+    // DHCP, the one run left out:  it isn't counted against the network task, and the tasks it held up count their deadlines
+    // from now
+    isDhcpInTaskRun = false;
+    restartTaskDeadlines();
+  }
+  else
+  {
+    if (runTimeInUs > stats->maxRunTimeInUs)
+    {
+      stats->maxRunTimeInUs = min(runTimeInUs, 0xFFFF);
+    }
+    
+    if ((runTimeInUs > config->budgetInUs) && (stats->overrunCount < 0xFF))
+    {
+      stats->overrunCount++;
+    }
+  }
+  
+  if (config->timing == TASK_WALL_CLOCK)
+  {
+    isTaskPending[task] = false;
+  }
+  else if (config->interval == 0)
+  {
+    taskDueMillis[task] = halMillis();
+  }
+  else
+  {
+    taskDueMillis[task] += config->interval;
+    
+    if ((int32_t)(halMillis() - taskDueMillis[task]) >= 0)
+    {
+      // fell more than a whole interval behind, don't try to catch up
+      taskDueMillis[task] = halMillis() + config->interval;
+    }
+  }
+}
+
+// periodic tasks that are overdue, or run every pass, count their deadline from now
+void restartTaskDeadlines(void)
+{
+  TaskConfig_t config;
+  uint32_t nowMillis = halMillis();
+  uint8_t task;
+  
+  for (task=0; task<NUM_TASKS; task++)
+  {
+    memcpy_P(&config, &taskConfig[task], sizeof(TaskConfig_t));
+    
+    if ((config.timing == TASK_PERIODIC) && ((config.interval == 0) || ((int32_t)(nowMillis - taskDueMillis[task]) >= 0)))
+    {
+      taskDueMillis[task] = nowMillis;
+    }
+  }
+}
+
+// count the wheel rotations captured by the ADC interrupt since the last run
+void taskCountRotations(void)
+{
+  uint32_t rotationTimeInUs;
+  
+  while (rotationBufferPop(&rotationTimeInUs))
+  {
+    countRotation(schedulerNow, rotationTimeInUs);
+    lastWheelActivityMillis = halMillis();
+  }
+}
+
+void taskSoftwareClock(void)
+{
+  serviceSoftwareClock();
+}
+
+// at 10pm, do a one-time prep for Hedgie's upcoming night in the office
+void taskNightReset(void)
+{
+  halSetLed(GREEN_LED, HIGH); 
+  noInterrupts();
+  wheelState = DETERMINE_MIRROR_LOCATION;
+  interrupts();
+  initNightStats();
+  diagnostics.nightStatsSaveCount = 0;
+  diagnostics.nightStatsBytesWritten = 0;
+  diagnostics.nightStatsMaxSaveTimeInUs = 0;
+  saveNightStatsToEEPROM();
+  initDebugMsgLog();
+  initResetLog();
+  startNightLog();
+  initBouts();
+  distanceRunIntervalInCm=0; 
+  initRevolutionStats(&intervalRevolutionStats);
+  statisticsCaptureState = STARTUP_TESTING_DISCARD_HEDGIE_STATISTICS;
+  startupTestingCount=0; 
+  halSetLed(GREEN_LED, LOW); 
+}
+
+// every 5 mins between 10pm and 7am (including exactly 7am), save interval stats, and send them to the SparkFun cloud service
+// and the accumulated distance to Adafruit IO.  Runs ahead of the 7am tweet, so the tweet has the last interval
+void taskIntervalStats(void)
+{
+  pushStartMillis = max(halMillis(), 1);
+  
+  if ((schedulerNow.hour() >= 22) || (schedulerNow.hour() < 7) || ((schedulerNow.hour() == 7) && (schedulerNow.minute() == 0)))
+  {
+    // Both go through the EEPROM telemetry queue, so they are not lost when a push fails
+    sendDataToSparkFun(distanceRunIntervalInCm, &intervalRevolutionStats);
+    addRevolutionStatsToNightStats(&intervalRevolutionStats);
+    saveNightStatsToEEPROM();
+    endIdleBout();
+    distanceRunIntervalInCm=0;   
+    initRevolutionStats(&intervalRevolutionStats);
+  }
+  else
+  {
+    // during the day push 0 to Adafruit IO every 5 minutes
+    sendFeedToAdafruitIO(AIO_FEED_DISTANCE, 0, 0);
+  }
+}
+
+// at 7am send tweet
+void taskTweet(void)
+{
+  closeNightLog();
+  endBout();
+  addNightToHistory();
+  tweetNightStats();  // TWEET it !
+}
+
+// every 5 minutes push temperature, uptime and diagnostics data to Adafruit IO
+void taskHealthPush(void)
+{
+  float temperatureInC;
+  
+  if (readTemperature(&temperatureInC))
+  {
+    sendFeedToAdafruitIO(AIO_FEED_TEMPERATURE, (int32_t)(temperatureInC * 100), 2); 
+  }
+  
+  sendFeedToAdafruitIO(AIO_FEED_UPTIME, uptimeInMinutes, 0);
+  sendDiagnosticsToAdafruitIO();
+  uptimeInMinutes+=5;
+}
+
+// write the buffered night log to flash
+void taskNightLog(void)
+{
+  serviceNightLog();
+}
+
+// the rotation counter, the night stats and telemetry records being saved, and the debug log being cleared, a byte each pass the
+// EEPROM is ready
+void taskEepromWrites(void)
+{
+  serviceRotationCounter();
+  
+  if (isNightStatsSaveDue)
+  {
+    isNightStatsSaveDue = false;
+    saveNightStatsToEEPROM();
+  }
+  
+  serviceEepromRecordWrite(&debugLogClearWrite);
+  serviceEepromRecordWrite(&telemetryWrite);
+  
+  if (nightStatsWrite.isPending && serviceEepromRecordWrite(&nightStatsWrite))
+  {
+    diagnostics.nightStatsBytesWritten += nightStatsWrite.bytesWritten;
+  }
+}
+
+// advance the background upload by one small step
+void taskUpload(void)
+{
+  if (ethernetState == ETHERNET_UP)
+  {
+    serviceUpload();
+  }
+}
+
+void taskUi(void)
+{
+  if ((isLcdReady == false) || isLcdResyncNeeded)
+  {
+    // deferred from setup(), or starting the LCD over:  a step each pass
+    if (serviceLcdBegin() == false)
+    {
+      return;
+    }
+    
+    if (isLcdResyncNeeded)
+    {
+      // send the whole frame again
+      isLcdResyncNeeded = false;
+      memset(lcdShadow, ' ', sizeof(lcdShadow));
+      return;
+    }
+    
+    isLcdReady = true;
+    showUiPages(UI_PAGE_TIME, true);
+    return;
+  }
+  
+  handleButtonPress(schedulerNow);
+  serviceUi();
+}
+
+// update RTC chip using NTP every morning
+void taskNtpDaily(void)
+{
+  if (ethernetState == ETHERNET_UP)
+  {
+    startNtpSync();
+  }
+}
+
+// update RTC chip using NTP when the protoshield button is pressed, and advance a sync in progress
+void taskNtp(void)
+{
+  if ((isProtoshieldButtonPress() == true) && (ethernetState == ETHERNET_UP))
+  {
+    startNtpSync();
+  }
+  
+  serviceNtp();
+}
+
+// Ethernet bring up, moved out of setup().  The W5100 gets a second after reset, then DHCP, then another second.
+//
+// DHCP still blocks in halNetBegin(), for up to ETHERNET_DHCP_TIMEOUT_MS.  The Ethernet library's DHCP client only comes as a
+// blocking call, and a second one written as steps would not fit in the RAM that's left.  The stall is safe:  the ADC interrupt
+// keeps sampling, and timestamps up to ROTATION_BUFFER_SIZE rotations (16, over 4s at any speed hedgie runs) for
+// taskCountRotations() to catch up on, and the watchdog allows at least 8s.  It happens once after a reset, then only while
+// the network is down, with the retries backed off up to ETHERNET_DHCP_MAX_RETRY_MS.  It's the one exception to the task
+// budgets:  runTask() leaves it out of the run times and deadlines
+void taskNetwork(void)
+{
+  uint32_t stateTimeInMs = halMillis() - ethernetStateMillis;
+  
+  switch (ethernetState)
+  {
+    case ETHERNET_POWER_UP:
+      if (stateTimeInMs >= ETHERNET_POWER_UP_MS)
+      {
+        ethernetState = ETHERNET_DHCP;
+      }
+      break;
+      
+    case ETHERNET_DHCP:
+      halSetLed(GREEN_LED, HIGH);
+      isDhcpInTaskRun = true;
+      
+      if (halNetBegin(mac) == false) 
+      {
+        logDebugMsg(ETHERNET_DHCP_FAILED, ETHERNET_DHCP_FAILED);
+        ethernetState = ETHERNET_RETRY_WAIT;
+      } 
+      else
+      {
+        logDebugMsg(ETHERNET_DHCP_OK, ETHERNET_DHCP_OK);
+        ethernetState = ETHERNET_SETTLE;
+        ethernetRetryMs = ETHERNET_DHCP_RETRY_MS;
+      } 
+      
+      halSetLed(GREEN_LED, LOW);
+      ethernetStateMillis = halMillis();
+      break;
+      
+    case ETHERNET_SETTLE:
+      if (stateTimeInMs >= ETHERNET_SETTLE_MS)
+      {
+        ethernetState = ETHERNET_UP;
+        
+        if (diagnostics.bootToNetworkInMs == 0)
+        {
+          diagnostics.bootToNetworkInMs = min(halMillis(), 0xFFFF);
+          
+          // the RTC keeps UTC.  Set it after a reset, in case it still has local time from an older sketch
+          startNtpSync();
+        }
+      }
+      break;
+      
+    case ETHERNET_RETRY_WAIT:
+      if (stateTimeInMs >= ethernetRetryMs)
+      {
+        ethernetState = ETHERNET_DHCP;
+        ethernetRetryMs = min(ethernetRetryMs * 2, ETHERNET_DHCP_MAX_RETRY_MS);
+      }
+      break;
+      
+    case ETHERNET_UP:
+    default:
+      break;
+  }
+}
+
+// name=worst run time in us/runs over budget/missed deadlines, for each task
+void writeTaskStats(Print& out)
+{
+  uint8_t task;
+  
+  for (task=0; task<NUM_TASKS; task++)
+  {
+    writeTaskStat(task, out);
+  }
+}
+
+void writeTaskStat(uint8_t task, Print& out)
+{
+  TaskConfig_t config;
+  
+  memcpy_P(&config, &taskConfig[task], sizeof(TaskConfig_t));
+  out.print(' ');
+  out.print(config.name);
+  out.print('=');
+  out.print(diagnostics.taskStats[task].maxRunTimeInUs);
+  out.print('/');
+  out.print(diagnostics.taskStats[task].overrunCount);
+  out.print('/');
+  out.print(diagnostics.taskStats[task].missedDeadlineCount);
+}
+
+// start the wheel sensor sampling in the background:  the ADC converts analog pin 0 on every Timer0 overflow (every 1.024ms),
+// and the ADC interrupt runs the wheel state machine on each sample
+void setupWheelSampling(void)
+{
+  noInterrupts();
+  wheelState = DETERMINE_MIRROR_LOCATION;
+  whiteSampleCount = 0;
+  rotationBufferHead = 0;
+  rotationBufferTail = 0;
+  initAdaptiveDetector();
+#ifdef WHEEL_SENSOR_COMPARATOR
+  halStartComparatorCapture();
+  wheelState = WAITING_FOR_MIRROR;
+#else
+  halStartAdcSampling();
+#endif
+  interrupts();
+  diagnostics.bootToSamplingInUs = halMicros();
+  
+  // buttons wake the Arduino from the daytime sleep
+  halEnableButtonWake();
+}
+
+// daytime, and nothing for loop() to do for a while
+boolean isReadyToSleep(DateTime& dateNow)
+{
+  return ((dateNow.hour() >= 7) && (dateNow.hour() < 22) &&
+          (uploadState == UPLOAD_IDLE) && (uploadQueueHead == uploadQueueTail) &&
+          (uiPage == UI_PAGE_NONE) && (ntpState == NTP_IDLE) && (nightLogBufferLength == 0) &&
+          (halMillis() - lastWheelActivityMillis >= DAYTIME_AWAKE_AFTER_ACTIVITY_MS));
+}
+
+// Comparator wheel sensor:  called from the Timer1 capture interrupt, on each comparator edge.  The output goes low on the mirror
+void wheelEdgeInterrupt(uint32_t edgeTimeInUs, boolean isMirrorEdge)
+{
+  if (isMirrorEdge)
+  {
+    wheelState = detectMirrorEdge(edgeTimeInUs);
+  }
+  else
+  {
+    wheelState = detectWhiteEdge(edgeTimeInUs);
+  }
+}
+
+// called from the Timer1 capture interrupt, on a falling comparator edge
+WHEEL_STATE_t detectMirrorEdge(uint32_t edgeTimeInUs)
+{
+  // a short dip into white is noise at the mirror edge, keep waiting for white
+  if (edgeTimeInUs - whiteEdgeTimeInUs >= COMPARATOR_WHITE_DEBOUNCE_IN_US)
+  {
+    rotationBufferPush(edgeTimeInUs);
+    halSetLed(WHEEL_ROTATION_LED, HIGH);
+  }
+  
+  halSetComparatorEdge(false);       // next, the rising edge (white)
+  return WAITING_FOR_WHITE;
+}
+
+// called from the Timer1 capture interrupt, on a rising comparator edge
+WHEEL_STATE_t detectWhiteEdge(uint32_t edgeTimeInUs)
+{
+  halSetLed(WHEEL_ROTATION_LED, LOW);
+  whiteEdgeTimeInUs = edgeTimeInUs;
+  halSetComparatorEdge(true);        // next, the falling edge (mirror)
+  return WAITING_FOR_MIRROR;
+}
+
+// Stop the ADC sampling, and let the analog comparator watch the wheel instead (halArmComparatorWake())
+void armWakeOnActivity(void)
+{
+  if (isWakeOnActivityArmed)
+  {
+    return;
+  }
+  
+#ifdef WHEEL_SENSOR_COMPARATOR
+  // the comparator is already watching the wheel, and its capture interrupt wakes the CPU
+  isWakeOnActivityArmed = true;
+  return;
+#endif
+  
+  noInterrupts();
+  halArmComparatorWake();
+  isWakeOnActivityArmed = true;
+  interrupts();
+}
+
+// back to ADC sampling, if the wheel didn't already do it
+void disarmWakeOnActivity(void)
+{
+#ifdef WHEEL_SENSOR_COMPARATOR
+  isWakeOnActivityArmed = false;
+  return;
+#endif
+  
+  noInterrupts();
+  
+  if (isWakeOnActivityArmed)
+  {
+    halDisarmComparatorWake();
+    wheelState = DETERMINE_MIRROR_LOCATION;
+    halStartAdcSampling();
+    isWakeOnActivityArmed = false;
+  }
+  
+  interrupts();
+}
+
+// Idle sleep until the wheel turns, a button is pressed, or DAYTIME_SLEEP_MAX_MS passes.  Timer0 keeps running for millis(),
+// so the CPU also wakes briefly every 1.024ms, and goes straight back to sleep
+void sleepUntilActivity(void)
+{
+  uint32_t sleepStartMillis = halMillis();
+  
+  armWakeOnActivity();
+  isButtonWake = false;
+  
+  while (isWakeOnActivityArmed && !isButtonWake && (rotationBufferHead == rotationBufferTail) && 
+         (halMillis() - sleepStartMillis < DAYTIME_SLEEP_MAX_MS))
+  {
+    halIdle();
+  }
+  
+  diagnostics.sleepTimeInMs += halMillis() - sleepStartMillis;
+}
+
+// wheel turned during the daytime sleep.  This edge is the mirror, so count it here, and have the ADC wait for white before
+// looking for the next one
+void wheelWakeInterrupt(void)
+{
+  rotationBufferPush(halMicros());
+  halSetLed(WHEEL_ROTATION_LED, HIGH);
+  wheelState = WAITING_FOR_WHITE;
+  whiteSampleCount = 0;
+  adaptiveDetector.samplesSinceMirror = 0;
+  wheelWakeTimeInUs = halMicros();
+  isWakeLatencyPending = true;
+  isWakeOnActivityArmed = false;
+  diagnostics.wheelWakeCount++;
+  halStartAdcSampling();
+}
+
+void buttonWakeInterrupt(void)
+{
+  isButtonWake = true;
+}
+
+// ADC interrupt, every 1.024ms
+void wheelSampleInterrupt(int sample)
+{
+  uint32_t wakeLatencyInUs;
+  
+  if (isWakeLatencyPending)
+  {
+    // first sample since the wheel woke us up
+    wakeLatencyInUs = halMicros() - wheelWakeTimeInUs;
+    diagnostics.maxWakeLatencyInUs = max(diagnostics.maxWakeLatencyInUs, min(wakeLatencyInUs, 0xFFFF));
+    isWakeLatencyPending = false;
+  }
+  
+  processWheelSample(sample);
+}
+
+// wheel state machine, run once per sensor sample
+void processWheelSample(int sample)
+{
+  if (wheelDetector == ADAPTIVE_THRESHOLD_DETECTOR)
+  {
+    updateAdaptiveDetector(sample);
+  }
+  
+  switch (wheelState)
+  {
+    case DETERMINE_MIRROR_LOCATION:
+      if (isMirror(sample))
+      {
+        wheelState = WAITING_FOR_WHITE;
+      }
+      else
+      {
+        wheelState = WAITING_FOR_MIRROR;
+      }
+      
+      break;
+  
+    case WAITING_FOR_MIRROR:
+      wheelState = detectMirror(sample);
+      break;
+      
+    case WAITING_FOR_WHITE:
+    default:
+      wheelState = detectWhite(sample);
+      break;
+  }
+}
+
+#ifdef DETECTION_BENCHMARK
+// Replay synthesized wheel sensor traces through processWheelSample() and print how many rotations were missed or counted twice.
+// Each line is:  detector (0 fixed, 1 adaptive), sample period (us), noise and offset (ADC counts), speed (RPM), missed, double
+// counted.  The summary line for each configuration gives the highest speed counted without errors at that speed and all
+// slower speeds.
+void runDetectionBenchmark(void)
+{
+  uint8_t periodIndex;
+  uint8_t noiseIndex;
+  uint8_t speedIndex;
+  uint8_t offsetIndex;
+  uint8_t detector;
+  uint16_t maxSpeedInRpm;
+  boolean isErrorFree;
+  BenchResult_t result;
+  
+  Serial.println(F("detector sampleUs noise offset rpm missed double"));
+  
+  for (detector=FIXED_THRESHOLD_DETECTOR; detector<=ADAPTIVE_THRESHOLD_DETECTOR; detector++)
+  {
+    wheelDetector = (WHEEL_DETECTOR_t)detector;
+    randomSeed(1);    // both detectors see the same traces
+    
+    for (periodIndex=0; periodIndex<BENCH_NUM_SAMPLE_PERIODS; periodIndex++)
+    {
+      for (noiseIndex=0; noiseIndex<BENCH_NUM_NOISE_LEVELS; noiseIndex++)
+      {
+        for (offsetIndex=0; offsetIndex<BENCH_NUM_OFFSETS; offsetIndex++)
+        {
+          maxSpeedInRpm = 0;
+          isErrorFree = true;
+          
+          for (speedIndex=0; speedIndex<BENCH_NUM_SPEEDS; speedIndex++)
+          {
+            runDetectionBenchmarkTrace(benchSpeedInRpm[speedIndex], benchNoiseLevel[noiseIndex], benchOffset[offsetIndex], 
+                                       benchSamplePeriodInUs[periodIndex], &result);
+            
+            Serial.print(detector);
+            Serial.print(' ');
+            Serial.print(benchSamplePeriodInUs[periodIndex]);
+            Serial.print(' ');
+            Serial.print(benchNoiseLevel[noiseIndex]);
+            Serial.print(' ');
+            Serial.print(benchOffset[offsetIndex]);
+            Serial.print(' ');
+            Serial.print(benchSpeedInRpm[speedIndex]);
+            Serial.print(' ');
+            Serial.print(result.missedRotations);
+            Serial.print(' ');
+            Serial.println(result.doubleCountedRotations);
+            
+            if ((result.missedRotations != 0) || (result.doubleCountedRotations != 0))
+            {
+              isErrorFree = false;
+            }
+            else if (isErrorFree)
+            {
+              maxSpeedInRpm = benchSpeedInRpm[speedIndex];
+            }
+          }
+          
+          Serial.print(F("max rpm "));
+          Serial.print(maxSpeedInRpm);
+          Serial.print(F(" ("));
+          Serial.print(((uint32_t)maxSpeedInRpm * WHEEL_CIRCUMFERENCE_IN_CM) / 60);
+          Serial.println(F(" cm/s)"));
+        }
+      }
+    }
+  }
+  
+  wheelDetector = ADAPTIVE_THRESHOLD_DETECTOR;
+  Serial.println(F("done"));
+}
+
+// One trace:  the mirror passes the sensor BENCH_ROTATIONS_PER_TRACE times.  Rotations are checked halfway through the white part
+// of the wheel, where each mirror pass should have produced exactly one detection.
+void runDetectionBenchmarkTrace(uint16_t speedInRpm, uint16_t noiseLevel, uint16_t offset, uint16_t samplePeriodInUs, BenchResult_t *result)
+{
+  uint32_t revolutionInUs = 60000000UL / speedInRpm;
+  uint32_t mirrorInUs = (revolutionInUs * BENCH_MIRROR_WIDTH_IN_CM) / WHEEL_CIRCUMFERENCE_IN_CM;
+  uint32_t checkpointInUs = (revolutionInUs + mirrorInUs) / 2;    // middle of the white part
+  uint32_t rotationTimeInUs;
+  uint8_t numDetections = 0;
+  uint8_t rotation;
+  int sample;
+  
+  result->missedRotations = 0;
+  result->doubleCountedRotations = 0;
+  
+  // start the detector the same way as at 10pm, in the middle of the white part of the wheel
+  wheelState = DETERMINE_MIRROR_LOCATION;
+  whiteSampleCount = 0;
+  rotationBufferHead = 0;
+  rotationBufferTail = 0;
+  initAdaptiveDetector();
+  benchTimeInUs = checkpointInUs + random(samplePeriodInUs);
+  
+  for (rotation=1; rotation<=BENCH_ROTATIONS_PER_TRACE; rotation++)
+  {
+    while (benchTimeInUs < checkpointInUs + (rotation * revolutionInUs))
+    {
+      if ((benchTimeInUs % revolutionInUs) < mirrorInUs)
+      {
+        sample = BENCH_MIRROR_LEVEL;
+      }
+      else
+      {
+        sample = BENCH_WHITE_LEVEL;
+      }
+      
+      sample += offset + random(-(int)noiseLevel, noiseLevel + 1);
+      processWheelSample(constrain(sample, 0, 1023));
+      
+      while (rotationBufferPop(&rotationTimeInUs))
+      {
+        numDetections++;
+      }
+      
+      benchTimeInUs += samplePeriodInUs;
+    }
+    
+    if (numDetections == 0)
+    {
+      result->missedRotations++;
+    }
+    else
+    {
+      result->doubleCountedRotations += numDetections - 1;
+    }
+    
+    numDetections = 0;
+  }
+}
+#endif
+
+// called from the ADC interrupt, via processWheelSample()
+WHEEL_STATE_t detectMirror(int sample)
+{
+  // check for mirror
+  if (isMirror(sample))
+  {
+    // mirror detected !  queue the rotation, loop() does the counting
+    rotationBufferPush(halMicros());
+    
+    if (wheelDetector == ADAPTIVE_THRESHOLD_DETECTOR)
+    {
+      // wait for about an eighth of the last revolution of white before looking for the mirror again
+      adaptiveDetector.debounceSamples = constrain(adaptiveDetector.samplesSinceMirror >> 3, 
+                                                   ADAPTIVE_MIN_DEBOUNCE_SAMPLES, WHITE_SAMPLES_TO_DEBOUNCE);
+      adaptiveDetector.samplesSinceMirror = 0;
+    }
+    
+    halSetLed(WHEEL_ROTATION_LED, HIGH);
+    wheelState = WAITING_FOR_WHITE;
+  }
+  else
+  {
+    // mirror not detected
+    wheelState = WAITING_FOR_MIRROR;
+  }
+  
+  return wheelState;
+}
+
+// called from the ADC interrupt, via processWheelSample()
+WHEEL_STATE_t detectWhite(int sample)
+{
+  if (isWhite(sample))
+  {
+    // detected white
+    whiteSampleCount++;    
+  }
+  else if (isMirror(sample))
+  {
+    // detected mirror
+    whiteSampleCount=0;
+  }
+  
+  if (whiteSampleCount > ((wheelDetector == ADAPTIVE_THRESHOLD_DETECTOR) ? adaptiveDetector.debounceSamples : WHITE_SAMPLES_TO_DEBOUNCE))
+  {
+    //  white has been detected
+    halSetLed(WHEEL_ROTATION_LED, LOW); 
+    whiteSampleCount=0;
+    wheelState = WAITING_FOR_MIRROR;
+  }
+  else
+  {
+    // still waiting to get enough consecutive white samples
+    wheelState = WAITING_FOR_WHITE;
+  }
+
+  return wheelState;
+}
+
+// white -> mirror
+boolean isMirror(int sample)
+{
+  if (wheelDetector == ADAPTIVE_THRESHOLD_DETECTOR)
+  {
+    return (sample > adaptiveDetector.risingThreshold);
+  }
+  
+  if (sample > MIRROR_THRESHOLD)
+  {
+    // mirror detected
+    return true;
+  }
+  else
+  {
+    // white detected
+    return false;
+  }
+}
+
+// mirror -> white.  With the adaptive detector, samples between the two thresholds are neither white nor mirror, and don't
+// restart the white debounce
+boolean isWhite(int sample)
+{
+  if (wheelDetector == ADAPTIVE_THRESHOLD_DETECTOR)
+  {
+    return (sample < adaptiveDetector.fallingThreshold);
+  }
+  
+  return !isMirror(sample);
+}
+
+// start from levels that put the thresholds around MIRROR_THRESHOLD, the running averages take over within a revolution
+void initAdaptiveDetector(void)
+{
+  adaptiveDetector.whiteLevel = (MIRROR_THRESHOLD / 2) << ADAPTIVE_LEVEL_SHIFT;
+  adaptiveDetector.mirrorLevel = (MIRROR_THRESHOLD * 2) << ADAPTIVE_LEVEL_SHIFT;
+  adaptiveDetector.samplesSinceMirror = 0;
+  adaptiveDetector.mirrorSampleCount = 0;
+  adaptiveDetector.debounceSamples = WHITE_SAMPLES_TO_DEBOUNCE;
+  updateAdaptiveDetector(MIRROR_THRESHOLD);    // sets the thresholds, a sample between the levels leaves them alone
+}
+
+// Called from the ADC interrupt on every sample, so only shifts and adds.  Samples above the rising threshold move the mirror
+// level, the rest move the white level, which lets the white level follow slow drift in ambient light or sensor alignment.
+// The rising threshold sits halfway between the levels and the falling threshold a quarter of the way, for hysteresis.
+// A step up in the white level of more than half the span puts every sample above the rising threshold, where only the mirror
+// level moves.  After ADAPTIVE_MAX_MIRROR_SAMPLES of that, both levels are started over from the sample (also when the wheel
+// stopped on the mirror, which just makes the mirror white until it moves).
+void updateAdaptiveDetector(int sample)
+{
+  int16_t whiteLevel;
+  int16_t span;
+  
+  if (sample > adaptiveDetector.risingThreshold)
+  {
+    adaptiveDetector.mirrorLevel += ((sample << ADAPTIVE_LEVEL_SHIFT) - adaptiveDetector.mirrorLevel) >> ADAPTIVE_MIRROR_AVERAGE_SHIFT;
+    adaptiveDetector.mirrorSampleCount++;
+    
+    if (adaptiveDetector.mirrorSampleCount > ADAPTIVE_MAX_MIRROR_SAMPLES)
+    {
+      adaptiveDetector.whiteLevel = sample << ADAPTIVE_LEVEL_SHIFT;
+      adaptiveDetector.mirrorLevel = (sample + ADAPTIVE_MIN_SPAN) << ADAPTIVE_LEVEL_SHIFT;
+      adaptiveDetector.mirrorSampleCount = 0;
+    }
+  }
+  else
+  {
+    adaptiveDetector.whiteLevel += ((sample << ADAPTIVE_LEVEL_SHIFT) - adaptiveDetector.whiteLevel) >> ADAPTIVE_WHITE_AVERAGE_SHIFT;
+    adaptiveDetector.mirrorSampleCount = 0;
+  }
+  
+  if (adaptiveDetector.samplesSinceMirror < 0xFFFF)
+  {
+    adaptiveDetector.samplesSinceMirror++;
+  }
+  
+  whiteLevel = adaptiveDetector.whiteLevel >> ADAPTIVE_LEVEL_SHIFT;
+  span = (adaptiveDetector.mirrorLevel >> ADAPTIVE_LEVEL_SHIFT) - whiteLevel;
+  
+  if (span < ADAPTIVE_MIN_SPAN)
+  {
+    // mirror level not known yet, or lost:  keep the thresholds clear of the white noise
+    span = ADAPTIVE_MIN_SPAN;
+  }
+  
+  adaptiveDetector.risingThreshold = whiteLevel + (span >> 1);
+  adaptiveDetector.fallingThreshold = whiteLevel + (span >> 2);
+}
+
+// called from loop() for each rotation taken off the rotation buffer
+void countRotation(DateTime& dateNow, uint32_t rotationTimeInUs)
+{
+  uint32_t periodInUs = rotationTimeInUs - lastRotationTimeInUs;  // wraps correctly across the micros() rollover
+  boolean isRevolution = isLastRotationTimeValid && (periodInUs <= REVOLUTION_PERIOD_MAX_IN_US);
+  boolean isSameBout = isLastRotationTimeValid && (periodInUs <= BOUT_GAP_IN_US);
+  
+  lastRotationTimeInUs = rotationTimeInUs;
+  isLastRotationTimeValid = true;
+  
+  if (dateNow.hour() >= 22 || dateNow.hour() < 7)
+  {
+     if (statisticsCaptureState == STARTUP_TESTING_DISCARD_HEDGIE_STATISTICS)
+     {
+       startupTestingCount++;
+       
+       if (startupTestingCount >= STARTUP_COUNT_THRESHOLD)
+       {
+         statisticsCaptureState = CAPTURE_HEDGIE_STATISTICS;
+       }
+     }
+     else
+     {
+        if (nightStats.totalDistanceInCm == 0)
+        {
+          nightStats.dateTimeOfFirstRotationInDateTime = dateNow;
+        }
+        else
+        {
+          nightStats.dateTimeOfLastRotationInDateTime = dateNow;
+        }
+        
+        // only accumulate rotation and distance data during hedgie office hours, and when startup test rotations have been completed
+        distanceRunIntervalInCm += (unsigned long) WHEEL_CIRCUMFERENCE_IN_CM;
+        nightStats.totalDistanceInCm += (unsigned long) WHEEL_CIRCUMFERENCE_IN_CM;
+        incrementRotationCounter();
+        appendNightLog(rotationTimeInUs);
+        updateBouts(periodInUs, isSameBout);
+        
+        if (isRevolution)
+        {
+          updateRevolutionStats(&intervalRevolutionStats, periodInUs);
+        }
+     }
+  }
+}
+
+void initRevolutionStats(IntervalRevolutionStats_t *stats)
+{
+  uint8_t i;
+  
+  // with no rotation in the interval, the last timestamp may be more than one micros() rollover old
+  if (stats->numRevolutions == 0)
+  {
+    isLastRotationTimeValid = false;
+  }
+  
+  stats->minPeriodInUs = 0xFFFFFFFF;
+  stats->maxPeriodInUs = 0;
+  stats->sumPeriodInUs = 0;
+  stats->numRevolutions = 0;
+  
+  for (i=0; i<NUM_SPEED_BUCKETS; i++)
+  {
+    stats->speedHistogram[i] = 0;
+  }
+}
+
+void updateRevolutionStats(IntervalRevolutionStats_t *stats, uint32_t periodInUs)
+{
+  uint8_t bucket;
+  
+  if (periodInUs < stats->minPeriodInUs)
+  {
+    stats->minPeriodInUs = periodInUs;
+  }
+  
+  if (periodInUs > stats->maxPeriodInUs)
+  {
+    stats->maxPeriodInUs = periodInUs;
+  }
+  
+  stats->sumPeriodInUs += periodInUs;
+  stats->numRevolutions++;
+  
+  // a longer period is a slower speed
+  bucket = 0;
+  while ((bucket < NUM_SPEED_BUCKETS-1) && (periodInUs <= speedBucketPeriodInUs[bucket]))
+  {
+    bucket++;
+  }
+  
+  stats->speedHistogram[bucket]++;
+}
+
+void addRevolutionStatsToNightStats(IntervalRevolutionStats_t *stats)
+{
+  uint8_t i;
+  
+  if (stats->numRevolutions == 0)
+  {
+    return;
+  }
+  
+  if ((nightStats.fastestRevolutionInUs == 0) || (stats->minPeriodInUs < nightStats.fastestRevolutionInUs))
+  {
+    nightStats.fastestRevolutionInUs = stats->minPeriodInUs;
+  }
+  
+  for (i=0; i<NUM_SPEED_BUCKETS; i++)
+  {
+    nightStats.speedHistogram[i] += stats->speedHistogram[i];
+  }
+}
+
+void initBouts(void)
+{
+  uint8_t i;
+  
+  isBoutRunning = false;
+  diagnostics.boutCount = 0;
+  diagnostics.boutMaxTimeInUs = 0;
+  
+  for (i=0; i<NUM_TOP_BOUTS; i++)
+  {
+    diagnostics.topBouts[i].numRotations = 0;
+  }
+}
+
+// Called for each counted rotation.  The same few compares whatever the length of the night:  the top bouts are only
+// sorted when a bout ends
+void updateBouts(uint32_t periodInUs, boolean isSameBout)
+{
+  uint32_t startTimeInUs = halMicros();
+  
+  if (isBoutRunning && (isSameBout == false))
+  {
+    endBout();
+  }
+  
+  if (isBoutRunning == false)
+  {
+    currentBout.startTime = softwareClockUtc();
+    currentBout.numRotations = 0;
+    currentBout.fastestRevolutionInUs = 0;
+    boutStartMillis = halMillis();
+    isBoutRunning = true;
+  }
+  else if ((currentBout.fastestRevolutionInUs == 0) || (periodInUs < currentBout.fastestRevolutionInUs))
+  {
+    currentBout.fastestRevolutionInUs = periodInUs;
+  }
+  
+  if (currentBout.numRotations < 0xFFFF)
+  {
+    currentBout.numRotations++;
+  }
+  
+  boutLastMillis = halMillis();
+  diagnostics.boutMaxTimeInUs = max(diagnostics.boutMaxTimeInUs, halMicros() - startTimeInUs);
+}
+
+// the running bout is over:  count it, and keep it if it's one of the longest
+void endBout(void)
+{
+  uint8_t i;
+  
+  if (isBoutRunning == false)
+  {
+    return;
+  }
+  
+  isBoutRunning = false;
+  
+  if (currentBout.numRotations < BOUT_MIN_ROTATIONS)
+  {
+    return;
+  }
+  
+  currentBout.durationInSecs = min((boutLastMillis - boutStartMillis) / 1000, 0xFFFF);
+  diagnostics.boutCount++;
+  
+  // insertion, from the end of the list
+  i = NUM_TOP_BOUTS;
+  while ((i > 0) && ((diagnostics.topBouts[i-1].numRotations == 0) ||
+                     (currentBout.durationInSecs > diagnostics.topBouts[i-1].durationInSecs)))
+  {
+    if (i < NUM_TOP_BOUTS)
+    {
+      diagnostics.topBouts[i] = diagnostics.topBouts[i-1];
+    }
+    
+    i--;
+  }
+  
+  if (i < NUM_TOP_BOUTS)
+  {
+    diagnostics.topBouts[i] = currentBout;
+  }
+}
+
+// the wheel has been still for longer than the gap, so the bout is over without waiting for the next rotation
+void endIdleBout(void)
+{
+  if (isBoutRunning && (halMillis() - boutLastMillis > BOUT_GAP_IN_US / 1000))
+  {
+    endBout();
+  }
+}
+
+// <start, local time>/<duration in s>/<distance in m>/<peak speed in cm/s>
+void writeBout(Bout_t *bout, Print& out)
+{
+  char timeStr[TIME_STRING_SIZE];
+  DateTime startTime(bout->startTime + getUtcOffsetInSecs(bout->startTime));
+  
+  getTimeAsString(startTime, timeStr, SHORT_TIME_FORMAT);
+  out.print(timeStr);
+  out.print('/');
+  out.print(bout->durationInSecs);
+  out.print('/');
+  out.print(((uint32_t)bout->numRotations * WHEEL_CIRCUMFERENCE_IN_CM) / 100);
+  out.print('/');
+  out.print(bout->fastestRevolutionInUs ? convertRevolutionToCmPerSec(bout->fastestRevolutionInUs) : 0);
+}
+
+uint32_t getMeanRevolutionInUs(IntervalRevolutionStats_t *stats)
+{
+  if (stats->numRevolutions == 0)
+  {
+    return 0;
+  }
+  
+  return stats->sumPeriodInUs / stats->numRevolutions;
+}
+
+uint16_t convertRevolutionToCmPerSec(uint32_t periodInUs)
+{
+  if (periodInUs == 0 || periodInUs == 0xFFFFFFFF)
+  {
+    // no revolution recorded
+    return 0;
+  }
+  
+  return (WHEEL_CIRCUMFERENCE_IN_CM * 1000000UL) / periodInUs;
+}
+
+// producer side, called from the ADC interrupt only
+boolean rotationBufferPush(uint32_t rotationTimeInUs)
+{
+  uint8_t nextHead = (rotationBufferHead + 1) & (ROTATION_BUFFER_SIZE - 1);
+  
+  if (nextHead == rotationBufferTail)
+  {
+    // buffer full, loop() has fallen too far behind
+    rotationBufferOverflowCount++;
+    return false;
+  }
+  
+  rotationBuffer[rotationBufferHead] = rotationTimeInUs;
+  rotationBufferHead = nextHead;  // publish the entry only after it has been written
+  return true;
+}
+
+// consumer side, called from loop() only
+boolean rotationBufferPop(uint32_t *rotationTimeInUs)
+{
+  uint8_t tail = rotationBufferTail;
+  
+  if (tail == rotationBufferHead)
+  {
+    // empty
+    return false;
+  }
+  
+  // the entry at tail can't be overwritten until tail moves, so no interrupt lock is needed
+  *rotationTimeInUs = rotationBuffer[tail];
+  rotationBufferTail = (tail + 1) & (ROTATION_BUFFER_SIZE - 1);
+  return true;
+}
+
+// the messages are cleared in the background, by taskEepromWrites().  The markers are only ever written once
+void initDebugMsgLog(void)
+{
+  eepromWriteIfChanged(EEPROMaddrForDebugLog+DEBUG_START_MARKER, 55);
+  eepromWriteIfChanged(EEPROMaddrForDebugLog+NUMBER_OF_DEBUG_MESSAGES, 55);
+  startEepromRecordWrite(&debugLogClearWrite, EEPROMaddrForDebugLog+DEBUG_START_MARKER+1, NULL,
+                         NUMBER_OF_DEBUG_MESSAGES-DEBUG_START_MARKER-1, 0, 0);
+  debugMsgLogged = 0;
+}
+
+// Each message is written once a night, the log shows which were reached.  While the EEPROM is busy with another write, or the
+// log is still being cleared, the message is left for its next call rather than waiting
+void logDebugMsg(uint8_t debugIndex, uint8_t debugMsg)
+{
+  if ((debugMsgLogged & (1UL << debugIndex)) || debugLogClearWrite.isPending || (halEepromIsReady() == false))
+  {
+    return;
+  }
+  
+  halEepromWrite(EEPROMaddrForDebugLog+debugIndex, debugMsg);
+  debugMsgLogged |= 1UL << debugIndex;
+}
+
+void initResetLog(void)
+{
+  uint8_t i;
+  
+  for (i=0; i<sizeof(DateTime); i++)
+  {
+    eepromWriteIfChanged(EEPROMaddrForResetLog+i, 0);
+  }
+}
+
+void saveTimeOfLastResetToEEPROM(DateTime timeOfLastReset)
+{
+  uint8_t i;
+  
+  for (i=0; i<sizeof(DateTime); i++)
+  {
+    halEepromWrite(EEPROMaddrForResetLog+i, ((unsigned char *)(&timeOfLastReset))[i]);
+  }
+}
+
+DateTime readTimeOfLastResetFromEEPROM(void)
+{
+  uint8_t i;
+  DateTime timeOfLastReset;
+
+  for (i=0; i<sizeof(DateTime); i++)
+  {
+    ((unsigned char *)(&timeOfLastReset))[i] = halEepromRead(EEPROMaddrForResetLog+i);
+  }
+  
+  return timeOfLastReset;
+}
+
+void displayTimeOfLastReset(void)
+{
+  char timeStr[TIME_STRING_SIZE];
+  DateTime timeOfLastReset;
+  
+  lcdFrame.clear();
+  lcdFrame.setCursor(0,0); //Start at character 0 on line 0
+  lcdFrame.print(F("unexpected reset"));
+  lcdFrame.setCursor(0,1); //Start at character 0 on line 1
+  timeOfLastReset = readTimeOfLastResetFromEEPROM();
+  getTimeAsString(timeOfLastReset, timeStr, LONG_TIME_FORMAT);
+  lcdFrame.print(timeStr);
+}
+
+boolean isButtonPress(void)
+{
+  if (halReadButton(CAPTOUCH_BUTTON))
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}  
+
+boolean isProtoshieldButtonPress(void)
+{
+  if (halReadButton(PROTOSHIELD_BUTTON) == LOW)
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}  
+
+void delaySecsWithWatchdog(uint16_t numSecDelay)
+{
+  int i;
+  
+  for (i=0; i<numSecDelay; i++)
+  {
+    halDelay(1000);
+    wdtCount = NUM_INTERVALS_TO_RESET;  // restore watchdog count
+  }
+}
+
+
+void initNightStats(void)
+{
+  uint8_t i;
+  
+  nightStats.totalDistanceInCm = 0;
+  nightStats.dateTimeOfFirstRotationInDateTime = softwareClockNow();
+  nightStats.dateTimeOfLastRotationInDateTime = softwareClockNow();  
+  nightStats.fastestRevolutionInUs = 0;
+  nightStats.rotationCounterAtSave = getRotationCounter();
+  
+  for (i=0; i<NUM_SPEED_BUCKETS; i++)
+  {
+    nightStats.speedHistogram[i] = 0;
+  }
+};
+
+// Each save goes to the next journal slot, so the writes are spread over 6 slots.  The slot still holds the record from 6 saves ago,
+// which mostly has the same bytes:  only the bytes that changed are written (each EEPROM write takes 3.3ms).  The writes are done
+// in the background by taskEepromWrites().  The CRC is invalidated first:  a reset part way through leaves a bad CRC, and the
+// previous record is recovered instead
+void saveNightStatsToEEPROM(void)
+{
+  int addr;
+  uint32_t startTimeInUs = halMicros();
+  uint32_t saveTimeInUs;
+  
+  if (nightStatsWrite.isPending)
+  {
+    // the last save isn't written yet.  Left as it is, its slot has a bad CRC or the record it had, and this one replaces it
+    diagnostics.nightStatsBytesWritten += nightStatsWrite.bytesWritten;
+  }
+  
+  nightStatsJournalSlot = (nightStatsJournalSlot + 1) % NIGHT_STATS_JOURNAL_SLOTS;
+  nightStatsJournalSequence++;
+  addr = EEPROMaddrForNightStats + (nightStatsJournalSlot * NIGHT_STATS_SLOT_SIZE);
+  nightStats.rotationCounterAtSave = getRotationCounter();
+  
+  nightStatsSlotImage[0] = nightStatsJournalSequence & 0xFF;
+  nightStatsSlotImage[1] = nightStatsJournalSequence >> 8;
+  memcpy(&nightStatsSlotImage[2], &nightStats, sizeof(HedgieNightStats_t));
+  nightStatsSlotImage[2+sizeof(HedgieNightStats_t)] = crc8((const uint8_t *)&nightStats, sizeof(HedgieNightStats_t));
+  startEepromRecordWrite(&nightStatsWrite, addr, nightStatsSlotImage, NIGHT_STATS_SLOT_SIZE, 2+sizeof(HedgieNightStats_t),
+                         ~nightStatsSlotImage[2+sizeof(HedgieNightStats_t)]);
+  
+  saveTimeInUs = halMicros() - startTimeInUs;
+  diagnostics.nightStatsSaveCount++;
+  
+  if (saveTimeInUs > diagnostics.nightStatsMaxSaveTimeInUs)
+  {
+    diagnostics.nightStatsMaxSaveTimeInUs = saveTimeInUs;
+  }
+}
+
+// newest valid journal record.  Night stats are cleared if there isn't one
+void loadNightStatsFromEEPROM(void)
+{
+  int addr;
+  uint8_t i;
+  uint8_t slot;
+  
+  slot = findNewestNightStatsSlot(&nightStatsJournalSequence);
+  
+  if (slot >= NIGHT_STATS_JOURNAL_SLOTS)
+  {
+    initNightStats();
+    return;
+  }
+  
+  nightStatsJournalSlot = slot;
+  addr = EEPROMaddrForNightStats + (slot * NIGHT_STATS_SLOT_SIZE);
+  
+  for (i=0; i<sizeof(HedgieNightStats_t); i++)
+  {
+    ((unsigned char *)(&nightStats))[i] = halEepromRead(addr+2+i);
+  }
+}
+
+// pick up where the journal left off, so the next save doesn't overwrite the newest record
+void initNightStatsJournal(void)
+{
+  uint8_t slot;
+  
+  slot = findNewestNightStatsSlot(&nightStatsJournalSequence);
+  nightStatsJournalSlot = (slot < NIGHT_STATS_JOURNAL_SLOTS) ? slot : 0;
+}
+
+// one pass over the journal.  Returns NIGHT_STATS_JOURNAL_SLOTS if no slot has a valid record
+uint8_t findNewestNightStatsSlot(uint16_t *sequenceNumber)
+{
+  HedgieNightStats_t stats;
+  uint8_t newestSlot = NIGHT_STATS_JOURNAL_SLOTS;
+  uint16_t newestSequence = 0;
+  uint16_t sequence;
+  int addr;
+  uint8_t slot;
+  uint8_t i;
+  
+  for (slot=0; slot<NIGHT_STATS_JOURNAL_SLOTS; slot++)
+  {
+    addr = EEPROMaddrForNightStats + (slot * NIGHT_STATS_SLOT_SIZE);
+    sequence = halEepromRead(addr) | (halEepromRead(addr+1) << 8);
+    
+    for (i=0; i<sizeof(HedgieNightStats_t); i++)
+    {
+      ((unsigned char *)(&stats))[i] = halEepromRead(addr+2+i);
+    }
+    
+    if (halEepromRead(addr+2+sizeof(HedgieNightStats_t)) != crc8((const uint8_t *)&stats, sizeof(HedgieNightStats_t)))
+    {
+      // never written, or torn write
+      continue;
+    }
+    
+    // sequence numbers wrap, so compare the difference
+    if ((newestSlot == NIGHT_STATS_JOURNAL_SLOTS) || ((int16_t)(sequence - newestSequence) > 0))
+    {
+      newestSlot = slot;
+      newestSequence = sequence;
+    }
+  }
+  
+  *sequenceNumber = newestSequence;
+  return newestSlot;
+}
+
+// Rotation counter:  a 512 bit string in EEPROM.  Counting up from 0, each rotation clears the next bit, then once all bits are clear,
+// each rotation sets the next bit again.  So the value (mod 1024) is always readable from the bits, and each rotation costs one
+// EEPROM byte write.  The write never waits:  a rotation that comes while the EEPROM is busy is written by taskEepromWrites(),
+// along with any others in the same byte.
+// Wear:  each byte is written once per 64 rotations.  At ~6000 rotations a night that's ~100 writes a night, of the 100,000 allowed.
+// The counter only holds 1024 rotations since the last night stats save (5 mins).  Past ROTATION_COUNTER_MODULUS - 2 x
+// ROTATION_COUNTER_SAVE_MARGIN, a save is made early, so it doesn't wrap even at ~3 rotations/sec
+void initRotationCounter(void)
+{
+  uint16_t bitIndex;
+  uint8_t firstBit;
+  
+  firstBit = halEepromRead(EEPROMaddrForRotationCounter) & 0x01;
+  
+  // count the leading bits that are the same as the first bit
+  for (bitIndex=0; bitIndex<ROTATION_COUNTER_BITS; bitIndex++)
+  {
+    if (((halEepromRead(EEPROMaddrForRotationCounter + (bitIndex >> 3)) >> (bitIndex & 7)) & 0x01) != firstBit)
+    {
+      break;
+    }
+  }
+  
+  if (firstBit == 0)
+  {
+    // clearing pass
+    rotationCounterValue = bitIndex;
+  }
+  else if (bitIndex == ROTATION_COUNTER_BITS)
+  {
+    // all bits set:  start of the clearing pass
+    rotationCounterValue = 0;
+  }
+  else
+  {
+    // setting pass
+    rotationCounterValue = ROTATION_COUNTER_BITS + bitIndex;
+  }
+}
+
+void incrementRotationCounter(void)
+{
+  uint16_t numRotations;
+  
+  rotationCounterPending++;
+  serviceRotationCounter();
+  numRotations = (getRotationCounter() + ROTATION_COUNTER_MODULUS - nightStats.rotationCounterAtSave) % ROTATION_COUNTER_MODULUS;
+  
+  if (numRotations >= ROTATION_COUNTER_MODULUS - (2 * ROTATION_COUNTER_SAVE_MARGIN))
+  {
+    isNightStatsSaveDue = true;
+  }
+}
+
+// writes the pending rotations that share the counter's next byte, if the EEPROM is ready
+void serviceRotationCounter(void)
+{
+  uint16_t bitIndex;
+  int addr;
+  uint8_t value;
+  
+  if ((rotationCounterPending == 0) || (halEepromIsReady() == false))
+  {
+    return;
+  }
+  
+  bitIndex = rotationCounterValue % ROTATION_COUNTER_BITS;
+  addr = EEPROMaddrForRotationCounter + (bitIndex >> 3);
+  value = halEepromRead(addr);
+  
+  do
+  {
+    if (rotationCounterValue < ROTATION_COUNTER_BITS)
+    {
+      value &= ~(1 << (rotationCounterValue & 7));
+    }
+    else
+    {
+      value |= (1 << (rotationCounterValue & 7));
+    }
+    
+    rotationCounterValue = (rotationCounterValue + 1) % ROTATION_COUNTER_MODULUS;
+    rotationCounterPending--;
+  } while ((rotationCounterPending > 0) && ((rotationCounterValue & 7) != 0));
+  
+  halEepromWrite(addr, value);
+}
+
+// the count, including the rotations not written yet
+uint16_t getRotationCounter(void)
+{
+  return (rotationCounterValue + rotationCounterPending) % ROTATION_COUNTER_MODULUS;
+}
+
+// after an unexpected reset, add the rotations counted since the night stats were last saved
+void recoverRotationsSinceLastSave(DateTime& dateNow)
+{
+  uint16_t numRotations;
+  
+  numRotations = (rotationCounterValue + ROTATION_COUNTER_MODULUS - (nightStats.rotationCounterAtSave % ROTATION_COUNTER_MODULUS)) % ROTATION_COUNTER_MODULUS;
+  
+  if (numRotations > ROTATION_COUNTER_MODULUS - ROTATION_COUNTER_SAVE_MARGIN)
+  {
+    // further than the counter gets before the early save:  the save counted rotations that the reset kept from being written
+    numRotations = 0;
+  }
+  
+  diagnostics.rotationsRecoveredAtReset = numRotations;
+  
+  if (numRotations > 0)
+  {
+    nightStats.totalDistanceInCm += (unsigned long)numRotations * WHEEL_CIRCUMFERENCE_IN_CM;
+    distanceRunIntervalInCm += (unsigned long)numRotations * WHEEL_CIRCUMFERENCE_IN_CM;
+    nightStats.dateTimeOfLastRotationInDateTime = dateNow;   // close enough:  the last one was just before the reset
+  }
+}
+
+// Night history:  a ring of NightSummary_t, one per night, written at 7am.  The newest has the highest day number.  The 7 and 30
+// day windows are running totals:  each new night is added, and the nights that have dropped out are taken off, oldest first
+void initNightHistory(void)
+{
+  NightSummary_t summary;
+  boolean isCrcOk;
+  uint8_t i;
+  uint8_t crc;
+  
+  for (i=0; i<sizeof(historyWindows); i++)
+  {
+    ((uint8_t *)historyWindows)[i] = halEepromRead(EEPROMaddrForHistoryWindows + i);
+  }
+  
+  historyCountedDay = halEepromRead(EEPROMaddrForHistoryWindows + sizeof(historyWindows));
+  historyCountedDay |= (uint16_t)halEepromRead(EEPROMaddrForHistoryWindows + sizeof(historyWindows) + 1) << 8;
+  crc = halEepromRead(EEPROMaddrForHistoryWindows + sizeof(historyWindows) + 2);
+  
+  isCrcOk = (crc == getHistoryWindowsCrc());
+  
+  if (halEepromRead(EEPROMaddrForHistoryFormat) != HISTORY_FORMAT_MARKER)
+  {
+    if (isCrcOk == false)
+    {
+      // first run with the history, clear out what was there before.  The marker goes last, so a reset part way through
+      // formats again
+      memset(historyWindows, 0, sizeof(historyWindows));
+      historyCountedDay = HISTORY_EMPTY_DAY;
+      
+      for (i=0; i<HISTORY_SLOTS; i++)
+      {
+        eepromWriteIfChanged(EEPROMaddrForNightHistory + (i * sizeof(NightSummary_t)), lowByte(HISTORY_EMPTY_DAY));
+        eepromWriteIfChanged(EEPROMaddrForNightHistory + (i * sizeof(NightSummary_t)) + 1, highByte(HISTORY_EMPTY_DAY));
+      }
+      
+      saveHistoryWindows();
+    }
+    
+    // a good CRC without the marker is a history from before the marker:  kept
+    eepromWriteIfChanged(EEPROMaddrForHistoryFormat, HISTORY_FORMAT_MARKER);
+    
+    if (isCrcOk == false)
+    {
+      return;
+    }
+  }
+  
+  for (i=0; i<HISTORY_SLOTS; i++)
+  {
+    readNightSummary(i, &summary);
+    
+    if ((summary.dayNumber != HISTORY_EMPTY_DAY) &&
+        ((historyNewestSlot == HISTORY_SLOTS) || (summary.dayNumber > historyNewestDay())))
+    {
+      historyNewestSlot = i;
+    }
+  }
+  
+  if ((isCrcOk == false) || (((historyNewestSlot < HISTORY_SLOTS) ? historyNewestDay() : HISTORY_EMPTY_DAY) != historyCountedDay))
+  {
+    // reset between writing the night's summary and saving the totals, or part way through saving them:  the ring is still good
+    rebuildHistoryWindows();
+    saveHistoryWindows();
+  }
+}
+
+// the totals from scratch:  the nights in the ring inside each window, going back from the newest
+void rebuildHistoryWindows(void)
+{
+  NightSummary_t summary;
+  HistoryWindow_t *window;
+  uint16_t newestDay;
+  uint8_t slot;
+  uint8_t age;
+  uint8_t i;
+  
+  memset(historyWindows, 0, sizeof(historyWindows));
+  historyCountedDay = HISTORY_EMPTY_DAY;
+  
+  if (historyNewestSlot == HISTORY_SLOTS)
+  {
+    return;
+  }
+  
+  newestDay = historyNewestDay();
+  
+  for (i=0; i<NUM_HISTORY_WINDOWS; i++)
+  {
+    window = &historyWindows[i];
+    
+    for (age=0; age<HISTORY_SLOTS; age++)
+    {
+      slot = (historyNewestSlot + HISTORY_SLOTS - age) % HISTORY_SLOTS;
+      readNightSummary(slot, &summary);
+      
+      if ((summary.dayNumber == HISTORY_EMPTY_DAY) || (summary.dayNumber > newestDay) ||
+          ((uint16_t)(summary.dayNumber + historyWindowDays[i]) <= newestDay))
+      {
+        break;
+      }
+      
+      window->distanceInM += summary.distanceInM;
+      window->boutCount += summary.boutCount;
+      window->nightCount++;
+      window->oldestSlot = slot;
+    }
+  }
+  
+  historyCountedDay = newestDay;
+}
+
+// called at 7am, after the last interval and the last bout
+void addNightToHistory(void)
+{
+  NightSummary_t summary;
+  NightSummary_t oldest;
+  HistoryWindow_t *window;
+  DateTime dateNow = softwareClockNow();
+  uint8_t slot;
+  uint8_t i;
+  
+  summary.dayNumber = (dateNow.unixtime() / 86400UL) - DAYS_FROM_1970_TO_2000;
+  
+  if ((historyNewestSlot < HISTORY_SLOTS) && (summary.dayNumber <= historyNewestDay()))
+  {
+    // already have this morning (or the clock went back)
+    return;
+  }
+  
+  summary.distanceInM = min(convertCmsToM(nightStats.totalDistanceInCm), 0xFFFF);
+  summary.startTime = packHistoryTime(nightStats.dateTimeOfFirstRotationInDateTime);
+  summary.endTime = packHistoryTime(nightStats.dateTimeOfLastRotationInDateTime);
+  summary.boutCount = min(diagnostics.boutCount, 0xFF);
+  summary.fastestInCmPerSec = nightStats.fastestRevolutionInUs ? min(convertRevolutionToCmPerSec(nightStats.fastestRevolutionInUs), 0xFF) : 0;
+  
+  slot = (historyNewestSlot < HISTORY_SLOTS) ? (historyNewestSlot + 1) % HISTORY_SLOTS : 0;
+  writeNightSummary(slot, &summary);
+  historyNewestSlot = slot;
+  
+  for (i=0; i<NUM_HISTORY_WINDOWS; i++)
+  {
+    window = &historyWindows[i];
+    
+    if (window->nightCount == 0)
+    {
+      window->oldestSlot = slot;
+    }
+    
+    window->distanceInM += summary.distanceInM;
+    window->boutCount += summary.boutCount;
+    window->nightCount++;
+    
+    // usually one night drops out, more after days without a summary.  Never the new one.  The ring is longer than the
+    // 30 day window, so the oldest night of a window is never overwritten
+    readNightSummary(window->oldestSlot, &oldest);
+    
+    while ((uint16_t)(oldest.dayNumber + historyWindowDays[i]) <= summary.dayNumber)
+    {
+      window->distanceInM -= oldest.distanceInM;
+      window->boutCount -= oldest.boutCount;
+      window->nightCount--;
+      window->oldestSlot = (window->oldestSlot + 1) % HISTORY_SLOTS;
+      readNightSummary(window->oldestSlot, &oldest);
+    }
+  }
+  
+  historyCountedDay = summary.dayNumber;
+  saveHistoryWindows();
+}
+
+uint16_t historyNewestDay(void)
+{
+  NightSummary_t summary;
+  
+  readNightSummary(historyNewestSlot, &summary);
+  return summary.dayNumber;
+}
+
+// local time, to 3 minute steps after 10pm
+uint8_t packHistoryTime(DateTime& dateTime)
+{
+  uint16_t minutesAfter10pm = ((dateTime.hour() * 60) + dateTime.minute() + 120) % 1440;
+  
+  return min(minutesAfter10pm / HISTORY_TIME_STEP_IN_MINS, 0xFF);
+}
+
+DateTime unpackHistoryTime(uint8_t packedTime)
+{
+  uint16_t minuteOfDay = ((22 * 60) + (packedTime * HISTORY_TIME_STEP_IN_MINS)) % 1440;
+  
+  return DateTime(2000, 1, 1, minuteOfDay / 60, minuteOfDay % 60);
+}
+
+void readNightSummary(uint8_t slot, NightSummary_t *summary)
+{
+  uint8_t i;
+  int addr = EEPROMaddrForNightHistory + (slot * sizeof(NightSummary_t));
+  
+  for (i=0; i<sizeof(NightSummary_t); i++)
+  {
+    ((uint8_t *)summary)[i] = halEepromRead(addr+i);
+  }
+  
+  // a day number's high byte of 0xFF is an empty slot, whatever the low byte:  see writeNightSummary()
+  if (highByte(summary->dayNumber) == highByte(HISTORY_EMPTY_DAY))
+  {
+    summary->dayNumber = HISTORY_EMPTY_DAY;
+  }
+}
+
+// The day number's high byte is cleared first and written last, so a reset part way through leaves an empty slot.  The day
+// number is two bytes, so the slot is only valid once the last byte is written
+void writeNightSummary(uint8_t slot, NightSummary_t *summary)
+{
+  uint8_t i;
+  int addr = EEPROMaddrForNightHistory + (slot * sizeof(NightSummary_t));
+  
+  eepromWriteIfChanged(addr+1, highByte(HISTORY_EMPTY_DAY));
+  
+  for (i=0; i<sizeof(NightSummary_t); i++)
+  {
+    if (i != 1)
+    {
+      eepromWriteIfChanged(addr+i, ((uint8_t *)summary)[i]);
+    }
+  }
+  
+  eepromWriteIfChanged(addr+1, ((uint8_t *)summary)[1]);
+}
+
+void saveHistoryWindows(void)
+{
+  uint8_t i;
+  
+  for (i=0; i<sizeof(historyWindows); i++)
+  {
+    eepromWriteIfChanged(EEPROMaddrForHistoryWindows + i, ((uint8_t *)historyWindows)[i]);
+  }
+  
+  eepromWriteIfChanged(EEPROMaddrForHistoryWindows + sizeof(historyWindows), lowByte(historyCountedDay));
+  eepromWriteIfChanged(EEPROMaddrForHistoryWindows + sizeof(historyWindows) + 1, highByte(historyCountedDay));
+  eepromWriteIfChanged(EEPROMaddrForHistoryWindows + sizeof(historyWindows) + 2, getHistoryWindowsCrc());
+}
+
+uint8_t getHistoryWindowsCrc(void)
+{
+  uint8_t crc;
+  
+  crc = crc8((const uint8_t *)historyWindows, sizeof(historyWindows), HISTORY_CRC_SEED);
+  return crc8((const uint8_t *)&historyCountedDay, sizeof(historyCountedDay), crc);
+}
+
+// Night rotation log.  Each night has a 64KB flash block:  a NightLogHeader_t, then one record per counted rotation.
+// A record is the change in revolution period, in ms, as zigzag + 1 in a little endian base 128 varint.  Record 0 is an escape,
+// followed by the ms since the start of the night, as a varint.  A record never starts with 0xFF 0xFF, and an escape's time never
+// starts with 0xFF, so either is the end of the log
+void initNightLog(boolean isNight)
+{
+  NightLogHeader_t header;
+  uint8_t id[3];
+  uint8_t block;
+  
+  halFlashBegin();
+  
+  // manufacturer, type, capacity (2^n bytes)
+  halFlashSelect();
+  halSpiTransfer(FLASH_JEDEC_ID);
+  id[0] = halSpiTransfer(0);
+  id[1] = halSpiTransfer(0);
+  id[2] = halSpiTransfer(0);
+  halFlashDeselect();
+  
+  if ((id[0] == 0x00) || (id[0] == 0xFF) || (id[2] < 16) || (id[2] > 31))
+  {
+    // no flash chip
+    nightLogState = NIGHT_LOG_OFF;
+    return;
+  }
+  
+  nightLogBlockCount = min((1UL << id[2]) / NIGHT_LOG_BLOCK_SIZE, NIGHT_LOG_MAX_BLOCKS);
+  nightLogState = NIGHT_LOG_IDLE;
+  
+  // the newest night has the highest sequence number
+  for (block=0; block<nightLogBlockCount; block++)
+  {
+    readNightLogHeader(block, &header);
+    
+    if ((header.magic == NIGHT_LOG_MAGIC) && ((int16_t)(header.sequence - nightLogSequence) > 0))
+    {
+      nightLogSequence = header.sequence;
+      nightLogBlock = block;
+      nightLogStartTime = header.startTime;
+    }
+  }
+  
+  // reset during the night:  carry on after the last record
+  if (isNight && (nightLogSequence != 0) && (softwareClockUtc() - nightLogStartTime < NIGHT_LOG_RESUME_WINDOW))
+  {
+    diagnostics.nightLogRotations = decodeNightLog(nightLogBlock, NULL, &nightLogWriteAddress);
+    diagnostics.nightLogBytes = nightLogWriteAddress - (nightLogBlock * NIGHT_LOG_BLOCK_SIZE) - sizeof(NightLogHeader_t);
+    isNightLogTimeValid = false;
+    nightLogFlushMillis = halMillis();
+    nightLogState = NIGHT_LOG_RECORDING;
+  }
+}
+
+// 10pm:  erase the next block.  Rotations are buffered until the erase is done
+void startNightLog(void)
+{
+  if (nightLogState == NIGHT_LOG_OFF)
+  {
+    return;
+  }
+  
+  nightLogBlock = (nightLogBlock + 1) % nightLogBlockCount;
+  nightLogSequence++;
+  
+  if (nightLogSequence == 0)
+  {
+    // 0 means no log
+    nightLogSequence = 1;
+  }
+  
+  nightLogStartTime = softwareClockUtc();
+  nightLogWriteAddress = (nightLogBlock * NIGHT_LOG_BLOCK_SIZE) + sizeof(NightLogHeader_t);
+  nightLogBufferLength = 0;
+  isNightLogTimeValid = false;
+  diagnostics.nightLogRotations = 0;
+  diagnostics.nightLogBytes = 0;
+  diagnostics.nightLogMaxEncodeTimeInUs = 0;
+  diagnostics.nightLogDropCount = 0;
+  
+  while (isFlashBusy());    // only if the last night's write is still going, for a ms at most
+  flashEraseBlock(nightLogBlock * NIGHT_LOG_BLOCK_SIZE);
+  nightLogState = NIGHT_LOG_ERASING;
+}
+
+// 7am:  write what's left, then stop
+void closeNightLog(void)
+{
+  if ((nightLogState == NIGHT_LOG_RECORDING) || (nightLogState == NIGHT_LOG_ERASING))
+  {
+    nightLogState = NIGHT_LOG_CLOSING;
+  }
+}
+
+// called for each counted rotation.  Only fills the RAM buffer, serviceNightLog() writes it to flash
+void appendNightLog(uint32_t rotationTimeInUs)
+{
+  uint32_t startTimeInUs = halMicros();
+  uint32_t periodInUs = rotationTimeInUs - nightLogLastRotationInUs;
+  uint32_t timeInMs;
+  uint16_t periodInMs;
+  int16_t changeInMs;
+  uint8_t length = nightLogBufferLength;
+  
+  if ((nightLogState != NIGHT_LOG_RECORDING) && (nightLogState != NIGHT_LOG_ERASING))
+  {
+    return;
+  }
+  
+  if ((NIGHT_LOG_BUFFER_SIZE - length < NIGHT_LOG_MAX_RECORD) ||
+      (nightLogWriteAddress + length + NIGHT_LOG_MAX_RECORD + 2 > (nightLogBlock + 1) * NIGHT_LOG_BLOCK_SIZE))
+  {
+    // the next one that fits has to carry its full time
+    diagnostics.nightLogDropCount++;
+    isNightLogTimeValid = false;
+    return;
+  }
+  
+  if ((isNightLogTimeValid == false) || (periodInUs > REVOLUTION_PERIOD_MAX_IN_US))
+  {
+    // escape, with the time since the start of the night
+    timeInMs = (softwareClockUtc() - nightLogStartTime) * 1000;
+    timeInMs += halMillis() - softwareClockMillis;
+    
+    if ((timeInMs >= 0x80) && ((timeInMs & 0x7F) == 0x7F))
+    {
+      // a ms later, so the time never starts with 0xFF, which is erased flash
+      timeInMs++;
+    }
+    
+    putNightLogVarint(0);
+    putNightLogVarint(timeInMs);
+    nightLogLastPeriodInMs = 0;
+    nightLogResidualInUs = 0;
+  }
+  else
+  {
+    periodInMs = periodInUs / 1000;
+    nightLogResidualInUs += periodInUs % 1000;
+    
+    if (nightLogResidualInUs >= 1000)
+    {
+      periodInMs++;
+      nightLogResidualInUs -= 1000;
+    }
+    
+    // zigzag:  0, -1, 1, -2, 2 ... -> 0, 1, 2, 3, 4 ...
+    changeInMs = periodInMs - nightLogLastPeriodInMs;
+    putNightLogVarint((changeInMs >= 0) ? ((uint32_t)changeInMs << 1) + 1 : ((uint32_t)(-changeInMs) << 1));
+    nightLogLastPeriodInMs = periodInMs;
+  }
+  
+  nightLogLastRotationInUs = rotationTimeInUs;
+  isNightLogTimeValid = true;
+  diagnostics.nightLogRotations++;
+  diagnostics.nightLogBytes += nightLogBufferLength - length;
+  diagnostics.nightLogMaxEncodeTimeInUs = max(diagnostics.nightLogMaxEncodeTimeInUs, halMicros() - startTimeInUs);
+}
+
+// 7 bits a byte, low bits first, top bit set on all but the last byte.  The caller checks there's room
+void putNightLogVarint(uint32_t value)
+{
+  while (value >= 0x80)
+  {
+    nightLogBuffer[nightLogBufferLength++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  
+  nightLogBuffer[nightLogBufferLength++] = value;
+}
+
+// one step:  finish the erase and write the header, or write part of the buffer (up to the end of a flash page)
+void serviceNightLog(void)
+{
+  NightLogHeader_t header;
+  uint16_t length;
+  
+  if ((nightLogState == NIGHT_LOG_OFF) || (nightLogState == NIGHT_LOG_IDLE) || isFlashBusy())
+  {
+    return;
+  }
+  
+  if (nightLogState == NIGHT_LOG_ERASING)
+  {
+    header.magic = NIGHT_LOG_MAGIC;
+    header.sequence = nightLogSequence;
+    header.startTime = nightLogStartTime;
+    flashProgram(nightLogBlock * NIGHT_LOG_BLOCK_SIZE, (uint8_t *)&header, sizeof(header));
+    nightLogFlushMillis = halMillis();
+    nightLogState = NIGHT_LOG_RECORDING;
+    return;
+  }
+  
+  if ((nightLogBufferLength >= NIGHT_LOG_FLUSH_BYTES) || (nightLogState == NIGHT_LOG_CLOSING) ||
+      ((nightLogBufferLength > 0) && (halMillis() - nightLogFlushMillis >= NIGHT_LOG_FLUSH_MS)))
+  {
+    length = min(nightLogBufferLength, FLASH_PAGE_SIZE - (nightLogWriteAddress % FLASH_PAGE_SIZE));
+    
+    if (length > 0)
+    {
+      flashProgram(nightLogWriteAddress, nightLogBuffer, length);
+      nightLogWriteAddress += length;
+      
+      // the hot path adds to the buffer from the same loop() pass, never at the same time
+      memmove(nightLogBuffer, &nightLogBuffer[length], nightLogBufferLength - length);
+      nightLogBufferLength -= length;
+      nightLogFlushMillis = halMillis();
+    }
+    else if (nightLogState == NIGHT_LOG_CLOSING)
+    {
+      nightLogState = NIGHT_LOG_IDLE;
+    }
+  }
+}
+
+// Streams one night's log from flash:  prints each rotation as the ms since the start of the night (when out isn't NULL), and
+// returns the number of rotations and the address after the last record
+uint32_t decodeNightLog(uint8_t block, Print *out, uint32_t *endAddress)
+{
+  uint32_t address = (block * NIGHT_LOG_BLOCK_SIZE) + sizeof(NightLogHeader_t);
+  uint32_t blockEnd = (block + 1) * NIGHT_LOG_BLOCK_SIZE;
+  uint32_t rotations = 0;
+  uint32_t timeInMs = 0;
+  int32_t periodInMs = 0;
+  uint32_t value;
+  uint8_t shift;
+  uint8_t c;
+  uint8_t next;
+  boolean isEscape = false;
+  
+  flashCommand(FLASH_READ, address);
+  c = halSpiTransfer(0);
+  
+  while (address < blockEnd)
+  {
+    next = halSpiTransfer(0);
+    
+    if ((c == 0xFF) && (next == 0xFF) && (isEscape == false))
+    {
+      // erased flash
+      break;
+    }
+    
+    if ((c == 0xFF) && isEscape)
+    {
+      // the escape was written, and the reset came before its time was.  Carry on from the escape:  writing 0x00 over it again
+      // leaves it as it is
+      address--;
+      break;
+    }
+    
+    // one varint, starting with c
+    value = 0;
+    shift = 0;
+    
+    while (true)
+    {
+      value |= (uint32_t)(c & 0x7F) << shift;
+      address++;
+      shift += 7;
+      
+      if (((c & 0x80) == 0) || (shift > 28) || (address >= blockEnd))
+      {
+        break;
+      }
+      
+      c = next;
+      next = halSpiTransfer(0);
+    }
+    
+    c = next;
+    
+    if (isEscape)
+    {
+      timeInMs = value;
+      periodInMs = 0;
+      isEscape = false;
+    }
+    else if (value == 0)
+    {
+      isEscape = true;
+      continue;
+    }
+    else
+    {
+      // undo the zigzag
+      value--;
+      periodInMs += (value & 1) ? -(int32_t)(value >> 1) - 1 : (int32_t)(value >> 1);
+      timeInMs += periodInMs;
+    }
+    
+    rotations++;
+    
+    if (out != NULL)
+    {
+      out->println(timeInMs);
+    }
+    
+    wdtCount = NUM_INTERVALS_TO_RESET;  // restore watchdog count, exports take a while
+  }
+  
+  halFlashDeselect();
+  *endAddress = address;
+  return rotations;
+}
+
+// the newest night, one line per rotation, after a line with its start time (UTC)
+void exportNightLog(Print& out)
+{
+  uint32_t endAddress;
+  
+  if (nightLogSequence == 0)
+  {
+    out.println(F("no night log"));
+    return;
+  }
+  
+  out.print(F("night "));
+  out.print(nightLogSequence);
+  out.print(F(" start "));
+  out.println(nightLogStartTime);
+  out.print(F("rotations "));
+  out.println(decodeNightLog(nightLogBlock, &out, &endAddress));
+}
+
+void readNightLogHeader(uint8_t block, NightLogHeader_t *header)
+{
+  flashRead(block * NIGHT_LOG_BLOCK_SIZE, (uint8_t *)header, sizeof(NightLogHeader_t));
+}
+
+// SPI NOR flash (W25Qxx).  Selects the chip and sends the command and 24 bit address.  The caller deselects
+void flashCommand(uint8_t command, uint32_t address)
+{
+  halFlashSelect();
+  halSpiTransfer(command);
+  halSpiTransfer(address >> 16);
+  halSpiTransfer(address >> 8);
+  halSpiTransfer(address);
+}
+
+boolean isFlashBusy(void)
+{
+  uint8_t status;
+  
+  if (nightLogState == NIGHT_LOG_OFF)
+  {
+    return false;
+  }
+  
+  halFlashSelect();
+  halSpiTransfer(FLASH_READ_STATUS);
+  status = halSpiTransfer(0);
+  halFlashDeselect();
+  return (status & 0x01) != 0;
+}
+
+void flashRead(uint32_t address, uint8_t *data, uint16_t length)
+{
+  flashCommand(FLASH_READ, address);
+  
+  while (length--)
+  {
+    *data++ = halSpiTransfer(0);
+  }
+  
+  halFlashDeselect();
+}
+
+// within one page, and not while busy.  Returns without waiting for the write (under 1ms)
+void flashProgram(uint32_t address, const uint8_t *data, uint16_t length)
+{
+  halFlashSelect();
+  halSpiTransfer(FLASH_WRITE_ENABLE);
+  halFlashDeselect();
+  flashCommand(FLASH_PAGE_PROGRAM, address);
+  
+  while (length--)
+  {
+    halSpiTransfer(*data++);
+  }
+  
+  halFlashDeselect();
+}
+
+// returns without waiting for the erase (up to a couple of seconds)
+void flashEraseBlock(uint32_t address)
+{
+  halFlashSelect();
+  halSpiTransfer(FLASH_WRITE_ENABLE);
+  halFlashDeselect();
+  flashCommand(FLASH_BLOCK_ERASE, address);
+  halFlashDeselect();
+}
+
+// returns true if the byte had to be written
+boolean eepromWriteIfChanged(int addr, uint8_t value)
+{
+  if (halEepromRead(addr) == value)
+  {
+    return false;
+  }
+  
+  halEepromWrite(addr, value);
+  return true;
+}
+
+// image is kept as it is until the write is done
+void startEepromRecordWrite(EepromRecordWrite_t *write, int addr, const uint8_t *image, uint8_t length, uint8_t commitIndex,
+                            uint8_t invalidValue)
+{
+  write->image = image;
+  write->addr = addr;
+  write->length = length;
+  write->commitIndex = commitIndex;
+  write->invalidValue = invalidValue;
+  write->position = 0;
+  write->bytesWritten = 0;
+  write->isPending = true;
+}
+
+// Writes the record's next byte if the EEPROM is ready, never waits.  Bytes that are already right are stepped over in the same
+// call.  True when there's nothing left to write
+boolean serviceEepromRecordWrite(EepromRecordWrite_t *write)
+{
+  uint8_t index;
+  uint8_t value;
+  
+  while (write->isPending && halEepromIsReady())
+  {
+    if (write->position == 0)
+    {
+      index = write->commitIndex;
+      value = write->invalidValue;
+    }
+    else if (write->position <= write->length)
+    {
+      index = write->position - 1;
+      value = (write->image != NULL) ? write->image[index] : 0;
+      
+      if (index == write->commitIndex)
+      {
+        write->position++;
+        continue;
+      }
+    }
+    else
+    {
+      index = write->commitIndex;
+      value = (write->image != NULL) ? write->image[index] : 0;
+      write->isPending = false;
+    }
+    
+    write->position++;
+    write->bytesWritten += eepromWriteIfChanged(write->addr + index, value);
+  }
+  
+  return (write->isPending == false);
+}
+
+// the rest of the record now, waiting for each write
+void finishEepromRecordWrite(EepromRecordWrite_t *write)
+{
+  while (serviceEepromRecordWrite(write) == false)
+  {
+    halEepromRead(write->addr);   // a read waits for the write in progress
+  }
+}
+
+// records still to write, or a write in progress:  EEPROM reads would wait, or see a record that isn't all there
+boolean isEepromWritePending(void)
+{
+  return (halEepromIsReady() == false) || telemetryWrite.isPending || nightStatsWrite.isPending;
+}
+
+void handleButtonPress(DateTime& dateNow)
+{
+  NightSummary_t summary;
+  boolean isPressed = isButtonPress();
+  boolean isNewPress = isPressed && (wasButtonPressed == false);
+  
+  wasButtonPressed = isPressed;
+  
+  // presses are ignored while the pages are showing, except on the history page
+  if (isNewPress && (uiPage == UI_PAGE_NONE))
+  {
+    // check time to make sure we don't load overtop stats that have yet to be saved
+    if (dateNow.hour() >= 7 && dateNow.hour() < 22)
+    {
+      loadNightStatsFromEEPROM();
+    }
+    
+    historyBrowseAge = 0;
+    showUiPages(UI_PAGE_DISTANCE, false);
+  }
+  else if (isNewPress && (uiPage == UI_PAGE_HISTORY))
+  {
+    // back a night, to the newest again after the oldest.  The page timer starts again
+    historyBrowseAge++;
+    
+    if (historyBrowseAge < HISTORY_SLOTS)
+    {
+      readNightSummary((historyNewestSlot + HISTORY_SLOTS - historyBrowseAge) % HISTORY_SLOTS, &summary);
+    }
+    
+    if ((historyBrowseAge >= HISTORY_SLOTS) || (summary.dayNumber == HISTORY_EMPTY_DAY))
+    {
+      historyBrowseAge = 0;
+    }
+    
+    renderUiPage(UI_PAGE_HISTORY);
+  }
+}
+
+void displayNightStats(void)
+{
+  uint32_t km;
+  uint32_t kmFraction;
+  char timeStr[TIME_STRING_SIZE];
+  
+  lcdFrame.clear();
+  lcdFrame.setCursor(0,0); 
+  lcdFrame.print(F("km   start end")); 
+  
+  lcdFrame.setCursor(0,1); 
+  convertCmsToKm(nightStats.totalDistanceInCm, &km, &kmFraction);  
+  lcdFrame.print(km);  
+  lcdFrame.print(F("."));  
+  lcdFrame.print(kmFraction);  
+  lcdFrame.setCursor(5,1); 
+  getTimeAsString(nightStats.dateTimeOfFirstRotationInDateTime, timeStr, SHORT_TIME_FORMAT);
+  lcdFrame.print(timeStr);
+  lcdFrame.setCursor(11,1); 
+  getTimeAsString(nightStats.dateTimeOfLastRotationInDateTime, timeStr, SHORT_TIME_FORMAT);
+  lcdFrame.print(timeStr);
+}
+
+// "Mar 14 12.3km 5r"
+// "10:15-5:30 85cm/s"  (clipped to 16 characters)
+void displayNightHistory(void)
+{
+  NightSummary_t summary;
+  DateTime date;
+  DateTime time;
+  char timeStr[TIME_STRING_SIZE];
+  
+  lcdFrame.clear();
+  lcdFrame.setCursor(0,0); 
+  
+  if (historyNewestSlot < HISTORY_SLOTS)
+  {
+    readNightSummary((historyNewestSlot + HISTORY_SLOTS - historyBrowseAge) % HISTORY_SLOTS, &summary);
+  }
+  else
+  {
+    summary.dayNumber = HISTORY_EMPTY_DAY;
+  }
+  
+  if (summary.dayNumber == HISTORY_EMPTY_DAY)
+  {
+    lcdFrame.print(F("no history")); 
+    return;
+  }
+  
+  date = DateTime((uint32_t)(summary.dayNumber + DAYS_FROM_1970_TO_2000) * 86400UL);
+  lcdFrame.print((const __FlashStringHelper *)pgm_read_ptr(&monthStr[date.month()-1]));
+  lcdFrame.print(' ');
+  lcdFrame.print(date.day());
+  lcdFrame.setCursor(7,0); 
+  lcdFrame.print(summary.distanceInM / 1000);
+  lcdFrame.print('.');
+  lcdFrame.print((summary.distanceInM % 1000) / 100);
+  lcdFrame.print(F("km "));
+  lcdFrame.print(summary.boutCount);
+  lcdFrame.print('r');
+  
+  lcdFrame.setCursor(0,1); 
+  time = unpackHistoryTime(summary.startTime);
+  getTimeAsString(time, timeStr, SHORT_TIME_FORMAT);
+  lcdFrame.print(timeStr);
+  lcdFrame.print('-');
+  time = unpackHistoryTime(summary.endTime);
+  getTimeAsString(time, timeStr, SHORT_TIME_FORMAT);
+  lcdFrame.print(timeStr);
+  lcdFrame.print(' ');
+  lcdFrame.print(summary.fastestInCmPerSec);
+  lcdFrame.print(F("cm/s"));
+}
+
+// average a night, over the nights in each window:  "7d  2.1km 6r"
+void displayHistoryAverages(void)
+{
+  uint32_t km;
+  uint32_t kmFraction;
+  uint8_t i;
+  
+  lcdFrame.clear();
+  
+  for (i=0; i<NUM_HISTORY_WINDOWS; i++)
+  {
+    lcdFrame.setCursor(0,i); 
+    lcdFrame.print(historyWindowDays[i]);
+    lcdFrame.print('d');
+    lcdFrame.setCursor(4,i); 
+    
+    if (historyWindows[i].nightCount == 0)
+    {
+      lcdFrame.print(F("--"));
+      continue;
+    }
+    
+    convertCmsToKm((historyWindows[i].distanceInM * 100) / historyWindows[i].nightCount, &km, &kmFraction);
+    lcdFrame.print(km);
+    lcdFrame.print('.');
+    lcdFrame.print(kmFraction);
+    lcdFrame.print(F("km "));
+    lcdFrame.print(historyWindows[i].boutCount / historyWindows[i].nightCount);
+    lcdFrame.print('r');
+  }
+}
+
+void displayTemperature(void)
+{
+  float temperatureInC;
+  
+  lcdFrame.clear();
+  lcdFrame.setCursor(0,0); 
+  lcdFrame.print(F("temperature")); 
+  lcdFrame.setCursor(0,1);
+  
+  if (readTemperature(&temperatureInC))
+  {
+    lcdFrame.print(temperatureInC);
+  }
+  else
+  {
+    lcdFrame.print(F("--"));
+  }
+}
+
+// Show one page, or the button sequence starting at firstPage.  Returns right away, serviceUi() moves through the pages
+void showUiPages(UI_PAGE_t firstPage, boolean isSinglePage)
+{
+  lcdSetBacklight(true);
+  isUiSinglePage = isSinglePage;
+  renderUiPage(firstPage);
+}
+
+// called on every loop() pass
+void serviceUi(void)
+{
+  if ((uiPage != UI_PAGE_NONE) && (halMillis() - uiPageStartMillis >= uiPageDurationInMs[uiPage]))
+  {
+    if (isUiSinglePage || (uiPage == NUM_UI_PAGES-1))
+    {
+      // done, blank the screen and turn off the backlight
+      renderUiPage(UI_PAGE_NONE);
+      lcdSetBacklight(false);
+    }
+    else
+    {
+      renderUiPage((UI_PAGE_t)(uiPage + 1));
+    }
+  }
+  
+  flushLcd();
+}
+
+void renderUiPage(UI_PAGE_t page)
+{
+  DateTime dateNow;
+  
+  switch (page)
+  {
+    case UI_PAGE_DISTANCE:
+      displayNightStats();
+      break;
+      
+    case UI_PAGE_HISTORY:
+      displayNightHistory();
+      break;
+      
+    case UI_PAGE_AVERAGES:
+      displayHistoryAverages();
+      break;
+      
+    case UI_PAGE_TEMPERATURE:
+      displayTemperature();
+      break;
+      
+    case UI_PAGE_TIME:
+      dateNow = softwareClockNow();
+      displayTime(dateNow);
+      break;
+      
+    case UI_PAGE_LAST_RESET:
+      displayTimeOfLastReset();
+      break;
+      
+    case UI_PAGE_NONE:
+    default:
+      lcdFrame.clear();
+      break;
+  }
+  
+  uiPage = page;
+  uiPageStartMillis = halMillis();
+  
+  // new screen update, measured by flushLcd()
+  isLcdUpdateInProgress = true;
+  lcdUpdateCommands = 0;
+  lcdUpdateTimeInUs = 0;
+}
+
+// Send up to LCD_CELLS_PER_PASS changed characters to the LCD.  The cursor is only moved when the next changed character isn't
+// the one the LCD cursor is already on.
+void flushLcd(void)
+{
+  uint32_t startTimeInUs = halMicros();
+  uint8_t numCellsWritten = 0;
+  uint8_t row;
+  uint8_t col;
+  uint16_t fullRedrawCommands;
+  
+  for (row=0; (row<LCD_ROWS) && (numCellsWritten<LCD_CELLS_PER_PASS); row++)
+  {
+    for (col=0; (col<LCD_COLS) && (numCellsWritten<LCD_CELLS_PER_PASS); col++)
+    {
+      if (lcdFrame.cells[row][col] != lcdShadow[row][col])
+      {
+        if ((lcdCursorRow != row) || (lcdCursorCol != col))
+        {
+          lcdSetCursor(col, row);
+          lcdUpdateCommands++;
+        }
+        
+        lcdWrite(lcdFrame.cells[row][col]);
+        lcdShadow[row][col] = lcdFrame.cells[row][col];
+        lcdUpdateCommands++;
+        numCellsWritten++;
+        
+        // LCD moves the cursor to the right after each character
+        lcdCursorRow = row;
+        lcdCursorCol = col + 1;
+      }
+    }
+  }
+  
+  if (numCellsWritten > 0)
+  {
+    lcdUpdateTimeInUs += halMicros() - startTimeInUs;
+  }
+  else if (isLcdUpdateInProgress)
+  {
+    // screen is up to date.  Compare with the old way:  clear the LCD, then a cursor move and 16 characters for each line
+    isLcdUpdateInProgress = false;
+    fullRedrawCommands = 1 + (LCD_ROWS * (1 + LCD_COLS));
+    diagnostics.lcdUpdateCount++;
+    
+    if (lcdUpdateCommands < fullRedrawCommands)
+    {
+      diagnostics.lcdI2cBytesSaved += (uint32_t)(fullRedrawCommands - lcdUpdateCommands) * LCD_I2C_BYTES_PER_COMMAND;
+      
+      if (lcdUpdateCommands > 0)
+      {
+        diagnostics.lcdTimeSavedInUs += ((lcdUpdateTimeInUs / lcdUpdateCommands) * (fullRedrawCommands - lcdUpdateCommands));
+      }
+      
+      diagnostics.lcdTimeSavedInUs += LCD_CLEAR_TIME_IN_US;
+    }
+  }
+}
+
+void flashLED(void)
+{
+#if 1
+  halSetLed(GREEN_LED, HIGH); 
+  halDelay(300);
+  halSetLed(GREEN_LED, LOW); 
+  halDelay(300);
+#endif  
+}
+
+void convertCmsToKm(uint32_t cms, uint32_t *km, uint32_t *kmFraction)
+{
+  *km = cms/(1000L*100L);
+  *kmFraction = (cms%(1000L*100L))/(100L*100L);
+}
+
+uint32_t convertCmsToM(uint32_t cms)
+{
+  return cms/100L;
+}
+
+// feed in DateTime...get back string with time, like "12:45 pm" or "3:45am"
+void getTimeAsString(DateTime& dateTime, char *timeBuf_p, TIME_FORMAT_t format)
+{
+  char ampm;
+  uint8_t hour;
+  uint8_t minute;
+ 
+  hour = dateTime.hour();
+  minute = dateTime.minute();
+  
+  if (hour == 12)
+  {
+    ampm = 'P';
+  }
+  else if(hour < 13)
+  {
+    ampm = 'A';
+    
+    // detect and correct when hour is between midnight and 1am
+    if (hour == 0)
+    {
+      hour = 12;
+    }
+  }
+  else
+  {
+    ampm = 'P';
+    hour = hour - 12;
+  }
+  
+  if (format == LONG_TIME_FORMAT)
+  {
+    sprintf_P(timeBuf_p, PSTR("%u:%.2u %cM"), hour, minute, ampm);
+  }
+  else
+  {
+    // don't include the AM/PM in the time string
+    sprintf_P(timeBuf_p, PSTR("%u:%.2u"), hour, minute);
+  }  
+}
+
+// the ThingTweet form body, printed piece by piece.  Printed twice:  once to count it, once to send it
+void writeTwitterMsg(DateTime& timeNow, Print& out)
+{
+  char timeStr[TIME_STRING_SIZE];
+  uint32_t km;
+  uint32_t kmFraction;
+  DateTime longestBoutStart;
+  uint8_t dayOfWeek;
+  uint8_t monthOfYear;
+  
+  dayOfWeek = timeNow.dayOfWeek();
+  monthOfYear = timeNow.month();
+  
+  // range checks to make sure string array lookups stay inbounds
+  if (dayOfWeek > 6)
+  {
+    dayOfWeek = 0;
+  }
+  
+  if ((monthOfYear < 1) || (monthOfYear > 12))  // Note:  this is correct - in the DateTime class, the 1st Month is "1", but the first DayOfWeek is "0"
+  {
+    monthOfYear = 1;
+  }
+  
+  convertCmsToKm(nightStats.totalDistanceInCm, &km, &kmFraction);  
+  
+  // api_key=...&status=Sir Charles update for <day> <month> <date> <year>:  Distance ran last night: <km> km,  Start: <time>,  Finish: <time>   #runhedgie
+  out.print(F("api_key="));
+  out.print((const __FlashStringHelper *)thingtweetAPIKey);
+  out.print(F("&status=Sir Charles update for "));
+  out.print((const __FlashStringHelper *)pgm_read_ptr(&dayOfWeekStr[dayOfWeek]));
+  out.print(' ');
+  out.print((const __FlashStringHelper *)pgm_read_ptr(&monthStr[monthOfYear-1]));  // Jan = 1, but index needs to be zero for string lookup
+  out.print(' ');
+  out.print(timeNow.day());
+  out.print(' ');
+  out.print(timeNow.year());
+  out.print(F(":  Distance ran last night: "));
+  out.print(km);
+  out.print('.');
+  out.print(kmFraction);
+  out.print(F(" km,  Start: "));
+  getTimeAsString(nightStats.dateTimeOfFirstRotationInDateTime, timeStr, LONG_TIME_FORMAT);
+  out.print(timeStr);
+  out.print(F(",  Finish: "));
+  getTimeAsString(nightStats.dateTimeOfLastRotationInDateTime, timeStr, LONG_TIME_FORMAT);
+  out.print(timeStr);
+  
+  if (diagnostics.boutCount > 0)
+  {
+    // ",  Runs: 14, longest 23 min at 1:05 AM"
+    longestBoutStart = DateTime(diagnostics.topBouts[0].startTime + getUtcOffsetInSecs(diagnostics.topBouts[0].startTime));
+    out.print(F(",  Runs: "));
+    out.print(diagnostics.boutCount);
+    out.print(F(", longest "));
+    out.print((diagnostics.topBouts[0].durationInSecs + 30) / 60);
+    out.print(F(" min at "));
+    getTimeAsString(longestBoutStart, timeStr, LONG_TIME_FORMAT);
+    out.print(timeStr);
+  }
+  
+  out.print(F("   #runhedgie"));
+}
+
+void blinkLed(int numberBlinks)
+{
+  int i;
+  
+  for (i=0; i<numberBlinks; i++)
+  {
+    flashLED();
+  }
+  
+  delaySecsWithWatchdog(2);
+}
+
+void tweetNightStats(void)
+{
+  // the message itself is written when the request is sent
+  logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_5, ETHERNET_CONNECT_TO_THINGSPEAK_5);
+  
+  if (queueUpload(UPLOAD_THINGTWEET, NULL, softwareClockNow().unixtime(), 0) == false)
+  {
+    logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_1, ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_1);
+  }
+  else
+  {
+    logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_6, ETHERNET_CONNECT_TO_THINGSPEAK_6);
+  }
+}
+
+// called by the upload state machine, in the send step.  The date is the one the tweet was queued on
+void updateTwitterStatus(UploadJob_t *job, Print& out)
+{
+  CountingPrint bodyLength;
+  DateTime timeNow((uint32_t)job->value);
+  
+  writeTwitterMsg(timeNow, bodyLength);
+  
+  out.print(F("POST /apps/thingtweet/1/statuses/update HTTP/1.1\n"));
+  out.print(F("Host: api.thingspeak.com\n"));
+  out.print(F("Connection: close\n"));
+  out.print(F("Content-Type: application/x-www-form-urlencoded\n"));
+  out.print(F("Content-Length: "));
+  out.print(bodyLength.count);
+  out.print(F("\n\n"));
+  writeTwitterMsg(timeNow, out);
+}
+
+// save the interval to the EEPROM telemetry queue, then start sending the backlog
+void sendDataToSparkFun(uint32_t distanceRunIntervalInCm, IntervalRevolutionStats_t *intervalStats)
+{
+  TelemetryRecord_t record;
+  uint8_t i;
+  
+  record.unixTime = softwareClockUtc();
+  record.numRotations = distanceRunIntervalInCm / WHEEL_CIRCUMFERENCE_IN_CM;
+  record.totalDistanceInM = convertCmsToM(nightStats.totalDistanceInCm);
+  record.minRevolutionInMs = intervalStats->numRevolutions ? intervalStats->minPeriodInUs/1000 : 0;
+  record.maxRevolutionInMs = intervalStats->maxPeriodInUs/1000;
+  record.meanRevolutionInMs = getMeanRevolutionInUs(intervalStats)/1000;
+  
+  for (i=0; i<NUM_SPEED_BUCKETS; i++)
+  {
+    record.speedHistogram[i] = (intervalStats->speedHistogram[i] > 255) ? 255 : intervalStats->speedHistogram[i];
+  }
+  
+  saveTelemetryRecord(&record);
+  
+  // once the record is written
+  isBacklogReplayDue = true;
+}
+
+// pipelined:  one GET per record, all written on the same connection.  The server closes it after the last one
+void writeSparkFunBacklogRequest(Print& out)
+{
+  TelemetryRecord_t record;
+  uint8_t i;
+  
+  for (i=0; i<telemetryBatchSize; i++)
+  {
+    readTelemetryRecord(telemetryBatchSlots[i], &record);
+    writeSparkFunRequest(&record, (i == telemetryBatchSize-1), out);
+  }
+}
+
+void writeSparkFunRequest(TelemetryRecord_t *record, boolean isLastRequest, Print& out)
+{
+  char timeAsString[10];
+  DateTime recordTime(record->unixTime + getUtcOffsetInSecs(record->unixTime));
+  uint8_t i;
+  
+  // Post the data! Request should look a little something like:
+  // GET /input/publicKey?private_key=privateKey&light=1024&switch=0&name=Jim HTTP/1.1\n
+  // Host: data.sparkfun.com\n
+  // Connection: close\n
+  // \n
+  
+  // format
+  // http://data.sparkfun.com/input/[publicKey]?private_key=[privateKey]&distanceInCm=[value]&minRevMs=[value]&maxRevMs=[value]&meanRevMs=[value]
+  //   &peakSpeedCmps=[value]&speedHist=[slow]-[..]-[..]-[fast]&time=[value]
+  
+  out.print(F("GET /input/"));
+  out.print((const __FlashStringHelper *)publicKey);
+  out.print(F("?private_key="));
+  out.print((const __FlashStringHelper *)privateKey);
+  
+  out.print('&');
+  out.print(F("distanceInCm"));
+  out.print('=');
+  
+  out.print((uint32_t)record->numRotations * WHEEL_CIRCUMFERENCE_IN_CM);
+  
+  // revolution stats for the interval
+  out.print(F("&minRevMs="));
+  out.print(record->minRevolutionInMs);
+  out.print(F("&maxRevMs="));
+  out.print(record->maxRevolutionInMs);
+  out.print(F("&meanRevMs="));
+  out.print(record->meanRevolutionInMs);
+  out.print(F("&peakSpeedCmps="));
+  out.print(convertRevolutionToCmPerSec((uint32_t)record->minRevolutionInMs * 1000));
+  out.print(F("&speedHist="));
+  
+  for (i=0; i<NUM_SPEED_BUCKETS; i++)
+  {
+    if (i > 0)
+    {
+      out.print('-');
+    }
+    out.print(record->speedHistogram[i]);
+  }
+  
+  out.print('&');
+  out.print(F("time"));
+  out.print('=');
+  
+  // human readable time
+  getTimeAsString(recordTime, timeAsString, SHORT_TIME_FORMAT);
+  out.print(timeAsString);
+  
+  out.println(F(" HTTP/1.1"));
+  out.print(F("Host: "));
+  out.println(sparkfunServer);
+  
+  if (isLastRequest)
+  {
+    out.println(F("Connection: close"));
+  }
+  
+  out.println();
+}
+
+// all the records in one request to the Adafruit IO batch API, each with its own timestamp
+void writeAdafruitIOBacklogRequest(Print& out)
+{
+  CountingPrint bodyLength;
+  
+  writeAdafruitIOBacklogBody(bodyLength);
+  
+  out.print(F("POST /api/feeds/"));
+  out.print(F(AIO_FEED_DISTANCE));
+  out.println(F("/data/batch HTTP/1.1"));
+  out.print(F("Host: "));
+  out.println(aioServer);
+  out.println(F("Connection: close"));
+  out.print(F("X-AIO-Key: "));
+  out.println(F(AIO_KEY));
+  out.println(F("Content-Type: application/json"));
+  out.print(F("Content-Length: "));
+  out.println(bodyLength.count);
+  out.println();
+  writeAdafruitIOBacklogBody(out);
+}
+
+// [{"value":"1234","created_at":"2015-06-01T23:05:00-07:00"},...]
+void writeAdafruitIOBacklogBody(Print& out)
+{
+  TelemetryRecord_t record;
+  char timeStamp[32];
+  int utcOffsetInMins;
+  uint8_t i;
+  
+  out.print('[');
+  
+  for (i=0; i<telemetryBatchSize; i++)
+  {
+    readTelemetryRecord(telemetryBatchSlots[i], &record);
+    utcOffsetInMins = getUtcOffsetInSecs(record.unixTime) / 60;
+    DateTime recordTime(record.unixTime + utcOffsetInMins * 60L);
+    
+    // local time, with its offset from UTC
+    sprintf_P(timeStamp, PSTR("%04u-%02u-%02uT%02u:%02u:%02u%c%02u:%02u"), 
+       recordTime.year(), recordTime.month(), recordTime.day(),
+       recordTime.hour(), recordTime.minute(), recordTime.second(),
+       (utcOffsetInMins < 0) ? '-' : '+', abs(utcOffsetInMins) / 60, abs(utcOffsetInMins) % 60);
+    
+    if (i > 0)
+    {
+      out.print(',');
+    }
+    
+    out.print(F("{\"value\":\""));
+    out.print(record.totalDistanceInM);
+    out.print(F("\",\"created_at\":\""));
+    out.print(timeStamp);
+    out.print(F("\"}"));
+  }
+  
+  out.print(']');
+}
+
+// find the slot to write next (after the newest record), and count the records still to be sent
+void initTelemetryQueue(void)
+{
+  TelemetryRecord_t record;
+  uint32_t newestTime = 0;
+  uint8_t slot;
+  
+  telemetryWriteSlot = 0;
+  diagnostics.telemetryQueueDepth = 0;
+  
+  for (slot=0; slot<TELEMETRY_QUEUE_SLOTS; slot++)
+  {
+    if (readTelemetryRecord(slot, &record))
+    {
+      if (record.unixTime >= newestTime)
+      {
+        newestTime = record.unixTime;
+        telemetryWriteSlot = (slot + 1) % TELEMETRY_QUEUE_SLOTS;
+      }
+      
+      if (readTelemetrySlotState(slot) & (TELEMETRY_TO_SPARKFUN | TELEMETRY_TO_ADAFRUIT_IO))
+      {
+        diagnostics.telemetryQueueDepth++;
+      }
+    }
+  }
+}
+
+// Crash safe:  the slot is marked empty before the record is written, and only marked pending after the record and CRC are written.
+// A reset part way through leaves an empty slot, never a half written pending one.  The writes are done in the background by
+// taskEepromWrites()
+void saveTelemetryRecord(TelemetryRecord_t *record)
+{
+  int addr = EEPROMaddrForTelemetryQueue + (telemetryWriteSlot * TELEMETRY_SLOT_SIZE);
+  uint8_t i;
+  
+  // the last record, 5 minutes ago, is long written unless the EEPROM was kept busy all that time
+  finishEepromRecordWrite(&telemetryWrite);
+  
+  for (i=0; i<telemetryBatchSize; i++)
+  {
+    if (telemetryBatchSlots[i] == telemetryWriteSlot)
+    {
+      // queue is full and the oldest record is being sent right now.  Drop the new one instead
+      diagnostics.telemetryDropCount++;
+      return;
+    }
+  }
+  
+  if (readTelemetrySlotState(telemetryWriteSlot) & (TELEMETRY_TO_SPARKFUN | TELEMETRY_TO_ADAFRUIT_IO))
+  {
+    // queue is full, overwrite the oldest record
+    diagnostics.telemetryDropCount++;
+    diagnostics.telemetryQueueDepth--;
+  }
+  
+  telemetrySlotImage[0] = TELEMETRY_SLOT_VALID | TELEMETRY_TO_SPARKFUN | TELEMETRY_TO_ADAFRUIT_IO;
+  memcpy(&telemetrySlotImage[1], record, sizeof(TelemetryRecord_t));
+  telemetrySlotImage[1+sizeof(TelemetryRecord_t)] = crc8((const uint8_t *)record, sizeof(TelemetryRecord_t));
+  startEepromRecordWrite(&telemetryWrite, addr, telemetrySlotImage, TELEMETRY_SLOT_SIZE, 0, TELEMETRY_SLOT_VALID);   // empty first
+  
+  diagnostics.telemetryQueueDepth++;
+  telemetryWriteSlot = (telemetryWriteSlot + 1) % TELEMETRY_QUEUE_SLOTS;
+}
+
+// returns false if the slot doesn't hold a valid record
+boolean readTelemetryRecord(uint8_t slot, TelemetryRecord_t *record)
+{
+  int addr = EEPROMaddrForTelemetryQueue + (slot * TELEMETRY_SLOT_SIZE);
+  uint8_t i;
+  
+  if ((halEepromRead(addr) & 0xF0) != TELEMETRY_SLOT_VALID)
+  {
+    return false;
+  }
+  
+  for (i=0; i<sizeof(TelemetryRecord_t); i++)
+  {
+    ((unsigned char *)record)[i] = halEepromRead(addr+1+i);
+  }
+  
+  return (halEepromRead(addr+1+sizeof(TelemetryRecord_t)) == crc8((const uint8_t *)record, sizeof(TelemetryRecord_t)));
+}
+
+// destinations the slot's record still has to be sent to.  0 for an empty slot
+uint8_t readTelemetrySlotState(uint8_t slot)
+{
+  uint8_t state = halEepromRead(EEPROMaddrForTelemetryQueue + (slot * TELEMETRY_SLOT_SIZE));
+  
+  if ((state & 0xF0) != TELEMETRY_SLOT_VALID)
+  {
+    return 0;
+  }
+  
+  return (state & (TELEMETRY_TO_SPARKFUN | TELEMETRY_TO_ADAFRUIT_IO));
+}
+
+// oldest records first
+void selectTelemetryBatch(uint8_t destination)
+{
+  TelemetryRecord_t record;
+  uint8_t slot;
+  uint8_t i;
+  
+  telemetryBatchSize = 0;
+  telemetryAckCount = 0;
+  
+  for (i=0; (i<TELEMETRY_QUEUE_SLOTS) && (telemetryBatchSize < TELEMETRY_BATCH_SIZE); i++)
+  {
+    slot = (telemetryWriteSlot + i) % TELEMETRY_QUEUE_SLOTS;
+    
+    if ((readTelemetrySlotState(slot) & destination) && readTelemetryRecord(slot, &record))
+    {
+      telemetryBatchSlots[telemetryBatchSize++] = slot;
+    }
+  }
+}
+
+// clear the destination bit of each record that got a 2xx response.  One EEPROM write a call:  the next record waits for the
+// last write to finish, so false until all of them are done.  Each call picks up at telemetryAckCount
+boolean acknowledgeTelemetryBatch(uint8_t destination, uint8_t okResponseMask)
+{
+  int addr;
+  uint8_t state;
+  
+  while (telemetryAckCount < telemetryBatchSize)
+  {
+    if (okResponseMask & (1 << telemetryAckCount))
+    {
+      if (halEepromIsReady() == false)
+      {
+        return false;
+      }
+      
+      addr = EEPROMaddrForTelemetryQueue + (telemetryBatchSlots[telemetryAckCount] * TELEMETRY_SLOT_SIZE);
+      state = halEepromRead(addr) & ~destination;
+      halEepromWrite(addr, state);
+      
+      if ((state & (TELEMETRY_TO_SPARKFUN | TELEMETRY_TO_ADAFRUIT_IO)) == 0)
+      {
+        // sent everywhere, slot is free
+        diagnostics.telemetryQueueDepth--;
+      }
+    }
+    
+    telemetryAckCount++;
+  }
+  
+  return true;
+}
+
+// takes the records a backlog job sent off the telemetry queue.  False until all the EEPROM writes are done
+boolean acknowledgeUploadBatch(UploadJob_t *job)
+{
+  if (job->kind == UPLOAD_SPARKFUN_BACKLOG)
+  {
+    return acknowledgeTelemetryBatch(TELEMETRY_TO_SPARKFUN, uploadOkResponseMask);
+  }
+  
+  if (job->kind == UPLOAD_ADAFRUIT_IO_BACKLOG)
+  {
+    // one response for the whole batch
+    return acknowledgeTelemetryBatch(TELEMETRY_TO_ADAFRUIT_IO, (uploadOkResponseMask & 0x01) ? 0xFF : 0x00);
+  }
+  
+  return true;
+}
+
+void queueTelemetryBacklog(void)
+{
+  uint8_t pendingDestinations = 0;
+  uint8_t slot;
+  
+  for (slot=0; slot<TELEMETRY_QUEUE_SLOTS; slot++)
+  {
+    pendingDestinations |= readTelemetrySlotState(slot);
+  }
+  
+  if ((pendingDestinations & TELEMETRY_TO_ADAFRUIT_IO) && !isAdafruitIOBacklogQueued)
+  {
+    isAdafruitIOBacklogQueued = queueUpload(UPLOAD_ADAFRUIT_IO_BACKLOG, AIO_FEED_DISTANCE, 0, 0);
+  }
+  
+  if ((pendingDestinations & TELEMETRY_TO_SPARKFUN) && !isSparkfunBacklogQueued)
+  {
+    isSparkfunBacklogQueued = queueUpload(UPLOAD_SPARKFUN_BACKLOG, NULL, 0, 0);
+  }
+}
+
+// CRC-8, polynomial x^8 + x^5 + x^4 + 1 (Dallas/Maxim).  crc is the seed, or the CRC so far when a record is in pieces
+uint8_t crc8(const uint8_t *data, uint8_t length, uint8_t crc)
+{
+  uint8_t i;
+  
+  while (length--)
+  {
+    crc ^= *data++;
+    
+    for (i=0; i<8; i++)
+    {
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x31) : (crc << 1);
+    }
+  }
+  
+  return crc;
+}
+
+void sendFeedToAdafruitIO(const char *feedKey, int32_t value, uint8_t decimals)
+{
+  queueUpload(UPLOAD_ADAFRUIT_IO_FEED, feedKey, value, decimals);
+}
+
+// The diagnostics are written straight from the live counters as the upload sends them.  The ones since the last push are
+// started over once the upload is done, by startDiagnosticsPeriod().  A push while the last one is still queued leaves it to
+// send the lot
+void sendDiagnosticsToAdafruitIO(void)
+{
+  if (isDiagnosticsQueued)
+  {
+    return;
+  }
+  
+  isDiagnosticsQueued = queueUpload(UPLOAD_ADAFRUIT_IO_DIAGNOSTICS, AIO_FEED_DIAGNOSTICS, 0, 0);
+  
+  if (isDiagnosticsQueued)
+  {
+    diagnostics.rotationBufferOverflowCount = rotationBufferOverflowCount;
+    noInterrupts();
+    diagnostics.wheelWhiteLevel = adaptiveDetector.whiteLevel >> ADAPTIVE_LEVEL_SHIFT;
+    diagnostics.wheelMirrorLevel = adaptiveDetector.mirrorLevel >> ADAPTIVE_LEVEL_SHIFT;
+    diagnostics.wheelDebounceSamples = adaptiveDetector.debounceSamples;
+    interrupts();
+    diagnostics.minFreeRam = halMinFreeRam();
+    diagnostics.freeRam = halFreeRam();
+    diagnostics.currentBoutInSecs = isBoutRunning ? min((boutLastMillis - boutStartMillis) / 1000, 0xFFFF) : 0;
+    diagnostics.awakePermille = 1000 - min(1000, (diagnostics.sleepTimeInMs * 1000) / max(1, halMillis() - lastDiagnosticsMillis));
+    lastDiagnosticsMillis = halMillis();
+    diagnostics.sleepTimeInMs = 0;
+  }
+}
+
+// after the diagnostics upload, sent or not
+void startDiagnosticsPeriod(void)
+{
+  isDiagnosticsQueued = false;
+  noInterrupts();
+  diagnostics.wheelWakeCount = 0;
+  diagnostics.maxWakeLatencyInUs = 0;
+  interrupts();
+  diagnostics.maxLoopTimeInUs = 0;
+  diagnostics.lcdUpdateCount = 0;
+  diagnostics.lcdI2cBytesSaved = 0;
+  diagnostics.lcdTimeSavedInUs = 0;
+  memset(diagnostics.i2cStats, 0, sizeof(diagnostics.i2cStats));
+  memset(diagnostics.taskStats, 0, sizeof(diagnostics.taskStats));
+  diagnostics.i2cBusRecoveryCount = 0;
+  diagnostics.clockSyncFailureCount = 0;
+  diagnostics.dnsHitCount = 0;
+  diagnostics.dnsMissCount = 0;
+  diagnostics.dnsFailureCount = 0;
+  diagnostics.dnsStaleCount = 0;
+  diagnostics.uploadReusedCount = 0;
+  diagnostics.uploadReconnectCount = 0;
+  diagnostics.uploadConnectTimeSavedInMs = 0;
+}
+
+// same request the Adafruit IO library makes for Adafruit_IO_Feed::send().  Pipelined requests keep the connection open
+// (the HTTP/1.1 default), the last one asks the server to close it
+void writeAdafruitIORequest(UploadJob_t *job, boolean isLastRequest, Print& out)
+{
+  CountingPrint bodyLength;
+  
+  if (job->kind == UPLOAD_ADAFRUIT_IO_DIAGNOSTICS)
+  {
+    if (diagnosticsBodyLength == 0)
+    {
+      writeDiagnostics(bodyLength);
+      diagnosticsBodyLength = bodyLength.count + DIAGNOSTICS_BODY_SLACK;
+    }
+    
+    bodyLength.count = diagnosticsBodyLength;
+  }
+  else
+  {
+    writeAdafruitIOValue(job, bodyLength);
+  }
+  
+  out.print(F("POST /api/feeds/"));
+  out.print(job->feedKey);
+  out.println(F("/data/send HTTP/1.1"));
+  out.print(F("Host: "));
+  out.println(aioServer);
+  
+  if (isLastRequest)
+  {
+    out.println(F("Connection: close"));
+  }
+  
+  out.print(F("X-AIO-Key: "));
+  out.println(F(AIO_KEY));
+  out.println(F("Content-Type: application/json"));
+  out.print(F("Content-Length: "));
+  out.println(bodyLength.count + 12);   // + {"value":""}
+  out.println();
+  out.print(F("{\"value\":\""));
+  writeAdafruitIOValue(job, out);
+  out.print(F("\"}"));
+}
+
+void writeAdafruitIOValue(UploadJob_t *job, Print& out)
+{
+  int32_t value = job->value;
+  uint8_t i;
+  int32_t scale = 1;
+  
+  if (job->kind == UPLOAD_ADAFRUIT_IO_DIAGNOSTICS)
+  {
+    writeDiagnostics(out);
+    return;
+  }
+  
+  if (value < 0)
+  {
+    out.print('-');
+    value = -value;
+  }
+  
+  for (i=0; i<job->decimals; i++)
+  {
+    scale *= 10;
+  }
+  
+  out.print(value / scale);
+  
+  if (job->decimals > 0)
+  {
+    out.print('.');
+    
+    // print the fraction with leading zeros
+    for (scale /= 10; scale > 0; scale /= 10)
+    {
+      out.print((value / scale) % 10);
+    }
+  }
+}
+
+// One line of key=value pairs, no quotes (it goes in a JSON string).  Each pair is a field of the upload request.  For the upload,
+// the line is padded with spaces to diagnosticsBodyLength, and the pairs that would go past it are left out
+void writeDiagnostics(Print& out)
+{
+  CountingPrint fieldLength;
+  boolean isUpload = (&out == &uploadWriter);
+  uint16_t bodyStart = uploadWriter.position;
+  uint8_t field;
+  
+  for (field=0; field<NUM_DIAGNOSTICS_FIELDS; field++)
+  {
+    if (isUpload)
+    {
+      uploadWriter.beginField(field);
+      
+      if (uploadWriter.isSkipping == false)
+      {
+        fieldLength.count = 0;
+        writeDiagnosticsField(field, fieldLength);
+        
+        if (uploadWriter.position - bodyStart + fieldLength.count > diagnosticsBodyLength)
+        {
+          break;
+        }
+      }
+    }
+    
+    writeDiagnosticsField(field, out);
+  }
+  
+  if (isUpload)
+  {
+    uploadWriter.beginField(NUM_DIAGNOSTICS_FIELDS);
+    
+    while ((uploadWriter.position - bodyStart < diagnosticsBodyLength) && (out.write(' ') == 1))
+    {
+    }
+  }
+}
+
+void writeDiagnosticsField(uint8_t field, Print& out)
+{
+  uint16_t value;
+  
+  if ((field >= DIAGNOSTICS_TASK_STATS) && (field < DIAGNOSTICS_TASK_STATS + NUM_TASKS))
+  {
+    writeTaskStat(field - DIAGNOSTICS_TASK_STATS, out);
+    return;
+  }
+  
+  if ((field >= DIAGNOSTICS_TOP_BOUTS) && (field < DIAGNOSTICS_TOP_BOUTS + NUM_TOP_BOUTS))
+  {
+    if (diagnostics.topBouts[field - DIAGNOSTICS_TOP_BOUTS].numRotations != 0)
+    {
+      out.print(F(" bout"));
+      out.print(field - DIAGNOSTICS_TOP_BOUTS + 1);
+      out.print('=');
+      writeBout(&diagnostics.topBouts[field - DIAGNOSTICS_TOP_BOUTS], out);
+    }
+    return;
+  }
+  
+  switch (field)
+  {
+    case DIAGNOSTICS_LOOP_TIME:
+      out.print(F("loopMaxUs="));
+      out.print(diagnostics.maxLoopTimeInUs);
+      break;
+      
+    case DIAGNOSTICS_ROTATION_OVERFLOWS:
+      out.print(F(" rotOvf="));
+      out.print(diagnostics.rotationBufferOverflowCount);
+      break;
+      
+    case DIAGNOSTICS_UPLOAD_FAILURES:
+      out.print(F(" upFail="));
+      out.print(diagnostics.uploadFailureCount);
+      break;
+      
+    case DIAGNOSTICS_UPLOAD_DROPS:
+      out.print(F(" upDrop="));
+      out.print(diagnostics.uploadDropCount);
+      break;
+      
+    case DIAGNOSTICS_UPLOAD_REUSED:
+      out.print(F(" upReused="));
+      out.print(diagnostics.uploadReusedCount);
+      break;
+      
+    case DIAGNOSTICS_UPLOAD_RECONNECTS:
+      out.print(F(" upReconnect="));
+      out.print(diagnostics.uploadReconnectCount);
+      break;
+      
+    case DIAGNOSTICS_UPLOAD_TIME_SAVED:
+      out.print(F(" upMsSaved="));
+      out.print(diagnostics.uploadConnectTimeSavedInMs);
+      break;
+      
+    case DIAGNOSTICS_PUSH_LATENCY:
+      out.print(F(" pushMs="));
+      out.print(diagnostics.pushLatencyInMs);
+      break;
+      
+    case DIAGNOSTICS_TELEMETRY_DEPTH:
+      out.print(F(" tqDepth="));
+      out.print(diagnostics.telemetryQueueDepth);
+      break;
+      
+    case DIAGNOSTICS_TELEMETRY_DROPS:
+      out.print(F(" tqDrop="));
+      out.print(diagnostics.telemetryDropCount);
+      break;
+      
+    case DIAGNOSTICS_NIGHT_STATS_SAVES:
+      out.print(F(" nsSaves="));
+      out.print(diagnostics.nightStatsSaveCount);
+      break;
+      
+    case DIAGNOSTICS_NIGHT_STATS_BYTES:
+      out.print(F(" nsBytes="));
+      out.print(diagnostics.nightStatsBytesWritten);
+      break;
+      
+    case DIAGNOSTICS_NIGHT_STATS_SAVE_TIME:
+      out.print(F(" nsMaxUs="));
+      out.print(diagnostics.nightStatsMaxSaveTimeInUs);
+      break;
+      
+    case DIAGNOSTICS_ROTATIONS_RECOVERED:
+      out.print(F(" rotRecov="));
+      out.print(diagnostics.rotationsRecoveredAtReset);
+      break;
+      
+    case DIAGNOSTICS_LCD_UPDATES:
+      out.print(F(" lcdUpd="));
+      out.print(diagnostics.lcdUpdateCount);
+      break;
+      
+    case DIAGNOSTICS_LCD_BYTES_SAVED:
+      out.print(F(" lcdBytesSaved="));
+      out.print(diagnostics.lcdI2cBytesSaved);
+      break;
+      
+    case DIAGNOSTICS_LCD_TIME_SAVED:
+      out.print(F(" lcdMsSaved="));
+      out.print(diagnostics.lcdTimeSavedInUs / 1000);
+      break;
+      
+    case DIAGNOSTICS_I2C_STATS + I2C_DEVICE_RTC:
+      writeI2cStats(F(" i2cRtc="), &diagnostics.i2cStats[I2C_DEVICE_RTC], out);
+      break;
+      
+    case DIAGNOSTICS_I2C_STATS + I2C_DEVICE_TEMPERATURE:
+      writeI2cStats(F(" i2cTemp="), &diagnostics.i2cStats[I2C_DEVICE_TEMPERATURE], out);
+      break;
+      
+    case DIAGNOSTICS_I2C_STATS + I2C_DEVICE_LCD:
+      writeI2cStats(F(" i2cLcd="), &diagnostics.i2cStats[I2C_DEVICE_LCD], out);
+      break;
+      
+    case DIAGNOSTICS_I2C_RECOVERIES:
+      out.print(F(" i2cRecover="));
+      out.print(diagnostics.i2cBusRecoveryCount);
+      break;
+      
+    case DIAGNOSTICS_BOOT_TO_SAMPLING:
+      out.print(F(" bootSampleUs="));
+      out.print(diagnostics.bootToSamplingInUs);
+      break;
+      
+    case DIAGNOSTICS_BOOT_TO_COUNTING:
+      out.print(F(" bootCountMs="));
+      out.print(diagnostics.bootToCountingInMs);
+      break;
+      
+    case DIAGNOSTICS_BOOT_TO_NETWORK:
+      out.print(F(" bootNetMs="));
+      out.print(diagnostics.bootToNetworkInMs);
+      break;
+      
+    case DIAGNOSTICS_CLOCK_SYNC_FAILURES:
+      out.print(F(" clockSyncFail="));
+      out.print(diagnostics.clockSyncFailureCount);
+      break;
+      
+    case DIAGNOSTICS_CLOCK_DRIFT:
+      out.print(F(" driftPpm="));
+      out.print(diagnostics.clockDriftPpm);
+      break;
+      
+    case DIAGNOSTICS_DNS_HITS:
+      out.print(F(" dnsHit="));
+      out.print(diagnostics.dnsHitCount);
+      break;
+      
+    case DIAGNOSTICS_DNS_MISSES:
+      out.print(F(" dnsMiss="));
+      out.print(diagnostics.dnsMissCount);
+      break;
+      
+    case DIAGNOSTICS_DNS_FAILURES:
+      out.print(F(" dnsFail="));
+      out.print(diagnostics.dnsFailureCount);
+      break;
+      
+    case DIAGNOSTICS_DNS_STALE:
+      out.print(F(" dnsStale="));
+      out.print(diagnostics.dnsStaleCount);
+      break;
+      
+    case DIAGNOSTICS_AWAKE:
+      out.print(F(" awake="));
+      out.print(diagnostics.awakePermille);
+      break;
+      
+    case DIAGNOSTICS_WHEEL_WAKES:
+      // counted by the wake interrupt
+      noInterrupts();
+      value = diagnostics.wheelWakeCount;
+      interrupts();
+      out.print(F(" wheelWakes="));
+      out.print(value);
+      break;
+      
+    case DIAGNOSTICS_WAKE_LATENCY:
+      noInterrupts();
+      value = diagnostics.maxWakeLatencyInUs;
+      interrupts();
+      out.print(F(" wakeUs="));
+      out.print(value);
+      break;
+      
+    case DIAGNOSTICS_WHITE_LEVEL:
+      out.print(F(" white="));
+      out.print(diagnostics.wheelWhiteLevel);
+      break;
+      
+    case DIAGNOSTICS_MIRROR_LEVEL:
+      out.print(F(" mirror="));
+      out.print(diagnostics.wheelMirrorLevel);
+      break;
+      
+    case DIAGNOSTICS_DEBOUNCE:
+      out.print(F(" debounce="));
+      out.print(diagnostics.wheelDebounceSamples);
+      break;
+      
+    case DIAGNOSTICS_NIGHT_LOG_ROTATIONS:
+      out.print(F(" nlRot="));
+      out.print(diagnostics.nightLogRotations);
+      break;
+      
+    case DIAGNOSTICS_NIGHT_LOG_BYTES:
+      out.print(F(" nlBytes="));
+      out.print(diagnostics.nightLogBytes);
+      break;
+      
+    case DIAGNOSTICS_NIGHT_LOG_RATIO:
+      out.print(F(" nlRatio="));    // x100, against 4 byte timestamps
+      out.print((diagnostics.nightLogRotations * 400) / max(diagnostics.nightLogBytes, 1));
+      break;
+      
+    case DIAGNOSTICS_NIGHT_LOG_ENCODE_TIME:
+      out.print(F(" nlEncUs="));
+      out.print(diagnostics.nightLogMaxEncodeTimeInUs);
+      break;
+      
+    case DIAGNOSTICS_NIGHT_LOG_DROPS:
+      out.print(F(" nlDrop="));
+      out.print(diagnostics.nightLogDropCount);
+      break;
+      
+    case DIAGNOSTICS_BOUTS:
+      out.print(F(" bouts="));
+      out.print(diagnostics.boutCount);
+      break;
+      
+    case DIAGNOSTICS_CURRENT_BOUT:
+      out.print(F(" boutCurS="));
+      out.print(diagnostics.currentBoutInSecs);
+      break;
+      
+    case DIAGNOSTICS_BOUT_TIME:
+      out.print(F(" boutUs="));
+      out.print(diagnostics.boutMaxTimeInUs);
+      break;
+      
+    case DIAGNOSTICS_NTP_OFFSET:
+      out.print(F(" ntpOffMs="));
+      out.print(diagnostics.ntpOffsetInMs);
+      break;
+      
+    case DIAGNOSTICS_NTP_ROUND_TRIP:
+      out.print(F(" ntpRttMs="));
+      out.print(diagnostics.ntpRoundTripInMs);
+      break;
+      
+    case DIAGNOSTICS_NTP_SYNCS:
+      out.print(F(" ntpSync="));
+      out.print(diagnostics.ntpSyncCount);
+      break;
+      
+    case DIAGNOSTICS_NTP_FAILURES:
+      out.print(F(" ntpFail="));
+      out.print(diagnostics.ntpFailureCount);
+      break;
+      
+    case DIAGNOSTICS_NTP_LOST:
+      out.print(F(" ntpLost="));
+      out.print(diagnostics.ntpLostCount);
+      break;
+      
+    case DIAGNOSTICS_NTP_REJECTED:
+      out.print(F(" ntpRej="));
+      out.print(diagnostics.ntpRejectedCount);
+      break;
+      
+    case DIAGNOSTICS_MIN_FREE_RAM:
+      out.print(F(" ramMin="));
+      out.print(diagnostics.minFreeRam);
+      break;
+      
+    case DIAGNOSTICS_FREE_RAM:
+    default:
+      out.print(F(" ramFree="));
+      out.print(diagnostics.freeRam);
+      break;
+  }
+}
+
+boolean queueUpload(UPLOAD_KIND_t kind, const char *feedKey, int32_t value, uint8_t decimals)
+{
+  uint8_t nextHead = (uploadQueueHead + 1) % UPLOAD_QUEUE_SIZE;
   
-  switch (wheelState)
+  if (nextHead == uploadQueueTail)
   {
-    case DETERMINE_MIRROR_LOCATION:
-      if (isMirror())
+    // queue full
+    diagnostics.uploadDropCount++;
+    return false;
+  }
+  
+  uploadQueue[uploadQueueHead].kind = kind;
+  uploadQueue[uploadQueueHead].feedKey = feedKey;
+  uploadQueue[uploadQueueHead].value = value;
+  uploadQueue[uploadQueueHead].decimals = decimals;
+  uploadQueueHead = nextHead;
+  return true;
+}
+
+UPLOAD_SERVER_t getUploadServer(UPLOAD_KIND_t kind)
+{
+  switch (kind)
+  {
+    case UPLOAD_SPARKFUN_BACKLOG:
+      return SERVER_SPARKFUN;
+      
+    case UPLOAD_THINGTWEET:
+      return SERVER_THINGSPEAK;
+      
+    case UPLOAD_ADAFRUIT_IO_FEED:
+    case UPLOAD_ADAFRUIT_IO_DIAGNOSTICS:
+    default:
+      return SERVER_ADAFRUIT_IO;
+  }
+}
+
+void writeUploadRequest(UploadJob_t *job, Print& out)
+{
+  uint8_t i;
+  
+  switch (job->kind)
+  {
+    case UPLOAD_SPARKFUN_BACKLOG:
+      writeSparkFunBacklogRequest(out);
+      break;
+      
+    case UPLOAD_ADAFRUIT_IO_BACKLOG:
+      writeAdafruitIOBacklogRequest(out);
+      break;
+      
+    case UPLOAD_THINGTWEET:
+      updateTwitterStatus(job, out);
+      break;
+      
+    case UPLOAD_ADAFRUIT_IO_FEED:
+    case UPLOAD_ADAFRUIT_IO_DIAGNOSTICS:
+    default:
+      // pipelined:  the feed updates queued together are all written on this connection
+      for (i=0; i<uploadPipelineLength; i++)
       {
-        wheelState = WAITING_FOR_WHITE;
+        writeAdafruitIORequest(&uploadQueue[(uploadQueueTail + i) % UPLOAD_QUEUE_SIZE], (i == uploadPipelineLength-1), out);
+      }
+      break;
+  }
+}
+
+// Advances the upload at the head of the queue by one step.  Called on every loop() pass, never waits on the network.
+void serviceUpload(void)
+{
+  UploadJob_t *job;
+  IPAddress address;
+  DNS_RESULT_t dnsResult;
+  HAL_TCP_STATE_t tcpState;
+  uint16_t txFree;
+  uint8_t i;
+  int c;
+  
+  if (uploadState == UPLOAD_IDLE)
+  {
+    if (isBacklogReplayDue && (isEepromWritePending() == false))
+    {
+      isBacklogReplayDue = false;
+      queueTelemetryBacklog();
+    }
+    
+    if (uploadQueueHead == uploadQueueTail)
+    {
+      // nothing to send
+      return;
+    }
+    
+    job = &uploadQueue[uploadQueueTail];
+    
+    if ((job->kind == UPLOAD_SPARKFUN_BACKLOG || job->kind == UPLOAD_ADAFRUIT_IO_BACKLOG) && isEepromWritePending())
+    {
+      // the backlog is read from the EEPROM, don't wait for the writes there to finish
+      return;
+    }
+    
+    uploadResponseCount = 0;
+    uploadOkResponseMask = 0;
+    uploadPipelineLength = getUploadPipelineLength();
+    
+    // pick the backlog records for this request now, so the request doesn't change while it's being sent
+    if (job->kind == UPLOAD_SPARKFUN_BACKLOG)
+    {
+      selectTelemetryBatch(TELEMETRY_TO_SPARKFUN);
+    }
+    else if (job->kind == UPLOAD_ADAFRUIT_IO_BACKLOG)
+    {
+      selectTelemetryBatch(TELEMETRY_TO_ADAFRUIT_IO);
+    }
+    
+    if ((job->kind == UPLOAD_SPARKFUN_BACKLOG || job->kind == UPLOAD_ADAFRUIT_IO_BACKLOG) && (telemetryBatchSize == 0))
+    {
+      // backlog already sent
+      finishUpload(true);
+      return;
+    }
+    
+    halSetLed(GREEN_LED, HIGH);
+    uploadState = UPLOAD_RESOLVE;
+    uploadStepStartMillis = halMillis();
+  }
+  
+  job = &uploadQueue[uploadQueueTail];
+  
+  switch (uploadState)
+  {
+    case UPLOAD_RESOLVE:
+      dnsResult = resolveUploadServer(getUploadServer(job->kind), address);
+      
+      if (dnsResult == DNS_PENDING)
+      {
+        break;
+      }
+      
+      if ((dnsResult == DNS_OK) && halTcpConnect(address, 80))
+      {
+        uploadState = UPLOAD_CONNECT;
+        uploadStepStartMillis = halMillis();
       }
       else
       {
-        wheelState = WAITING_FOR_MIRROR;
+        finishUploadPipeline();
       }
+      break;
       
+    case UPLOAD_CONNECT:
+      tcpState = halTcpState();
+      
+      if (tcpState == HAL_TCP_ESTABLISHED)
+      {
+        uploadBytesBuffered = 0;
+        uploadBytesSent = 0;
+        uploadRequestLength = 0xFFFF;
+        isUploadSending = false;
+        uploadWriter.startRequest();
+        diagnosticsBodyLength = 0;
+        uploadConnectTimeInMs = halMillis() - uploadStepStartMillis;
+        uploadState = UPLOAD_SEND;
+        uploadStepStartMillis = halMillis();
+        
+        if (job->kind == UPLOAD_THINGTWEET)
+        {
+          logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_OK_1, ETHERNET_CONNECT_TO_THINGSPEAK_OK_1);
+        }
+      }
+      else if ((tcpState == HAL_TCP_CLOSED) || (halMillis() - uploadStepStartMillis > UPLOAD_CONNECT_TIMEOUT_MS))
+      {
+        // connect failed.  The server address may have changed, look it up again next time
+        invalidateHost(uploadServerName[getUploadServer(job->kind)]);
+        halTcpClose();
+        finishUploadPipeline();
+      }
       break;
-  
-    case WAITING_FOR_MIRROR:
-      wheelState = detectMirror(dateNow);
+      
+    case UPLOAD_SEND:
+      if (isUploadSending && halTcpIsSent())
+      {
+        isUploadSending = false;
+      }
+      
+      if ((isUploadSending == false) && (uploadBytesSent > 0) && (uploadBytesSent >= uploadRequestLength))
+      {
+        // whole request is sent
+        uploadLineIndex = 0;
+        uploadState = UPLOAD_READ_RESPONSE;
+        uploadStepStartMillis = halMillis();
+        break;
+      }
+      
+      // a batch's records are read from the EEPROM as the request is written:  not while a background write has it busy
+      if ((isUploadSending == false) && halEepromIsReady())
+      {
+        // copy the next chunk of the request into the transmit buffer, at most UPLOAD_CHUNK_SIZE bytes a pass.  SEND once
+        // the whole request is there, or the buffer is full
+        txFree = halTcpTxFree();
+        uploadWriter.startPass(uploadBytesBuffered, uploadBytesBuffered + min(txFree, UPLOAD_CHUNK_SIZE));
+        writeUploadRequest(job, uploadWriter);
+        uploadWriter.endPass();
+        uploadBytesBuffered = uploadWriter.position;
+        
+        if (uploadWriter.position < uploadWriter.windowEnd)
+        {
+          uploadRequestLength = uploadWriter.position;
+        }
+        
+        if ((uploadBytesBuffered > uploadBytesSent) && ((uploadBytesBuffered == uploadRequestLength) || (txFree <= UPLOAD_CHUNK_SIZE)))
+        {
+          uploadBytesSent = uploadBytesBuffered;
+          halTcpSend();
+          isUploadSending = true;
+        }
+      }
+      
+      if ((halTcpConnected() == false) || (halMillis() - uploadStepStartMillis > UPLOAD_SEND_TIMEOUT_MS))
+      {
+        halTcpDisconnect();
+        uploadState = UPLOAD_CLOSE;
+        uploadStepStartMillis = halMillis();
+      }
       break;
       
-    case WAITING_FOR_WHITE:
+    case UPLOAD_READ_RESPONSE:
+      for (i=0; (i<UPLOAD_READ_BYTES_PER_PASS) && ((c = halTcpRead()) >= 0); i++)
+      {
+        parseUploadResponse((char)c);
+      }
+      
+      // the server closes the connection after the response (Connection: close)
+      if ((halTcpConnected() == false) || (halMillis() - uploadStepStartMillis > UPLOAD_RESPONSE_TIMEOUT_MS))
+      {
+        halTcpDisconnect();
+        uploadState = UPLOAD_CLOSE;
+        uploadStepStartMillis = halMillis();
+        
+        if (job->kind == UPLOAD_THINGTWEET)
+        {
+          logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_3, ETHERNET_CONNECT_TO_THINGSPEAK_3);
+        }
+      }
+      break;
+      
+    case UPLOAD_CLOSE:
     default:
-      wheelState = detectWhite();
+      if ((halTcpState() == HAL_TCP_CLOSED) || (halMillis() - uploadStepStartMillis > UPLOAD_CLOSE_TIMEOUT_MS))
+      {
+        halTcpClose();
+        
+        // the sent records come off the telemetry queue in the EEPROM one write a pass, rather than waiting for each write
+        if (acknowledgeUploadBatch(job) == false)
+        {
+          break;
+        }
+        
+        if (job->kind == UPLOAD_THINGTWEET)
+        {
+          logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_4, ETHERNET_CONNECT_TO_THINGSPEAK_4);
+        }
+        
+        finishUploadPipeline();
+      }
+      break;
+  }
+}
+
+// Adafruit IO feed updates at the head of the queue are sent together, on one connection
+uint8_t getUploadPipelineLength(void)
+{
+  uint8_t length = 0;
+  uint8_t index = uploadQueueTail;
+  UPLOAD_KIND_t kind;
+  
+  while ((index != uploadQueueHead) && (length < UPLOAD_PIPELINE_MAX))
+  {
+    kind = uploadQueue[index].kind;
+    
+    if ((kind != UPLOAD_ADAFRUIT_IO_FEED) && (kind != UPLOAD_ADAFRUIT_IO_DIAGNOSTICS))
+    {
       break;
+    }
+    
+    length++;
+    index = (index + 1) % UPLOAD_QUEUE_SIZE;
+  }
+  
+  // anything else goes on its own
+  return max(length, 1);
+}
+
+// finish each job written on the connection by its own response.  When the server answered some of them and then dropped the
+// connection, the rest stay queued, and are sent again on a new connection by the next pass
+void finishUploadPipeline(void)
+{
+  uint8_t responseCount = uploadResponseCount;
+  uint8_t okResponseMask = uploadOkResponseMask;
+  uint8_t pipelineLength = uploadPipelineLength;
+  uint8_t i;
+  
+  if (responseCount > 1)
+  {
+    diagnostics.uploadReusedCount += responseCount - 1;
+    diagnostics.uploadConnectTimeSavedInMs += (uint32_t)uploadConnectTimeInMs * (responseCount - 1);
+  }
+  
+  for (i=0; i<pipelineLength; i++)
+  {
+    if ((i >= responseCount) && (responseCount > 0))
+    {
+      diagnostics.uploadReconnectCount++;
+      break;
+    }
+    
+    // finishUpload() clears the response state for the next job
+    uploadOkResponseMask = okResponseMask >> i;
+    finishUpload((i < responseCount) && ((okResponseMask & (1 << i)) != 0));
+  }
+}
+
+DNS_RESULT_t resolveUploadServer(UPLOAD_SERVER_t server, IPAddress& address)
+{
+  return resolveHost(uploadServerName[server], address);
+}
+
+// One step of a lookup, never waits on the network.  Looks the hostname up in the DNS cache, and asks the DNS server only when the
+// cached answer has expired:  DNS_PENDING until the answer comes in.  When the lookup fails, the last good address is used until
+// the next try.  One lookup at a time, another hostname waits for the one going on
+DNS_RESULT_t resolveHost(const char *name, IPAddress& address)
+{
+  DnsCacheEntry_t *entry;
+  const char *queryName = dnsQueryName;
+  DNS_RESULT_t result;
+  
+  if (queryName != NULL)
+  {
+    result = pollDnsQuery();
+    
+    if ((result == DNS_PENDING) || (strcmp(queryName, name) != 0))
+    {
+      // still waiting, or it was another hostname's lookup.  This one goes on the next pass
+      return DNS_PENDING;
+    }
+    
+    entry = findDnsCacheEntry(name);
+    
+    if (result == DNS_OK)
+    {
+      address = entry->address;
+      return DNS_OK;
+    }
+  }
+  else
+  {
+    entry = findDnsCacheEntry(name);
+    
+    if ((int32_t)(entry->expiresMillis - halMillis()) > 0)
+    {
+      if (entry->isFailed == false)
+      {
+        diagnostics.dnsHitCount++;
+        address = entry->address;
+        return DNS_OK;
+      }
+    }
+    else
+    {
+      diagnostics.dnsMissCount++;
+      
+      if (sendDnsQuery(name))
+      {
+        return DNS_PENDING;
+      }
+      
+      diagnostics.dnsFailureCount++;
+      entry->expiresMillis = halMillis() + DNS_MIN_TTL_MS;
+      entry->isFailed = true;
+    }
+  }
+  
+  // failed recently
+  if (entry->address != 0)
+  {
+    diagnostics.dnsStaleCount++;
+    address = entry->address;
+    return DNS_OK;
+  }
+  
+  return DNS_FAILED;
+}
+
+// forget the cached address, after a connect to it failed
+void invalidateHost(const char *name)
+{
+  DnsCacheEntry_t *entry;
+  
+  entry = findDnsCacheEntry(name);
+  entry->address = 0;
+  entry->expiresMillis = halMillis();
+}
+
+// returns the hostname's entry.  A new hostname takes a free entry, or the one that expires first
+DnsCacheEntry_t *findDnsCacheEntry(const char *name)
+{
+  DnsCacheEntry_t *entry = &dnsCache[0];
+  uint8_t i;
+  
+  for (i=0; i<DNS_CACHE_SIZE; i++)
+  {
+    if ((dnsCache[i].name != NULL) && (strcmp(dnsCache[i].name, name) == 0))
+    {
+      return &dnsCache[i];
+    }
+    
+    if (dnsCache[i].name == NULL)
+    {
+      if (entry->name != NULL)
+      {
+        entry = &dnsCache[i];
+      }
+    }
+    else if ((entry->name != NULL) && ((int32_t)(dnsCache[i].expiresMillis - entry->expiresMillis) < 0))
+    {
+      entry = &dnsCache[i];
+    }
+  }
+  
+  entry->name = name;
+  entry->address = 0;
+  entry->expiresMillis = halMillis();
+  entry->isFailed = false;
+  return entry;
+}
+
+// Sends an A record query for name to the DHCP assigned DNS server.  The same query as DNSClient::getHostByName(), which waits for
+// the answer, and doesn't return the TTL.  pollDnsQuery() picks up the answer
+boolean sendDnsQuery(const char *name)
+{
+  uint8_t header[12] = { 0, 0, 0x01, 0x00, 0x00, 0x01, 0, 0, 0, 0, 0, 0 };
+  const uint8_t question[5] = { 0x00, 0x00, 0x01, 0x00, 0x01 };
+  const char *label;
+  const char *dot;
+  uint8_t length;
+  
+  if (halUdpBegin(HAL_UDP_DNS, DNS_LOCAL_PORT) == false)
+  {
+    // no free socket
+    return false;
+  }
+  
+  dnsQueryId++;
+  halUdpBeginPacket(HAL_UDP_DNS, halDnsServerIp(), DNS_PORT);
+  
+  // header:  id, recursion desired, 1 question
+  header[0] = dnsQueryId >> 8;
+  header[1] = dnsQueryId;
+  halUdpWrite(HAL_UDP_DNS, header, sizeof(header));
+  
+  // name, as length prefixed labels:  "pool.ntp.org" is 4pool3ntp3org0
+  label = name;
+  
+  while (*label != '\0')
+  {
+    dot = strchr(label, '.');
+    
+    if (dot == NULL)
+    {
+      dot = label + strlen(label);
+    }
+    
+    length = dot - label;
+    halUdpWrite(HAL_UDP_DNS, &length, 1);
+    halUdpWrite(HAL_UDP_DNS, (const uint8_t *)label, length);
+    label = (*dot == '.') ? dot + 1 : dot;
+  }
+  
+  // end of the name, type A, class IN
+  halUdpWrite(HAL_UDP_DNS, question, sizeof(question));
+  
+  if (halUdpEndPacket(HAL_UDP_DNS) == false)
+  {
+    halUdpStop(HAL_UDP_DNS);
+    return false;
+  }
+  
+  dnsQueryName = name;
+  dnsQueryStartMillis = halMillis();
+  return true;
+}
+
+// Checks for the answer to the lookup going on, and puts it in the DNS cache when it comes in, or when the lookup times out
+DNS_RESULT_t pollDnsQuery(void)
+{
+  DnsCacheEntry_t *entry;
+  DNS_RESULT_t result = DNS_PENDING;
+  uint32_t queryAddress;
+  uint32_t ttlInSecs;
+  uint32_t ttlInMs;
+  
+  if (halUdpParsePacket(HAL_UDP_DNS) > 0)
+  {
+    result = readDnsReply(&queryAddress, &ttlInSecs);
+  }
+  
+  if ((result == DNS_PENDING) && (halMillis() - dnsQueryStartMillis > DNS_TIMEOUT_MS))
+  {
+    result = DNS_FAILED;
+  }
+  
+  if (result == DNS_PENDING)
+  {
+    return DNS_PENDING;
+  }
+  
+  halUdpStop(HAL_UDP_DNS);
+  entry = findDnsCacheEntry(dnsQueryName);
+  dnsQueryName = NULL;
+  
+  if (result == DNS_OK)
+  {
+    ttlInMs = (ttlInSecs < DNS_MAX_TTL_MS / 1000) ? ttlInSecs * 1000 : DNS_MAX_TTL_MS;
+    ttlInMs = max(ttlInMs, DNS_MIN_TTL_MS);
+    entry->address = queryAddress;
+    entry->expiresMillis = halMillis() + ttlInMs;
+    entry->isFailed = false;
+  }
+  else
+  {
+    diagnostics.dnsFailureCount++;
+    entry->expiresMillis = halMillis() + DNS_MIN_TTL_MS;
+    entry->isFailed = true;
   }
   
-  // at 10pm, do a one-time prep for Hedgie's upcoming night in the office
-  if (newHour && (dateNow.hour() == 22))
+  return result;
+}
+
+// Returns the first address in the answer with its TTL.  DNS_PENDING for a packet that doesn't answer our query
+DNS_RESULT_t readDnsReply(uint32_t *address, uint32_t *ttlInSecs)
+{
+  uint16_t answerCount;
+  uint16_t questionCount;
+  uint16_t type;
+  uint16_t dataLength;
+  uint8_t ip[4];
+  uint8_t i;
+  boolean isFound = false;
+  
+  // header:  id, flags (a response, no error), counts
+  if (readDnsWord() != dnsQueryId)
   {
-    digitalWrite(GREEN_LED, HIGH); 
-    wheelState = DETERMINE_MIRROR_LOCATION;
-    initNightStats();
-    saveNightStatsToEEPROM();
-    initDebugMsgLog();
-    initResetLog();
-    distanceRunIntervalInCm=0; 
-    statisticsCaptureState = STARTUP_TESTING_DISCARD_HEDGIE_STATISTICS;
-    startupTestingCount=0; 
-    digitalWrite(GREEN_LED, LOW); 
+    return DNS_PENDING;
   }
   
-  // at 7am send tweet
-  if (newHour && (dateNow.hour() == 7))
+  if ((readDnsWord() & 0x800F) != 0x8000)
   {
-    digitalWrite(GREEN_LED, HIGH); 
-    tweetNightStats();  // TWEET it !
-    digitalWrite(GREEN_LED, LOW); 
+    return DNS_FAILED;
   }
   
-  // every 5 minutes push temperature and uptime data to Adafruit IO
-  if (newMinute && ((dateNow.minute() % 5) == 0))
+  questionCount = readDnsWord();
+  answerCount = readDnsWord();
+  readDnsWord();
+  readDnsWord();
+  
+  for (; questionCount > 0; questionCount--)
   {
-    hedgieTemperature.send(tempsensor.readTempC()); 
-    hedgieUptime.send(uptimeInMinutes);
-    uptimeInMinutes+=5;
+    skipDnsName();
+    readDnsWord();  // type
+    readDnsWord();  // class
   }
   
-  // every 5 mins between 10pm and 7am, save interval stats, and send to SparkFun cloud service
-  // also send accumulated distance to Adafruit IO
-  // some tricky logic here:
-  // - only push once at exactly 7am
-  // - only push data when the minute changes (otherwise it would keep pushing data repeatedly during every 5th minute)
-  if (((dateNow.hour() >= 22) || (dateNow.hour() < 7) || (newHour && (dateNow.hour() == 7))) &&
-      (newMinute && ((dateNow.minute() % 5) == 0)))
+  // answers can start with CNAME records, skip to the first A record
+  for (; (answerCount > 0) && (isFound == false); answerCount--)
   {
-    digitalWrite(GREEN_LED, HIGH);
+    if (skipDnsName() == false)
+    {
+      break;
+    }
+    
+    type = readDnsWord();
+    readDnsWord();  // class
+    *ttlInSecs = (uint32_t)readDnsWord() << 16;
+    *ttlInSecs |= readDnsWord();
+    dataLength = readDnsWord();
     
-    // push accumulated distance to Adafruit IO 
-    hedgieDistance.send(convertCmsToM(nightStats.totalDistanceInCm)); 
+    if ((type == 1) && (dataLength == 4))
+    {
+      for (i=0; i<4; i++)
+      {
+        ip[i] = halUdpRead(HAL_UDP_DNS);
+      }
       
-    // Send interval stats to the Sparkfun Data service
-    sendDataToSparkFun(dateNow, distanceRunIntervalInCm);
-    saveNightStatsToEEPROM();
-    distanceRunIntervalInCm=0;   
-    digitalWrite(GREEN_LED, LOW); 
-  }
-  else
-  {
-    // during the day push 0 to Adafruit IO every 5 minutes
-    if (newMinute && ((dateNow.minute() % 5) == 0))
+      *address = (uint32_t)IPAddress(ip[0], ip[1], ip[2], ip[3]);
+      isFound = (*address != 0);
+    }
+    else
     {
-      hedgieDistance.send(0);
+      for (; dataLength > 0; dataLength--)
+      {
+        halUdpRead(HAL_UDP_DNS);
+      }
     }
   }
-      
-  handleButtonPress(dateNow);
   
-  // update RTC chip using NTP, when protoshield button is pressed
-  // this is done manually, because NTP sometimes returns incorrect time
-  if (isProtoshieldButtonPress() == true)
-  {
-    updateRtcUsingNTP();  // update real-time clock 
-  }
-    
-  delay(DELAY_BETWEEN_SAMPLES);
+  return isFound ? DNS_OK : DNS_FAILED;
+}
+
+// big endian, as in the DNS packet
+uint16_t readDnsWord(void)
+{
+  uint16_t value;
   
-  wdtCount = NUM_INTERVALS_TO_RESET;  // restore watchdog count
-} 
+  value = (uint8_t)halUdpRead(HAL_UDP_DNS) << 8;
+  value |= (uint8_t)halUdpRead(HAL_UDP_DNS);
+  return value;
+}
 
-WHEEL_STATE_t detectMirror(DateTime& dateNow)
+// skip a name:  labels ending with 0 or with a 2 byte pointer to a name earlier in the packet
+boolean skipDnsName(void)
 {
-  // check for mirror
-  if (isMirror())
+  int length;
+  
+  while (true)
   {
-    // mirror detected !
+    length = halUdpRead(HAL_UDP_DNS);
     
-    if (dateNow.hour() >= 22 || dateNow.hour() < 7)
+    if (length <= 0)
     {
-       if (statisticsCaptureState == STARTUP_TESTING_DISCARD_HEDGIE_STATISTICS)
-       {
-         startupTestingCount++;
-         
-         if (startupTestingCount >= STARTUP_COUNT_THRESHOLD)
-         {
-           statisticsCaptureState = CAPTURE_HEDGIE_STATISTICS;
-         }
-       }
-       else
-       {
-          if (nightStats.totalDistanceInCm == 0)
-          {
-            nightStats.dateTimeOfFirstRotationInDateTime = rtc.now();
-          }
-          else
-          {
-            nightStats.dateTimeOfLastRotationInDateTime = rtc.now();
-          }
-          
-          // only accumulate rotation and distance data during hedgie office hours, and when startup test rotations have been completed
-          distanceRunIntervalInCm += (unsigned long) WHEEL_CIRCUMFERENCE_IN_CM;
-          nightStats.totalDistanceInCm += (unsigned long) WHEEL_CIRCUMFERENCE_IN_CM;
-       }
+      // end of the name, or of the packet
+      return (length == 0);
     }
     
-    digitalWrite(WHEEL_ROTATION_LED, HIGH);
-    wheelState = WAITING_FOR_WHITE;
+    if ((length & 0xC0) == 0xC0)
+    {
+      halUdpRead(HAL_UDP_DNS);
+      return true;
+    }
+    
+    for (; length > 0; length--)
+    {
+      halUdpRead(HAL_UDP_DNS);
+    }
   }
-  else
+}
+
+// pick the status code out of each status line of the response:  "HTTP/1.1 200 OK"
+void parseUploadResponse(char c)
+{
+  if (c == '\n')
   {
-    // mirror not detected
-    wheelState = WAITING_FOR_MIRROR;
+    uploadLineIndex = 0;
+    return;
   }
   
-  return wheelState;
+  if (uploadLineIndex == 0)
+  {
+    isUploadStatusLine = (c == 'H');
+    uploadStatusCode = 0;
+  }
+  else if ((uploadLineIndex == 4) && (c != '/'))
+  {
+    isUploadStatusLine = false;
+  }
+  else if (isUploadStatusLine && (uploadLineIndex >= 9) && (uploadLineIndex < 12) && (c >= '0') && (c <= '9'))
+  {
+    uploadStatusCode = (uploadStatusCode * 10) + (c - '0');
+    
+    if (uploadLineIndex == 11)
+    {
+      // got the whole status code
+      if ((uploadStatusCode >= 200) && (uploadStatusCode < 300) && (uploadResponseCount < 8))
+      {
+        uploadOkResponseMask |= (1 << uploadResponseCount);
+      }
+      
+      uploadResponseCount++;
+    }
+  }
+  
+  if (uploadLineIndex < 255)
+  {
+    uploadLineIndex++;
+  }
 }
 
-
-WHEEL_STATE_t detectWhite(void)
+void finishUpload(boolean isSuccess)
 {
-  if (!isMirror())
+  UploadJob_t *job = &uploadQueue[uploadQueueTail];
+  
+  // after UPLOAD_CLOSE it's done already.  Any other way here, there's no 2xx response to acknowledge
+  acknowledgeUploadBatch(job);
+  
+  if (job->kind == UPLOAD_SPARKFUN_BACKLOG)
   {
-    // detected white
-    whiteSampleCount++;    
+    isSparkfunBacklogQueued = false;
   }
-  else
+  else if (job->kind == UPLOAD_ADAFRUIT_IO_BACKLOG)
   {
-    // detected mirror
-    whiteSampleCount=0;
+    isAdafruitIOBacklogQueued = false;
+  }
+  else if (job->kind == UPLOAD_ADAFRUIT_IO_DIAGNOSTICS)
+  {
+    startDiagnosticsPeriod();
   }
   
-  if (whiteSampleCount > 20)
+  if (job->kind == UPLOAD_THINGTWEET)
   {
-    //  white has been detected
-    digitalWrite(WHEEL_ROTATION_LED, LOW); 
-    whiteSampleCount=0;
-    wheelState = WAITING_FOR_MIRROR;
+    if (isSuccess)
+    {
+      logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_OK_2, ETHERNET_CONNECT_TO_THINGSPEAK_OK_2);
+    }
+    else
+    {
+      logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_2, ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_2);
+    }
   }
-  else
+  
+  if (isSuccess == false)
   {
-    // still waiting to get enough consecutive white samples
-    wheelState = WAITING_FOR_WHITE;
+    diagnostics.uploadFailureCount++;
   }
-
-  return wheelState;
-}
-
-boolean isMirror(void)
-{
-  if (analogRead(0) > 300)
+  
+  uploadQueueTail = (uploadQueueTail + 1) % UPLOAD_QUEUE_SIZE;
+  uploadState = UPLOAD_IDLE;
+  telemetryBatchSize = 0;
+  telemetryAckCount = 0;
+  halSetLed(GREEN_LED, LOW);
+  
+  if ((uploadQueueHead == uploadQueueTail) && (pushStartMillis != 0))
   {
-    // mirror detected
-    return true;
+    // everything queued by the push is done
+    diagnostics.pushLatencyInMs = min(halMillis() - pushStartMillis, 0xFFFF);
+    pushStartMillis = 0;
   }
-  else
+  
+  // keep replaying the backlog while the server is accepting it.  After a failure, wait for the next 5 minute push
+  if (isSuccess && (job->kind == UPLOAD_SPARKFUN_BACKLOG || job->kind == UPLOAD_ADAFRUIT_IO_BACKLOG))
   {
-    // white detected
-    return false;
+    // on the next idle pass, it reads the queue back from the EEPROM
+    isBacklogReplayDue = true;
   }
 }
 
-void initDebugMsgLog(void)
+void startNtpSync(void)
 {
-  int i;
-  
-  for (i=0; i<NUMBER_OF_DEBUG_MESSAGES; i++)
+  if (ntpState != NTP_IDLE)
   {
-    EEPROM.write(EEPROMaddrForDebugLog+i, 0);
+    // already running
+    return;
   }
   
-  EEPROM.write(EEPROMaddrForDebugLog+DEBUG_START_MARKER, 55);
-  EEPROM.write(EEPROMaddrForDebugLog+NUMBER_OF_DEBUG_MESSAGES, 55);
+  logDebugMsg(ETHERNET_NTP_10, ETHERNET_NTP_10);
+  halSetLed(GREEN_LED, HIGH); 
+  ntpSampleCount = 0;
+  ntpRequestCount = 0;
+  ntpState = NTP_RESOLVE;
 }
 
-void logDebugMsg(uint8_t debugIndex, uint8_t debugMsg)
+// Advances the NTP sync by one step, never waits on the network
+void serviceNtp(void)
 {
-  EEPROM.write(EEPROMaddrForDebugLog+debugIndex, debugMsg);
+  byte packetBuffer[NTP_PACKET_SIZE];  //Buffer to hold outgoing packets
+  uint32_t nowMillis = halMillis();
+  DNS_RESULT_t dnsResult;
+  
+  switch (ntpState)
+  {
+    case NTP_RESOLVE:
+      dnsResult = resolveHost(ntpServerName, timeServer);
+      
+      if (dnsResult == DNS_PENDING)
+      {
+        break;
+      }
+      
+      if (dnsResult == DNS_FAILED)
+      {
+        logDebugMsg(ETHERNET_NTP_12, ETHERNET_NTP_12);
+        finishNtpSync();
+        break;
+      }
+      
+      logDebugMsg(ETHERNET_NTP_11, ETHERNET_NTP_11);
+      halUdpBegin(HAL_UDP_NTP, localPort);
+      ntpRequestMillis = nowMillis - NTP_SAMPLE_INTERVAL_MS;   // first request right away
+      ntpState = NTP_SEND;
+      break;
+      
+    case NTP_SEND:
+      if (nowMillis - ntpRequestMillis < NTP_SAMPLE_INTERVAL_MS)
+      {
+        break;
+      }
+      
+      if (ntpRequestCount == NTP_SAMPLES)
+      {
+        finishNtpSync();
+        break;
+      }
+      
+      // a late reply to an earlier request is thrown away by its token
+      ntpRequestToken = halMicros();
+      ntpRequestMillis = halMillis();
+      sendNTPpacket(timeServer, packetBuffer, ntpRequestToken); // send an NTP packet to a time server
+      ntpRequestCount++;
+      ntpState = NTP_WAIT_REPLY;
+      break;
+      
+    case NTP_WAIT_REPLY:
+      if (halUdpParsePacket(HAL_UDP_NTP) >= NTP_PACKET_SIZE)
+      {
+        if (readNtpReply(&ntpSamples[ntpSampleCount], nowMillis))
+        {
+          // answered.  Unusable answers are dropped
+          if (ntpSamples[ntpSampleCount].roundTripInMs <= NTP_MAX_ROUND_TRIP_MS)
+          {
+            logDebugMsg(ETHERNET_NTP_4, ETHERNET_NTP_4);
+            ntpSampleCount++;
+          }
+          else
+          {
+            diagnostics.ntpRejectedCount++;
+          }
+          
+          ntpState = NTP_SEND;
+        }
+      }
+      else if (nowMillis - ntpRequestMillis > NTP_REPLY_TIMEOUT_MS)
+      {
+        diagnostics.ntpLostCount++;
+        ntpState = NTP_SEND;
+      }
+      break;
+      
+    case NTP_APPLY:
+      if ((int32_t)(nowMillis - ntpApplyMillis) >= 0)
+      {
+        applyNtpTime();
+      }
+      break;
+      
+    case NTP_IDLE:
+    default:
+      break;
+  }
 }
 
-void initResetLog(void)
+// returns false when the packet doesn't answer our last request.  An answer from an unsynchronized server, or with too long a round
+// trip, gets a round trip of 0xFFFF.  NTP timestamps are seconds since 1900, and a 32 bit binary fraction of a second
+boolean readNtpReply(NtpSample_t *sample, uint32_t arrivalMillis)
 {
-  int i;
+  byte packetBuffer[NTP_PACKET_SIZE];  //Buffer to hold incoming packets
+  uint32_t receiveTime;
+  uint32_t transmitTime;
+  uint16_t receiveMs;
+  uint16_t transmitMs;
+  int32_t serverTimeInMs;
+  int32_t roundTripInMs;
+  uint16_t fractionInMs;
   
-  for (i=0; i<sizeof(DateTime); i++)
+  halUdpRead(HAL_UDP_NTP, packetBuffer, NTP_PACKET_SIZE);  // read the packet into the buffer
+  
+  // mode 4 is a server reply
+  if (((packetBuffer[0] & 0x07) != 4) || (readNtpWord32(&packetBuffer[24]) != ntpRequestToken))
+  {
+    return false;
+  }
+  
+  sample->roundTripInMs = 0xFFFF;
+  
+  // leap indicator 3 and stratum 0 mean the server isn't synchronized
+  if (((packetBuffer[0] >> 6) == 3) || (packetBuffer[1] == 0) || (packetBuffer[1] > 15))
+  {
+    return true;
+  }
+  
+  receiveTime = readNtpWord32(&packetBuffer[32]);
+  receiveMs = ntpFractionToMs(readNtpWord32(&packetBuffer[36]));
+  transmitTime = readNtpWord32(&packetBuffer[40]);
+  transmitMs = ntpFractionToMs(readNtpWord32(&packetBuffer[44]));
+  
+  // round trip:  our send to arrival, less the time the server held the request
+  serverTimeInMs = (int32_t)(transmitTime - receiveTime) * 1000 + transmitMs - receiveMs;
+  roundTripInMs = (int32_t)(arrivalMillis - ntpRequestMillis) - serverTimeInMs;
+  roundTripInMs = max(roundTripInMs, 0);
+  
+  if ((transmitTime == 0) || (serverTimeInMs < 0) || (roundTripInMs > NTP_MAX_ROUND_TRIP_MS))
   {
-    EEPROM.write(EEPROMaddrForResetLog+i, 0);
+    return true;
   }
+  
+  fractionInMs = transmitMs + roundTripInMs / 2;
+  sample->unixTime = transmitTime - SEVENTY_YEARS + fractionInMs / 1000;
+  sample->fractionInMs = fractionInMs % 1000;
+  sample->roundTripInMs = roundTripInMs;
+  sample->arrivalMillis = arrivalMillis;
+  return true;
 }
 
-void saveTimeOfLastResetToEEPROM(DateTime timeOfLastReset)
+// picks the sample with the shortest round trip (the least queueing), and uses it if enough of the others agree with it
+void finishNtpSync(void)
 {
-  int i;
+  NtpSample_t *best;
+  int32_t differenceInMs;
+  uint32_t elapsedInMs;
+  uint8_t agreeingCount = 0;
+  uint8_t i;
   
-  for (i=0; i<sizeof(DateTime); i++)
+  halUdpStop(HAL_UDP_NTP);
+  ntpState = NTP_IDLE;
+  halSetLed(GREEN_LED, LOW); 
+  
+  if (ntpSampleCount == 0)
+  {
+    diagnostics.ntpFailureCount++;
+    return;
+  }
+  
+  best = &ntpSamples[0];
+  
+  for (i=1; i<ntpSampleCount; i++)
+  {
+    if (ntpSamples[i].roundTripInMs < best->roundTripInMs)
+    {
+      best = &ntpSamples[i];
+    }
+  }
+  
+  // compare each sample with the best one, brought to the same local millis()
+  for (i=0; i<ntpSampleCount; i++)
+  {
+    differenceInMs = (int32_t)(ntpSamples[i].unixTime - best->unixTime) * 1000 + ntpSamples[i].fractionInMs - best->fractionInMs - 
+                     (int32_t)(ntpSamples[i].arrivalMillis - best->arrivalMillis);
+    
+    if (abs(differenceInMs) <= NTP_MAX_SPREAD_MS)
+    {
+      agreeingCount++;
+    }
+  }
+  
+  diagnostics.ntpRejectedCount += ntpSampleCount - agreeingCount;
+  
+  if (agreeingCount < NTP_MIN_AGREEING_SAMPLES)
   {
-    EEPROM.write(EEPROMaddrForResetLog+i, ((unsigned char *)(&timeOfLastReset))[i]);
+    diagnostics.ntpFailureCount++;
+    return;
   }
+  
+  // the time now, from the best sample.  Set the clocks when the next second starts
+  elapsedInMs = best->fractionInMs + (halMillis() - best->arrivalMillis);
+  ntpApplyTime = best->unixTime + elapsedInMs / 1000 + 1;
+  ntpApplyMillis = halMillis() + (1000 - (elapsedInMs % 1000));
+  diagnostics.ntpRoundTripInMs = best->roundTripInMs;
+  ntpState = NTP_APPLY;
 }
 
-DateTime readTimeOfLastResetFromEEPROM(void)
+void applyNtpTime(void)
 {
-  int i;
-  DateTime timeOfLastReset;
-
-  for (i=0; i<sizeof(DateTime); i++)
+  int32_t offsetInSecs;
+  
+  offsetInSecs = constrain((int32_t)(ntpApplyTime - softwareClockUtc()), -2000000L, 2000000L);
+  diagnostics.ntpOffsetInMs = offsetInSecs * 1000 - (int32_t)(halMillis() - softwareClockMillis);
+  
+  //set the RTC
+  writeRtcTime(ntpApplyTime);
+  setSoftwareClock(ntpApplyTime);
+  isClockDriftReferenceValid = false;    // the RTC was stepped, restart the drift measurement at the next resync
+  diagnostics.ntpSyncCount++;
+  logDebugMsg(ETHERNET_NTP_5, ETHERNET_NTP_5);
+  ntpState = NTP_IDLE;
+  
+  // show the time on the local LCD display
+  if (isLcdReady)
   {
-    ((unsigned char *)(&timeOfLastReset))[i] = EEPROM.read(EEPROMaddrForResetLog+i);
+    showUiPages(UI_PAGE_TIME, true);
   }
-  
-  return timeOfLastReset;
 }
 
-void displayTimeOfLastReset(void)
+// NTP fields are big endian
+uint32_t readNtpWord32(const byte *p)
 {
-  char timeStr[10];
-  DateTime timeOfLastReset;
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+uint16_t ntpFractionToMs(uint32_t fraction)
+{
+  return ((fraction >> 16) * 1000) >> 16;
+}
+
+// send an NTP request to the time server at the given address 
+void sendNTPpacket(IPAddress& address, byte *packetBuffer, uint32_t token)
+{
+  // set all bytes in the buffer to 0
+  memset(packetBuffer, 0, NTP_PACKET_SIZE); 
+  // Initialize values needed to form NTP request
+  // (see URL above for details on the packets)
+  packetBuffer[0] = 0b11100011;   // LI, Version, Mode
+  packetBuffer[1] = 0;     // Stratum, or type of clock
+  packetBuffer[2] = 6;     // Polling Interval
+  packetBuffer[3] = 0xEC;  // Peer Clock Precision
+  // 8 bytes of zero for Root Delay & Root Dispersion
+  packetBuffer[12]  = 49; 
+  packetBuffer[13]  = 0x4E;
+  packetBuffer[14]  = 49;
+  packetBuffer[15]  = 52;
+  // transmit timestamp, echoed back by the server
+  packetBuffer[40] = token >> 24;
+  packetBuffer[41] = token >> 16;
+  packetBuffer[42] = token >> 8;
+  packetBuffer[43] = token;
+
   
-  lcd.backlight();
-  lcd.clear();
-  lcd.setCursor(0,0); //Start at character 0 on line 0
-  lcd.print(F("unexpected reset"));
-  lcd.setCursor(0,1); //Start at character 0 on line 1
-  timeOfLastReset = readTimeOfLastResetFromEEPROM();
-  getTimeAsString(timeOfLastReset, timeStr, LONG_TIME_FORMAT);
-  lcd.print(timeStr);
-  delaySecsWithWatchdog(2);
-  lcd.noBacklight();
+  // all NTP fields have been given values, now
+  // you can send a packet requesting a timestamp:      
+  logDebugMsg(ETHERNET_NTP_6, ETHERNET_NTP_6);
+  halUdpBeginPacket(HAL_UDP_NTP, address, NTP_PORT); //NTP requests are to port 123
+  logDebugMsg(ETHERNET_NTP_7, ETHERNET_NTP_7);
+  halUdpWrite(HAL_UDP_NTP, packetBuffer,NTP_PACKET_SIZE);
+  logDebugMsg(ETHERNET_NTP_8, ETHERNET_NTP_8);
+  halUdpEndPacket(HAL_UDP_NTP); 
+  logDebugMsg(ETHERNET_NTP_9, ETHERNET_NTP_9);
 }
 
-boolean isButtonPress(void)
+// local time - UTC, in seconds.  Outside the first call of each year, just a comparison with the year's DST start and end
+int32_t getUtcOffsetInSecs(uint32_t utcTime)
 {
-  if (digitalRead(CAPTOUCH_BUTTON))
+  boolean isDst;
+  
+  if ((utcTime < timezoneYearStart) || (utcTime >= timezoneYearEnd))
   {
-    return true;
+    loadTimezoneYear(utcTime);
+  }
+  
+  if (dstStart < dstEnd)
+  {
+    isDst = (utcTime >= dstStart) && (utcTime < dstEnd);
   }
   else
   {
-    return false;
+    // southern hemisphere:  DST over the new year
+    isDst = (utcTime >= dstStart) || (utcTime < dstEnd);
   }
-}  
+  
+  return isDst ? daylightOffsetInSecs : standardOffsetInSecs;
+}
+
+// work out the DST start and end for the year of utcTime, from the local time zone's rule.  Valid thru 2099
+void loadTimezoneYear(uint32_t utcTime)
+{
+  TimezoneRule_t rule;
+  uint16_t year = DateTime(utcTime).year();
+  
+  memcpy_P(&rule, &timezoneRules[localTimezone], sizeof(rule));
+  timezoneYearStart = DateTime(year, 1, 1).unixtime();
+  timezoneYearEnd = DateTime(year + 1, 1, 1).unixtime();
+  standardOffsetInSecs = (int32_t)rule.standardOffsetInMins * 60;
+  daylightOffsetInSecs = standardOffsetInSecs + (int32_t)rule.dstOffsetInMins * 60;
+  
+  if (rule.dstOffsetInMins == 0)
+  {
+    // never DST
+    dstStart = 0;
+    dstEnd = 0;
+    return;
+  }
+  
+  dstStart = getDstTransition(year, rule.startMonth, rule.startWeek, rule.startDayOfWeek, rule.startHour, standardOffsetInSecs);
+  dstEnd = getDstTransition(year, rule.endMonth, rule.endWeek, rule.endDayOfWeek, rule.endHour, daylightOffsetInSecs);
+}
 
-boolean isProtoshieldButtonPress(void)
+// UTC of the week'th dayOfWeek of the month (week 5 is the last), at hour local time
+uint32_t getDstTransition(uint16_t year, uint8_t month, uint8_t week, uint8_t dayOfWeek, uint8_t hour, int32_t offsetInSecs)
 {
-  if (digitalRead(PROTOSHIELD_BUTTON) == LOW)
+  DateTime firstOfMonth(year, month, 1);
+  uint8_t daysInMonth;
+  uint8_t day;
+  
+  daysInMonth = (month == 12) ? 31 : (DateTime(year, month + 1, 1).unixtime() - firstOfMonth.unixtime()) / 86400UL;
+  day = 1 + ((7 + dayOfWeek - firstOfMonth.dayOfWeek()) % 7);
+  
+  if (week < 5)
   {
-    return true;
+    day += (week - 1) * 7;
   }
   else
   {
-    return false;
+    day += (day + 28 <= daysInMonth) ? 28 : 21;
   }
-}  
+  
+  return firstOfMonth.unixtime() + (uint32_t)(day - 1) * 86400UL + (uint32_t)hour * 3600UL - offsetInSecs;
+}
+
+void displayTime(DateTime& dateNow)
+{
+  char timeStr[TIME_STRING_SIZE];
+  
+  lcdFrame.clear();
+  lcdFrame.setCursor(0,0); //Start at character 0 on line 0
+  lcdFrame.print(F("Time is:"));
+  lcdFrame.setCursor(0,1); //Start at character 0 on line 1
+  getTimeAsString(dateNow, timeStr, LONG_TIME_FORMAT);
+  lcdFrame.print(timeStr);
+}
 
-boolean isNewHour(DateTime& dateNow)
+boolean isValidHour(DateTime& dateNow)
 {
-  if (prevHour != dateNow.hour())
+  if (dateNow.hour() <= 23)
   {
-    prevHour = dateNow.hour();
     return true;
   }
   else
@@ -603,554 +6664,429 @@ boolean isNewHour(DateTime& dateNow)
   }
 }
 
-boolean isNewMinute(DateTime& dateNow)
+// start the software clock from the RTC.  If the RTC reads don't agree, take one anyway, the next resync will fix it
+void initSoftwareClock(void)
 {
-  if (prevMinute != dateNow.minute())
-  {
-    prevMinute = dateNow.minute();
-    return true;
-  }
-  else
+  DateTime rtcTime;
+  
+  if (syncSoftwareClockFromRtc() == false)
   {
-    return false;
+    readRtcTime(&rtcTime);
+    setSoftwareClock(rtcTime.unixtime());
   }
 }
 
-void delaySecsWithWatchdog(uint16_t numSecDelay)
+// current time, without touching the I2C bus
+DateTime softwareClockNow(void)
 {
-  int i;
+  uint32_t elapsedMillis = halMillis() - softwareClockMillis;
   
-  for (i=0; i<numSecDelay; i++)
+  if (elapsedMillis >= 1000)
   {
-    delay (1000);
-    wdtCount = NUM_INTERVALS_TO_RESET;  // restore watchdog count
+    // whole seconds only, the remainder carries over to the next call
+    softwareClockTime += elapsedMillis / 1000;
+    softwareClockMillis += (elapsedMillis / 1000) * 1000;
+    softwareClockDateTime = DateTime(softwareClockTime + getUtcOffsetInSecs(softwareClockTime));
   }
+  
+  return softwareClockDateTime;
 }
 
-
-void initNightStats(void)
+// the software clock as UTC, for the RTC and the telemetry records
+uint32_t softwareClockUtc(void)
 {
-  nightStats.totalDistanceInCm = 0;
-  nightStats.dateTimeOfFirstRotationInDateTime = rtc.now();
-  nightStats.dateTimeOfLastRotationInDateTime = rtc.now();  
-};
+  softwareClockNow();
+  return softwareClockTime;
+}
 
-void saveNightStatsToEEPROM(void)
+// called from loop(), resyncs once a minute
+void serviceSoftwareClock(void)
 {
-  int i;
-  
-  for (i=0; i<sizeof(HedgieNightStats_t); i++)
+  if (halMillis() - softwareClockSyncMillis >= CLOCK_SYNC_INTERVAL_MS)
   {
-    EEPROM.write(EEPROMaddrForNightStats+i, ((unsigned char *)(&nightStats))[i]);
+    if (syncSoftwareClockFromRtc() == false)
+    {
+      // keep running on millis(), try again next minute
+      diagnostics.clockSyncFailureCount++;
+    }
   }
 }
 
-void loadNightStatsFromEEPROM(void)
+// Read the RTC CLOCK_SYNC_READS times, and use the time when two good reads agree to within a second.
+// Returns false when there's no majority, and the software clock is left alone.
+boolean syncSoftwareClockFromRtc(void)
 {
-  int i;
+  DateTime reads[CLOCK_SYNC_READS];
+  uint32_t rtcTime = 0;
+  boolean isValid[CLOCK_SYNC_READS];
+  boolean isAgreed = false;
+  int32_t driftInMs;
+  uint32_t elapsedMillis;
+  uint8_t i;
+  uint8_t j;
   
-  for (i=0; i<sizeof(HedgieNightStats_t); i++)
+  softwareClockSyncMillis = halMillis();
+  
+  for (i=0; i<CLOCK_SYNC_READS; i++)
   {
-    ((unsigned char *)(&nightStats))[i] = EEPROM.read(EEPROMaddrForNightStats+i);
+    isValid[i] = readRtcTime(&reads[i]) && isValidRtcTime(reads[i]);
   }
-}
-
-void handleButtonPress(DateTime& dateNow)
-{
-  char timeStr[10];
   
-  if (isButtonPress())
+  for (i=0; (i<CLOCK_SYNC_READS) && !isAgreed; i++)
   {
-    uint32_t km;
-    uint32_t kmFraction;
-    char timeStr[10];
-    
-    // check time to make sure we don't load overtop stats that have yet to be saved
-    if (dateNow.hour() >= 7 && dateNow.hour() < 22)
+    for (j=i+1; (j<CLOCK_SYNC_READS) && !isAgreed; j++)
     {
-      loadNightStatsFromEEPROM();
+      if (isValid[i] && isValid[j] && 
+          (reads[j].unixtime() - reads[i].unixtime() <= 1))
+      {
+        // the later read, reads[j] may have caught the seconds tick
+        rtcTime = reads[j].unixtime();
+        isAgreed = true;
+      }
     }
-    
-    lcd.backlight();
-    lcd.clear();
-    lcd.setCursor(0,0); 
-    lcd.print(F("km   start end")); 
-    
-    lcd.setCursor(0,1); 
-    convertCmsToKm(nightStats.totalDistanceInCm, &km, &kmFraction);  
-    lcd.print(km);  
-    lcd.print(F("."));  
-    lcd.print(kmFraction);  
-    lcd.setCursor(5,1); 
-    getTimeAsString(nightStats.dateTimeOfFirstRotationInDateTime, timeStr, SHORT_TIME_FORMAT);
-    lcd.print(timeStr);
-    lcd.setCursor(11,1); 
-    getTimeAsString(nightStats.dateTimeOfLastRotationInDateTime, timeStr, SHORT_TIME_FORMAT);
-    lcd.print(timeStr);
-    delaySecsWithWatchdog(4);
-    
-    // display temperature
-    lcd.clear();
-    lcd.setCursor(0,0); 
-    lcd.print(F("temperature")); 
-    lcd.setCursor(0,1);
-    lcd.print(tempsensor.readTempC());
-    delaySecsWithWatchdog(4);
-    
-    displayTime(dateNow);
-    
-    displayTimeOfLastReset();
-  
-    lcd.clear();
-    lcd.noBacklight();
-  }  
+  }
+  
+  if (isAgreed == false)
+  {
+    return false;
+  }
+  
+  // drift:  how far millis() has moved against the RTC since the reference, in parts per million
+  elapsedMillis = softwareClockSyncMillis - clockDriftReferenceMillis;
+  
+  if (isClockDriftReferenceValid && (elapsedMillis >= CLOCK_SYNC_INTERVAL_MS))
+  {
+    driftInMs = (int32_t)((rtcTime - clockDriftReferenceTime) * 1000) - (int32_t)elapsedMillis;
+    diagnostics.clockDriftPpm = (driftInMs * 1000) / (int32_t)(elapsedMillis / 1000);
+  }
+  
+  if (!isClockDriftReferenceValid || (elapsedMillis >= CLOCK_DRIFT_RESTART_MS))
+  {
+    clockDriftReferenceTime = rtcTime;
+    clockDriftReferenceMillis = softwareClockSyncMillis;
+    isClockDriftReferenceValid = true;
+  }
+  
+  if (rtcTime != softwareClockUtc())
+  {
+    setSoftwareClock(rtcTime);
+  }
+  
+  return true;
 }
 
-void flashLED(void)
+// after the RTC has been set (NTP), or from a good RTC read
+void setSoftwareClock(uint32_t unixTime)
 {
-#if 1
-  digitalWrite(GREEN_LED, HIGH); 
-  delay(300);
-  digitalWrite(GREEN_LED, LOW); 
-  delay(300);
-#endif  
+  softwareClockTime = unixTime;
+  softwareClockMillis = halMillis();
+  softwareClockDateTime = DateTime(softwareClockTime + getUtcOffsetInSecs(softwareClockTime));
 }
 
-void convertCmsToKm(uint32_t cms, uint32_t *km, uint32_t *kmFraction)
+// a read with a corrupted I2C transfer decodes to fields out of range
+boolean isValidRtcTime(DateTime& dateTime)
 {
-  *km = cms/(1000L*100L);
-  *kmFraction = (cms%(1000L*100L))/(100L*100L);
+  return ((dateTime.year() >= 2015) && (dateTime.year() <= 2099) &&
+          (dateTime.month() >= 1) && (dateTime.month() <= 12) &&
+          (dateTime.day() >= 1) && (dateTime.day() <= 31) &&
+          (dateTime.hour() <= 23) && (dateTime.minute() <= 59) && (dateTime.second() <= 59));
 }
 
-uint32_t convertCmsToM(uint32_t cms)
+// ================================================================================================================================
+// I2C layer.  The RTC, temperature sensor and LCD share one long bus, so every transaction is retried a few times, with a bus
+// recovery between attempts, and is counted per device.
+// ================================================================================================================================
+
+void initI2c(void)
 {
-  return cms/100L;
+  halI2cBegin();
 }
 
-// feed in DateTime...get back string with time, like "12:45 pm" or "3:45am"
-void getTimeAsString(DateTime& dateTime, char *timeBuf_p, TIME_FORMAT_t format)
+// The LCD acts on each byte it gets, so sending its EN pulses again after it got some of them puts it out of step.  An LCD write is
+// only retried when the address wasn't acked, otherwise the LCD is started over by the UI task
+boolean i2cWrite(I2C_DEVICE_t device, const uint8_t *data, uint8_t length)
 {
-  char *ampm;
-  uint8_t hour;
-  uint8_t minute;
- 
-  hour = dateTime.hour();
-  minute = dateTime.minute();
+  uint32_t startTimeInUs = halMicros();
+  boolean isSuccess = false;
+  boolean isRetryable = true;
+  uint8_t attempt;
+  uint8_t status;
   
-  if (hour == 12)
+  for (attempt=1; (attempt<=I2C_MAX_ATTEMPTS) && !isSuccess && isRetryable; attempt++)
   {
-    ampm = "PM";
-  }
-  else if(hour < 13)
-  {
-    ampm = "AM";
-    
-    // detect and correct when hour is between midnight and 1am
-    if (hour == 0)
+    if (attempt > 1)
     {
-      hour = 12;
+      recoverI2cBus();
     }
-  }
-  else
-  {
-    ampm = "PM";
-    hour = hour - 12;
+    
+    status = halI2cWrite(i2cDeviceAddress[device], data, length);
+    isSuccess = (status == 0);
+    isRetryable = (device != I2C_DEVICE_LCD) || (status == I2C_ADDRESS_NACK);
   }
   
-  if (format == LONG_TIME_FORMAT)
+  if ((isSuccess == false) && (isRetryable == false))
   {
-    sprintf(timeBuf_p, "%u:%.2u %s", hour, minute, ampm);
+    isLcdResyncNeeded = true;
+    lcdBeginStep = 0;
   }
-  else
-  {
-    // don't include the AM/PM in the time string
-    sprintf(timeBuf_p, "%u:%.2u", hour, minute);
-  }  
+  
+  recordI2cTransaction(device, attempt-1, isSuccess, startTimeInUs);
+  return isSuccess;
 }
 
-void constructTwitterMsg(char *twitterMsg)
+boolean i2cReadRegisters(I2C_DEVICE_t device, uint8_t reg, uint8_t *data, uint8_t length)
 {
-  char timeStartStr[15];
-  char timeEndStr[15];
-  uint32_t km;
-  uint32_t kmFraction;
-  DateTime timeNow;
-  uint8_t dayOfWeek;
-  uint8_t monthOfYear;
-  uint8_t dayOfMonth;
-  uint16_t year;
-
-  
-  timeNow = rtc.now();
-  dayOfWeek = timeNow.dayOfWeek();
-  dayOfMonth = timeNow.day();
-  monthOfYear = timeNow.month();
-  year = timeNow.year();
-  
-  // range checks to make sure string array lookups stay inbounds
-  if (dayOfWeek > 6)
-  {
-    dayOfWeek = 0;
-  }
+  uint32_t startTimeInUs = halMicros();
+  boolean isSuccess = false;
+  uint8_t attempt;
   
-  if (monthOfYear > 12)  // Note:  this is correct - in the DateTime class, the 1st Month is "1", but the first DayOfWeek is "0"
+  for (attempt=1; (attempt<=I2C_MAX_ATTEMPTS) && !isSuccess; attempt++)
   {
-    monthOfYear = 1;
+    if (attempt > 1)
+    {
+      recoverI2cBus();
+    }
+    
+    isSuccess = halI2cRead(i2cDeviceAddress[device], reg, data, length);
   }
   
-  convertCmsToKm(nightStats.totalDistanceInCm, &km, &kmFraction);  
-  getTimeAsString(nightStats.dateTimeOfFirstRotationInDateTime, timeStartStr, LONG_TIME_FORMAT);
-  getTimeAsString(nightStats.dateTimeOfLastRotationInDateTime, timeEndStr, LONG_TIME_FORMAT);
-  logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_5, ETHERNET_CONNECT_TO_THINGSPEAK_5);
-  
-  // build twitter string
-  sprintf(twitterMsg, "%s%s%sSir Charles update for %s %s %u %u:  Distance ran last night: %lu.%lu km,  Start: %s,  Finish: %s   #runhedgie", 
-     "api_key=",
-     thingtweetAPIKey,
-     "&status=",
-     dayOfWeekStr[dayOfWeek], 
-     monthStr[monthOfYear-1],  // Jan = 1, but index needs to be zero for string lookup
-     dayOfMonth, 
-     year, 
-     km, 
-     kmFraction, 
-     timeStartStr, 
-     timeEndStr);
-     
-  logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_6, ETHERNET_CONNECT_TO_THINGSPEAK_6);
-
-  //Serial.println(twitterMsg);
-  //Serial.println(strlen(twitterMsg));
+  recordI2cTransaction(device, attempt-1, isSuccess, startTimeInUs);
+  return isSuccess;
 }
 
-void blinkLed(int numberBlinks)
+void recordI2cTransaction(I2C_DEVICE_t device, uint8_t attempts, boolean isSuccess, uint32_t startTimeInUs)
 {
-  int i;
+  I2cDeviceStats_t *stats = &diagnostics.i2cStats[device];
+  uint32_t latencyInUs = halMicros() - startTimeInUs;
   
-  for (i=0; i<numberBlinks; i++)
+  stats->transactionCount++;
+  stats->retryCount += attempts - 1;
+  
+  if (isSuccess == false)
   {
-    flashLED();
+    stats->failureCount++;
   }
   
-  delaySecsWithWatchdog(2);
+  if (latencyInUs > stats->maxLatencyInUs)
+  {
+    stats->maxLatencyInUs = min(latencyInUs, 0xFFFF);
+  }
 }
 
-void tweetNightStats(void)
+// a slave cut off mid byte can hold SDA low forever, see halI2cRecoverBus()
+void recoverI2cBus(void)
 {
-  char twitterMsg[200];
-   
-  constructTwitterMsg(twitterMsg);
-  updateTwitterStatus(twitterMsg);
+  diagnostics.i2cBusRecoveryCount++;
+  halI2cRecoverBus();
 }
 
-void updateTwitterStatus(char *twitterMsg)
+// DS1307 time registers 0-6, BCD.  A read that doesn't decode to a real time is retried like a bus error
+boolean readRtcTime(DateTime *dateTime)
 {
-  //Serial.println(F("connecting..."));
+  uint8_t regs[7];
+  uint8_t attempt;
   
-  if (client.connect(thingspeeakServer, 80)) 
+  for (attempt=0; attempt<I2C_MAX_ATTEMPTS; attempt++)
   {
-    client.print("POST /apps/thingtweet/1/statuses/update HTTP/1.1\n");
-    client.print("Host: api.thingspeak.com\n");
-    client.print("Connection: close\n");
-    client.print("Content-Type: application/x-www-form-urlencoded\n");
-    client.print("Content-Length: ");
-    client.print(strlen(twitterMsg));
-    client.print("\n\n");
-    client.print(twitterMsg);
-    
-    logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_OK_1, ETHERNET_CONNECT_TO_THINGSPEAK_OK_1);
-
-    
-    if (client.connected())
+    if (i2cReadRegisters(I2C_DEVICE_RTC, 0, regs, sizeof(regs)) == false)
     {
-      //Serial.println(F("Connected to ThingSpeak..."));
-      //Serial.println();
-      logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_OK_2, ETHERNET_CONNECT_TO_THINGSPEAK_OK_2);
-      
+      return false;
     }
-    else
+    
+    regs[0] &= 0x7F;    // clock halt bit
+    
+    *dateTime = DateTime(2000 + bcdToBin(regs[6]), bcdToBin(regs[5]), bcdToBin(regs[4]), 
+                         bcdToBin(regs[2]), bcdToBin(regs[1]), bcdToBin(regs[0]));
+    
+    if (isValidBcd(regs[0], 59) && isValidBcd(regs[1], 59) && isValidBcd(regs[2], 23) && 
+        isValidBcd(regs[4], 31) && (regs[4] != 0) && isValidBcd(regs[5], 12) && (regs[5] != 0) && isValidBcd(regs[6], 99))
     {
-      //Serial.println(F("Connection to ThingSpeak failed"));   
-      //Serial.println();
-      logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_2, ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_2);
+      return true;
     }
-  } 
-  else 
-  {
-    //Serial.println(F("Connection to ThingSpeak failed"));   
-    //Serial.println();
-    logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_1, ETHERNET_CONNECT_TO_THINGSPEAK_FAILED_1);
+    
+    diagnostics.i2cStats[I2C_DEVICE_RTC].rangeErrorCount++;
   }
   
-  //Serial.println(F("...disconnecting"));
-  //Serial.println();
-  
-  logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_3, ETHERNET_CONNECT_TO_THINGSPEAK_3);
-
-  client.stop();
-  
-  logDebugMsg(ETHERNET_CONNECT_TO_THINGSPEAK_4, ETHERNET_CONNECT_TO_THINGSPEAK_4);
+  return false;
 }
 
-void sendDataToSparkFun(DateTime& dateNow, uint32_t distanceRunIntervalInCm)
+boolean writeRtcTime(uint32_t unixTime)
 {
-  char distanceInCmAsString[10];
-  char timeAsString[10];
-  
-  // Make a TCP connection to remote host
-  if (client.connect(sparkfunServer, 80))
-  {
-    // Post the data! Request should look a little something like:
-    // GET /input/publicKey?private_key=privateKey&light=1024&switch=0&name=Jim HTTP/1.1\n
-    // Host: data.sparkfun.com\n
-    // Connection: close\n
-    // \n
-    
-    // format
-    // http://data.sparkfun.com/input/[publicKey]?private_key=[privateKey]&distanceInCm=[value]&time=[value]
-    
-    client.print("GET /input/");
-    client.print(publicKey);
-    client.print("?private_key=");
-    client.print(privateKey);
-    
-    client.print("&");
-    client.print("distanceInCm");
-    client.print("=");
-    
-    // convert distance to string
-    sprintf(distanceInCmAsString, "%lu", distanceRunIntervalInCm);
-    client.print(distanceInCmAsString);
-    
-    client.print("&");
-    client.print("time");
-    client.print("=");
-    
-    // human readable time
-    getTimeAsString(dateNow, timeAsString, SHORT_TIME_FORMAT);
-    client.print(timeAsString);
-    
-    client.println(" HTTP/1.1");
-    client.print("Host: ");
-    client.println(sparkfunServer);
-    client.println("Connection: close");
-    client.println();
-  }
-  else
-  {
-    // Serial.println(F("Connection failed"));
-  } 
-  
-  // Check for a response from the server, and route it
-  // out the serial port.
-  while (client.connected())
-  {
-    if ( client.available() )
-    {
-      char c = client.read();
-      // Serial.print(c);
-    }      
-  }
+  DateTime dateTime(unixTime);
+  uint8_t data[8];
   
-  // Serial.println();
-  client.stop();
+  data[0] = 0;    // register address
+  data[1] = binToBcd(dateTime.second());    // also clears the clock halt bit
+  data[2] = binToBcd(dateTime.minute());
+  data[3] = binToBcd(dateTime.hour());      // 24 hour mode
+  data[4] = dateTime.dayOfWeek() + 1;       // DS1307 counts days 1-7
+  data[5] = binToBcd(dateTime.day());
+  data[6] = binToBcd(dateTime.month());
+  data[7] = binToBcd(dateTime.year() - 2000);
+  return i2cWrite(I2C_DEVICE_RTC, data, sizeof(data));
 }
 
-void setupEthernet()
+boolean isValidBcd(uint8_t value, uint8_t maxValue)
 {
-  // Serial.println(F("Connecting Arduino to network..."));
-  // Serial.println();  
+  return (((value & 0x0F) <= 9) && ((value >> 4) <= 9) && (bcdToBin(value) <= maxValue));
+}
 
-  delaySecsWithWatchdog(1);
-  
-  // start the Ethernet connection:
-  if (Ethernet.begin(mac) == 0) 
-  {
-    // Serial.println(F("DHCP Failed, reset Arduino to try again"));
-    // Serial.println();
-    logDebugMsg(ETHERNET_DHCP_FAILED, ETHERNET_DHCP_FAILED);
-  } 
-  else
-  {
-    // Serial.println(F("Arduino connected to network using DHCP"));
-    // Serial.println();
-    logDebugMsg(ETHERNET_DHCP_OK, ETHERNET_DHCP_OK);
-  } 
-  
-  // Serial.print(F("My IP address: "));
-  // Serial.println(Ethernet.localIP());
+uint8_t bcdToBin(uint8_t value)
+{
+  return value - 6 * (value >> 4);
+}
 
-  // give the Ethernet shield a second to initialize:
-  delaySecsWithWatchdog(1);
+uint8_t binToBcd(uint8_t value)
+{
+  return value + 6 * (value / 10);
 }
 
-void updateRtcUsingNTP(void)
+// MCP9808 ambient temperature register:  sign and 8.4 fixed point degrees in the low 13 bits
+boolean readTemperature(float *temperatureInC)
 {
-  DateTime dateNow;
+  uint8_t regs[2];
+  int16_t sixteenths;
+  
+  if (i2cReadRegisters(I2C_DEVICE_TEMPERATURE, MCP9808_REG_AMBIENT_TEMP, regs, sizeof(regs)) == false)
+  {
+    return false;
+  }
   
-  digitalWrite(GREEN_LED, HIGH); 
+  sixteenths = ((regs[0] & 0x0F) << 8) | regs[1];
   
-  Udp.begin(localPort);
-  //get the NTP timestamp
-  epoch = getNTP();
-  //set the RTC
-  rtc.adjust(epoch);
+  if (regs[0] & 0x10)
+  {
+    sixteenths -= 4096;
+  }
   
-  digitalWrite(GREEN_LED, LOW); 
+  *temperatureInC = sixteenths / 16.0;
   
-  // show the time on the local LCD display
-  dateNow = rtc.now();
-  displayTime(dateNow);
+  if ((*temperatureInC < -40) || (*temperatureInC > 125))
+  {
+    // outside the sensor's range
+    diagnostics.i2cStats[I2C_DEVICE_TEMPERATURE].rangeErrorCount++;
+    return false;
+  }
+  
+  return true;
 }
 
-unsigned long getNTP() 
+// HD44780 in 4 bit mode, behind the PCF8574 backpack
+// Initializes the LCD for 16 chars 2 lines, and turns on the backlight.  One step a call, at least LCD_BEGIN_STEP_MS apart:  the
+// reset and the clear take the LCD 4.5ms and 2ms, which are waited out between UI passes instead of in one.  True when it's done
+boolean serviceLcdBegin(void)
 {
-  int packetSize;
-  unsigned long epoch;
-  byte packetBuffer[NTP_PACKET_SIZE];  //Buffer to hold incoming and outgoing packets
-  DNSClient dns;
-
-  dns.begin(Ethernet.dnsServerIP());
-  logDebugMsg(ETHERNET_NTP_10, ETHERNET_NTP_10);
+  uint32_t nowMillis = halMillis();
   
-  if(dns.getHostByName("pool.ntp.org",timeServer)) 
-  {
-    //Serial.print(F("NTP server ip :"));
-    //Serial.println(timeServer);
-    logDebugMsg(ETHERNET_NTP_11, ETHERNET_NTP_11);
-  }
-  else 
+  if ((nowMillis < LCD_POWER_UP_MS) || (nowMillis - lcdBeginStepMillis < LCD_BEGIN_STEP_MS))
   {
-    //Serial.print(F("dns lookup failed"));
-    logDebugMsg(ETHERNET_NTP_12, ETHERNET_NTP_12);
+    // LCD power up, usually long over by the time the UI task gets here
+    return false;
   }
   
-  logDebugMsg(ETHERNET_NTP_1, ETHERNET_NTP_1);
-  sendNTPpacket(timeServer, packetBuffer); // send an NTP packet to a time server
-  logDebugMsg(ETHERNET_NTP_2, ETHERNET_NTP_2);
-
-  delaySecsWithWatchdog(1);
-  packetSize = Udp.parsePacket();
-  logDebugMsg(ETHERNET_NTP_3, ETHERNET_NTP_3);
+  lcdBeginStepMillis = nowMillis;
   
-  if(packetSize)
+  switch (lcdBeginStep)
   {
-    // We've received a packet, read the data from it
-    Udp.read(packetBuffer,NTP_PACKET_SIZE);  // read the packet into the buffer
-    logDebugMsg(ETHERNET_NTP_4, ETHERNET_NTP_4);
-    
-    //the timestamp starts at byte 40 of the received packet and is four bytes,
-    // or two words, long. First, esxtract the two words:
-
-    unsigned long highWord = word(packetBuffer[40], packetBuffer[41]);
-    unsigned long lowWord = word(packetBuffer[42], packetBuffer[43]);  
-    // combine the four bytes (two words) into a long integer
-    // this is NTP time (seconds since Jan 1 1900):
-    unsigned long secsSince1900 = highWord << 16 | lowWord;  
-
-    // Unix time starts on Jan 1 1970. In seconds, that's 2208988800:
-    const unsigned long seventyYears = 2208988800UL;     
-    // subtract seventy years:
-    epoch = secsSince1900 - seventyYears;  
-    epoch = epoch - TZ_OFFSET;
-    epoch = epoch + dstOffset(epoch);  //Adjust for DST
-    
-    return epoch;
-    logDebugMsg(ETHERNET_NTP_5, ETHERNET_NTP_5);
+    case 0:
+    case 1:
+      // reset into 4 bit mode
+      lcdSendNibble(0x03);
+      break;
+      
+    case 2:
+      lcdSendNibble(0x03);
+      halDelayMicros(150);
+      lcdSendNibble(0x02);
+      lcdSend(0x28, 0);    // 2 lines, 5x8 font
+      lcdSend(0x0C, 0);    // display on, no cursor
+      lcdSend(0x06, 0);    // cursor moves right
+      break;
+      
+    case 3:
+      lcdClear();
+      lcdSetBacklight(true);
+      break;
+      
+    default:
+      lcdBeginStep = 0;
+      return true;
   }
+  
+  lcdBeginStep++;
+  return false;
 }
 
-// send an NTP request to the time server at the given address 
-void sendNTPpacket(IPAddress& address, byte *packetBuffer)
+// the LCD is busy for LCD_CLEAR_TIME_IN_US after
+void lcdClear(void)
 {
-  // set all bytes in the buffer to 0
-  memset(packetBuffer, 0, NTP_PACKET_SIZE); 
-  // Initialize values needed to form NTP request
-  // (see URL above for details on the packets)
-  packetBuffer[0] = 0b11100011;   // LI, Version, Mode
-  packetBuffer[1] = 0;     // Stratum, or type of clock
-  packetBuffer[2] = 6;     // Polling Interval
-  packetBuffer[3] = 0xEC;  // Peer Clock Precision
-  // 8 bytes of zero for Root Delay & Root Dispersion
-  packetBuffer[12]  = 49; 
-  packetBuffer[13]  = 0x4E;
-  packetBuffer[14]  = 49;
-  packetBuffer[15]  = 52;
+  lcdSend(0x01, 0);
+  lcdCursorCol = 0;
+  lcdCursorRow = 0;
+}
 
-  
-  // all NTP fields have been given values, now
-  // you can send a packet requesting a timestamp:      
-  logDebugMsg(ETHERNET_NTP_6, ETHERNET_NTP_6);
-  Udp.beginPacket(address, 123); //NTP requests are to port 123
-  logDebugMsg(ETHERNET_NTP_7, ETHERNET_NTP_7);
-  Udp.write(packetBuffer,NTP_PACKET_SIZE);
-  logDebugMsg(ETHERNET_NTP_8, ETHERNET_NTP_8);
-  Udp.endPacket(); 
-  logDebugMsg(ETHERNET_NTP_9, ETHERNET_NTP_9);
+void lcdSetCursor(uint8_t col, uint8_t row)
+{
+  lcdSend(0x80 | ((row * 0x40) + col), 0);
 }
 
-int dstOffset (DateTime time)
-{
-  //Receives unix epoch time and returns seconds of offset for local DST
-  //Valid thru 2099 for US only, Calculations from "http://www.webexhibits.org/daylightsaving/i.html"
-  //Code idea from jm_wsb @ "http://forum.arduino.cc/index.php/topic,40286.0.html"
-  //Get epoch times @ "http://www.epochconverter.com/" for testing
-  //DST update wont be reflected until the next time sync
-  int beginDSTDay = (14 - (1 + time.year() * 5 / 4) % 7);  
-  int beginDSTMonth=3;
-  int endDSTDay = (7 - (1 + time.year() * 5 / 4) % 7);
-  int endDSTMonth=11;
-  if (((time.month() > beginDSTMonth) && (time.month() < endDSTMonth))
-    || ((time.month() == beginDSTMonth) && (time.day() > beginDSTDay))
-    || ((time.month() == beginDSTMonth) && (time.day() == beginDSTDay) && (time.hour() >= 2))
-    || ((time.month() == endDSTMonth) && (time.day() < endDSTDay))
-    || ((time.month() == endDSTMonth) && (time.day() == endDSTDay) && (time.hour() < 1)))
-    return (3600);  //Add back in one hours worth of seconds - DST in effect
-  else
-    return (0);  //NonDST
+void lcdWrite(uint8_t c)
+{
+  lcdSend(c, LCD_RS);
 }
 
-void displayTime(DateTime& dateNow)
+void lcdSetBacklight(boolean isOn)
+{
+  lcdBacklight = isOn ? LCD_BACKLIGHT : 0;
+  i2cWrite(I2C_DEVICE_LCD, &lcdBacklight, 1);
+}
+
+// a command or character, both nibbles in one I2C transaction
+void lcdSend(uint8_t value, uint8_t mode)
 {
-  char timeStr[10];
+  uint8_t data[4];
+  uint8_t high = (value & 0xF0) | mode | lcdBacklight;
+  uint8_t low = (value << 4) | mode | lcdBacklight;
   
-  lcd.backlight();
-  lcd.clear();
-  lcd.setCursor(0,0); //Start at character 0 on line 0
-  lcd.print(F("Time is:"));
-  lcd.setCursor(0,1); //Start at character 0 on line 1
-  getTimeAsString(dateNow, timeStr, LONG_TIME_FORMAT);
-  lcd.print(timeStr);
-  delaySecsWithWatchdog(2);
-  lcd.noBacklight();
+  data[0] = high | LCD_EN;
+  data[1] = high;
+  data[2] = low | LCD_EN;
+  data[3] = low;
+  i2cWrite(I2C_DEVICE_LCD, data, sizeof(data));
 }
 
-boolean isValidHour(DateTime& dateNow)
+// only used while the LCD is still in 8 bit mode, at power up
+void lcdSendNibble(uint8_t nibble)
 {
-  if (dateNow.hour() <= 23)
-  {
-    return true;
-  }
-  else
-  {
-    return false;
-  }
+  uint8_t data[2];
+  
+  data[0] = (nibble << 4) | lcdBacklight | LCD_EN;
+  data[1] = (nibble << 4) | lcdBacklight;
+  i2cWrite(I2C_DEVICE_LCD, data, sizeof(data));
 }
 
-int freeRam () 
+// transactions/retries/failures/range errors/worst latency in us
+void writeI2cStats(const __FlashStringHelper *name, I2cDeviceStats_t *stats, Print& out)
 {
-  extern int __heap_start, *__brkval; 
-  int v; 
-  return (int) &v - (__brkval == 0 ? (int) &__heap_start : (int) __brkval); 
+  out.print(name);
+  out.print(stats->transactionCount);
+  out.print('/');
+  out.print(stats->retryCount);
+  out.print('/');
+  out.print(stats->failureCount);
+  out.print('/');
+  out.print(stats->rangeErrorCount);
+  out.print('/');
+  out.print(stats->maxLatencyInUs);
 }
 
-ISR(WDT_vect) 
-{ // Watchdog interrupt @ 8 sec. interval
+// watchdog interrupt, every 8 seconds.  loop() restores the count, so it only runs out when loop() hangs
+void watchdogInterrupt(void)
+{
   if(!--wdtCount) 
   { // Decrement sleep interval counter...
     // If it reaches zero, force a processor reset
-    wdt_enable(WDTO_15MS); // turn on the WatchDog and allow it to fire
-    while(1);
+    halReset();
   }
 }
 
@@ -0,0 +1,166 @@
+// Bout tracking cost against the length of the night:  host CPU time per updateBouts() (every counted rotation) and per endBout()
+// (every bout), for synthetic nights from an hour of running to 100 nights without a reset.  Both should be flat, as neither
+// looks at more than the running bout and the NUM_TOP_BOUTS kept.
+//
+// "random" bouts are 5 to 604 rotations.  In "rising" nights each bout is longer than the last, so every endBout() inserts at the
+// top of the list and moves all of it:  the worst case.  Rotations are a second apart, bouts 60s apart.  The simulated clock is
+// set straight to each rotation, nothing else runs in between.  Each night is run BENCH_REPEATS times, and the fastest run kept
+
+#include <chrono>
+#include "sketch.h"
+#include "test.h"
+
+#define BENCH_START_TIME (1717304400UL)         // 2024-06-02 05:00 UTC, 10pm Pacific
+#define BENCH_PERIOD_IN_US (1000000ULL)
+#define BENCH_BOUT_GAP_IN_US (60000000ULL)
+#define BENCH_MAX_RANDOM_BOUT (600)
+#define BENCH_REPEATS (5)
+#define BENCH_MAX_GROWTH (2)                    // the longest night against the shortest, per call
+
+typedef struct
+{
+  const char *name;
+  uint32_t rotations;
+  bool isRising;
+} BenchNight_t;
+
+static const BenchNight_t benchNights[] =
+{
+  { "an hour, random", 3600, false },
+  { "a night, random", 32400, false },
+  { "100 nights, random", 3240000, false },
+  { "an hour, rising", 3600, true },
+  { "a night, rising", 32400, true },
+  { "100 nights, rising", 3240000, true },
+};
+
+typedef struct
+{
+  uint32_t bouts;
+  uint64_t updateTimeInNs;
+  uint64_t endTimeInNs;
+  uint16_t topDurationsInSecs[NUM_TOP_BOUTS];
+} BenchResult_t;
+
+static uint64_t getTimeInNs(void)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// keeps the longest durations seen, to check the sketch's list with
+static void addTopDuration(BenchResult_t *result, uint16_t durationInSecs)
+{
+  uint8_t i = NUM_TOP_BOUTS;
+
+  while ((i > 0) && (durationInSecs > result->topDurationsInSecs[i-1]))
+  {
+    if (i < NUM_TOP_BOUTS)
+    {
+      result->topDurationsInSecs[i] = result->topDurationsInSecs[i-1];
+    }
+
+    i--;
+  }
+
+  if (i < NUM_TOP_BOUTS)
+  {
+    result->topDurationsInSecs[i] = durationInSecs;
+  }
+}
+
+static void runNight(const BenchNight_t *night, BenchResult_t *result)
+{
+  uint32_t rotations = 0;
+  uint32_t boutRotations;
+  uint32_t i;
+  uint64_t startInNs;
+
+  memset(result, 0, sizeof(*result));
+  initBouts();
+  srand(1);
+
+  while (rotations < night->rotations)
+  {
+    boutRotations = night->isRising ? (BOUT_MIN_ROTATIONS + result->bouts) :
+                                      (BOUT_MIN_ROTATIONS + (rand() % BENCH_MAX_RANDOM_BOUT));
+    boutRotations = min(boutRotations, night->rotations - rotations);
+    rotations += boutRotations;
+
+    // the first rotation of a bout comes after the gap
+    simTimeInUs += BENCH_BOUT_GAP_IN_US;
+    startInNs = getTimeInNs();
+    updateBouts(BENCH_BOUT_GAP_IN_US, false);
+
+    for (i=1; i<boutRotations; i++)
+    {
+      simTimeInUs += BENCH_PERIOD_IN_US;
+      updateBouts(BENCH_PERIOD_IN_US, true);
+    }
+
+    result->updateTimeInNs += getTimeInNs() - startInNs;
+
+    // as endIdleBout() would, once the gap is up
+    startInNs = getTimeInNs();
+    endBout();
+    result->endTimeInNs += getTimeInNs() - startInNs;
+
+    if (boutRotations >= BOUT_MIN_ROTATIONS)
+    {
+      result->bouts++;
+      addTopDuration(result, boutRotations - 1);
+    }
+  }
+
+  // the sketch kept the same bouts
+  CHECK_EQUAL(result->bouts, diagnostics.boutCount);
+
+  for (i=0; i<NUM_TOP_BOUTS; i++)
+  {
+    CHECK_EQUAL(result->topDurationsInSecs[i], diagnostics.topBouts[i].durationInSecs);
+  }
+}
+
+int main(void)
+{
+  BenchResult_t result;
+  BenchResult_t best;
+  double updateNsPerCall[sizeof(benchNights)/sizeof(benchNights[0])];
+  double endNsPerCall[sizeof(benchNights)/sizeof(benchNights[0])];
+  uint8_t n;
+  uint8_t repeat;
+
+  simInit(BENCH_START_TIME);
+  setup();
+  printf("%-20s %9s %6s %14s %11s\n", "", "rotations", "bouts", "ns/updateBouts", "ns/endBout");
+
+  for (n=0; n<sizeof(benchNights)/sizeof(benchNights[0]); n++)
+  {
+    memset(&best, 0, sizeof(best));
+
+    for (repeat=0; repeat<BENCH_REPEATS; repeat++)
+    {
+      runNight(&benchNights[n], &result);
+
+      if ((repeat == 0) || (result.updateTimeInNs + result.endTimeInNs < best.updateTimeInNs + best.endTimeInNs))
+      {
+        best = result;
+      }
+    }
+
+    updateNsPerCall[n] = (double)best.updateTimeInNs / benchNights[n].rotations;
+    endNsPerCall[n] = (double)best.endTimeInNs / best.bouts;
+    printf("%-20s %9u %6u %14.1f %11.1f\n", benchNights[n].name, benchNights[n].rotations, best.bouts, updateNsPerCall[n],
+           endNsPerCall[n]);
+  }
+
+  // the 100 nights against the hour, for both kinds of night
+  for (n=0; n<sizeof(benchNights)/sizeof(benchNights[0]); n+=3)
+  {
+    CHECK(updateNsPerCall[n + 2] <= BENCH_MAX_GROWTH * updateNsPerCall[n]);
+    CHECK(endNsPerCall[n + 2] <= BENCH_MAX_GROWTH * endNsPerCall[n]);
+  }
+
+  printf("host CPU time, endBout() including the timer read\n");
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
@@ -0,0 +1,251 @@
+// Wheel detector accuracy on wheel sensor traces read from files:  each trace is replayed through the ADC sampling interrupt
+// (setupWheelSampling(), then processWheelSample() on every sample), once with each detector.  The rotations it queues are matched
+// to the trace's mirror passes:  a pass with none is missed, each one past the first is counted twice.  The first pass only finds
+// the mirror, as at 10pm, and isn't scored.
+//
+// Passes are grouped by speed, into the speeds of the DETECTION_BENCHMARK build, and "max rpm" is the fastest group counted
+// without errors with all the slower ones.  The trace format is in traces/sprint.trace.  With no arguments, the traces in
+// benchTraces[] are run, and the adaptive detector's results checked against them:  lamp.trace has the pass as the lamp goes off
+// missed, as the mirror level takes a pass to come down
+
+#include <fstream>
+#include <sstream>
+#include "sketch.h"
+#include "test.h"
+
+#define BENCH_NUM_SPEEDS (12)
+#define BENCH_STEP_IN_US (1000)             // the rotation buffer is emptied this often
+#define BENCH_SETTLE_IN_US (1000000ULL)     // run past the end of the trace
+
+// the adaptive detector's worst results on the trace
+typedef struct
+{
+  const char *fileName;
+  uint16_t minMaxSpeedInRpm;
+  uint32_t maxErrors;
+} BenchTrace_t;
+
+static const BenchTrace_t benchTraces[] =
+{
+  { "traces/sprint.trace", 1000, 0 },
+  { "traces/lamp.trace", 0, 1 },
+};
+
+static const uint16_t benchSpeedsInRpm[BENCH_NUM_SPEEDS] = { 30, 60, 100, 150, 200, 300, 400, 600, 800, 1000, 1200, 1500 };
+static const char *detectorNames[] = { "fixed", "adaptive" };
+
+typedef struct
+{
+  std::vector<std::pair<uint64_t, int> > points;
+  std::vector<uint64_t> passes;             // start of each mirror pass
+} Trace_t;
+
+typedef struct
+{
+  uint32_t missed[BENCH_NUM_SPEEDS];
+  uint32_t doubleCounted[BENCH_NUM_SPEEDS];
+  uint32_t passes[BENCH_NUM_SPEEDS];
+} BenchResult_t;
+
+static bool loadTrace(const char *fileName, Trace_t *trace)
+{
+  std::ifstream file(fileName);
+  std::string line;
+  std::string word;
+  uint64_t timeInUs;
+  int level;
+
+  if (file.is_open() == false)
+  {
+    return false;
+  }
+
+  while (std::getline(file, line))
+  {
+    std::istringstream fields(line);
+
+    if (line.empty() || (line[0] == '#'))
+    {
+      continue;
+    }
+
+    if (line.compare(0, 9, "rotation ") == 0)
+    {
+      fields >> word >> timeInUs;
+      trace->passes.push_back(timeInUs);
+    }
+    else if (fields >> timeInUs >> level)
+    {
+      trace->points.push_back(std::make_pair(timeInUs, level));
+    }
+  }
+
+  return (trace->points.empty() == false) && (trace->passes.size() > 2);
+}
+
+// the slowest group the speed is at least
+static uint8_t getSpeedGroup(uint64_t periodInUs)
+{
+  uint32_t speedInRpm = 60000000ULL / max(periodInUs, (uint64_t)1);
+  uint8_t group = 0;
+
+  while ((group + 1 < BENCH_NUM_SPEEDS) && (speedInRpm >= benchSpeedsInRpm[group + 1]))
+  {
+    group++;
+  }
+
+  return group;
+}
+
+static void runTrace(const Trace_t *trace, WHEEL_DETECTOR_t detector, BenchResult_t *result)
+{
+  std::vector<uint64_t> detections;
+  uint64_t endInUs = trace->points.back().first + BENCH_SETTLE_IN_US;
+  uint64_t windowStartInUs;
+  uint64_t windowEndInUs;
+  uint64_t periodInUs;
+  uint32_t rotationTimeInUs;
+  uint32_t count;
+  uint8_t group;
+  size_t pass;
+  size_t i = 0;
+
+  memset(result, 0, sizeof(*result));
+  simInit(0);
+  simLoadTrace(trace->points);
+  wheelDetector = detector;
+  setupWheelSampling();
+
+  while (simTimeInUs < endInUs)
+  {
+    simAdvance(BENCH_STEP_IN_US);
+
+    while (rotationBufferPop(&rotationTimeInUs))
+    {
+      detections.push_back(rotationTimeInUs);
+    }
+  }
+
+  // each pass has from halfway to the one before, to halfway to the next.  Detections before the second pass are the first
+  // pass's, or noise before it
+  for (pass=1; pass<trace->passes.size(); pass++)
+  {
+    periodInUs = (pass + 1 < trace->passes.size()) ? trace->passes[pass + 1] - trace->passes[pass] :
+                                                     trace->passes[pass] - trace->passes[pass - 1];
+    windowStartInUs = (trace->passes[pass - 1] + trace->passes[pass]) / 2;
+    windowEndInUs = (pass + 1 < trace->passes.size()) ? (trace->passes[pass] + trace->passes[pass + 1]) / 2 : endInUs;
+    group = getSpeedGroup(periodInUs);
+
+    while ((i < detections.size()) && (detections[i] < windowStartInUs))
+    {
+      i++;
+    }
+
+    for (count=0; (i < detections.size()) && (detections[i] < windowEndInUs); i++)
+    {
+      count++;
+    }
+
+    result->passes[group]++;
+    result->missed[group] += (count == 0) ? 1 : 0;
+    result->doubleCounted[group] += (count > 1) ? count - 1 : 0;
+  }
+}
+
+// the fastest group with no errors in it or any slower one.  0:  errors from the start
+static uint16_t getMaxSpeedInRpm(const BenchResult_t *result)
+{
+  uint16_t maxSpeedInRpm = 0;
+  uint8_t group;
+
+  for (group=0; group<BENCH_NUM_SPEEDS; group++)
+  {
+    if ((result->missed[group] != 0) || (result->doubleCounted[group] != 0))
+    {
+      break;
+    }
+
+    if (result->passes[group] != 0)
+    {
+      maxSpeedInRpm = benchSpeedsInRpm[group];
+    }
+  }
+
+  return maxSpeedInRpm;
+}
+
+// runs both detectors, and returns the adaptive one's errors and max rpm
+static void runTraceFile(const char *fileName, uint32_t *errors, uint16_t *maxSpeedInRpm)
+{
+  Trace_t trace;
+  BenchResult_t result;
+  uint32_t missed;
+  uint32_t doubleCounted;
+  uint8_t detector;
+  uint8_t group;
+
+  if (loadTrace(fileName, &trace) == false)
+  {
+    printf("%s:  can't read the trace\n", fileName);
+    testFailures++;
+    return;
+  }
+
+  for (detector=FIXED_THRESHOLD_DETECTOR; detector<=ADAPTIVE_THRESHOLD_DETECTOR; detector++)
+  {
+    runTrace(&trace, (WHEEL_DETECTOR_t)detector, &result);
+    missed = 0;
+    doubleCounted = 0;
+
+    for (group=0; group<BENCH_NUM_SPEEDS; group++)
+    {
+      missed += result.missed[group];
+      doubleCounted += result.doubleCounted[group];
+    }
+
+    *errors = missed + doubleCounted;
+    *maxSpeedInRpm = getMaxSpeedInRpm(&result);
+    printf("%-22s %-9s %6u %7u %7u %8u\n", fileName, detectorNames[detector], (unsigned)trace.passes.size() - 1, missed,
+           doubleCounted, *maxSpeedInRpm);
+
+    // the errors by speed
+    for (group=0; group<BENCH_NUM_SPEEDS; group++)
+    {
+      if ((result.missed[group] != 0) || (result.doubleCounted[group] != 0))
+      {
+        printf("  %4u rpm and up:  %u of %u missed, %u counted twice\n", benchSpeedsInRpm[group], result.missed[group],
+               result.passes[group], result.doubleCounted[group]);
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t errors = 0;
+  uint16_t maxSpeedInRpm = 0;
+  int i;
+  uint8_t n;
+
+  printf("%-22s %-9s %6s %7s %7s %8s\n", "", "detector", "passes", "missed", "double", "max rpm");
+
+  if (argc > 1)
+  {
+    for (i=1; i<argc; i++)
+    {
+      runTraceFile(argv[i], &errors, &maxSpeedInRpm);
+    }
+  }
+  else
+  {
+    for (n=0; n<sizeof(benchTraces)/sizeof(benchTraces[0]); n++)
+    {
+      runTraceFile(benchTraces[n].fileName, &errors, &maxSpeedInRpm);
+      CHECK(errors <= benchTraces[n].maxErrors);
+      CHECK(maxSpeedInRpm >= benchTraces[n].minMaxSpeedInRpm);
+    }
+  }
+
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
@@ -0,0 +1,187 @@
+// Night stats journal against the v8.5 scheme, over whole nights (10pm to 7am, a save every 5 minutes):  EEPROM bytes written,
+// time loop() is held up by the writes, and the most writes to any one EEPROM byte.
+//
+// The v8.5 scheme wrote every byte of HedgieNightStats_t to address 800 with EEPROM.write() on each save.  It is replayed on the
+// same stats, then the EEPROM is put back, so both schemes see the same nights.  The rotation counter (one byte write per
+// rotation, in the background) comes with the journal, and is shown on its own.  The journal is written a byte a pass by
+// taskEepromWrites(), called here as loop() would, so its time is the passes' run time, not the EEPROM's
+
+#include "sketch.h"
+#include "test.h"
+
+#define BENCH_START_TIME (1717304400UL)         // 2024-06-02 05:00 UTC, 10pm Pacific
+#define BENCH_INTERVALS (9 * 12)                // 10pm to 7am
+#define BENCH_ROTATIONS_PER_RUN_INTERVAL (300)  // a revolution a second
+
+typedef struct
+{
+  const char *name;
+  uint8_t runEvery;      // 0:  no running.  Otherwise hedgie runs in every runEvery-th interval
+} BenchNight_t;
+
+static const BenchNight_t benchNights[] =
+{
+  { "quiet night", 0 },
+  { "typical night", 5 },
+  { "busy night", 1 },
+};
+
+typedef struct
+{
+  uint32_t bytes;
+  uint64_t timeInUs;
+  uint64_t worstTimeInUs;
+  uint32_t worstCellWrites;
+} BenchResult_t;
+
+// both schemes start with the EEPROM idle
+static void waitForEeprom(void)
+{
+  simAdvance(SIM_EEPROM_WRITE_TIME_IN_US);
+}
+
+static void saveOldScheme(BenchResult_t *result, uint32_t *oldCellWrites)
+{
+  static uint8_t image[SIM_EEPROM_SIZE];
+  static uint32_t cellWrites[SIM_EEPROM_SIZE];
+  uint32_t writeCount = simEepromWriteCount;
+  uint64_t startInUs;
+  uint8_t i;
+
+  memcpy(image, simEeprom, sizeof(image));
+  memcpy(cellWrites, simEepromCellWriteCount, sizeof(cellWrites));
+  waitForEeprom();
+  startInUs = simTimeInUs;
+
+  for (i=0; i<sizeof(HedgieNightStats_t); i++)
+  {
+    halEepromWrite(EEPROMaddrForNightStats + i, ((unsigned char *)(&nightStats))[i]);
+    oldCellWrites[EEPROMaddrForNightStats + i]++;
+  }
+
+  result->bytes += simEepromWriteCount - writeCount;
+  result->timeInUs += simTimeInUs - startInUs;
+  result->worstTimeInUs = max(result->worstTimeInUs, simTimeInUs - startInUs);
+
+  // the journal's EEPROM, and its wear, as they were
+  waitForEeprom();
+  memcpy(simEeprom, image, sizeof(image));
+  memcpy(simEepromCellWriteCount, cellWrites, sizeof(cellWrites));
+  simEepromWriteCount = writeCount;
+}
+
+static void saveJournal(BenchResult_t *result)
+{
+  uint32_t writeCount = simEepromWriteCount;
+  uint64_t startInUs;
+
+  uint64_t heldInUs;
+
+  waitForEeprom();
+  startInUs = simTimeInUs;
+  saveNightStatsToEEPROM();
+  heldInUs = simTimeInUs - startInUs;
+
+  // the writes, a pass at a time
+  while (nightStatsWrite.isPending)
+  {
+    startInUs = simTimeInUs;
+    taskEepromWrites();
+    heldInUs += simTimeInUs - startInUs;
+    simAdvance(DELAY_BETWEEN_SAMPLES * 1000UL);
+  }
+
+  result->bytes += simEepromWriteCount - writeCount;
+  result->timeInUs += heldInUs;
+  result->worstTimeInUs = max(result->worstTimeInUs, heldInUs);
+}
+
+static uint32_t getWorstCellWrites(const uint32_t *cellWrites, int start, int length)
+{
+  uint32_t worst = 0;
+  int addr;
+
+  for (addr=start; addr<start+length; addr++)
+  {
+    worst = max(worst, cellWrites[addr]);
+  }
+
+  return worst;
+}
+
+int main(void)
+{
+  static uint32_t oldCellWrites[SIM_EEPROM_SIZE];
+  const BenchNight_t *night;
+  BenchResult_t oldResult;
+  BenchResult_t journalResult;
+  HedgieNightStats_t savedStats;
+  uint32_t counterWrites;
+  uint32_t rotationTimeInUs = 0;
+  uint32_t rotations;
+  uint16_t interval;
+  uint16_t i;
+  uint8_t n;
+
+  printf("%-14s %9s %5s | %-28s | %-31s | %s\n", "", "rotations", "saves",
+         "v8.5:  bytes    ms worst wear", "journal:  bytes    ms worst wear", "counter:  bytes  wear");
+
+  for (n=0; n<sizeof(benchNights)/sizeof(benchNights[0]); n++)
+  {
+    night = &benchNights[n];
+    simInit(BENCH_START_TIME);
+    setup();
+    memset(&oldResult, 0, sizeof(oldResult));
+    memset(&journalResult, 0, sizeof(journalResult));
+    memset(oldCellWrites, 0, sizeof(oldCellWrites));
+    rotations = 0;
+    counterWrites = 0;
+
+    for (interval=0; interval<BENCH_INTERVALS; interval++)
+    {
+      DateTime dateNow(DateTime(2024, 6, 1, 22, 0, 0).unixtime() + (interval * 300UL));
+      uint32_t writeCount = simEepromWriteCount;
+
+      if ((night->runEvery != 0) && ((interval % night->runEvery) == 0))
+      {
+        for (i=0; i<BENCH_ROTATIONS_PER_RUN_INTERVAL; i++)
+        {
+          rotationTimeInUs += 1000000UL;
+          countRotation(dateNow, rotationTimeInUs);
+          rotations++;
+        }
+      }
+
+      counterWrites += simEepromWriteCount - writeCount;
+      rotationTimeInUs += 60000000UL;
+      addRevolutionStatsToNightStats(&intervalRevolutionStats);
+      initRevolutionStats(&intervalRevolutionStats);
+
+      saveOldScheme(&oldResult, oldCellWrites);
+      saveJournal(&journalResult);
+
+      // the journal gives back what was saved
+      savedStats = nightStats;
+      loadNightStatsFromEEPROM();
+      CHECK(memcmp(&savedStats, &nightStats, sizeof(nightStats)) == 0);
+      nightStats = savedStats;
+      wdtCount = NUM_INTERVALS_TO_RESET;
+    }
+
+    oldResult.worstCellWrites = getWorstCellWrites(oldCellWrites, EEPROMaddrForNightStats, sizeof(HedgieNightStats_t));
+    journalResult.worstCellWrites = getWorstCellWrites(simEepromCellWriteCount, EEPROMaddrForNightStats,
+                                                       NIGHT_STATS_JOURNAL_SLOTS * NIGHT_STATS_SLOT_SIZE);
+    printf("%-14s %9u %5u | %12u %5llu %5llu %4u | %15u %5llu %5llu %4u | %15u %5u\n", night->name, rotations, BENCH_INTERVALS,
+           oldResult.bytes, (unsigned long long)(oldResult.timeInUs / 1000), (unsigned long long)(oldResult.worstTimeInUs / 1000),
+           oldResult.worstCellWrites, journalResult.bytes, (unsigned long long)(journalResult.timeInUs / 1000),
+           (unsigned long long)(journalResult.worstTimeInUs / 1000), journalResult.worstCellWrites, counterWrites,
+           getWorstCellWrites(simEepromCellWriteCount, EEPROMaddrForRotationCounter, ROTATION_COUNTER_BYTES));
+
+    CHECK(journalResult.bytes < oldResult.bytes);
+    CHECK(journalResult.worstCellWrites < oldResult.worstCellWrites);
+  }
+
+  printf("ms:  total time loop() waited on the writes.  worst:  one save, ms.  wear:  most writes to one byte in the night\n");
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
@@ -0,0 +1,150 @@
+// Night rotation log cost:  flash bytes per rotation, the board's time per rotation writing them (the SPI transfers of
+// serviceNightLog(), as the simulator models them), and host CPU time per appendNightLog(), for a night of each pace.
+//
+// "steady" is a revolution a second with 0.3ms of jitter, "changing pace" 250ms to 1.25s at random, "pauses" bouts of 100
+// rotations at 0.7s with pauses of 6s to 15 minutes, each followed by an escape.  4 bytes per rotation is a timestamp each.
+// The flash time is mostly the status poll on every pass (6us):  a page program is 2us a byte.  Each night is run BENCH_REPEATS
+// times, and the fastest run kept
+
+#include <chrono>
+#include "sketch.h"
+#include "test.h"
+
+#define BENCH_START_TIME (1717304400UL)         // 2024-06-02 05:00 UTC, 10pm Pacific
+#define BENCH_ROTATIONS (30000)
+#define BENCH_REPEATS (5)
+
+typedef enum
+{
+  BENCH_STEADY,
+  BENCH_CHANGING,
+  BENCH_PAUSES,
+} BENCH_PACE_t;
+
+typedef struct
+{
+  const char *name;
+  BENCH_PACE_t pace;
+  double maxBytesPerRotation;
+  double maxFlashUsPerRotation;
+} BenchNight_t;
+
+static const BenchNight_t benchNights[] =
+{
+  { "steady",         BENCH_STEADY,   1.01, 8.0 },
+  { "changing pace",  BENCH_CHANGING, 2.0,  10.0 },
+  { "pauses",         BENCH_PAUSES,   1.1,  8.0 },
+};
+
+typedef struct
+{
+  uint32_t bytes;
+  uint64_t flashTimeInUs;
+  uint64_t appendTimeInNs;
+} BenchResult_t;
+
+static uint64_t getTimeInNs(void)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t getNextPeriodInUs(BENCH_PACE_t pace, uint32_t rotation)
+{
+  switch (pace)
+  {
+    case BENCH_STEADY:
+      return 1000000 - 300 + (rand() % 600);
+
+    case BENCH_CHANGING:
+      return 250000 + (rand() % 1000000);
+
+    case BENCH_PAUSES:
+    default:
+      return ((rotation % 100) != 0) ? 700000 - 5000 + (rand() % 10000) : 6000000 + ((rand() % 900) * 1000000ULL);
+  }
+}
+
+// a fresh flash and night, with the night log task run after each rotation
+static void runNight(const BenchNight_t *night, BenchResult_t *result)
+{
+  uint64_t rotationInUs;
+  uint64_t startInUs;
+  uint64_t startInNs;
+  uint32_t i;
+
+  memset(result, 0, sizeof(*result));
+  simInit(BENCH_START_TIME);
+  setSoftwareClock(BENCH_START_TIME);
+  initNightLog(false);
+  srand(1);
+
+  startNightLog();
+  rotationInUs = simTimeInUs;
+
+  for (i=0; i<BENCH_ROTATIONS; i++)
+  {
+    rotationInUs += getNextPeriodInUs(night->pace, i);
+    simAdvance(rotationInUs - simTimeInUs);
+
+    startInNs = getTimeInNs();
+    appendNightLog(halMicros());
+    result->appendTimeInNs += getTimeInNs() - startInNs;
+
+    startInUs = simTimeInUs;
+    serviceNightLog();
+    result->flashTimeInUs += simTimeInUs - startInUs;
+  }
+
+  closeNightLog();
+
+  while (nightLogState != NIGHT_LOG_IDLE)
+  {
+    simAdvance(1000);
+    startInUs = simTimeInUs;
+    serviceNightLog();
+    result->flashTimeInUs += simTimeInUs - startInUs;
+  }
+
+  result->bytes = diagnostics.nightLogBytes;
+  CHECK_EQUAL(BENCH_ROTATIONS, diagnostics.nightLogRotations);
+  CHECK_EQUAL(0, diagnostics.nightLogDropCount);
+}
+
+int main(void)
+{
+  BenchResult_t result;
+  BenchResult_t best;
+  double bytesPerRotation;
+  double flashUsPerRotation;
+  uint8_t n;
+  uint8_t repeat;
+
+  printf("%-16s %9s %9s %10s %12s %13s\n", "", "rotations", "bytes", "bytes/rot", "flash us/rot", "ns/appendLog");
+
+  for (n=0; n<sizeof(benchNights)/sizeof(benchNights[0]); n++)
+  {
+    memset(&best, 0, sizeof(best));
+
+    for (repeat=0; repeat<BENCH_REPEATS; repeat++)
+    {
+      runNight(&benchNights[n], &result);
+
+      if ((repeat == 0) || (result.appendTimeInNs < best.appendTimeInNs))
+      {
+        best = result;
+      }
+    }
+
+    bytesPerRotation = (double)best.bytes / BENCH_ROTATIONS;
+    flashUsPerRotation = (double)best.flashTimeInUs / BENCH_ROTATIONS;
+    printf("%-16s %9u %9u %10.2f %12.2f %13.1f\n", benchNights[n].name, BENCH_ROTATIONS, best.bytes, bytesPerRotation,
+           flashUsPerRotation, (double)best.appendTimeInNs / BENCH_ROTATIONS);
+
+    CHECK(bytesPerRotation <= benchNights[n].maxBytesPerRotation);
+    CHECK(flashUsPerRotation <= benchNights[n].maxFlashUsPerRotation);
+  }
+
+  printf("flash:  simulated time in serviceNightLog(), status polls included.  appendLog:  host CPU time\n");
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
@@ -0,0 +1,1546 @@
+// Host implementation of hedgie_hal.h:  the simulator behind the host tests.  See sim.h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include "sim.h"
+#include <RTClib.h>
+
+// the simulator uses std::min() and std::max()
+#undef min
+#undef max
+
+HardwareSerial Serial;
+
+uint64_t simTimeInUs = 0;
+static uint64_t utcAtStartInUs = 0;
+
+SimTrace_t simTrace = NULL;
+static std::vector<std::pair<uint64_t, int> > tracePoints;
+uint32_t simSampleCount = 0;
+uint32_t simEdgeCount = 0;
+bool simIsComparatorDividerFitted = false;
+uint32_t simWakeCount = 0;
+uint64_t simFirstSampleTimeInUs = 0;
+uint64_t simIdleTimeInUs = 0;
+
+bool simLed[16];
+static bool isButtonPressed[16];
+
+uint8_t simEeprom[SIM_EEPROM_SIZE];
+uint32_t simEepromWriteCount = 0;
+uint32_t simEepromCellWriteCount[SIM_EEPROM_SIZE];
+uint64_t simEepromWaitTimeInUs = 0;
+uint32_t simEepromResetAfterWrites = 0;
+static uint64_t eepromBusyUntilInUs = 0;
+
+int32_t simRtcDriftPpm = 0;
+float simTemperatureInC = 21.5;
+char simLcd[2][17];
+uint32_t simLcdBusyErrors = 0;
+uint8_t simI2cFailAddress = 0;
+uint32_t simI2cFailCount = 0;
+uint8_t simI2cFailStatus = 2;
+uint32_t simI2cTransactionCount = 0;
+
+bool simIsFlashFitted = true;
+std::vector<uint8_t> simFlash;
+uint32_t simFlashBytesProgrammed = 0;
+uint32_t simFlashBusyErrors = 0;
+
+bool simIsDhcpOk = true;
+uint32_t simDhcpTimeInMs = 1200;
+SimDnsServer simDns;
+SimNtpServer simNtp;
+SimHttpServer simHttp;
+uint32_t simTcpOverflowErrors = 0;
+
+// interrupts
+static bool isInterruptsEnabled = true;
+static bool isInInterrupt = false;
+static bool isAdcOn = false;
+static bool isCaptureOn = false;
+static bool isCaptureMirrorNext = true;
+static bool isWakeArmed = false;
+static bool isButtonWakeOn = false;
+static bool isWatchdogOn = false;
+static bool comparatorOutput = true;         // high while the sensor is below the threshold (white)
+static bool isAdcPending = false;
+static int pendingSample = 0;
+static bool isCapturePending = false;
+static uint32_t pendingCaptureTimeInUs = 0;
+static bool pendingCaptureIsMirror = false;
+static bool isWakePending = false;
+static bool isButtonPending = false;
+static bool isWatchdogPending = false;
+static uint64_t nextAdcTimeInUs = 0;
+static uint64_t nextComparatorTimeInUs = 0;
+static uint64_t nextWatchdogTimeInUs = 0;
+
+// DS1307:  the time at rtcBaseInUs of simulated time
+static uint32_t rtcBaseTime = 0;
+static uint64_t rtcBaseInUs = 0;
+static uint8_t rtcPointer = 0;
+static uint8_t mcp9808Pointer = 0;
+
+// HD44780
+static uint8_t lcdPins = 0;
+static bool isLcd4Bit = false;
+static bool isLcdHighNibble = true;
+static uint8_t lcdHighNibble = 0;
+static uint8_t lcdAddress = 0;
+static uint8_t lcdDdram[128];
+static uint64_t lcdBusyUntilInUs = 0;
+
+// W25Qxx
+static bool isFlashSelected = false;
+static uint8_t flashCommand = 0;
+static uint32_t flashByteCount = 0;
+static uint32_t flashAddress = 0;
+static bool isFlashWriteEnabled = false;
+static uint64_t flashBusyUntilInUs = 0;
+
+// UDP
+struct SimPacket
+{
+  uint64_t arrivalInUs;
+  std::vector<uint8_t> data;
+};
+
+struct SimUdpSocket
+{
+  bool isOpen;
+  uint16_t localPort;
+  std::deque<SimPacket> received;
+  std::vector<uint8_t> current;
+  size_t readPosition;
+  IPAddress sendAddress;
+  uint16_t sendPort;
+  std::vector<uint8_t> sending;
+};
+
+static SimUdpSocket udpSockets[NUM_HAL_UDP];
+
+// TCP, the one upload connection
+struct SimTcpChunk
+{
+  uint64_t arrivalInUs;
+  std::string data;
+};
+
+static HAL_TCP_STATE_t tcpState = HAL_TCP_CLOSED;
+static bool isTcpRefused = false;
+static uint64_t tcpEstablishedInUs = 0;
+static uint64_t tcpClosedInUs = 0;           // both sides done, after a FIN
+static uint64_t tcpPeerFinInUs = 0;          // 0:  the server hasn't closed
+static bool isTcpOurFin = false;
+static uint64_t tcpAckInUs = 0;
+static bool isTcpSendOkPending = false;
+static uint16_t tcpUnacked = 0;
+static std::string tcpPending;
+static std::deque<SimTcpChunk> tcpToServer;
+static std::deque<SimTcpChunk> tcpFromServer;
+static std::string httpReceived;
+static uint32_t httpRequestsOnConnection = 0;
+
+static uint32_t randomState = 1;
+
+static void runInterrupts(void);
+static void checkComparator(void);
+static void serveDns(SimUdpSocket *socket, const std::vector<uint8_t>& query);
+static void serveNtp(SimUdpSocket *socket, const std::vector<uint8_t>& request);
+static void updateTcp(void);
+static void skipComparatorChecks(uint64_t endInUs);
+
+// ================================================================================================================================
+// Clock and interrupts
+// ================================================================================================================================
+
+void simInit(uint32_t utcTime)
+{
+  uint8_t i;
+
+  simTimeInUs = 0;
+  utcAtStartInUs = (uint64_t)utcTime * 1000000;
+  simTrace = NULL;
+  simSampleCount = 0;
+  simEdgeCount = 0;
+  simIsComparatorDividerFitted = false;
+  simWakeCount = 0;
+  simFirstSampleTimeInUs = 0;
+  simIdleTimeInUs = 0;
+  memset(simLed, 0, sizeof(simLed));
+  memset(isButtonPressed, 0, sizeof(isButtonPressed));
+  memset(simEeprom, 0xFF, sizeof(simEeprom));
+  simEepromWriteCount = 0;
+  memset(simEepromCellWriteCount, 0, sizeof(simEepromCellWriteCount));
+  simEepromWaitTimeInUs = 0;
+  simEepromResetAfterWrites = 0;
+  eepromBusyUntilInUs = 0;
+
+  isInterruptsEnabled = true;
+  isInInterrupt = false;
+  isAdcOn = false;
+  isCaptureOn = false;
+  isWakeArmed = false;
+  isButtonWakeOn = false;
+  isWatchdogOn = false;
+  isAdcPending = false;
+  isCapturePending = false;
+  isWakePending = false;
+  isButtonPending = false;
+  isWatchdogPending = false;
+  nextAdcTimeInUs = SIM_ADC_PERIOD_IN_US;
+
+  simRtcDriftPpm = 0;
+  simSetRtc(utcTime);
+  simTemperatureInC = 21.5;
+  memset(simLcd, 0, sizeof(simLcd));
+  memset(lcdDdram, ' ', sizeof(lcdDdram));
+  simLcdBusyErrors = 0;
+  lcdPins = 0;
+  isLcd4Bit = false;
+  isLcdHighNibble = true;
+  lcdAddress = 0;
+  lcdBusyUntilInUs = 0;
+  simI2cFailCount = 0;
+  simI2cTransactionCount = 0;
+
+  simIsFlashFitted = true;
+  simFlash.assign(SIM_FLASH_SIZE, 0xFF);
+  simFlashBytesProgrammed = 0;
+  simFlashBusyErrors = 0;
+  isFlashSelected = false;
+  isFlashWriteEnabled = false;
+  flashBusyUntilInUs = 0;
+
+  simIsDhcpOk = true;
+  simDhcpTimeInMs = 1200;
+  simDns = SimDnsServer();
+  simDns.delayInMs = 30;
+  simDns.ttlInSecs = 300;
+  simDns.isDown = false;
+  simDns.isNxDomain = false;
+  simDns.queryCount = 0;
+  simNtp = SimNtpServer();
+  simNtp.steps.push_back(SimNtpStep());
+  simNtp.steps[0].requestDelayInMs = 20;
+  simNtp.steps[0].replyDelayInMs = 20;
+  simNtp.requestCount = 0;
+  simNtp.replyCount = 0;
+  simHttp = SimHttpServer();
+  simHttp.isAccepting = true;
+  simHttp.rttInMs = 40;
+  simHttp.responseDelayInMs = 100;
+  simHttp.statusCode = 200;
+  simHttp.closeAfterRequests = 0;
+  simHttp.connectionCount = 0;
+  simTcpOverflowErrors = 0;
+
+  for (i=0; i<NUM_HAL_UDP; i++)
+  {
+    udpSockets[i] = SimUdpSocket();
+  }
+
+  tcpState = HAL_TCP_CLOSED;
+  tcpPending.clear();
+  tcpToServer.clear();
+  tcpFromServer.clear();
+  isTcpSendOkPending = false;
+  tcpUnacked = 0;
+}
+
+uint64_t simUtcInUs(void)
+{
+  return utcAtStartInUs + simTimeInUs;
+}
+
+// A stepped trace holds its level until the next point, so the comparator checks before then can't see an edge
+static void skipComparatorChecks(uint64_t endInUs)
+{
+  std::vector<std::pair<uint64_t, int> >::const_iterator point;
+  uint64_t changeInUs = endInUs + 1;
+
+  if ((simTrace != NULL) || tracePoints.empty())
+  {
+    return;
+  }
+
+  // the first change since the last check
+  point = std::upper_bound(tracePoints.begin(), tracePoints.end(),
+                           std::make_pair(nextComparatorTimeInUs - SIM_COMPARATOR_STEP_IN_US, 0x7FFFFFFF));
+
+  if (point != tracePoints.end())
+  {
+    changeInUs = std::min(changeInUs, point->first);
+  }
+
+  if (changeInUs > nextComparatorTimeInUs)
+  {
+    nextComparatorTimeInUs += ((changeInUs - nextComparatorTimeInUs + SIM_COMPARATOR_STEP_IN_US - 1) / SIM_COMPARATOR_STEP_IN_US) *
+                              SIM_COMPARATOR_STEP_IN_US;
+  }
+}
+
+// Runs the interrupts that come due, in time order, up to timeInUs from now.  Time spent inside an interrupt handler just passes:
+// the other interrupts wait for it to return
+void simAdvance(uint64_t timeInUs)
+{
+  uint64_t endInUs = simTimeInUs + timeInUs;
+  uint64_t nextInUs;
+
+  while (isInInterrupt == false)
+  {
+    nextInUs = nextAdcTimeInUs;
+
+    if (isCaptureOn || isWakeArmed)
+    {
+      skipComparatorChecks(endInUs);
+      nextInUs = std::min(nextInUs, nextComparatorTimeInUs);
+    }
+
+    if (isWatchdogOn)
+    {
+      nextInUs = std::min(nextInUs, nextWatchdogTimeInUs);
+    }
+
+    if (nextInUs > endInUs)
+    {
+      break;
+    }
+
+    simTimeInUs = nextInUs;
+
+    if (nextInUs == nextAdcTimeInUs)
+    {
+      // Timer0 overflow.  Runs on, whether the ADC uses it or not
+      nextAdcTimeInUs += SIM_ADC_PERIOD_IN_US;
+
+      if (isAdcOn)
+      {
+        isAdcPending = true;
+        pendingSample = simTraceLevel(simTimeInUs);
+      }
+    }
+
+    if ((isCaptureOn || isWakeArmed) && (nextInUs == nextComparatorTimeInUs))
+    {
+      nextComparatorTimeInUs += SIM_COMPARATOR_STEP_IN_US;
+      checkComparator();
+    }
+
+    if (isWatchdogOn && (nextInUs == nextWatchdogTimeInUs))
+    {
+      nextWatchdogTimeInUs += SIM_WATCHDOG_PERIOD_IN_US;
+      isWatchdogPending = true;
+    }
+
+    runInterrupts();
+  }
+
+  simTimeInUs = std::max(simTimeInUs, endInUs);
+}
+
+static void runInterrupts(void)
+{
+  if ((isInterruptsEnabled == false) || isInInterrupt)
+  {
+    return;
+  }
+
+  isInInterrupt = true;
+
+  // in AVR vector order
+  if (isWatchdogPending)
+  {
+    isWatchdogPending = false;
+    watchdogInterrupt();
+  }
+
+  if (isButtonPending)
+  {
+    isButtonPending = false;
+    buttonWakeInterrupt();
+  }
+
+  if (isCapturePending)
+  {
+    isCapturePending = false;
+    simEdgeCount++;
+
+    if (simFirstSampleTimeInUs == 0)
+    {
+      simFirstSampleTimeInUs = simTimeInUs;
+    }
+
+    wheelEdgeInterrupt(pendingCaptureTimeInUs, pendingCaptureIsMirror);
+  }
+
+  if (isAdcPending)
+  {
+    isAdcPending = false;
+    simSampleCount++;
+
+    if (simFirstSampleTimeInUs == 0)
+    {
+      simFirstSampleTimeInUs = simTimeInUs;
+    }
+
+    wheelSampleInterrupt(pendingSample);
+  }
+
+  if (isWakePending)
+  {
+    isWakePending = false;
+    simWakeCount++;
+    wheelWakeInterrupt();
+  }
+
+  isInInterrupt = false;
+}
+
+void noInterrupts(void)
+{
+  isInterruptsEnabled = false;
+}
+
+void interrupts(void)
+{
+  isInterruptsEnabled = true;
+  runInterrupts();
+}
+
+uint32_t halMicros(void)
+{
+  return (uint32_t)simTimeInUs;
+}
+
+uint32_t halMillis(void)
+{
+  return (uint32_t)(simTimeInUs / 1000);
+}
+
+void halDelay(uint32_t delayInMs)
+{
+  simAdvance((uint64_t)delayInMs * 1000);
+}
+
+void halDelayMicros(uint16_t delayInUs)
+{
+  simAdvance(delayInUs);
+}
+
+// ================================================================================================================================
+// Pins, watchdog, sleep
+// ================================================================================================================================
+
+void halInitPins(void)
+{
+}
+
+void simSetButton(uint8_t pin, bool isPressed)
+{
+  if (isPressed != isButtonPressed[pin])
+  {
+    isButtonPressed[pin] = isPressed;
+    isButtonPending = isButtonWakeOn;
+    runInterrupts();
+  }
+}
+
+// the touch sensor drives its pin high when touched, the protoshield button pulls its pin low
+boolean halReadButton(uint8_t pin)
+{
+  return (isButtonPressed[pin] == (pin == SIM_TOUCH_SENSOR_PIN)) ? HIGH : LOW;
+}
+
+void halSetLed(uint8_t pin, boolean isOn)
+{
+  simLed[pin] = isOn;
+}
+
+void halStartWatchdog(void)
+{
+  isWatchdogOn = true;
+  nextWatchdogTimeInUs = simTimeInUs + SIM_WATCHDOG_PERIOD_IN_US;
+}
+
+void halReset(void)
+{
+  isInInterrupt = false;
+  throw SimReset();
+}
+
+// until the next interrupt:  Timer0 overflows every 1.024ms
+void halIdle(void)
+{
+  uint64_t sleepInUs = nextAdcTimeInUs - simTimeInUs;
+
+  if ((isCaptureOn || isWakeArmed) && (nextComparatorTimeInUs - simTimeInUs < sleepInUs))
+  {
+    sleepInUs = nextComparatorTimeInUs - simTimeInUs;
+  }
+
+  simIdleTimeInUs += sleepInUs;
+  simAdvance(sleepInUs);
+}
+
+// no AVR RAM to measure
+uint16_t halFreeRam(void)
+{
+  return 0;
+}
+
+uint16_t halMinFreeRam(void)
+{
+  return 0;
+}
+
+// ================================================================================================================================
+// Wheel sensor
+// ================================================================================================================================
+
+void simLoadTrace(const std::vector<std::pair<uint64_t, int> >& points)
+{
+  tracePoints = points;
+  simTrace = NULL;
+}
+
+int simTraceLevel(uint64_t timeInUs)
+{
+  std::vector<std::pair<uint64_t, int> >::const_iterator point;
+  int level;
+
+  if (simTrace != NULL)
+  {
+    level = simTrace(timeInUs);
+  }
+  else if (tracePoints.empty() == false)
+  {
+    point = std::upper_bound(tracePoints.begin(), tracePoints.end(), std::make_pair(timeInUs, 0x7FFFFFFF));
+    level = (point == tracePoints.begin()) ? tracePoints[0].second : (point - 1)->second;
+  }
+  else
+  {
+    level = 100;
+  }
+
+  return std::max(0, std::min(level, 1023));
+}
+
+void simAddRotations(std::vector<std::pair<uint64_t, int> >& points, uint64_t startInUs, uint32_t rotations, uint32_t periodInUs,
+                     int whiteLevel, int mirrorLevel)
+{
+  uint64_t mirrorInUs = std::max((uint64_t)periodInUs * SIM_MIRROR_WIDTH_IN_CM / SIM_WHEEL_CIRCUMFERENCE_IN_CM, (uint64_t)1);
+  uint32_t i;
+
+  for (i=0; i<rotations; i++)
+  {
+    points.push_back(std::make_pair(startInUs + ((uint64_t)i * periodInUs), mirrorLevel));
+    points.push_back(std::make_pair(startInUs + ((uint64_t)i * periodInUs) + mirrorInUs, whiteLevel));
+  }
+}
+
+// the comparator's - input:  A0, or for the mirror edge A1 through the 15k/82k divider when it's fitted
+static bool getComparatorOutput(bool isMirrorChannel)
+{
+  int level = simTraceLevel(simTimeInUs);
+
+  if (isMirrorChannel && simIsComparatorDividerFitted)
+  {
+    level = (level * 82) / 97;
+  }
+
+  return SIM_BANDGAP_COUNTS > level;
+}
+
+static void checkComparator(void)
+{
+  bool output = getComparatorOutput(isCaptureOn && isCaptureMirrorNext);
+
+  if (isCaptureOn && (output != comparatorOutput) && (output != isCaptureMirrorNext))
+  {
+    // falling edge for the mirror, rising for white
+    isCapturePending = true;
+    pendingCaptureTimeInUs = (uint32_t)simTimeInUs;
+    pendingCaptureIsMirror = isCaptureMirrorNext;
+  }
+
+  if (isWakeArmed && comparatorOutput && (output == false))
+  {
+    isWakeArmed = false;
+    isWakePending = true;
+  }
+
+  comparatorOutput = output;
+}
+
+void halStartAdcSampling(void)
+{
+  isAdcOn = true;
+  isCaptureOn = false;
+}
+
+void halStartComparatorCapture(void)
+{
+  isAdcOn = false;
+  isCaptureOn = true;
+  isCaptureMirrorNext = true;
+  comparatorOutput = getComparatorOutput(true);
+  nextComparatorTimeInUs = simTimeInUs + SIM_COMPARATOR_STEP_IN_US;
+}
+
+void halSetComparatorEdge(boolean isMirrorNext)
+{
+  isCaptureMirrorNext = isMirrorNext;
+  comparatorOutput = getComparatorOutput(isMirrorNext);
+  isCapturePending = false;
+}
+
+void halArmComparatorWake(void)
+{
+  isAdcOn = false;
+  isWakeArmed = true;
+  comparatorOutput = getComparatorOutput(false);
+  nextComparatorTimeInUs = simTimeInUs + SIM_COMPARATOR_STEP_IN_US;
+}
+
+void halDisarmComparatorWake(void)
+{
+  isWakeArmed = false;
+  isWakePending = false;
+}
+
+void halEnableButtonWake(void)
+{
+  isButtonWakeOn = true;
+}
+
+// ================================================================================================================================
+// EEPROM:  a write waits for the one before it to finish, as eeprom_write_byte() does
+// ================================================================================================================================
+
+static void waitForEeprom(void)
+{
+  if (simTimeInUs < eepromBusyUntilInUs)
+  {
+    simEepromWaitTimeInUs += eepromBusyUntilInUs - simTimeInUs;
+    simAdvance(eepromBusyUntilInUs - simTimeInUs);
+  }
+}
+
+uint8_t halEepromRead(int addr)
+{
+  waitForEeprom();
+  return simEeprom[addr % SIM_EEPROM_SIZE];
+}
+
+boolean halEepromIsReady(void)
+{
+  return simTimeInUs >= eepromBusyUntilInUs;
+}
+
+void halEepromWrite(int addr, uint8_t value)
+{
+  if ((simEepromResetAfterWrites != 0) && (--simEepromResetAfterWrites == 0))
+  {
+    halReset();
+  }
+
+  waitForEeprom();
+  simEeprom[addr % SIM_EEPROM_SIZE] = value;
+  simEepromWriteCount++;
+  simEepromCellWriteCount[addr % SIM_EEPROM_SIZE]++;
+  eepromBusyUntilInUs = simTimeInUs + SIM_EEPROM_WRITE_TIME_IN_US;
+}
+
+// ================================================================================================================================
+// I2C devices
+// ================================================================================================================================
+
+void simSetRtc(uint32_t utcTime)
+{
+  rtcBaseTime = utcTime;
+  rtcBaseInUs = simTimeInUs;
+}
+
+uint32_t simRtcTime(void)
+{
+  int64_t elapsedInUs = simTimeInUs - rtcBaseInUs;
+
+  elapsedInUs += (elapsedInUs * simRtcDriftPpm) / 1000000;
+  return rtcBaseTime + (uint32_t)(elapsedInUs / 1000000);
+}
+
+static uint8_t toBcd(uint8_t value)
+{
+  return ((value / 10) << 4) | (value % 10);
+}
+
+static uint8_t fromBcd(uint8_t value)
+{
+  return ((value >> 4) * 10) + (value & 0x0F);
+}
+
+static void getRtcRegisters(uint8_t *regs)
+{
+  DateTime now(simRtcTime());
+
+  regs[0] = toBcd(now.second());
+  regs[1] = toBcd(now.minute());
+  regs[2] = toBcd(now.hour());
+  regs[3] = now.dayOfWeek() + 1;
+  regs[4] = toBcd(now.day());
+  regs[5] = toBcd(now.month());
+  regs[6] = toBcd(now.year() - 2000);
+}
+
+// writing the seconds restarts the DS1307's divider, so the new time starts on a whole second
+static void writeRtc(const uint8_t *data, uint8_t length)
+{
+  uint8_t regs[7];
+  uint8_t i;
+
+  getRtcRegisters(regs);
+  rtcPointer = data[0];
+
+  for (i=1; i<length; i++, rtcPointer++)
+  {
+    if (rtcPointer < 7)
+    {
+      regs[rtcPointer] = data[i];
+    }
+  }
+
+  if (length > 1)
+  {
+    simSetRtc(DateTime(2000 + fromBcd(regs[6]), fromBcd(regs[5]), fromBcd(regs[4]),
+                       fromBcd(regs[2] & 0x3F), fromBcd(regs[1]), fromBcd(regs[0] & 0x7F)).unixtime());
+  }
+}
+
+static void updateLcdScreen(void)
+{
+  uint8_t col;
+
+  for (col=0; col<16; col++)
+  {
+    simLcd[0][col] = lcdDdram[col];
+    simLcd[1][col] = lcdDdram[0x40 + col];
+  }
+}
+
+static void runLcdCommand(uint8_t value, bool isData)
+{
+  if (simTimeInUs < lcdBusyUntilInUs)
+  {
+    simLcdBusyErrors++;
+    return;
+  }
+
+  if (isData)
+  {
+    lcdDdram[lcdAddress] = value;
+    lcdAddress = (lcdAddress + 1) & 0x7F;
+  }
+  else if (value == 0x01)
+  {
+    memset(lcdDdram, ' ', sizeof(lcdDdram));
+    lcdAddress = 0;
+    lcdBusyUntilInUs = simTimeInUs + SIM_LCD_CLEAR_TIME_IN_US;
+  }
+  else if (value & 0x80)
+  {
+    lcdAddress = value & 0x7F;
+  }
+  else if ((value & 0xE0) == 0x20)
+  {
+    // function set:  data length
+    isLcd4Bit = ((value & 0x10) == 0);
+  }
+
+  updateLcdScreen();
+}
+
+// the HD44780 latches D4-D7 (and RS) on the falling edge of EN
+static void writeLcdPins(uint8_t pins)
+{
+  uint8_t nibble = lcdPins >> 4;
+  bool isData = (lcdPins & 0x01) != 0;
+
+  if ((lcdPins & 0x04) && ((pins & 0x04) == 0))
+  {
+    if (isLcd4Bit == false)
+    {
+      runLcdCommand(nibble << 4, isData);
+      isLcdHighNibble = true;
+    }
+    else if (isLcdHighNibble)
+    {
+      lcdHighNibble = nibble;
+      isLcdHighNibble = false;
+    }
+    else
+    {
+      runLcdCommand((lcdHighNibble << 4) | nibble, isData);
+      isLcdHighNibble = true;
+    }
+  }
+
+  lcdPins = pins;
+}
+
+static bool isI2cFailed(uint8_t address, uint8_t *status)
+{
+  simI2cTransactionCount++;
+
+  if ((simI2cFailCount > 0) && (address == simI2cFailAddress))
+  {
+    simI2cFailCount--;
+    *status = simI2cFailStatus;
+    return true;
+  }
+
+  if ((address != SIM_RTC_ADDRESS) && (address != SIM_MCP9808_ADDRESS) && (address != SIM_LCD_ADDRESS))
+  {
+    *status = SIM_I2C_ADDRESS_NACK;
+    return true;
+  }
+
+  return false;
+}
+
+void halI2cBegin(void)
+{
+}
+
+uint8_t halI2cWrite(uint8_t address, const uint8_t *data, uint8_t length)
+{
+  uint8_t status;
+  uint8_t i;
+
+  if (isI2cFailed(address, &status))
+  {
+    // an address nack is over after the address, a data nack got some of the data through
+    simAdvance(SIM_I2C_BYTE_TIME_IN_US * ((status == SIM_I2C_ADDRESS_NACK) ? 1 : (1 + length)));
+
+    if ((status != SIM_I2C_ADDRESS_NACK) && (address == SIM_LCD_ADDRESS) && (length > 1))
+    {
+      writeLcdPins(data[0]);
+    }
+
+    return status;
+  }
+
+  if (address == SIM_LCD_ADDRESS)
+  {
+    // each byte is on the pins for a byte time
+    for (i=0; i<length; i++)
+    {
+      simAdvance(SIM_I2C_BYTE_TIME_IN_US);
+      writeLcdPins(data[i]);
+    }
+
+    simAdvance(SIM_I2C_BYTE_TIME_IN_US);
+    return 0;
+  }
+
+  simAdvance(SIM_I2C_BYTE_TIME_IN_US * (1 + length));
+
+  if ((address == SIM_RTC_ADDRESS) && (length > 0))
+  {
+    writeRtc(data, length);
+  }
+  else if ((address == SIM_MCP9808_ADDRESS) && (length > 0))
+  {
+    mcp9808Pointer = data[0];
+  }
+
+  return 0;
+}
+
+boolean halI2cRead(uint8_t address, uint8_t reg, uint8_t *data, uint8_t length)
+{
+  uint8_t regs[7];
+  int16_t sixteenths;
+  uint8_t status;
+  uint8_t i;
+
+  if (isI2cFailed(address, &status))
+  {
+    simAdvance(SIM_I2C_BYTE_TIME_IN_US * 2);
+    return false;
+  }
+
+  // register address write, then a read with a repeated start
+  simAdvance(SIM_I2C_BYTE_TIME_IN_US * (3 + length));
+
+  if (address == SIM_RTC_ADDRESS)
+  {
+    getRtcRegisters(regs);
+
+    for (i=0; i<length; i++)
+    {
+      data[i] = ((reg + i) < 7) ? regs[reg + i] : 0;
+    }
+
+    return true;
+  }
+
+  if (address == SIM_MCP9808_ADDRESS)
+  {
+    mcp9808Pointer = reg;
+    sixteenths = (int16_t)lround(simTemperatureInC * 16) & 0x1FFF;
+    memset(data, 0, length);
+
+    if ((reg == SIM_MCP9808_AMBIENT) && (length >= 2))
+    {
+      data[0] = sixteenths >> 8;
+      data[1] = sixteenths;
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
+void halI2cRecoverBus(void)
+{
+  simAdvance(200);
+}
+
+// ================================================================================================================================
+// SPI flash (W25Qxx)
+// ================================================================================================================================
+
+void halFlashBegin(void)
+{
+}
+
+void halFlashSelect(void)
+{
+  isFlashSelected = true;
+  flashByteCount = 0;
+}
+
+// a program or erase starts when the chip is deselected
+void halFlashDeselect(void)
+{
+  if (isFlashSelected && isFlashWriteEnabled && (simTimeInUs >= flashBusyUntilInUs))
+  {
+    if ((flashCommand == SIM_FLASH_PAGE_PROGRAM) && (flashByteCount > 4))
+    {
+      flashBusyUntilInUs = simTimeInUs + SIM_FLASH_PROGRAM_TIME_IN_US;
+      isFlashWriteEnabled = false;
+    }
+    else if ((flashCommand == SIM_FLASH_BLOCK_ERASE) && (flashByteCount >= 4))
+    {
+      std::fill(simFlash.begin() + (flashAddress & ~0xFFFFUL), simFlash.begin() + (flashAddress & ~0xFFFFUL) + 0x10000, 0xFF);
+      flashBusyUntilInUs = simTimeInUs + SIM_FLASH_ERASE_TIME_IN_US;
+      isFlashWriteEnabled = false;
+    }
+  }
+
+  isFlashSelected = false;
+}
+
+uint8_t halSpiTransfer(uint8_t value)
+{
+  bool isBusy = (simTimeInUs < flashBusyUntilInUs);
+  uint8_t result = 0xFF;
+  uint32_t index = flashByteCount++;
+
+  simAdvance(SIM_SPI_BYTE_TIME_IN_US);
+
+  if ((isFlashSelected == false) || (simIsFlashFitted == false))
+  {
+    return 0xFF;
+  }
+
+  if (index == 0)
+  {
+    flashCommand = value;
+    flashAddress = 0;
+
+    if (isBusy && (value != SIM_FLASH_READ_STATUS))
+    {
+      simFlashBusyErrors++;
+      flashCommand = 0;
+    }
+    else if (value == SIM_FLASH_WRITE_ENABLE)
+    {
+      isFlashWriteEnabled = true;
+    }
+
+    return 0xFF;
+  }
+
+  switch (flashCommand)
+  {
+    case SIM_FLASH_JEDEC_ID:
+      // Winbond, W25Q, 2^20 bytes
+      result = (index == 1) ? 0xEF : (index == 2) ? 0x40 : 0x14;
+      break;
+
+    case SIM_FLASH_READ_STATUS:
+      result = (isBusy ? 0x01 : 0) | (isFlashWriteEnabled ? 0x02 : 0);
+      break;
+
+    case SIM_FLASH_READ:
+    case SIM_FLASH_PAGE_PROGRAM:
+    case SIM_FLASH_BLOCK_ERASE:
+      if (index <= 3)
+      {
+        flashAddress = (flashAddress << 8) | value;
+      }
+      else if (flashCommand == SIM_FLASH_READ)
+      {
+        result = simFlash[(flashAddress + index - 4) % SIM_FLASH_SIZE];
+      }
+      else if ((flashCommand == SIM_FLASH_PAGE_PROGRAM) && isFlashWriteEnabled)
+      {
+        // NOR flash only clears bits.  The address wraps within the page
+        simFlash[(flashAddress & ~0xFFUL) | ((flashAddress + index - 4) & 0xFF)] &= value;
+        simFlashBytesProgrammed++;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  return result;
+}
+
+// ================================================================================================================================
+// Network:  DHCP, the DNS, NTP and HTTP stand-ins
+// ================================================================================================================================
+
+static uint32_t nextRandom(void)
+{
+  randomState = randomState * 1103515245 + 12345;
+  return randomState >> 8;
+}
+
+long random(long howBig)
+{
+  return (howBig <= 0) ? 0 : (long)(nextRandom() % howBig);
+}
+
+long random(long howSmall, long howBig)
+{
+  return (howSmall >= howBig) ? howSmall : howSmall + random(howBig - howSmall);
+}
+
+void randomSeed(unsigned long seed)
+{
+  randomState = seed;
+}
+
+boolean halNetBegin(uint8_t *)
+{
+  if (simIsDhcpOk == false)
+  {
+    simAdvance((uint64_t)SIM_DHCP_TIMEOUT_IN_MS * 1000);
+    return false;
+  }
+
+  simAdvance((uint64_t)simDhcpTimeInMs * 1000);
+  return true;
+}
+
+IPAddress halDnsServerIp(void)
+{
+  return SIM_DNS_SERVER_ADDRESS;
+}
+
+// a packet that arrived while the socket was closed is gone
+static void dropArrivedPackets(SimUdpSocket *socket)
+{
+  while ((socket->received.empty() == false) && (socket->received.front().arrivalInUs <= simTimeInUs))
+  {
+    socket->received.pop_front();
+  }
+}
+
+static void queuePacket(SimUdpSocket *socket, uint64_t arrivalInUs, const std::vector<uint8_t>& data)
+{
+  SimPacket packet;
+  std::deque<SimPacket>::iterator position = socket->received.begin();
+
+  packet.arrivalInUs = arrivalInUs;
+  packet.data = data;
+
+  while ((position != socket->received.end()) && (position->arrivalInUs <= arrivalInUs))
+  {
+    position++;
+  }
+
+  socket->received.insert(position, packet);
+}
+
+boolean halUdpBegin(HAL_UDP_t udp, uint16_t localPort)
+{
+  SimUdpSocket *socket = &udpSockets[udp];
+
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  dropArrivedPackets(socket);
+  socket->isOpen = true;
+  socket->localPort = localPort;
+  socket->current.clear();
+  return true;
+}
+
+void halUdpStop(HAL_UDP_t udp)
+{
+  SimUdpSocket *socket = &udpSockets[udp];
+
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  dropArrivedPackets(socket);
+  socket->isOpen = false;
+  socket->current.clear();
+}
+
+boolean halUdpBeginPacket(HAL_UDP_t udp, IPAddress address, uint16_t port)
+{
+  SimUdpSocket *socket = &udpSockets[udp];
+
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  socket->sendAddress = address;
+  socket->sendPort = port;
+  socket->sending.clear();
+  return socket->isOpen;
+}
+
+void halUdpWrite(HAL_UDP_t udp, const uint8_t *data, uint16_t length)
+{
+  simAdvance((uint64_t)SIM_W5100_BYTE_TIME_IN_US * length);
+  udpSockets[udp].sending.insert(udpSockets[udp].sending.end(), data, data + length);
+}
+
+// EthernetUDP::endPacket() waits for the W5100 to send it
+boolean halUdpEndPacket(HAL_UDP_t udp)
+{
+  SimUdpSocket *socket = &udpSockets[udp];
+
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US * 3);
+
+  if (socket->isOpen == false)
+  {
+    return false;
+  }
+
+  if ((socket->sendAddress == SIM_DNS_SERVER_ADDRESS) && (socket->sendPort == 53))
+  {
+    serveDns(socket, socket->sending);
+  }
+  else if ((socket->sendAddress == SIM_HOST_ADDRESS) && (socket->sendPort == 123))
+  {
+    serveNtp(socket, socket->sending);
+  }
+
+  return true;
+}
+
+int halUdpParsePacket(HAL_UDP_t udp)
+{
+  SimUdpSocket *socket = &udpSockets[udp];
+
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  socket->current.clear();
+  socket->readPosition = 0;
+
+  if ((socket->isOpen == false) || socket->received.empty() || (socket->received.front().arrivalInUs > simTimeInUs))
+  {
+    return 0;
+  }
+
+  socket->current = socket->received.front().data;
+  socket->received.pop_front();
+  return socket->current.size();
+}
+
+int halUdpRead(HAL_UDP_t udp)
+{
+  SimUdpSocket *socket = &udpSockets[udp];
+
+  simAdvance(SIM_W5100_BYTE_TIME_IN_US);
+
+  if (socket->readPosition >= socket->current.size())
+  {
+    return -1;
+  }
+
+  return socket->current[socket->readPosition++];
+}
+
+int halUdpRead(HAL_UDP_t udp, uint8_t *data, uint16_t length)
+{
+  SimUdpSocket *socket = &udpSockets[udp];
+  uint16_t count = std::min((size_t)length, socket->current.size() - socket->readPosition);
+
+  simAdvance((uint64_t)SIM_W5100_BYTE_TIME_IN_US * count);
+  memcpy(data, &socket->current[socket->readPosition], count);
+  socket->readPosition += count;
+  return count;
+}
+
+// A record for the name in the query, or NXDOMAIN
+static void serveDns(SimUdpSocket *socket, const std::vector<uint8_t>& query)
+{
+  std::vector<uint8_t> reply;
+  std::map<std::string, IPAddress>::const_iterator entry;
+  IPAddress address = SIM_HOST_ADDRESS;
+  std::string name;
+  size_t position = 12;
+  bool isFound;
+  uint8_t i;
+
+  simDns.queryCount++;
+
+  if (simDns.isDown || (query.size() < 17))
+  {
+    return;
+  }
+
+  while ((position < query.size()) && (query[position] != 0))
+  {
+    if (name.empty() == false)
+    {
+      name += '.';
+    }
+
+    name.append((const char *)&query[position + 1], query[position]);
+    position += query[position] + 1;
+  }
+
+  position += 5;    // the 0, type and class
+  entry = simDns.names.find(name);
+  isFound = (entry != simDns.names.end()) || (simDns.isNxDomain == false);
+
+  if (entry != simDns.names.end())
+  {
+    address = entry->second;
+  }
+
+  // header:  the query's id, a response with recursion available, 1 question, 1 or 0 answers
+  reply.assign(query.begin(), query.begin() + std::min(position, query.size()));
+  reply[2] = 0x81;
+  reply[3] = isFound ? 0x80 : 0x83;
+  reply[6] = 0;
+  reply[7] = isFound ? 1 : 0;
+
+  if (isFound)
+  {
+    // a pointer to the name in the question, type A, class IN, TTL, 4 bytes of address
+    const uint8_t answer[] = { 0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01,
+                               (uint8_t)(simDns.ttlInSecs >> 24), (uint8_t)(simDns.ttlInSecs >> 16),
+                               (uint8_t)(simDns.ttlInSecs >> 8), (uint8_t)simDns.ttlInSecs, 0x00, 0x04 };
+
+    reply.insert(reply.end(), answer, answer + sizeof(answer));
+
+    for (i=0; i<4; i++)
+    {
+      reply.push_back(address[i]);
+    }
+  }
+
+  queuePacket(socket, simTimeInUs + (uint64_t)simDns.delayInMs * 1000, reply);
+}
+
+static void writeNtpTime(uint8_t *field, uint64_t utcInUs)
+{
+  uint32_t seconds = (uint32_t)(utcInUs / 1000000) + 2208988800UL;
+  uint32_t fraction = (uint32_t)(((utcInUs % 1000000) << 32) / 1000000);
+  uint8_t i;
+
+  for (i=0; i<4; i++)
+  {
+    field[i] = seconds >> (24 - (8 * i));
+    field[4 + i] = fraction >> (24 - (8 * i));
+  }
+}
+
+// the server's receive and transmit times are its clock when the request gets there
+static void serveNtp(SimUdpSocket *socket, const std::vector<uint8_t>& request)
+{
+  const SimNtpStep& step = simNtp.steps[simNtp.requestCount % simNtp.steps.size()];
+  std::vector<uint8_t> reply(48, 0);
+  uint64_t arrivalInUs = simTimeInUs + (uint64_t)step.requestDelayInMs * 1000;
+  uint64_t serverTimeInUs = utcAtStartInUs + arrivalInUs + (int64_t)step.serverErrorInMs * 1000;
+
+  simNtp.requestCount++;
+
+  if (step.isLost || (request.size() < 48))
+  {
+    return;
+  }
+
+  reply[0] = step.isUnsynchronized ? 0xE4 : 0x24;    // leap indicator, version 4, mode 4 (server)
+  reply[1] = step.isUnsynchronized ? 0 : 2;          // stratum
+  memcpy(&reply[24], &request[40], 8);               // originate:  the request's transmit time
+
+  if (step.isWrongToken)
+  {
+    reply[27] ^= 0x55;
+  }
+
+  writeNtpTime(&reply[32], serverTimeInUs);
+  writeNtpTime(&reply[40], serverTimeInUs);
+  queuePacket(socket, arrivalInUs + (uint64_t)step.replyDelayInMs * 1000, reply);
+  simNtp.replyCount++;
+}
+
+// ================================================================================================================================
+// TCP and the HTTP stand-in.  Events are worked out when the sketch looks, from the times they happened
+// ================================================================================================================================
+
+static uint64_t getHalfRttInUs(void)
+{
+  return (uint64_t)simHttp.rttInMs * 500;
+}
+
+// requests the server has all of get a response.  Connection: close, or the server's request limit, ends the connection
+static void serveHttp(uint64_t arrivalInUs)
+{
+  std::string request;
+  std::string headers;
+  std::string response;
+  size_t headerEnd;
+  size_t lengthField;
+  size_t contentLength;
+  bool isClose;
+  char statusLine[40];
+
+  while ((tcpPeerFinInUs == 0) && ((headerEnd = httpReceived.find("\r\n\r\n")) != std::string::npos))
+  {
+    headers = httpReceived.substr(0, headerEnd);
+    std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    lengthField = headers.find("content-length:");
+    contentLength = (lengthField == std::string::npos) ? 0 : strtoul(headers.c_str() + lengthField + 15, NULL, 10);
+
+    if (httpReceived.size() < headerEnd + 4 + contentLength)
+    {
+      break;
+    }
+
+    request = httpReceived.substr(0, headerEnd + 4 + contentLength);
+    httpReceived.erase(0, request.size());
+    simHttp.requests.push_back(request);
+    httpRequestsOnConnection++;
+
+    if ((simHttp.closeAfterRequests != 0) && (httpRequestsOnConnection > simHttp.closeAfterRequests))
+    {
+      // dropped without an answer
+      tcpPeerFinInUs = arrivalInUs + getHalfRttInUs();
+      break;
+    }
+
+    isClose = (headers.find("connection: close") != std::string::npos) ||
+              ((simHttp.closeAfterRequests != 0) && (httpRequestsOnConnection == simHttp.closeAfterRequests));
+    snprintf(statusLine, sizeof(statusLine), "HTTP/1.1 %u OK\r\n", simHttp.statusCode);
+    response = statusLine;
+    response += "Content-Length: 0\r\n";
+    response += isClose ? "Connection: close\r\n\r\n" : "\r\n";
+
+    SimTcpChunk chunk;
+    chunk.arrivalInUs = arrivalInUs + (uint64_t)simHttp.responseDelayInMs * 1000 + getHalfRttInUs();
+    chunk.data = response;
+    tcpFromServer.push_back(chunk);
+
+    if (isClose)
+    {
+      tcpPeerFinInUs = chunk.arrivalInUs;
+    }
+  }
+}
+
+static void updateTcp(void)
+{
+  if ((tcpState == HAL_TCP_CONNECTING) && (simTimeInUs >= tcpEstablishedInUs))
+  {
+    tcpState = isTcpRefused ? HAL_TCP_CLOSED : HAL_TCP_ESTABLISHED;
+  }
+
+  while ((tcpToServer.empty() == false) && (tcpToServer.front().arrivalInUs <= simTimeInUs))
+  {
+    httpReceived += tcpToServer.front().data;
+    serveHttp(tcpToServer.front().arrivalInUs);
+    tcpToServer.pop_front();
+  }
+
+  if (isTcpSendOkPending && (simTimeInUs >= tcpAckInUs))
+  {
+    tcpUnacked = 0;
+  }
+
+  if ((tcpState == HAL_TCP_ESTABLISHED) && (tcpPeerFinInUs != 0) && (simTimeInUs >= tcpPeerFinInUs))
+  {
+    tcpState = HAL_TCP_CLOSING;
+  }
+
+  if ((tcpState == HAL_TCP_CLOSING) && isTcpOurFin && (simTimeInUs >= tcpClosedInUs))
+  {
+    tcpState = HAL_TCP_CLOSED;
+  }
+}
+
+static size_t getTcpAvailable(void)
+{
+  size_t count = 0;
+  std::deque<SimTcpChunk>::const_iterator chunk;
+
+  for (chunk = tcpFromServer.begin(); (chunk != tcpFromServer.end()) && (chunk->arrivalInUs <= simTimeInUs); chunk++)
+  {
+    count += chunk->data.size();
+  }
+
+  return count;
+}
+
+boolean halTcpConnect(IPAddress& address, uint16_t port)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US * 4);
+  tcpState = HAL_TCP_CONNECTING;
+  isTcpRefused = (address != SIM_HOST_ADDRESS) || (port != 80) || (simHttp.isAccepting == false);
+  tcpEstablishedInUs = simTimeInUs + ((uint64_t)simHttp.rttInMs * 1000);
+  tcpPeerFinInUs = 0;
+  isTcpOurFin = false;
+  isTcpSendOkPending = false;
+  tcpUnacked = 0;
+  tcpPending.clear();
+  tcpToServer.clear();
+  tcpFromServer.clear();
+  httpReceived.clear();
+  httpRequestsOnConnection = 0;
+
+  if (isTcpRefused == false)
+  {
+    simHttp.connectionCount++;
+  }
+
+  return true;
+}
+
+HAL_TCP_STATE_t halTcpState(void)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  updateTcp();
+  return tcpState;
+}
+
+boolean halTcpConnected(void)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  updateTcp();
+  return (tcpState == HAL_TCP_ESTABLISHED) ||
+         ((tcpState == HAL_TCP_CLOSING) && (isTcpOurFin == false) && (getTcpAvailable() > 0));
+}
+
+uint16_t halTcpTxFree(void)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  updateTcp();
+  return SIM_TCP_WINDOW - tcpUnacked - tcpPending.size();
+}
+
+void halTcpBuffer(const uint8_t *data, uint16_t length)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US + (uint64_t)SIM_W5100_BYTE_TIME_IN_US * length);
+
+  if (tcpUnacked + tcpPending.size() + length > SIM_TCP_WINDOW)
+  {
+    simTcpOverflowErrors += tcpUnacked + tcpPending.size() + length - SIM_TCP_WINDOW;
+  }
+
+  tcpPending.append((const char *)data, length);
+}
+
+void halTcpSend(void)
+{
+  SimTcpChunk chunk;
+
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  updateTcp();
+
+  if (tcpState != HAL_TCP_ESTABLISHED)
+  {
+    return;
+  }
+
+  chunk.arrivalInUs = simTimeInUs + getHalfRttInUs();
+  chunk.data = tcpPending;
+  tcpToServer.push_back(chunk);
+  tcpUnacked += tcpPending.size();
+  tcpPending.clear();
+  tcpAckInUs = simTimeInUs + ((uint64_t)simHttp.rttInMs * 1000);
+  isTcpSendOkPending = true;
+}
+
+boolean halTcpIsSent(void)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  updateTcp();
+
+  if (isTcpSendOkPending && (simTimeInUs >= tcpAckInUs))
+  {
+    isTcpSendOkPending = false;
+    return true;
+  }
+
+  return false;
+}
+
+int halTcpRead(void)
+{
+  int c;
+
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  updateTcp();
+
+  if (getTcpAvailable() == 0)
+  {
+    return -1;
+  }
+
+  c = (uint8_t)tcpFromServer.front().data[0];
+  tcpFromServer.front().data.erase(0, 1);
+
+  if (tcpFromServer.front().data.empty())
+  {
+    tcpFromServer.pop_front();
+  }
+
+  return c;
+}
+
+// our FIN.  The server closes its side when it gets it, if it hasn't already
+void halTcpDisconnect(void)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  updateTcp();
+
+  if ((tcpState == HAL_TCP_CLOSED) || isTcpOurFin)
+  {
+    return;
+  }
+
+  isTcpOurFin = true;
+  tcpState = HAL_TCP_CLOSING;
+  tcpClosedInUs = simTimeInUs + ((uint64_t)simHttp.rttInMs * 1000);
+}
+
+void halTcpClose(void)
+{
+  simAdvance(SIM_W5100_COMMAND_TIME_IN_US);
+  tcpState = HAL_TCP_CLOSED;
+  tcpPending.clear();
+  tcpToServer.clear();
+  tcpFromServer.clear();
+  isTcpSendOkPending = false;
+  tcpUnacked = 0;
+}
@@ -0,0 +1,102 @@
+// Runs the sketch on the host through a simulated night, then prints what the board would have shown.
+//
+//   hedgie_host [trace]
+//
+// The trace is "timeInUs level" lines, the wheel sensor's ADC reading from that time until the next line, from the start of the
+// run.  Without one, hedgie runs a bout of 200 revolutions at 1.2s every half hour.  The run starts at 8pm Pacific on 1 June 2024
+// and lasts 12 hours
+
+#include "sketch.h"
+
+#define HOST_START_TIME (1717297200UL)        // 2024-06-02 03:00 UTC
+#define HOST_RUN_IN_HOURS (12)
+#define HOST_BOUT_INTERVAL_IN_US (1800000000ULL)
+#define HOST_BOUT_ROTATIONS (200)
+#define HOST_BOUT_PERIOD_IN_US (1200000UL)
+#define HOST_TOUCH_IN_US (500000UL)
+
+static void runFor(uint64_t timeInUs)
+{
+  uint64_t endInUs = simTimeInUs + timeInUs;
+
+  while (simTimeInUs < endInUs)
+  {
+    loop();
+  }
+}
+
+static bool loadTraceFile(const char *fileName, std::vector<std::pair<uint64_t, int> >& points)
+{
+  FILE *file = fopen(fileName, "r");
+  unsigned long long timeInUs;
+  int level;
+
+  if (file == NULL)
+  {
+    return false;
+  }
+
+  while (fscanf(file, "%llu %d", &timeInUs, &level) == 2)
+  {
+    points.push_back(std::make_pair((uint64_t)timeInUs, level));
+  }
+
+  fclose(file);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<std::pair<uint64_t, int> > points;
+  uint64_t endInUs = (uint64_t)HOST_RUN_IN_HOURS * 3600 * 1000000;
+  uint64_t boutInUs;
+
+  simInit(HOST_START_TIME);
+
+  if (argc > 1)
+  {
+    if (loadTraceFile(argv[1], points) == false)
+    {
+      fprintf(stderr, "can't read %s\n", argv[1]);
+      return 1;
+    }
+  }
+  else
+  {
+    points.push_back(std::make_pair(0ULL, SIM_WHITE_LEVEL));
+
+    for (boutInUs = HOST_BOUT_INTERVAL_IN_US; boutInUs < endInUs; boutInUs += HOST_BOUT_INTERVAL_IN_US)
+    {
+      simAddRotations(points, boutInUs, HOST_BOUT_ROTATIONS, HOST_BOUT_PERIOD_IN_US, SIM_WHITE_LEVEL, SIM_MIRROR_LEVEL);
+    }
+  }
+
+  simLoadTrace(points);
+
+  try
+  {
+    setup();
+    runFor(endInUs);
+
+    // touch the button for the night's stats
+    simSetButton(CAPTOUCH_BUTTON, true);
+    runFor(HOST_TOUCH_IN_US);
+    simSetButton(CAPTOUCH_BUTTON, false);
+    runFor(HOST_TOUCH_IN_US);
+  }
+  catch (SimReset&)
+  {
+    printf("watchdog reset at %.3fs\n", simTimeInUs / 1e6);
+    return 1;
+  }
+
+  printf("simulated %.0fs, %u ADC samples, %u captures, %.0fs asleep\n",
+         simTimeInUs / 1e6, simSampleCount, simEdgeCount, simIdleTimeInUs / 1e6);
+  printf("night:  %lu cm, %u bouts, fastest revolution %lu us\n",
+         (unsigned long)nightStats.totalDistanceInCm, diagnostics.boutCount, (unsigned long)nightStats.fastestRevolutionInUs);
+  printf("EEPROM writes %u, flash bytes programmed %u, HTTP requests %u\n",
+         simEepromWriteCount, simFlashBytesProgrammed, (unsigned)simHttp.requests.size());
+  printf("LCD, after a touch:\n  [%.16s]\n  [%.16s]\n", simLcd[0], simLcd[1]);
+  writeTaskStats(Serial);
+  return 0;
+}
@@ -0,0 +1,194 @@
+// Arduino core stand-in for the host build:  the types, Print and Serial, flash strings (plain memory on the host), and the few
+// core calls the sketch makes outside the HAL.  Interrupt masking is the simulator's (hal_host.cpp)
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH (1)
+#define LOW (0)
+#define DEC (10)
+#define HEX (16)
+#define OCT (8)
+#define BIN (2)
+
+#define _BV(bit) (1UL << (bit))
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef max
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+
+// flash strings and tables are ordinary memory
+class __FlashStringHelper;
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strcmp_P strcmp
+#define sprintf_P sprintf
+
+void noInterrupts(void);
+void interrupts(void);
+
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+
+      // like the AVR core, a byte that isn't taken ends the write
+      while (size-- && (write(*buffer++) != 0))
+      {
+        n++;
+      }
+
+      return n;
+    }
+
+    size_t write(const char *str)
+    {
+      return (str == NULL) ? 0 : write((const uint8_t *)str, strlen(str));
+    }
+
+    size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+    size_t print(const char s[]) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC) { return printNumber(n, base); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return printNumber(n, base); }
+    size_t print(unsigned long n, int base = DEC) { return printNumber(n, base); }
+    size_t print(double n, int digits = 2) { return printFloat(n, digits); }
+
+    size_t print(long n, int base = DEC)
+    {
+      size_t count = 0;
+
+      if ((base == DEC) && (n < 0))
+      {
+        count = print('-');
+        return count + printNumber(-(unsigned long)n, DEC);
+      }
+
+      return printNumber((unsigned long)n, base);
+    }
+
+    size_t println(void) { return write("\r\n"); }
+    template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+    template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+
+  private:
+    size_t printNumber(unsigned long n, int base)
+    {
+      char buf[8 * sizeof(long) + 1];
+      char *str = &buf[sizeof(buf) - 1];
+
+      *str = '\0';
+
+      if (base < 2)
+      {
+        base = 10;
+      }
+
+      do
+      {
+        char c = n % base;
+        n /= base;
+        *--str = (c < 10) ? c + '0' : c + 'A' - 10;
+      } while (n);
+
+      return write(str);
+    }
+
+    // the Arduino core's rounding, so the text matches the board's
+    size_t printFloat(double number, int digits)
+    {
+      size_t n = 0;
+      double rounding = 0.5;
+      unsigned long intPart;
+      double remainder;
+
+      if (isnan(number)) return print("nan");
+      if (isinf(number)) return print("inf");
+      if (number > 4294967040.0) return print("ovf");
+      if (number < -4294967040.0) return print("ovf");
+
+      if (number < 0.0)
+      {
+        n += print('-');
+        number = -number;
+      }
+
+      for (int i=0; i<digits; i++)
+      {
+        rounding /= 10.0;
+      }
+
+      number += rounding;
+      intPart = (unsigned long)number;
+      remainder = number - (double)intPart;
+      n += print(intPart);
+
+      if (digits > 0)
+      {
+        n += print('.');
+      }
+
+      while (digits-- > 0)
+      {
+        remainder *= 10.0;
+        unsigned int toPrint = (unsigned int)remainder;
+        n += print(toPrint);
+        remainder -= toPrint;
+      }
+
+      return n;
+    }
+};
+
+// the serial port is stdout
+class HardwareSerial : public Print
+{
+  public:
+    void begin(unsigned long) {}
+
+    virtual size_t write(uint8_t c)
+    {
+      putchar(c);
+      return 1;
+    }
+
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,33 @@
+// IPAddress stand-in for the host build.  As on the board, the uint32_t form is the 4 bytes in memory order
+
+#ifndef IPADDRESS_H
+#define IPADDRESS_H
+
+#include <Arduino.h>
+
+class IPAddress
+{
+  public:
+    IPAddress() { memset(bytes, 0, sizeof(bytes)); }
+    IPAddress(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3) { bytes[0] = b0; bytes[1] = b1; bytes[2] = b2; bytes[3] = b3; }
+    IPAddress(uint32_t address) { memcpy(bytes, &address, sizeof(bytes)); }
+    IPAddress(const uint8_t *address) { memcpy(bytes, address, sizeof(bytes)); }
+
+    operator uint32_t() const
+    {
+      uint32_t address;
+
+      memcpy(&address, bytes, sizeof(address));
+      return address;
+    }
+
+    bool operator==(const IPAddress& other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+    bool operator!=(const IPAddress& other) const { return !(*this == other); }
+    uint8_t operator[](int index) const { return bytes[index]; }
+    uint8_t& operator[](int index) { return bytes[index]; }
+
+  private:
+    uint8_t bytes[4];
+};
+
+#endif
@@ -0,0 +1,149 @@
+// RTClib stand-in for the host build:  DateTime only, with the library's arithmetic and memory layout (the sketch saves one to
+// EEPROM).  Like the library, years are 2000 to 2099, and every year divisible by 4 is a leap year
+
+#ifndef RTCLIB_H
+#define RTCLIB_H
+
+#include <Arduino.h>
+
+#define SECONDS_FROM_1970_TO_2000 946684800
+
+class DateTime
+{
+  public:
+    DateTime(uint32_t t = 0)
+    {
+      uint16_t days;
+      uint8_t leap;
+
+      t -= SECONDS_FROM_1970_TO_2000;
+      ss = t % 60;
+      t /= 60;
+      mm = t % 60;
+      t /= 60;
+      hh = t % 24;
+      days = t / 24;
+
+      for (yOff = 0; ; ++yOff)
+      {
+        leap = yOff % 4 == 0;
+
+        if (days < 365 + leap)
+        {
+          break;
+        }
+
+        days -= 365 + leap;
+      }
+
+      for (m = 1; ; ++m)
+      {
+        uint8_t daysPerMonth = daysInMonth(m);
+
+        if (leap && (m == 2))
+        {
+          ++daysPerMonth;
+        }
+
+        if (days < daysPerMonth)
+        {
+          break;
+        }
+
+        days -= daysPerMonth;
+      }
+
+      d = days + 1;
+    }
+
+    DateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour = 0, uint8_t min = 0, uint8_t sec = 0)
+    {
+      if (year >= 2000)
+      {
+        year -= 2000;
+      }
+
+      yOff = year;
+      m = month;
+      d = day;
+      hh = hour;
+      mm = min;
+      ss = sec;
+    }
+
+    // compiler __DATE__ and __TIME__:  "Jan  1 2016", "12:34:56"
+    DateTime(const char *date, const char *time)
+    {
+      static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+      char month[4] = { date[0], date[1], date[2], 0 };
+
+      yOff = atoi(date + 9);
+      m = ((strstr(months, month) - months) / 3) + 1;
+      d = atoi(date + 4);
+      hh = atoi(time);
+      mm = atoi(time + 3);
+      ss = atoi(time + 6);
+    }
+
+    uint16_t year() const { return 2000 + yOff; }
+    uint8_t month() const { return m; }
+    uint8_t day() const { return d; }
+    uint8_t hour() const { return hh; }
+    uint8_t minute() const { return mm; }
+    uint8_t second() const { return ss; }
+
+    // 0 is Sunday.  Jan 1 2000 was a Saturday
+    uint8_t dayOfWeek() const
+    {
+      return (date2days(yOff, m, d) + 6) % 7;
+    }
+
+    uint32_t secondstime() const
+    {
+      return time2long(date2days(yOff, m, d), hh, mm, ss);
+    }
+
+    uint32_t unixtime() const
+    {
+      return secondstime() + SECONDS_FROM_1970_TO_2000;
+    }
+
+  protected:
+    uint8_t yOff, m, d, hh, mm, ss;
+
+    static uint8_t daysInMonth(uint8_t month)
+    {
+      static const uint8_t days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+      return days[month - 1];
+    }
+
+    static uint16_t date2days(uint16_t y, uint8_t m, uint8_t d)
+    {
+      uint16_t days = d;
+
+      if (y >= 2000)
+      {
+        y -= 2000;
+      }
+
+      for (uint8_t i = 1; i < m; ++i)
+      {
+        days += daysInMonth(i);
+      }
+
+      if ((m > 2) && (y % 4 == 0))
+      {
+        ++days;
+      }
+
+      return days + 365 * y + (y + 3) / 4 - 1;
+    }
+
+    static uint32_t time2long(uint16_t days, uint8_t h, uint8_t m, uint8_t s)
+    {
+      return ((days * 24UL + h) * 60 + m) * 60 + s;
+    }
+};
+
+#endif
@@ -0,0 +1,155 @@
+// Simulator controls for the host tests and benchmarks.  hal_host.cpp implements hedgie_hal.h on top of them.
+//
+// Time is virtual, and only moves inside the HAL:  delays and sleeps, and the modelled time of each transfer (an EEPROM write,
+// an I2C or SPI byte, a W5100 register access).  The CPU itself is free.  Interrupts (the ADC sample every 1.024ms, comparator
+// edges, the watchdog) run inside the HAL call during which they come due, unless noInterrupts() holds them off.
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include "../hedgie_hal.h"
+
+#define SIM_ADC_PERIOD_IN_US (1024)              // Timer0 overflow, which triggers the conversions
+#define SIM_COMPARATOR_STEP_IN_US (32)           // the comparator output is checked this often
+#define SIM_WATCHDOG_PERIOD_IN_US (8000000ULL)
+#define SIM_BANDGAP_COUNTS (225)                 // 1.1V, in ADC counts of 5V
+#define SIM_EEPROM_SIZE (1024)
+#define SIM_EEPROM_WRITE_TIME_IN_US (3400)
+#define SIM_I2C_BYTE_TIME_IN_US (90)             // 9 bits at 100kHz
+#define SIM_SPI_BYTE_TIME_IN_US (2)              // 8MHz, and the loop around SPI.transfer()
+#define SIM_W5100_BYTE_TIME_IN_US (10)           // a W5100 buffer byte is a 4 byte SPI frame
+#define SIM_W5100_COMMAND_TIME_IN_US (40)        // a socket command, or a few register reads
+#define SIM_FLASH_SIZE (0x100000UL)              // W25Q80, 1MB
+#define SIM_FLASH_PROGRAM_TIME_IN_US (700)
+#define SIM_FLASH_ERASE_TIME_IN_US (150000)
+#define SIM_LCD_CLEAR_TIME_IN_US (1520)
+#define SIM_TCP_WINDOW (2048)                    // the W5100's transmit buffer, per socket
+#define SIM_WHEEL_CIRCUMFERENCE_IN_CM (85)
+#define SIM_MIRROR_WIDTH_IN_CM (4)
+#define SIM_WHITE_LEVEL (150)                    // ADC counts, from the white part of the wheel
+#define SIM_MIRROR_LEVEL (600)
+#define SIM_TOUCH_SENSOR_PIN (6)                 // active high.  Other buttons are active low
+#define SIM_DHCP_TIMEOUT_IN_MS (4000)           // Ethernet.begin() gives up after this
+#define SIM_RTC_ADDRESS (0x68)                   // DS1307
+#define SIM_MCP9808_ADDRESS (0x18)
+#define SIM_MCP9808_AMBIENT (0x05)               // ambient temperature register
+#define SIM_LCD_ADDRESS (0x27)                   // PCF8574:  RS on P0, EN on P2, D4-D7 on P4-P7
+#define SIM_I2C_ADDRESS_NACK (2)                 // Wire.endTransmission() status
+#define SIM_FLASH_READ (0x03)                    // W25Qxx instructions
+#define SIM_FLASH_PAGE_PROGRAM (0x02)
+#define SIM_FLASH_WRITE_ENABLE (0x06)
+#define SIM_FLASH_READ_STATUS (0x05)
+#define SIM_FLASH_BLOCK_ERASE (0xD8)
+#define SIM_FLASH_JEDEC_ID (0x9F)
+#define SIM_HOST_ADDRESS (IPAddress(10, 0, 0, 2))        // the stand-in servers' address
+#define SIM_DNS_SERVER_ADDRESS (IPAddress(192, 168, 1, 1))
+
+// thrown by halReset(), when the watchdog count runs out
+struct SimReset
+{
+};
+
+// the wheel sensor, as the ADC reading at a time
+typedef int (*SimTrace_t)(uint64_t timeInUs);
+
+// what the NTP server does with one request
+struct SimNtpStep
+{
+  uint32_t requestDelayInMs;      // Arduino to server
+  uint32_t replyDelayInMs;        // and back
+  int32_t serverErrorInMs;        // server clock - true time
+  bool isLost;
+  bool isUnsynchronized;          // leap indicator 3, stratum 0
+  bool isWrongToken;              // the originate timestamp doesn't echo the request
+};
+
+struct SimNtpServer
+{
+  std::vector<SimNtpStep> steps;  // request n gets steps[n % size]
+  uint32_t requestCount;
+  uint32_t replyCount;
+};
+
+struct SimDnsServer
+{
+  uint32_t delayInMs;             // round trip
+  uint32_t ttlInSecs;
+  bool isDown;                    // queries are lost
+  std::map<std::string, IPAddress> names;    // anything else is SIM_HOST_ADDRESS, unless isNxDomain
+  bool isNxDomain;
+  uint32_t queryCount;
+};
+
+struct SimHttpServer
+{
+  bool isAccepting;               // false:  connections are refused
+  uint32_t rttInMs;
+  uint32_t responseDelayInMs;
+  uint16_t statusCode;
+  uint32_t closeAfterRequests;    // the server closes the connection after this many requests, without answering the rest.  0:  never
+  uint32_t connectionCount;
+  std::vector<std::string> requests;
+};
+
+// clock.  simInit() is a power up at utcTime:  RTC set to it, EEPROM and flash erased, network up, default servers
+extern uint64_t simTimeInUs;
+void simInit(uint32_t utcTime);
+void simAdvance(uint64_t timeInUs);
+uint64_t simUtcInUs(void);
+
+// wheel sensor.  Without a trace, the sensor sees white
+extern SimTrace_t simTrace;
+void simLoadTrace(const std::vector<std::pair<uint64_t, int> >& points);     // steps:  the level holds until the next point
+int simTraceLevel(uint64_t timeInUs);
+void simAddRotations(std::vector<std::pair<uint64_t, int> >& points, uint64_t startInUs, uint32_t rotations, uint32_t periodInUs,
+                     int whiteLevel, int mirrorLevel);   // a 4cm mirror on the 85cm wheel, at the start of each period
+extern uint32_t simSampleCount;               // ADC interrupts
+extern uint32_t simEdgeCount;                 // Timer1 captures
+extern bool simIsComparatorDividerFitted;     // the optional 15k/82k divider on A1, for a sketch built with COMPARATOR_MIRROR_CHANNEL 1
+extern uint32_t simWakeCount;                 // comparator wakes
+extern uint64_t simFirstSampleTimeInUs;       // first ADC interrupt or capture since simInit(), 0 for none
+extern uint64_t simIdleTimeInUs;
+
+// buttons and LEDs, by pin
+void simSetButton(uint8_t pin, bool isPressed);
+extern bool simLed[16];
+
+// EEPROM
+extern uint8_t simEeprom[SIM_EEPROM_SIZE];
+extern uint32_t simEepromWriteCount;
+extern uint32_t simEepromCellWriteCount[SIM_EEPROM_SIZE];    // wear, by address
+extern uint64_t simEepromWaitTimeInUs;        // time spent waiting for earlier writes to finish
+extern uint32_t simEepromResetAfterWrites;    // 0 for never.  Otherwise a reset (SimReset) comes instead of that many'th write
+
+// I2C devices:  DS1307, MCP9808, and the HD44780 LCD behind a PCF8574
+void simSetRtc(uint32_t utcTime);
+uint32_t simRtcTime(void);
+extern int32_t simRtcDriftPpm;
+extern float simTemperatureInC;
+extern char simLcd[2][17];
+extern uint32_t simLcdBusyErrors;              // commands sent while the LCD was still clearing
+extern uint8_t simI2cFailAddress;              // the next simI2cFailCount transactions to this address get simI2cFailStatus
+extern uint32_t simI2cFailCount;
+extern uint8_t simI2cFailStatus;
+extern uint32_t simI2cTransactionCount;
+
+// W25Qxx flash
+extern bool simIsFlashFitted;
+extern std::vector<uint8_t> simFlash;
+extern uint32_t simFlashBytesProgrammed;
+extern uint32_t simFlashBusyErrors;            // commands other than a status read while busy
+
+// network
+extern bool simIsDhcpOk;
+extern uint32_t simDhcpTimeInMs;
+extern SimDnsServer simDns;
+extern SimNtpServer simNtp;
+extern SimHttpServer simHttp;
+extern uint32_t simTcpOverflowErrors;          // bytes given to halTcpBuffer() beyond halTcpTxFree()
+
+#endif
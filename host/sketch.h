@@ -0,0 +1,21 @@
+// The sketch, compiled for the host.  Each host program includes this once, and links hal_host.o.
+//
+// The std headers come first, ahead of Arduino.h's min() and max() macros.  The sketch's structs are packed, as avr-gcc lays
+// them out, so the EEPROM and flash records have the board's sizes
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include "sim.h"
+
+#pragma pack(push, 1)
+#include "../hedgie_runs_v8_5.cpp"
+#pragma pack(pop)
+
+#endif
@@ -0,0 +1,30 @@
+// Checks for the host tests.  A failed check prints where, and main() returns the failure count
+
+#ifndef TEST_H
+#define TEST_H
+
+static int testFailures = 0;
+
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      testFailures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  do \
+  { \
+    long long e = (long long)(expected); \
+    long long a = (long long)(actual); \
+    if (e != a) \
+    { \
+      printf("%s:%d: CHECK_EQUAL(%s, %s) failed:  %lld != %lld\n", __FILE__, __LINE__, #expected, #actual, e, a); \
+      testFailures++; \
+    } \
+  } while (0)
+
+#endif
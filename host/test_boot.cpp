@@ -0,0 +1,194 @@
+// Reset to first sample.  A night run hangs loop(), the watchdog resets the board, and the sketch boots again from the EEPROM
+// and RTC the reset left behind, with the wheel still turning.  Measured from the reset (after the bootloader) to the first ADC
+// sample, and on to the first rotation counted, for a few ways the boot can go.  Also checks that no running was lost:  the
+// rotations counted before the hang are recovered from the EEPROM rotation counter, also when the wheel turns fast enough that the
+// counter would wrap between the 5 minute saves.
+//
+// Each boot is a fresh process, as the sketch's globals are only initialized once per process
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "sketch.h"
+#include "test.h"
+
+#define TEST_START_TIME (1717308000UL)          // 2024-06-02 06:00 UTC, 11pm Pacific
+#define TEST_DAY_TIME (1717354800UL)            // 2024-06-02 19:00 UTC, noon Pacific
+#define TEST_RUN_IN_US (600000000ULL)           // before the hang, so there's a night stats save and a few rotations since
+#define TEST_PERIOD_IN_US (1000000UL)
+#define TEST_FAST_PERIOD_IN_US (250000UL)       // 1200 rotations in 5 mins, more than the rotation counter holds
+#define TEST_AFTER_RESET_IN_US (60000000ULL)
+#define TEST_MAX_FIRST_SAMPLE_IN_US (10000)     // "within milliseconds"
+
+typedef struct
+{
+  const char *name;
+  bool isDay;
+  bool isColdStart;       // erased EEPROM:  a new board
+  bool isDhcpDown;
+  bool isLcdMissing;
+  bool isRtcMissing;
+  uint32_t periodInUs;
+} TestBoot_t;
+
+static const TestBoot_t testBoots[] =
+{
+  { "night reset",                   false, false, false, false, false, TEST_PERIOD_IN_US },
+  { "night reset, DHCP down",        false, false, true,  false, false, TEST_PERIOD_IN_US },
+  { "night reset, no LCD",           false, false, false, true,  false, TEST_PERIOD_IN_US },
+  { "night reset, RTC not answering", false, false, false, false, true, TEST_PERIOD_IN_US },
+  { "night reset, running fast",     false, false, false, false, false, TEST_FAST_PERIOD_IN_US },
+  { "day reset",                     true,  false, false, false, false, TEST_PERIOD_IN_US },
+  { "power up, new board",           false, true,  false, false, false, TEST_PERIOD_IN_US },
+};
+
+// what the reset leaves behind, passed from the process that hung to the one that boots
+typedef struct
+{
+  uint8_t eeprom[SIM_EEPROM_SIZE];
+  uint32_t rtcTime;
+  uint32_t distanceInCm;            // counted before the hang
+} ResetState_t;
+
+static ResetState_t *resetState;
+
+static void loadWheel(uint64_t phaseInUs, uint32_t periodInUs)
+{
+  std::vector<std::pair<uint64_t, int> > trace;
+
+  trace.push_back(std::make_pair(0ULL, SIM_WHITE_LEVEL));
+  simAddRotations(trace, phaseInUs, TEST_RUN_IN_US / periodInUs, periodInUs, SIM_WHITE_LEVEL, SIM_MIRROR_LEVEL);
+  simLoadTrace(trace);
+}
+
+// run the night, then hang loop() until the watchdog resets the board
+static void runUntilReset(uint32_t startTime, uint32_t periodInUs)
+{
+  simInit(startTime);
+  loadWheel(periodInUs / 2, periodInUs);
+  setup();
+
+  while (simTimeInUs < TEST_RUN_IN_US)
+  {
+    loop();
+  }
+
+  resetState->distanceInCm = nightStats.totalDistanceInCm;
+
+  try
+  {
+    while (true)
+    {
+      simAdvance(1000);
+    }
+  }
+  catch (SimReset&)
+  {
+    memcpy(resetState->eeprom, simEeprom, sizeof(simEeprom));
+    resetState->rtcTime = simRtcTime();
+  }
+}
+
+static int runBoot(const TestBoot_t *boot)
+{
+  uint32_t rotationsAfterReset;
+  uint32_t firstCountedInUs = 0;
+  uint32_t distanceInCm;
+
+  simInit(resetState->rtcTime);
+
+  if (boot->isColdStart == false)
+  {
+    memcpy(simEeprom, resetState->eeprom, sizeof(simEeprom));
+  }
+
+  simIsDhcpOk = !boot->isDhcpDown;
+
+  if (boot->isLcdMissing || boot->isRtcMissing)
+  {
+    simI2cFailAddress = boot->isLcdMissing ? SIM_LCD_ADDRESS : SIM_RTC_ADDRESS;
+    simI2cFailStatus = SIM_I2C_ADDRESS_NACK;
+    simI2cFailCount = 0xFFFFFFFF;
+
+    if (boot->isRtcMissing)
+    {
+      // the software clock has nothing to start from, so the RTC comes back after the boot
+      simI2cFailCount = 3 * I2C_MAX_ATTEMPTS * CLOCK_SYNC_READS;
+    }
+  }
+
+  // the wheel keeps turning through the reset, the next mirror 200ms after it
+  loadWheel(200000, boot->periodInUs);
+  setup();
+  distanceInCm = nightStats.totalDistanceInCm;
+
+  while (simTimeInUs < TEST_AFTER_RESET_IN_US)
+  {
+    loop();
+
+    if ((firstCountedInUs == 0) && (nightStats.totalDistanceInCm != distanceInCm))
+    {
+      firstCountedInUs = simTimeInUs;
+    }
+  }
+
+  printf("%-32s %12llu %14u %12u %13u %12u\n", boot->name, (unsigned long long)simFirstSampleTimeInUs,
+         diagnostics.bootToSamplingInUs, firstCountedInUs / 1000, diagnostics.bootToNetworkInMs,
+         diagnostics.rotationsRecoveredAtReset);
+
+  CHECK(simFirstSampleTimeInUs > 0);
+  CHECK(simFirstSampleTimeInUs <= TEST_MAX_FIRST_SAMPLE_IN_US);
+
+  if (boot->isDay == false)
+  {
+    // every mirror after the reset counts.  The ones that went by while loop() hung are lost, they were never counted
+    rotationsAfterReset = ((TEST_AFTER_RESET_IN_US - 200000) / boot->periodInUs) + 1;
+    CHECK(firstCountedInUs > 0);
+
+    if (boot->isColdStart == false)
+    {
+      CHECK_EQUAL(resetState->distanceInCm + (rotationsAfterReset * WHEEL_CIRCUMFERENCE_IN_CM), nightStats.totalDistanceInCm);
+    }
+  }
+
+  return testFailures;
+}
+
+int main(void)
+{
+  int status;
+  uint8_t i;
+  uint8_t j;
+
+  resetState = (ResetState_t *)mmap(NULL, sizeof(ResetState_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  printf("%-32s %12s %14s %12s %13s %12s\n", "", "sample (us)", "sampling (us)", "count (ms)", "network (ms)", "recovered");
+  fflush(stdout);
+
+  for (i=0; i<sizeof(testBoots)/sizeof(testBoots[0]); i++)
+  {
+    // the board that hangs, then the board that boots
+    for (j=0; j<2; j++)
+    {
+      if (fork() == 0)
+      {
+        if (j == 0)
+        {
+          runUntilReset(testBoots[i].isDay ? TEST_DAY_TIME : TEST_START_TIME, testBoots[i].periodInUs);
+          _exit(0);
+        }
+
+        status = runBoot(&testBoots[i]);
+        fflush(stdout);
+        _exit(status);
+      }
+
+      wait(&status);
+      testFailures += WEXITSTATUS(status);
+    }
+  }
+
+  printf("sample:  reset to the first ADC sample.  sampling:  to setupWheelSampling() done.  count:  to the first rotation "
+         "counted.\nnetwork:  to DHCP done, 0 for never.  recovered:  rotations since the last night stats save, from the counter\n");
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
@@ -0,0 +1,139 @@
+// Rotation capture:  synthetic wheel sensor traces through the sampling interrupt (ADC or, in test_capture_comparator, the
+// comparator capture), the rotation buffer and taskCountRotations(), checked against nightStats.  The run starts at 10:30pm
+// Pacific, so every rotation counts
+
+#include "sketch.h"
+#include "test.h"
+
+#define TEST_START_TIME (1717306200UL)         // 2024-06-02 05:30 UTC
+#define TEST_QUIET_IN_US (60000000ULL)         // before each segment, longer than a bout gap
+#define TEST_SETTLE_IN_US (5000000ULL)         // after it, for loop() to count the last rotations
+#define TEST_NOISE_STEP_IN_US (500)
+#define TEST_BLOCKED_LOOP_IN_MS (4000)         // like the old blocking uploads
+
+typedef std::vector<std::pair<uint64_t, int> > Trace_t;
+
+static Trace_t trace;
+static uint64_t traceEndInUs = 0;
+
+// a quiet white gap, then the rotations
+static void addSegment(uint32_t rotations, uint32_t periodInUs, int whiteLevel, int mirrorLevel)
+{
+  traceEndInUs += TEST_QUIET_IN_US;
+  trace.push_back(std::make_pair(traceEndInUs - TEST_QUIET_IN_US, whiteLevel));
+  simAddRotations(trace, traceEndInUs, rotations, periodInUs, whiteLevel, mirrorLevel);
+  traceEndInUs += (uint64_t)rotations * periodInUs;
+}
+
+// each mirror pass has a white dip in the middle, shorter than the white debounce
+static void addBouncySegment(uint32_t rotations, uint32_t periodInUs, uint32_t dipInUs)
+{
+  uint64_t mirrorInUs = (uint64_t)periodInUs * SIM_MIRROR_WIDTH_IN_CM / SIM_WHEEL_CIRCUMFERENCE_IN_CM;
+  uint64_t startInUs;
+  uint32_t i;
+
+  traceEndInUs += TEST_QUIET_IN_US;
+
+  for (i=0; i<rotations; i++)
+  {
+    startInUs = traceEndInUs + ((uint64_t)i * periodInUs);
+    trace.push_back(std::make_pair(startInUs, SIM_MIRROR_LEVEL));
+    trace.push_back(std::make_pair(startInUs + (mirrorInUs / 2), SIM_WHITE_LEVEL));
+    trace.push_back(std::make_pair(startInUs + (mirrorInUs / 2) + dipInUs, SIM_MIRROR_LEVEL));
+    trace.push_back(std::make_pair(startInUs + mirrorInUs + dipInUs, SIM_WHITE_LEVEL));
+  }
+
+  traceEndInUs += (uint64_t)rotations * periodInUs;
+}
+
+// uniform noise on both levels, a new value every TEST_NOISE_STEP_IN_US
+static void addNoisySegment(uint32_t rotations, uint32_t periodInUs, int noise)
+{
+  uint64_t mirrorInUs = (uint64_t)periodInUs * SIM_MIRROR_WIDTH_IN_CM / SIM_WHEEL_CIRCUMFERENCE_IN_CM;
+  uint64_t endInUs;
+  uint64_t timeInUs;
+  int level;
+
+  traceEndInUs += TEST_QUIET_IN_US;
+  endInUs = traceEndInUs + ((uint64_t)rotations * periodInUs);
+
+  for (timeInUs = traceEndInUs; timeInUs < endInUs; timeInUs += TEST_NOISE_STEP_IN_US)
+  {
+    level = (((timeInUs - traceEndInUs) % periodInUs) < mirrorInUs) ? SIM_MIRROR_LEVEL : SIM_WHITE_LEVEL;
+    trace.push_back(std::make_pair(timeInUs, level + (rand() % (2 * noise + 1)) - noise));
+  }
+
+  trace.push_back(std::make_pair(endInUs, SIM_WHITE_LEVEL));
+  traceEndInUs = endInUs;
+}
+
+static void runUntil(uint64_t endInUs, uint32_t blockedLoopInMs)
+{
+  while (simTimeInUs < endInUs)
+  {
+    loop();
+
+    if (blockedLoopInMs != 0)
+    {
+      halDelay(blockedLoopInMs);
+    }
+  }
+}
+
+// runs the trace through the newest segment, and returns the rotations counted
+static uint32_t runSegment(uint32_t blockedLoopInMs)
+{
+  uint32_t distanceInCm = nightStats.totalDistanceInCm;
+
+  simLoadTrace(trace);
+  runUntil(traceEndInUs + TEST_SETTLE_IN_US, blockedLoopInMs);
+  return (nightStats.totalDistanceInCm - distanceInCm) / WHEEL_CIRCUMFERENCE_IN_CM;
+}
+
+int main(void)
+{
+  srand(1);
+  simInit(TEST_START_TIME);
+  trace.push_back(std::make_pair(0ULL, SIM_WHITE_LEVEL));
+  simLoadTrace(trace);
+  setup();
+
+  // a steady run
+  addSegment(50, 1200000, SIM_WHITE_LEVEL, SIM_MIRROR_LEVEL);
+  CHECK_EQUAL(50, runSegment(0));
+
+  // fast:  the mirror is 12ms, the white well over the debounce
+  addSegment(100, 250000, SIM_WHITE_LEVEL, SIM_MIRROR_LEVEL);
+  CHECK_EQUAL(100, runSegment(0));
+
+  // loop() blocked for seconds at a time:  the rotations wait in the buffer
+  addSegment(60, 300000, SIM_WHITE_LEVEL, SIM_MIRROR_LEVEL);
+  CHECK_EQUAL(60, runSegment(TEST_BLOCKED_LOOP_IN_MS));
+  CHECK_EQUAL(0, rotationBufferOverflowCount);
+
+  // a 5ms dip into white in each mirror pass is one rotation
+  addBouncySegment(40, 1000000, 5000);
+  CHECK_EQUAL(40, runSegment(0));
+
+  // sensor noise, short of the thresholds
+  addNoisySegment(40, 800000, 60);
+  CHECK_EQUAL(40, runSegment(0));
+
+#ifndef WHEEL_SENSOR_COMPARATOR
+  // the white level steps up past the fixed threshold (ambient light).  The adaptive detector loses at most the first
+  // rotation while its levels move over.  The comparator's threshold is fixed, so this is the ADC build only
+  addSegment(50, 1000000, 320, 800);
+  CHECK(runSegment(0) >= 49);
+  CHECK((adaptiveDetector.whiteLevel >> ADAPTIVE_LEVEL_SHIFT) > 300);
+#endif
+
+  // the fastest revolution, from the 250ms segment, is good to a sample.  Interval stats reach nightStats at the next 5 minute
+  // boundary
+  runUntil(simTimeInUs + 300000000ULL, 0);
+  CHECK(nightStats.fastestRevolutionInUs >= 250000 - SIM_ADC_PERIOD_IN_US);
+  CHECK(nightStats.fastestRevolutionInUs <= 250000 + SIM_ADC_PERIOD_IN_US);
+  CHECK_EQUAL(0, rotationBufferOverflowCount);
+  printf("%u ADC samples, %u captures, %lu cm\n", simSampleCount, simEdgeCount, (unsigned long)nightStats.totalDistanceInCm);
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
@@ -0,0 +1,202 @@
+// Night history over a reset:  TEST_NIGHTS mornings are added to the ring (it wraps), and the power fails at each EEPROM write of
+// the last addNightToHistory(), the night's summary and then the 7 and 30 day totals.  The board boots again from the EEPROM that
+// was left.  Every night already in the ring has to be there, the new one there or not at all, and the totals have to be the ones
+// for the nights in the ring.  Also boots a history written before the format marker, which has to be kept
+//
+// Each boot is a fresh process, as the sketch's globals are only initialized once per process
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "sketch.h"
+#include "test.h"
+
+#define TEST_FIRST_MORNING_TIME (1717336800UL)  // 2024-06-02 14:00 UTC, 7am Pacific
+#define TEST_NIGHTS (40)
+
+// what the reset leaves behind, passed from the process that had it to the one that boots
+typedef struct
+{
+  uint8_t eeprom[SIM_EEPROM_SIZE];
+  uint32_t lastNightWrites;       // EEPROM writes of the last addNightToHistory(), without a reset
+  bool isReset;
+} ResetState_t;
+
+static ResetState_t *resetState;
+
+static uint16_t getTestDayNumber(uint8_t night)
+{
+  return ((TEST_FIRST_MORNING_TIME - 7 * 3600UL) / 86400UL) - DAYS_FROM_1970_TO_2000 + night;
+}
+
+static uint16_t getTestDistanceInM(uint8_t night)
+{
+  return 1000 + (night * 37);
+}
+
+static uint8_t getTestBoutCount(uint8_t night)
+{
+  return night % 7;
+}
+
+// the mornings, with the power failing at the resetAtWrite'th EEPROM write of the last one (0 for never)
+static void addNights(uint32_t resetAtWrite)
+{
+  uint32_t writeCount = 0;
+  uint8_t night;
+
+  simInit(TEST_FIRST_MORNING_TIME);
+  setup();
+
+  try
+  {
+    for (night=0; night<TEST_NIGHTS; night++)
+    {
+      setSoftwareClock(TEST_FIRST_MORNING_TIME + (night * 86400UL));
+      nightStats.totalDistanceInCm = getTestDistanceInM(night) * 100UL;
+      diagnostics.boutCount = getTestBoutCount(night);
+
+      if (night == TEST_NIGHTS - 1)
+      {
+        writeCount = simEepromWriteCount;
+        simEepromResetAfterWrites = resetAtWrite;
+      }
+
+      addNightToHistory();
+    }
+
+    resetState->lastNightWrites = simEepromWriteCount - writeCount;
+    resetState->isReset = false;
+  }
+  catch (SimReset&)
+  {
+    resetState->isReset = true;
+  }
+
+  memcpy(resetState->eeprom, simEeprom, sizeof(simEeprom));
+}
+
+static int checkBoot(void)
+{
+  NightSummary_t summary;
+  HistoryWindow_t expected[NUM_HISTORY_WINDOWS];
+  uint16_t newestDay;
+  uint8_t newestNight = TEST_NIGHTS - 2;
+  uint8_t slot;
+  uint8_t night;
+  uint8_t i;
+
+  simInit(TEST_FIRST_MORNING_TIME + (TEST_NIGHTS * 86400UL));
+  memcpy(simEeprom, resetState->eeprom, sizeof(simEeprom));
+  setup();
+
+  // the nights the last one didn't overwrite
+  for (night=TEST_NIGHTS-HISTORY_SLOTS; night<TEST_NIGHTS-1; night++)
+  {
+    readNightSummary(night % HISTORY_SLOTS, &summary);
+    CHECK_EQUAL(getTestDayNumber(night), summary.dayNumber);
+    CHECK_EQUAL(getTestDistanceInM(night), summary.distanceInM);
+  }
+
+  // the last one, all of it, nothing, or still the night it was overwriting
+  readNightSummary((TEST_NIGHTS - 1) % HISTORY_SLOTS, &summary);
+
+  if (summary.dayNumber == getTestDayNumber(TEST_NIGHTS - 1 - HISTORY_SLOTS))
+  {
+    CHECK_EQUAL(getTestDistanceInM(TEST_NIGHTS - 1 - HISTORY_SLOTS), summary.distanceInM);
+  }
+  else if (summary.dayNumber != HISTORY_EMPTY_DAY)
+  {
+    CHECK_EQUAL(getTestDayNumber(TEST_NIGHTS - 1), summary.dayNumber);
+    CHECK_EQUAL(getTestDistanceInM(TEST_NIGHTS - 1), summary.distanceInM);
+    CHECK_EQUAL(getTestBoutCount(TEST_NIGHTS - 1), summary.boutCount);
+    newestNight = TEST_NIGHTS - 1;
+  }
+
+  // the totals, from the test's nights
+  newestDay = getTestDayNumber(newestNight);
+  memset(expected, 0, sizeof(expected));
+
+  for (i=0; i<NUM_HISTORY_WINDOWS; i++)
+  {
+    for (night=newestNight+1-historyWindowDays[i]; night<=newestNight; night++)
+    {
+      expected[i].distanceInM += getTestDistanceInM(night);
+      expected[i].boutCount += getTestBoutCount(night);
+      expected[i].nightCount++;
+    }
+
+    slot = (newestNight + 1 - historyWindowDays[i]) % HISTORY_SLOTS;
+    CHECK_EQUAL(expected[i].distanceInM, historyWindows[i].distanceInM);
+    CHECK_EQUAL(expected[i].boutCount, historyWindows[i].boutCount);
+    CHECK_EQUAL(expected[i].nightCount, historyWindows[i].nightCount);
+    CHECK_EQUAL(slot, historyWindows[i].oldestSlot);
+  }
+
+  CHECK_EQUAL(newestDay, historyCountedDay);
+  CHECK_EQUAL(getHistoryWindowsCrc(), halEepromRead(EEPROMaddrForHistoryWindows + sizeof(historyWindows) + 2));
+  CHECK_EQUAL(HISTORY_FORMAT_MARKER, halEepromRead(EEPROMaddrForHistoryFormat));
+  return testFailures;
+}
+
+// runs each step in its own process
+static void runInChild(uint32_t resetAtWrite, bool isBoot)
+{
+  int status;
+
+  fflush(stdout);
+
+  if (fork() == 0)
+  {
+    status = isBoot ? checkBoot() : 0;
+
+    if (isBoot == false)
+    {
+      addNights(resetAtWrite);
+    }
+
+    fflush(stdout);
+    _exit(status);
+  }
+
+  wait(&status);
+  testFailures += WEXITSTATUS(status);
+}
+
+int main(void)
+{
+  uint32_t lastNightWrites;
+  uint32_t resets = 0;
+  uint32_t write;
+  int failures;
+
+  resetState = (ResetState_t *)mmap(NULL, sizeof(ResetState_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  // without a reset, to count the writes
+  runInChild(0, false);
+  lastNightWrites = resetState->lastNightWrites;
+  runInChild(0, true);
+
+  for (write=1; write<=lastNightWrites; write++)
+  {
+    failures = testFailures;
+    runInChild(write, false);
+    CHECK(resetState->isReset);
+    resets++;
+    runInChild(0, true);
+
+    if (testFailures != failures)
+    {
+      printf("reset at write %u of %u:  history lost\n", write, lastNightWrites);
+    }
+  }
+
+  // a history from before the format marker
+  runInChild(0, false);
+  resetState->eeprom[EEPROMaddrForHistoryFormat] = 0xFF;
+  runInChild(0, true);
+
+  printf("%u nights, the last one %u EEPROM writes, %u resets part way through it\n", TEST_NIGHTS, lastNightWrites, resets);
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
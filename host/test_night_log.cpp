@@ -0,0 +1,406 @@
+// Night rotation log against the W25Qxx model:  synthetic nights are logged with appendNightLog() and serviceNightLog(), as the
+// rotation and night log tasks would, then read back with decodeNightLog().  Every rotation logged has to decode to its time since
+// the start of the night, to TEST_MAX_TIME_ERROR_IN_MS, and the rotations not logged have to be counted as drops.
+//
+// "steady" is 1 byte records, "changing pace" 2 byte ones.  "pauses" has an escape after each pause, with every other one timed
+// so its time ends in 0x7F (written a ms later, so it never starts with 0xFF).  "too much" fills the block.  Then a reset right
+// after an escape's 0 byte was written, before its time was:  the next boot has to carry on from the escape.  And more nights
+// than there are blocks, so the blocks are erased and used again, and the next boot has to find the newest night
+//
+// Each case is a fresh process, as the sketch's globals are only initialized once per process
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "sketch.h"
+#include "test.h"
+
+#define TEST_START_TIME (1717304400UL)          // 2024-06-02 05:00 UTC, 10pm Pacific
+#define TEST_MAX_TIME_ERROR_IN_MS (2)
+#define TEST_MAX_REPORTED_ERRORS (10)
+#define TEST_MAX_ROTATIONS (40000)              // kept over the reset
+#define TEST_WRAP_NIGHTS (SIM_FLASH_SIZE / NIGHT_LOG_BLOCK_SIZE + 3)
+
+typedef enum
+{
+  TEST_STEADY,
+  TEST_CHANGING,
+  TEST_PAUSES,
+} TEST_PACE_t;
+
+typedef struct
+{
+  const char *name;
+  TEST_PACE_t pace;
+  uint32_t rotations;
+  bool isFull;              // more than the block holds
+} TestNight_t;
+
+static const TestNight_t testNights[] =
+{
+  { "steady",         TEST_STEADY,   32400, false },
+  { "changing pace",  TEST_CHANGING, 20000, false },
+  { "pauses",         TEST_PAUSES,   20000, false },
+  { "too much",       TEST_CHANGING, 60000, true },
+};
+
+// one night as it was logged:  the time of each rotation logged, and where its record starts
+typedef struct
+{
+  std::vector<uint32_t> timesInMs;
+  std::vector<uint32_t> addresses;
+  std::vector<bool> isEscape;
+  uint32_t drops;
+} TestLog_t;
+
+// what the reset leaves behind, passed from the process that had it to the one that boots
+typedef struct
+{
+  uint8_t flash[SIM_FLASH_SIZE];
+  uint32_t timesInMs[TEST_MAX_ROTATIONS];   // of the rotations before the escape
+  uint32_t rotations;
+  uint32_t escapeAddress;
+  uint32_t resetTimeInSecs;           // since the start of the night
+  uint32_t nights;
+} ResetState_t;
+
+static ResetState_t *resetState;
+
+// the decoded log, one number per line
+class TimesPrint : public Print
+{
+  public:
+    std::vector<uint32_t> timesInMs;
+    uint32_t value = 0;
+
+    virtual size_t write(uint8_t c)
+    {
+      if ((c >= '0') && (c <= '9'))
+      {
+        value = (value * 10) + (c - '0');
+      }
+      else if (c == '\n')
+      {
+        timesInMs.push_back(value);
+        value = 0;
+      }
+
+      return 1;
+    }
+};
+
+static uint32_t getNextPeriodInUs(TEST_PACE_t pace, uint32_t rotation)
+{
+  switch (pace)
+  {
+    case TEST_STEADY:
+      return 1000000 - 300 + (rand() % 600);
+
+    case TEST_CHANGING:
+      return 250000 + (rand() % 1000000);
+
+    case TEST_PAUSES:
+    default:
+      // bouts of 100 rotations, then a pause of 6s to 15 minutes
+      return ((rotation % 100) != 0) ? 700000 - 5000 + (rand() % 10000) : 6000000 + ((rand() % 900) * 1000000ULL);
+  }
+}
+
+// the task that writes the log, until it's done with what's buffered
+static void finishNightLog(void)
+{
+  closeNightLog();
+
+  while (nightLogState != NIGHT_LOG_IDLE)
+  {
+    simAdvance(1000);
+    serviceNightLog();
+  }
+}
+
+// logs rotations from now, as the rotation task does, with the night log task run after each.  Erasing the block takes longer
+// than the first period, so the first rotations wait in the buffer
+static void logRotations(TEST_PACE_t pace, uint32_t rotations, uint32_t nightStartMillis, TestLog_t *log)
+{
+  uint64_t rotationInUs = simTimeInUs;
+  uint32_t periodInUs;
+  uint32_t timeInMs;
+  uint32_t address;
+  uint16_t drops;
+  uint32_t i;
+
+  for (i=0; i<rotations; i++)
+  {
+    periodInUs = getNextPeriodInUs(pace, i);
+    rotationInUs += periodInUs;
+    timeInMs = (rotationInUs / 1000) - nightStartMillis;
+
+    if ((periodInUs > REVOLUTION_PERIOD_MAX_IN_US) && ((i % 200) == 0))
+    {
+      // an escape time ending in 0x7F
+      rotationInUs += ((0x7F - (timeInMs & 0x7F)) & 0x7F) * 1000ULL;
+      timeInMs = (rotationInUs / 1000) - nightStartMillis;
+    }
+
+    simAdvance(rotationInUs - simTimeInUs);
+    address = nightLogWriteAddress + nightLogBufferLength;
+    drops = diagnostics.nightLogDropCount;
+    appendNightLog(halMicros());
+
+    if (diagnostics.nightLogDropCount == drops)
+    {
+      log->timesInMs.push_back(timeInMs);
+      log->addresses.push_back(address);
+      log->isEscape.push_back(isNightLogTimeValid && (nightLogLastPeriodInMs == 0));
+    }
+    else
+    {
+      log->drops++;
+    }
+
+    serviceNightLog();
+  }
+}
+
+// 10pm, the night, and 7am.  Returns the night's start, in the ms the log's times count from
+static uint32_t logNight(TEST_PACE_t pace, uint32_t rotations, TestLog_t *log)
+{
+  uint32_t nightStartMillis;
+
+  startNightLog();
+  nightStartMillis = softwareClockMillis;
+  logRotations(pace, rotations, nightStartMillis, log);
+  finishNightLog();
+  return nightStartMillis;
+}
+
+// the block decodes to the night's times, and ends where the night's bytes do
+static void checkNightLog(uint8_t block, const uint32_t *timesInMs, uint32_t rotations, uint32_t *endAddress)
+{
+  TimesPrint decoded;
+  uint32_t errors = 0;
+  uint32_t i;
+
+  CHECK_EQUAL(rotations, decodeNightLog(block, &decoded, endAddress));
+  CHECK_EQUAL(rotations, decoded.timesInMs.size());
+
+  for (i=0; (i<rotations) && (i<decoded.timesInMs.size()); i++)
+  {
+    if (abs((int32_t)(decoded.timesInMs[i] - timesInMs[i])) > TEST_MAX_TIME_ERROR_IN_MS)
+    {
+      if (++errors <= TEST_MAX_REPORTED_ERRORS)
+      {
+        printf("  rotation %u:  expected %u ms, decoded %u\n", i, timesInMs[i], decoded.timesInMs[i]);
+      }
+    }
+  }
+
+  CHECK_EQUAL(0, errors);
+}
+
+static void startTest(void)
+{
+  simInit(TEST_START_TIME);
+  setSoftwareClock(TEST_START_TIME);
+  initNightLog(false);
+  srand(1);
+}
+
+static int runNight(const TestNight_t *night)
+{
+  TestLog_t log = TestLog_t();
+  uint32_t blockStart;
+  uint32_t endAddress;
+  uint32_t escapes = 0;
+  uint32_t i;
+
+  startTest();
+  logNight(night->pace, night->rotations, &log);
+  blockStart = nightLogBlock * NIGHT_LOG_BLOCK_SIZE;
+
+  for (i=0; i<log.isEscape.size(); i++)
+  {
+    escapes += log.isEscape[i] ? 1 : 0;
+  }
+
+  printf("%-16s %9u %7u %6u %7u %10.2f\n", night->name, night->rotations, (unsigned)log.timesInMs.size(), log.drops, escapes,
+         (double)diagnostics.nightLogBytes / log.timesInMs.size());
+
+  checkNightLog(nightLogBlock, log.timesInMs.data(), log.timesInMs.size(), &endAddress);
+  CHECK_EQUAL(diagnostics.nightLogRotations, log.timesInMs.size());
+  CHECK_EQUAL(diagnostics.nightLogDropCount, log.drops);
+  CHECK_EQUAL(blockStart + sizeof(NightLogHeader_t) + diagnostics.nightLogBytes, endAddress);
+  CHECK_EQUAL(0, simFlashBusyErrors);
+  CHECK_EQUAL(night->isFull, log.drops > 0);
+
+  // the next block is left alone
+  for (i=0; i<FLASH_PAGE_SIZE; i++)
+  {
+    CHECK_EQUAL(0xFF, simFlash[blockStart + NIGHT_LOG_BLOCK_SIZE + i]);
+  }
+
+  if (night->pace == TEST_PAUSES)
+  {
+    CHECK(escapes >= night->rotations / 100);
+  }
+
+  return testFailures;
+}
+
+// the power fails after the last escape's 0 is in flash, and before its time is
+static int resetAfterEscape(void)
+{
+  TestLog_t log = TestLog_t();
+  uint32_t blockStart;
+  uint32_t k;
+
+  startTest();
+  logNight(TEST_PAUSES, 3000, &log);
+  blockStart = nightLogBlock * NIGHT_LOG_BLOCK_SIZE;
+
+  for (k=log.isEscape.size()-1; (k > 0) && (log.isEscape[k] == false); k--);
+
+  CHECK(k > 0);
+  CHECK_EQUAL(0x00, simFlash[log.addresses[k]]);
+  std::fill(simFlash.begin() + log.addresses[k] + 1, simFlash.begin() + blockStart + NIGHT_LOG_BLOCK_SIZE, 0xFF);
+
+  memcpy(resetState->flash, simFlash.data(), SIM_FLASH_SIZE);
+  memcpy(resetState->timesInMs, log.timesInMs.data(), k * sizeof(uint32_t));
+  resetState->rotations = k;
+  resetState->escapeAddress = log.addresses[k];
+  resetState->resetTimeInSecs = (simTimeInUs / 1000000) + 1;
+  return testFailures;
+}
+
+static int bootAfterEscape(void)
+{
+  TestLog_t log = TestLog_t();
+  uint32_t nightStartMillis;
+  uint32_t endAddress;
+  uint32_t rotations = resetState->rotations;
+
+  simInit(TEST_START_TIME + resetState->resetTimeInSecs);
+  memcpy(simFlash.data(), resetState->flash, SIM_FLASH_SIZE);
+  setSoftwareClock(TEST_START_TIME + resetState->resetTimeInSecs);
+  nightStartMillis = softwareClockMillis - (resetState->resetTimeInSecs * 1000);
+  initNightLog(true);
+
+  CHECK_EQUAL(NIGHT_LOG_RECORDING, nightLogState);
+  CHECK_EQUAL(rotations, diagnostics.nightLogRotations);
+  CHECK_EQUAL(resetState->escapeAddress, nightLogWriteAddress);
+
+  // and carries on, from a new escape written over the old one
+  logRotations(TEST_CHANGING, 500, nightStartMillis, &log);
+  finishNightLog();
+  CHECK(log.isEscape[0]);
+  CHECK_EQUAL(resetState->escapeAddress, log.addresses[0]);
+  memcpy(&resetState->timesInMs[rotations], log.timesInMs.data(), log.timesInMs.size() * sizeof(uint32_t));
+  checkNightLog(nightLogBlock, resetState->timesInMs, rotations + log.timesInMs.size(), &endAddress);
+  CHECK_EQUAL(0, simFlashBusyErrors);
+  return testFailures;
+}
+
+// more nights than blocks, each shorter than the one before, so a block that wasn't erased would decode past the night's end
+static int wrapNights(void)
+{
+  std::vector<TestLog_t> logs(TEST_WRAP_NIGHTS);
+  uint32_t endAddress;
+  uint8_t blockCount;
+  uint8_t night;
+  uint8_t block;
+
+  startTest();
+  blockCount = nightLogBlockCount;
+  CHECK_EQUAL(SIM_FLASH_SIZE / NIGHT_LOG_BLOCK_SIZE, blockCount);
+
+  for (night=0; night<TEST_WRAP_NIGHTS; night++)
+  {
+    setSoftwareClock(TEST_START_TIME + (night * 86400UL));
+    logNight(TEST_CHANGING, 1000 - (night * 20), &logs[night]);
+    CHECK_EQUAL((night + 1) % blockCount, nightLogBlock);
+  }
+
+  // the newest nights, one a block
+  for (night=TEST_WRAP_NIGHTS-blockCount; night<TEST_WRAP_NIGHTS; night++)
+  {
+    NightLogHeader_t header;
+
+    block = (night + 1) % blockCount;
+    readNightLogHeader(block, &header);
+    CHECK_EQUAL(NIGHT_LOG_MAGIC, header.magic);
+    CHECK_EQUAL(night + 1, header.sequence);
+    CHECK_EQUAL(TEST_START_TIME + (night * 86400UL), header.startTime);
+    checkNightLog(block, logs[night].timesInMs.data(), logs[night].timesInMs.size(), &endAddress);
+  }
+
+  CHECK_EQUAL(0, simFlashBusyErrors);
+  memcpy(resetState->flash, simFlash.data(), SIM_FLASH_SIZE);
+  resetState->nights = TEST_WRAP_NIGHTS;
+  return testFailures;
+}
+
+static int bootAfterWrap(void)
+{
+  simInit(TEST_START_TIME + (TEST_WRAP_NIGHTS * 86400UL));
+  memcpy(simFlash.data(), resetState->flash, SIM_FLASH_SIZE);
+  setSoftwareClock(TEST_START_TIME + (TEST_WRAP_NIGHTS * 86400UL));
+  initNightLog(false);
+
+  CHECK_EQUAL(NIGHT_LOG_IDLE, nightLogState);
+  CHECK_EQUAL(resetState->nights, nightLogSequence);
+  CHECK_EQUAL(resetState->nights % nightLogBlockCount, nightLogBlock);
+  return testFailures;
+}
+
+static void runInChild(int (*run)(void))
+{
+  int status;
+
+  fflush(stdout);
+
+  if (fork() == 0)
+  {
+    status = run();
+    fflush(stdout);
+    _exit(status);
+  }
+
+  wait(&status);
+  testFailures += WEXITSTATUS(status);
+}
+
+int main(void)
+{
+  int status;
+  uint8_t i;
+
+  resetState = (ResetState_t *)mmap(NULL, sizeof(ResetState_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  printf("%-16s %9s %7s %6s %7s %10s\n", "", "rotations", "logged", "drops", "escapes", "bytes/rot");
+  fflush(stdout);
+
+  for (i=0; i<sizeof(testNights)/sizeof(testNights[0]); i++)
+  {
+    if (fork() == 0)
+    {
+      status = runNight(&testNights[i]);
+      fflush(stdout);
+      _exit(status);
+    }
+
+    wait(&status);
+    testFailures += WEXITSTATUS(status);
+  }
+
+  runInChild(resetAfterEscape);
+  runInChild(bootAfterEscape);
+  printf("reset after an escape:  %u rotations kept, carried on from the escape at 0x%05x\n", resetState->rotations,
+         resetState->escapeAddress);
+
+  runInChild(wrapNights);
+  runInChild(bootAfterWrap);
+  printf("%u nights in %u blocks, the newest found at boot\n", resetState->nights, (unsigned)(SIM_FLASH_SIZE / NIGHT_LOG_BLOCK_SIZE));
+
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
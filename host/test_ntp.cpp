@@ -0,0 +1,154 @@
+// NTP sync against the stand-in server, with delay, loss, bad replies and a wrong server clock injected per request.  The RTC
+// starts TEST_RTC_ERROR_IN_SECS slow, and the sync that follows DHCP either puts it right or leaves it alone.
+//
+// Checks the reply token matching (a wrong or late reply is thrown away, and the request counts as lost), the round trip and
+// outlier rejection, and that the clocks are set at a second boundary:  the RTC is measured against true time at its next tick
+//
+// Each case is a fresh process, as the sketch's globals are only initialized once per process
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sketch.h"
+#include "test.h"
+
+#define TEST_START_TIME (1717306200UL)         // 2024-06-02 05:30 UTC, 10:30pm Pacific
+#define TEST_RUN_IN_US (30000000ULL)           // DHCP, then 4 requests 2s apart
+#define TEST_RTC_ERROR_IN_SECS (7)
+#define TEST_MAX_CLOCK_ERROR_IN_MS (30)        // the NTP task runs every 20ms, so the clocks are set up to 20ms late
+#define TEST_MAX_APPLY_LATE_IN_MS (30)
+
+typedef struct
+{
+  const char *name;
+  SimNtpStep steps[NTP_SAMPLES];     // request and reply delay, server clock error, lost, unsynchronized, wrong token
+  bool isSynced;
+  int32_t expectedErrorInMs;         // NTP takes the path as symmetric:  half the difference shows up in the clock
+  uint16_t lostCount;
+  uint16_t rejectedCount;
+} TestNtp_t;
+
+static const TestNtp_t testNtps[] =
+{
+  { "clean",
+    { { 20, 20, 0, false, false, false }, { 20, 20, 0, false, false, false },
+      { 20, 20, 0, false, false, false }, { 20, 20, 0, false, false, false } }, true, 0, 0, 0 },
+  { "half the requests lost",
+    { { 20, 20, 0, true,  false, false }, { 30, 30, 0, false, false, false },
+      { 20, 20, 0, true,  false, false }, { 40, 40, 0, false, false, false } }, true, 0, 2, 0 },
+  { "all lost",
+    { { 20, 20, 0, true,  false, false }, { 20, 20, 0, true,  false, false },
+      { 20, 20, 0, true,  false, false }, { 20, 20, 0, true,  false, false } }, false, 0, 4, 0 },
+  { "wrong token",
+    { { 20, 20, 0, false, false, true  }, { 20, 20, 0, false, false, false },
+      { 20, 20, 0, false, false, true  }, { 20, 20, 0, false, false, false } }, true, 0, 2, 0 },
+  { "late reply, wrong clock",
+    { { 20, 2100, 5000, false, false, false }, { 100, 100, 0, false, false, false },
+      { 20, 20, 0, false, false, false }, { 20, 20, 0, false, false, false } }, true, 0, 1, 0 },
+  { "one outlier",
+    { { 20, 20, 0, false, false, false }, { 150, 150, 3000, false, false, false },
+      { 30, 30, 0, false, false, false }, { 20, 20, 0, false, false, false } }, true, 0, 0, 1 },
+  { "no two agree",
+    { { 20, 20, 0, false, false, false }, { 100, 100, 3000, false, false, false },
+      { 100, 100, -3000, false, false, false }, { 100, 100, 1500, false, false, false } }, false, 0, 0, 3 },
+  { "round trip too long",
+    { { 600, 600, 0, false, false, false }, { 600, 600, 0, false, false, false },
+      { 600, 600, 0, false, false, false }, { 20, 20, 0, false, false, false } }, false, 0, 0, 3 },
+  { "unsynchronized server",
+    { { 20, 20, 0, false, true,  false }, { 20, 20, 0, false, true,  false },
+      { 20, 20, 0, false, true,  false }, { 20, 20, 0, false, true,  false } }, false, 0, 0, 4 },
+  { "slow uplink",
+    { { 220, 20, 0, false, false, false }, { 220, 20, 0, false, false, false },
+      { 220, 20, 0, false, false, false }, { 220, 20, 0, false, false, false } }, true, 100, 0, 0 },
+};
+
+// RTC - true time, in ms.  Taken at the RTC's next tick, so it's good to the step
+static int32_t getRtcErrorInMs(void)
+{
+  uint32_t rtcTime = simRtcTime();
+
+  while (simRtcTime() == rtcTime)
+  {
+    simAdvance(1000);
+  }
+
+  return (int32_t)(((int64_t)simRtcTime() * 1000000 - (int64_t)simUtcInUs()) / 1000);
+}
+
+static int runNtp(const TestNtp_t *ntp)
+{
+  int32_t applyLateInMs = -1;
+  int32_t rtcErrorInMs;
+  uint8_t i;
+
+  simInit(TEST_START_TIME);
+  simSetRtc(TEST_START_TIME - TEST_RTC_ERROR_IN_SECS);
+  simNtp.steps.clear();
+
+  for (i=0; i<NTP_SAMPLES; i++)
+  {
+    simNtp.steps.push_back(ntp->steps[i]);
+  }
+
+  setup();
+
+  while (simTimeInUs < TEST_RUN_IN_US)
+  {
+    loop();
+
+    // the RTC was just written:  how far into the second, as the synced clock counts it
+    if ((applyLateInMs < 0) && (diagnostics.ntpSyncCount > 0))
+    {
+      applyLateInMs = ((simUtcInUs() / 1000) + ntp->expectedErrorInMs) % 1000;
+    }
+  }
+
+  rtcErrorInMs = getRtcErrorInMs();
+  printf("%-26s %8u %7u %5u %8u %8u %9d %10d\n", ntp->name, simNtp.requestCount, simNtp.replyCount, diagnostics.ntpLostCount,
+         diagnostics.ntpRejectedCount, diagnostics.ntpSyncCount, applyLateInMs, rtcErrorInMs);
+
+  CHECK_EQUAL(NTP_SAMPLES, simNtp.requestCount);
+  CHECK_EQUAL(ntp->lostCount, diagnostics.ntpLostCount);
+  CHECK_EQUAL(ntp->rejectedCount, diagnostics.ntpRejectedCount);
+  CHECK_EQUAL(ntp->isSynced ? 1 : 0, diagnostics.ntpSyncCount);
+  CHECK_EQUAL(ntp->isSynced ? 0 : 1, diagnostics.ntpFailureCount);
+
+  if (ntp->isSynced)
+  {
+    CHECK((applyLateInMs >= 0) && (applyLateInMs <= TEST_MAX_APPLY_LATE_IN_MS));
+    CHECK(abs(rtcErrorInMs - ntp->expectedErrorInMs) <= TEST_MAX_CLOCK_ERROR_IN_MS);
+  }
+  else
+  {
+    // left alone
+    CHECK(abs(rtcErrorInMs + (TEST_RTC_ERROR_IN_SECS * 1000)) <= 1);
+  }
+
+  return testFailures;
+}
+
+int main(void)
+{
+  int status;
+  uint8_t i;
+
+  printf("%-26s %8s %7s %5s %8s %8s %9s %10s\n", "", "requests", "replies", "lost", "rejected", "synced", "late (ms)",
+         "error (ms)");
+  fflush(stdout);
+
+  for (i=0; i<sizeof(testNtps)/sizeof(testNtps[0]); i++)
+  {
+    if (fork() == 0)
+    {
+      status = runNtp(&testNtps[i]);
+      fflush(stdout);
+      _exit(status);
+    }
+
+    wait(&status);
+    testFailures += WEXITSTATUS(status);
+  }
+
+  printf("late:  into the second (of the synced clock) when the clocks were set.  error:  RTC - true time afterwards\n");
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
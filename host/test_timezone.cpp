@@ -0,0 +1,133 @@
+// Time zones:  getUtcOffsetInSecs(), and through it loadTimezoneYear() and getDstTransition(), at every hour of 2000 thru 2099 for
+// every entry in timezoneRules[], against the C library's localtime_r() with the same rule as a POSIX TZ string.
+//
+// The hours are walked forward and then backward, so each year is loaded coming from either side.  At each change of offset
+// the reference sees, the year's dstStart or dstEnd has to be that hour, and the second before it has to have the old offset
+
+#include <time.h>
+#include "sketch.h"
+#include "test.h"
+
+#define TEST_FIRST_YEAR (2000)
+#define TEST_LAST_YEAR (2099)
+#define TEST_MAX_REPORTED_ERRORS (10)
+
+// the rules in timezoneRules[], in the same order
+static const char *testTzStrings[] =
+{
+  "PST8PDT,M3.2.0/2,M11.1.0/2",
+  "EST5EDT,M3.2.0/2,M11.1.0/2",
+  "CET-1CEST,M3.5.0/2,M10.5.0/3",
+  "GMT0BST,M3.5.0/1,M10.5.0/2",
+  "AEST-10AEDT,M10.1.0/2,M4.1.0/3",
+  "JST-9",
+};
+
+typedef struct
+{
+  uint32_t hours;
+  uint32_t transitions;
+  uint32_t errors;
+} TestResult_t;
+
+static int32_t getReferenceOffsetInSecs(uint32_t utcTime)
+{
+  time_t t = utcTime;
+  struct tm local;
+
+  localtime_r(&t, &local);
+  return local.tm_gmtoff;
+}
+
+static void reportError(TestResult_t *result, const char *what, uint32_t utcTime, int32_t expected, int32_t actual)
+{
+  result->errors++;
+
+  if (result->errors <= TEST_MAX_REPORTED_ERRORS)
+  {
+    printf("  %s at %lu:  expected %ld, got %ld\n", what, (unsigned long)utcTime, (long)expected, (long)actual);
+  }
+}
+
+static void checkHour(TestResult_t *result, uint32_t utcTime)
+{
+  int32_t offsetInSecs = getReferenceOffsetInSecs(utcTime);
+  int32_t previousOffsetInSecs = getReferenceOffsetInSecs(utcTime - 3600);
+  int32_t actualInSecs = getUtcOffsetInSecs(utcTime);
+
+  result->hours++;
+
+  if (actualInSecs != offsetInSecs)
+  {
+    reportError(result, "offset", utcTime, offsetInSecs, actualInSecs);
+  }
+
+  if (offsetInSecs == previousOffsetInSecs)
+  {
+    return;
+  }
+
+  // a transition:  on the hour, to the second
+  result->transitions++;
+  actualInSecs = getUtcOffsetInSecs(utcTime - 1);
+
+  if (actualInSecs != previousOffsetInSecs)
+  {
+    reportError(result, "offset a second before", utcTime - 1, previousOffsetInSecs, actualInSecs);
+  }
+
+  // and the one loadTimezoneYear() worked out for the year, with getDstTransition()
+  getUtcOffsetInSecs(utcTime);
+
+  if ((offsetInSecs > previousOffsetInSecs) && (dstStart != utcTime))
+  {
+    reportError(result, "dstStart", utcTime, utcTime, dstStart);
+  }
+  else if ((offsetInSecs < previousOffsetInSecs) && (dstEnd != utcTime))
+  {
+    reportError(result, "dstEnd", utcTime, utcTime, dstEnd);
+  }
+}
+
+int main(void)
+{
+  const uint32_t firstTime = DateTime(TEST_FIRST_YEAR, 1, 1).unixtime();
+  const uint32_t endTime = DateTime(TEST_LAST_YEAR + 1, 1, 1).unixtime();
+  TestResult_t result;
+  uint32_t utcTime;
+  uint8_t i;
+
+  CHECK_EQUAL(NUM_TIMEZONES, sizeof(testTzStrings)/sizeof(testTzStrings[0]));
+  printf("%-30s %8s %12s %7s\n", "", "hours", "transitions", "errors");
+
+  for (i=0; i<NUM_TIMEZONES; i++)
+  {
+    setenv("TZ", testTzStrings[i], 1);
+    tzset();
+    localTimezone = (TIMEZONE_t)i;
+    memset(&result, 0, sizeof(result));
+
+    // the cached year belongs to the last zone
+    timezoneYearStart = 0;
+    timezoneYearEnd = 0;
+
+    for (utcTime = firstTime; utcTime < endTime; utcTime += 3600)
+    {
+      checkHour(&result, utcTime);
+    }
+
+    for (utcTime = endTime - 3600; utcTime >= firstTime; utcTime -= 3600)
+    {
+      checkHour(&result, utcTime);
+    }
+
+    printf("%-30s %8u %12u %7u\n", testTzStrings[i], result.hours, result.transitions, result.errors);
+
+    // two a year with DST, seen from both ways
+    CHECK_EQUAL(0, result.errors);
+    CHECK_EQUAL((timezoneRules[i].dstOffsetInMins == 0) ? 0 : 2 * 2 * (TEST_LAST_YEAR - TEST_FIRST_YEAR + 1), result.transitions);
+  }
+
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}
@@ -0,0 +1,157 @@
+// Upload engine against the HTTP stand-in:  worst-case loop() latency, and the wheel sampling, while the 5 minute pushes and
+// the health pushes go out.  Each case runs an hour of night with hedgie running at a revolution a second.
+//
+// "worst loop" is any loop() pass once the network is up (the DHCP before that blocks, in Ethernet.begin()), "upload pass" the
+// worst run of the upload task, and "exchange" the longest upload from start to close:  what the old blocking uploads held
+// loop() up for.  "overruns" are task runs over their budget in the task table, of any task
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sketch.h"
+#include "test.h"
+
+#define TEST_START_TIME (1717306200UL)         // 2024-06-02 05:30 UTC, 10:30pm Pacific
+#define TEST_RUN_IN_US (3600000000ULL)
+#define TEST_PERIOD_IN_US (1000000UL)
+#define TEST_MAX_UPLOAD_PASS_IN_US (800)         // a DNS reply read and the connect, the most one pass does.  A chunk of the request is 400us
+
+typedef struct
+{
+  const char *name;
+  bool isAccepting;
+  uint32_t rttInMs;
+  uint32_t responseDelayInMs;
+  uint32_t closeAfterRequests;
+} TestServer_t;
+
+static const TestServer_t testServers[] =
+{
+  { "fast server",                    true,  20,  50, 0 },
+  { "slow server",                    true, 400, 3000, 0 },
+  { "refuses connections",            false, 40, 100, 0 },
+  { "closes after each request",      true,  40, 100, 1 },
+  { "drops the rest of a pipeline",   true,  40, 100, 2 },
+  { "response after the timeout",     true,  40, 6000, 0 },
+};
+
+int main(void)
+{
+  std::vector<std::pair<uint64_t, int> > trace;
+  const TestServer_t *server;
+  uint32_t worstLoopInUs;
+  uint32_t worstUploadPassInUs;
+  uint32_t overruns;
+  uint64_t exchangeStartInUs = 0;
+  uint64_t longestExchangeInUs;
+  uint32_t expectedSamples;
+  boolean isNetworkUp;
+  int status;
+  std::string body;
+  size_t j;
+  uint8_t task;
+  uint8_t i;
+
+  printf("%-30s %10s %12s %10s %6s %8s %8s\n", "", "worst loop", "upload pass", "exchange", "conns", "requests", "overruns");
+  fflush(stdout);
+
+  for (i=0; i<sizeof(testServers)/sizeof(testServers[0]); i++)
+  {
+    server = &testServers[i];
+
+    // the sketch's globals carry over from the last case:  start it over in a fresh process
+    if (fork() != 0)
+    {
+      wait(&status);
+      testFailures += WEXITSTATUS(status);
+      continue;
+    }
+
+    simInit(TEST_START_TIME);
+    simHttp.isAccepting = server->isAccepting;
+    simHttp.rttInMs = server->rttInMs;
+    simHttp.responseDelayInMs = server->responseDelayInMs;
+    simHttp.closeAfterRequests = server->closeAfterRequests;
+    trace.push_back(std::make_pair(0ULL, SIM_WHITE_LEVEL));
+    simAddRotations(trace, 0, TEST_RUN_IN_US / TEST_PERIOD_IN_US, TEST_PERIOD_IN_US, SIM_WHITE_LEVEL, SIM_MIRROR_LEVEL);
+    simLoadTrace(trace);
+
+    setup();
+    worstLoopInUs = 0;
+    worstUploadPassInUs = 0;
+    longestExchangeInUs = 0;
+    overruns = 0;
+
+    while (simTimeInUs < TEST_RUN_IN_US)
+    {
+      if (uploadState == UPLOAD_IDLE)
+      {
+        exchangeStartInUs = simTimeInUs;
+      }
+
+      // both are since the last health push, so they're taken after each pass and started over
+      diagnostics.maxLoopTimeInUs = 0;
+      diagnostics.taskStats[TASK_UPLOAD].maxRunTimeInUs = 0;
+
+      for (task=0; task<NUM_TASKS; task++)
+      {
+        diagnostics.taskStats[task].overrunCount = 0;
+      }
+
+      isNetworkUp = (ethernetState == ETHERNET_UP);
+      loop();
+
+      for (task=0; task<NUM_TASKS; task++)
+      {
+        overruns += diagnostics.taskStats[task].overrunCount;
+      }
+
+      if (isNetworkUp)
+      {
+        worstLoopInUs = max(worstLoopInUs, diagnostics.maxLoopTimeInUs);
+      }
+
+      worstUploadPassInUs = max(worstUploadPassInUs, (uint32_t)diagnostics.taskStats[TASK_UPLOAD].maxRunTimeInUs);
+
+      if (uploadState != UPLOAD_IDLE)
+      {
+        longestExchangeInUs = max(longestExchangeInUs, simTimeInUs - exchangeStartInUs);
+      }
+    }
+
+    printf("%-30s %10u %12u %10llu %6u %8u %8u\n", server->name, worstLoopInUs, worstUploadPassInUs,
+           (unsigned long long)longestExchangeInUs, simHttp.connectionCount, (unsigned)simHttp.requests.size(), overruns);
+
+    // the ADC never stopped:  a sample on every Timer0 overflow since setup(), give or take the ends
+    expectedSamples = simTimeInUs / SIM_ADC_PERIOD_IN_US;
+    CHECK(simSampleCount + 2 >= expectedSamples);
+    CHECK(worstUploadPassInUs <= TEST_MAX_UPLOAD_PASS_IN_US);
+    CHECK_EQUAL(0, overruns);
+    CHECK_EQUAL(0, simTcpOverflowErrors);
+    CHECK_EQUAL(0, rotationBufferOverflowCount);
+    // the first mirror pass only finds the mirror
+    CHECK_EQUAL(((TEST_RUN_IN_US / TEST_PERIOD_IN_US) - 1) * WHEEL_CIRCUMFERENCE_IN_CM, nightStats.totalDistanceInCm);
+
+    if (server->isAccepting)
+    {
+      CHECK(simHttp.requests.size() > 0);
+    }
+
+    // the health pushes are written from the live counters as they're sent, and have to come out whole all the same
+    for (j=0; j<simHttp.requests.size(); j++)
+    {
+      body = simHttp.requests[j].substr(simHttp.requests[j].find("\r\n\r\n") + 4);
+
+      if (body.find("loopMaxUs=") != std::string::npos)
+      {
+        CHECK(body.find(" ramFree=") != std::string::npos);
+        CHECK(body.compare(body.size() - 2, 2, "\"}") == 0);
+      }
+    }
+
+    fflush(stdout);
+    _exit(testFailures);
+  }
+
+  printf("%s\n", (testFailures == 0) ? "PASS" : "FAIL");
+  return testFailures;
+}